@@ -0,0 +1,462 @@
+
+/**
+ * @file	mem_arena.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "mem_arena.h"			// prototypes, definitions
+
+#if defined(USING_MEMORY_DEBUGGING)
+#	include "mem_internal.h"	// shards, fill values
+#	include "mem_atomic.h"		// stats
+#else
+#	include <stdbool.h>		// C99 supplies bool
+	// without tracking, still fill memory the same way
+#	define MEM_ON_INIT		0x0F
+#	define MEM_AFTER_FREE		0xFF
+#endif
+
+#include <stdio.h>			// fprintf
+#include <stdlib.h>			// malloc, free
+#include <string.h>			// memset
+
+#if !defined(USING_MEMORY_DEBUGGING)
+	// there's no fill policy, or mem_fill(), without tracking
+#	define mem_fill		memset
+#endif
+
+
+// offset of the first usable byte in a chunk
+#define CHUNK_DATA_OFFSET	\
+		((sizeof(struct mem_arena_chunk) + MEM_ARENA_ALIGNMENT - 1) & ~(MEM_ARENA_ALIGNMENT - 1))
+#define chunk_data(chunk)	((uint8_t*)(chunk) + CHUNK_DATA_OFFSET)
+#define chunk_end(chunk)	((uint8_t*)(chunk) + (chunk)->size)
+
+
+
+/**
+ * Accounts chunk bytes gained or lost by an arena in its contexts stats.
+ *
+ * @param[in] arena The arena whose chunks changed
+ * @param[in] added Bytes of chunks allocated
+ * @param[in] removed Bytes of chunks freed
+ */
+static void
+account_chunks(
+	struct mem_arena* arena,
+	const uint64_t added,
+	const uint64_t removed
+)
+{
+#if defined(USING_MEMORY_DEBUGGING)
+	struct mem_shard*	shard;
+
+	/* the counters are summed across shards, so it doesn't matter which
+	 * thread's shard is adjusted - and only our own may be, so use that */
+	if (( shard = mem_shard_get(arena->context)) == NULL )
+		return;
+
+	shard_stats_begin(shard);
+	shard_stats_add(shard, arena_allocated, added);
+	shard_stats_sub(shard, arena_allocated, removed);
+	shard_stats_end(shard);
+#else
+	(void)arena;
+	(void)added;
+	(void)removed;
+#endif
+}
+
+
+
+/**
+ * Fills part of a chunk, as much as the contexts fill policy calls for. Each
+ * chunk is treated as a block of its own; there are too few to sample, so
+ * FP_Sampled fills them in full, and as they have no bounds to mark,
+ * FP_Bounds leaves them alone, as FP_None does.
+ *
+ * @param[in] arena The arena the chunk belongs to
+ * @param[in] memory The start of the part to fill
+ * @param[in] value The byte value to fill with
+ * @param[in] num_bytes The size of the part
+ */
+static void
+fill_chunk(
+	struct mem_arena* arena,
+	void* memory,
+	const int value,
+	const size_t num_bytes
+)
+{
+	size_t	length = num_bytes;
+
+#if defined(USING_MEMORY_DEBUGGING)
+	struct mem_options*	options = &arena->context->options;
+
+	switch ( options->fill_policy )
+	{
+	case FP_None:
+	case FP_Bounds:
+		return;
+	case FP_Prefix:
+		if ( length > options->fill_length )
+			length = options->fill_length;
+		break;
+	default:
+		break;
+	}
+#else
+	(void)arena;
+#endif
+
+	mem_fill(memory, value, length);
+}
+
+
+
+/**
+ * Frees a chunk, filling it first (highlights use after free).
+ *
+ * @param[in] arena The arena the chunk belongs to
+ * @param[in] chunk The chunk to free
+ */
+static void
+free_chunk(
+	struct mem_arena* arena,
+	struct mem_arena_chunk* chunk
+)
+{
+	arena->chunk_bytes -= chunk->size;
+	arena->chunks--;
+	account_chunks(arena, 0, chunk->size);
+
+	fill_chunk(arena, chunk_data(chunk), MEM_AFTER_FREE, chunk->size - CHUNK_DATA_OFFSET);
+	free(chunk);
+}
+
+
+
+/**
+ * Makes a new chunk current, large enough for at least num_bytes; uses the
+ * spare chunk if it's big enough.
+ *
+ * @param[in] arena The arena to grow
+ * @param[in] num_bytes The size of the allocation that didn't fit
+ * @retval true if the arena has a new current chunk
+ * @retval false if a chunk could not be allocated
+ */
+static bool
+grow(
+	struct mem_arena* arena,
+	const size_t num_bytes
+)
+{
+	struct mem_arena_chunk*	chunk = NULL;
+	size_t			size = arena->chunk_size;
+
+	// oversized requests get a chunk of their own
+	if ( num_bytes > size - CHUNK_DATA_OFFSET )
+	{
+		if ( num_bytes > SIZE_MAX - CHUNK_DATA_OFFSET )
+			return false;
+		size = num_bytes + CHUNK_DATA_OFFSET;
+	}
+
+	if ( arena->spare != NULL )
+	{
+		if ( arena->spare->size >= size )
+		{
+			chunk = arena->spare;
+		}
+		else
+		{
+			free_chunk(arena, arena->spare);
+		}
+		arena->spare = NULL;
+	}
+
+	if ( chunk == NULL )
+	{
+		if (( chunk = (struct mem_arena_chunk*)malloc(size)) == NULL )
+			return false;
+
+		// initialize the value for the new memory, once for the chunk
+		fill_chunk(arena, chunk_data(chunk), MEM_ON_INIT, size - CHUNK_DATA_OFFSET);
+		chunk->size = size;
+
+		arena->chunk_bytes += size;
+		arena->chunks++;
+		account_chunks(arena, size, 0);
+	}
+
+	chunk->prev	= arena->chunk;
+	arena->chunk	= chunk;
+	arena->cur	= chunk_data(chunk);
+	arena->end	= chunk_end(chunk);
+
+	return true;
+}
+
+
+
+struct mem_arena*
+mem_arena_create(
+	struct mem_context* const context,
+	const char* name,
+	const size_t chunk_size,
+	struct mem_site* site
+)
+{
+	struct mem_arena*	arena;
+
+	if (( arena = (struct mem_arena*)calloc(1, sizeof(struct mem_arena))) == NULL )
+		return NULL;
+
+	arena->context		= context;
+	arena->site		= site;
+	arena->name		= name == NULL ? "unnamed" : name;
+	arena->chunk_size	= chunk_size == 0 ? MEM_ARENA_DEFAULT_CHUNK : chunk_size;
+
+	// make sure at least something fits in a default chunk
+	if ( arena->chunk_size < CHUNK_DATA_OFFSET + MEM_ARENA_ALIGNMENT )
+		arena->chunk_size = CHUNK_DATA_OFFSET + MEM_ARENA_ALIGNMENT;
+
+#if defined(USING_MEMORY_DEBUGGING)
+	if ( site != NULL && site->id == 0 )
+		mem_site_register(site);
+
+#	if defined(_WIN32)
+	EnterCriticalSection(&context->cs);
+#	else
+	pthread_mutex_lock(&context->lock);
+#	endif
+
+	TAILQ_INSERT_TAIL(&context->arenas, arena, np_arenas);
+
+#	if defined(_WIN32)
+	LeaveCriticalSection(&context->cs);
+#	else
+	pthread_mutex_unlock(&context->lock);
+#	endif
+#endif
+
+	return arena;
+}
+
+
+
+void
+mem_arena_destroy(
+	struct mem_arena* arena
+)
+{
+	struct mem_arena_mark	start = { NULL, NULL, 0, 0 };
+
+	if ( arena == NULL )
+		return;
+
+#if defined(USING_MEMORY_DEBUGGING)
+#	if defined(_WIN32)
+	EnterCriticalSection(&arena->context->cs);
+#	else
+	pthread_mutex_lock(&arena->context->lock);
+#	endif
+
+	TAILQ_REMOVE(&arena->context->arenas, arena, np_arenas);
+
+#	if defined(_WIN32)
+	LeaveCriticalSection(&arena->context->cs);
+#	else
+	pthread_mutex_unlock(&arena->context->lock);
+#	endif
+#endif
+
+	mem_arena_release(arena, &start);
+
+	if ( arena->spare != NULL )
+		free_chunk(arena, arena->spare);
+
+	free(arena);
+}
+
+
+
+void*
+mem_arena_alloc(
+	struct mem_arena* arena,
+	const size_t num_bytes
+)
+{
+	uint8_t*	mem_return;
+	size_t		size;
+
+	if ( num_bytes > SIZE_MAX - MEM_ARENA_ALIGNMENT )
+		return NULL;
+
+	// keep every allocation aligned; 0 bytes still gets a unique pointer
+	size = (num_bytes + MEM_ARENA_ALIGNMENT - 1) & ~((size_t)MEM_ARENA_ALIGNMENT - 1);
+	if ( size == 0 )
+		size = MEM_ARENA_ALIGNMENT;
+
+	if ( (size_t)(arena->end - arena->cur) < size )
+	{
+		if ( !grow(arena, size) )
+			return NULL;
+	}
+
+	mem_return = arena->cur;
+	arena->cur += size;
+	arena->allocs++;
+	arena->bytes += num_bytes;
+
+	return mem_return;
+}
+
+
+
+void
+mem_arena_mark(
+	struct mem_arena* arena,
+	struct mem_arena_mark* mark
+)
+{
+	mark->chunk	= arena->chunk;
+	mark->cur	= arena->cur;
+	mark->allocs	= arena->allocs;
+	mark->bytes	= arena->bytes;
+}
+
+
+
+void
+mem_arena_release(
+	struct mem_arena* arena,
+	const struct mem_arena_mark* mark
+)
+{
+	struct mem_arena_chunk*	chunk;
+
+	// drop every chunk allocated since the mark was taken
+	while (( chunk = arena->chunk) != mark->chunk && chunk != NULL )
+	{
+		arena->chunk = chunk->prev;
+
+		/* hang on to one chunk of the usual size; a released arena is
+		 * usually about to be used again */
+		if ( arena->spare == NULL && chunk->size == arena->chunk_size )
+		{
+			fill_chunk(arena, chunk_data(chunk), MEM_AFTER_FREE, chunk->size - CHUNK_DATA_OFFSET);
+			arena->spare = chunk;
+		}
+		else
+		{
+			free_chunk(arena, chunk);
+		}
+	}
+
+	if ( arena->chunk != NULL )
+	{
+		// fill what was handed out since the mark (highlights use after free)
+		fill_chunk(arena, mark->cur, MEM_AFTER_FREE, arena->cur - mark->cur);
+		arena->cur = mark->cur;
+		arena->end = chunk_end(arena->chunk);
+	}
+	else
+	{
+		arena->cur = NULL;
+		arena->end = NULL;
+	}
+
+	arena->allocs	= mark->allocs;
+	arena->bytes	= mark->bytes;
+}
+
+
+
+#if defined(USING_MEMORY_DEBUGGING)
+
+void
+mem_arena_output(
+	struct mem_context* const context,
+	FILE* file
+)
+{
+	struct mem_arena*	arena;
+	uint32_t		i = 0;
+
+	if ( TAILQ_EMPTY(&context->arenas) )
+		return;
+
+	fprintf(file,
+		"##################\n"
+		"  Unfreed Arenas  \n"
+	);
+
+	TAILQ_FOREACH(arena, &context->arenas, np_arenas)
+	{
+		i++;
+
+		fprintf(file,
+			"##################\n"
+			"%u)\n"
+			"Arena...: " PRINT_POINTER "\n"
+			"Name....: %s\n"
+			"Function: %s\n"
+			"File....: %s\n"
+			"Line....: %u\n"
+			"Allocs..: %" PRIu64 "\n"
+			"Size....: %" PRIu64 "\n"
+			"Chunks..: %u (%" PRIu64 " bytes)\n",
+			i, (uintptr_t)arena,
+			arena->name,
+			arena->site != NULL ? arena->site->function : "unknown",
+			arena->site != NULL ? arena->site->file_name : "unknown",
+			arena->site != NULL ? arena->site->line : 0,
+			arena->allocs,
+			arena->bytes,
+			arena->chunks, arena->chunk_bytes
+		);
+	}
+}
+
+
+
+void
+mem_arena_release_all(
+	struct mem_context* const context
+)
+{
+	struct mem_arena*	arena;
+	struct mem_arena_mark	start = { NULL, NULL, 0, 0 };
+
+	for ( ;; )
+	{
+#	if defined(_WIN32)
+		EnterCriticalSection(&context->cs);
+#	else
+		pthread_mutex_lock(&context->lock);
+#	endif
+
+		if (( arena = TAILQ_FIRST(&context->arenas)) != NULL )
+			TAILQ_REMOVE(&context->arenas, arena, np_arenas);
+
+#	if defined(_WIN32)
+		LeaveCriticalSection(&context->cs);
+#	else
+		pthread_mutex_unlock(&context->lock);
+#	endif
+
+		if ( arena == NULL )
+			break;
+
+		mem_arena_release(arena, &start);
+		if ( arena->spare != NULL )
+			free_chunk(arena, arena->spare);
+		free(arena);
+	}
+}
+
+#endif	// USING_MEMORY_DEBUGGING
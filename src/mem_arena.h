@@ -0,0 +1,205 @@
+#ifndef MEM_ARENA_H_INCLUDED
+#define MEM_ARENA_H_INCLUDED
+
+/**
+ * @file	mem_arena.h
+ * @author	James Warren
+ * @brief	Region (arena) allocation, accounted within a mem_context
+ */
+
+
+#include "tracked_memory.h"		// mem_context, mem_site
+
+#include <stdint.h>			// data types
+
+
+struct mem_context;
+struct mem_site;
+
+
+/** Alignment of every pointer returned by mem_arena_alloc() */
+#define MEM_ARENA_ALIGNMENT		16
+/** Chunk size used if 0 is passed to mem_arena_create() */
+#define MEM_ARENA_DEFAULT_CHUNK		(64 * 1024)
+
+
+/**
+ * A chunk of memory owned by an arena; the memory handed out follows the
+ * structure, from the first MEM_ARENA_ALIGNMENT boundary.
+ *
+ * @struct mem_arena_chunk
+ */
+struct mem_arena_chunk
+{
+	/** The chunk allocated before this one, or NULL if the first */
+	struct mem_arena_chunk*	prev;
+	/** The total size of the chunk, including this structure */
+	size_t			size;
+};
+
+
+/**
+ * An arena (or region); memory is bump-allocated out of large chunks, and is
+ * never freed individually - instead it is all released at once, either back
+ * to a point recorded with mem_arena_mark(), or with mem_arena_destroy().
+ *
+ * Intended for the many short-lived allocations that all die together, such as
+ * those made while handling a single request; one mem_arena_release() replaces
+ * what would otherwise be hundreds of tracked_free() calls.
+ *
+ * When USING_MEMORY_DEBUGGING is defined, every arena is accounted in the
+ * mem_context it was created with - the chunk bytes count towards the context
+ * stats, and an arena not destroyed is reported as a leak by
+ * output_memory_info(), as a whole rather than per allocation.
+ *
+ * An arena is not thread-safe; only one thread may use it at a time. It can be
+ * destroyed by any thread.
+ *
+ * Use the ARENA_CREATE macro to create one, so the site is recorded.
+ *
+ * @struct mem_arena
+ */
+struct mem_arena
+{
+	/** The context the arena is accounted in */
+	struct mem_context*	context;
+	/** The site the arena was created at */
+	struct mem_site*	site;
+	/** Descriptive name, for reporting; not copied */
+	const char*		name;
+	/** The size of each chunk, unless an allocation needs a bigger one */
+	size_t			chunk_size;
+
+	/** The chunk currently being allocated from */
+	struct mem_arena_chunk*	chunk;
+	/** A released chunk, kept to save a malloc when the arena next grows */
+	struct mem_arena_chunk*	spare;
+	/** The next free byte in the current chunk */
+	uint8_t*		cur;
+	/** The end of the current chunk */
+	uint8_t*		end;
+
+	uint64_t	allocs;		/**< Allocations currently live in the arena */
+	uint64_t	bytes;		/**< Bytes currently allocated from the arena */
+	uint64_t	chunk_bytes;	/**< Bytes held in chunks, including the spare */
+	uint32_t	chunks;		/**< Number of chunks held, including the spare */
+
+#if defined(USING_MEMORY_DEBUGGING)
+	/** Linked list entry, within the contexts arenas */
+	TAILQ_ENTRY(mem_arena)	np_arenas;
+#endif
+};
+
+
+/**
+ * A position within an arena, recorded by mem_arena_mark(), that the arena can
+ * later be released back to.
+ *
+ * @struct mem_arena_mark
+ */
+struct mem_arena_mark
+{
+	struct mem_arena_chunk*	chunk;	/**< The chunk current at the time */
+	uint8_t*	cur;		/**< The next free byte at the time */
+	uint64_t	allocs;		/**< Live allocations at the time */
+	uint64_t	bytes;		/**< Allocated bytes at the time */
+};
+
+
+
+/**
+ * Creates a new, empty, arena - use the ARENA_CREATE macro to call this. No
+ * chunk is allocated until the first mem_arena_alloc().
+ *
+ * Must be destroyed via mem_arena_destroy().
+ *
+ * @param[in] context The memory context to account the arena in; ignored if
+ * USING_MEMORY_DEBUGGING is not defined
+ * @param[in] name A name for the arena, used in reports; must remain valid for
+ * the lifetime of the arena
+ * @param[in] chunk_size The size of each chunk; if 0, MEM_ARENA_DEFAULT_CHUNK
+ * @param[in] site The site this method was called from
+ * @return The new arena, or NULL if it could not be allocated
+ */
+struct mem_arena*
+mem_arena_create(
+	struct mem_context* const context,
+	const char* name,
+	const size_t chunk_size,
+	struct mem_site* site
+);
+
+
+/**
+ * Destroys an arena, releasing every chunk; all memory allocated from it
+ * becomes invalid.
+ *
+ * @param[in] arena The arena to destroy
+ */
+void
+mem_arena_destroy(
+	struct mem_arena* arena
+);
+
+
+/**
+ * Allocates memory from an arena. The returned pointer is aligned to
+ * MEM_ARENA_ALIGNMENT, and remains valid until the arena is released to a mark
+ * taken before this call, or destroyed. There is no way to free it alone.
+ *
+ * @param[in] arena The arena to allocate from
+ * @param[in] num_bytes The number of bytes to allocate
+ * @return A pointer to the allocated memory, or NULL if a new chunk was
+ * needed and could not be allocated
+ */
+void*
+mem_arena_alloc(
+	struct mem_arena* arena,
+	const size_t num_bytes
+);
+
+
+/**
+ * Records the current position of an arena, so it can be returned to with
+ * mem_arena_release().
+ *
+ * @param[in] arena The arena to mark
+ * @param[out] mark The mark to populate
+ */
+void
+mem_arena_mark(
+	struct mem_arena* arena,
+	struct mem_arena_mark* mark
+);
+
+
+/**
+ * Releases everything allocated from an arena since the mark was taken, in
+ * one go; chunks allocated since are freed. Marks taken after this one become
+ * invalid.
+ *
+ * @param[in] arena The arena to release
+ * @param[in] mark The mark to release back to, as set by mem_arena_mark()
+ */
+void
+mem_arena_release(
+	struct mem_arena* arena,
+	const struct mem_arena_mark* mark
+);
+
+
+
+#if defined(USING_MEMORY_DEBUGGING)
+
+/** Macro to create a tracked arena */
+#	define ARENA_CREATE(name, chunk_size)	mem_arena_create(&g_mem_ctx, name, chunk_size, MEM_SITE())
+
+#else
+
+#	define ARENA_CREATE(name, chunk_size)	mem_arena_create(NULL, name, chunk_size, NULL)
+
+#endif	// USING_MEMORY_DEBUGGING
+
+
+
+#endif	// MEM_ARENA_H_INCLUDED
@@ -0,0 +1,112 @@
+#ifndef MEM_ATOMIC_H_INCLUDED
+#define MEM_ATOMIC_H_INCLUDED
+
+/**
+ * @file	mem_atomic.h
+ * @author	James Warren
+ * @brief	Minimal atomic operations used by the memory tracker
+ *
+ * C99 has no atomics of its own, so we wrap the compiler intrinsics; the GCC
+ * __atomic builtins (also provided by clang) on POSIX, and the Interlocked
+ * family on Windows. Only the handful of operations the tracker actually needs
+ * are provided - this is not intended as a general purpose library.
+ */
+
+
+#if defined(_WIN32)
+
+	// Interlocked functions are all full barriers, so ordering is implicit
+#	define mem_atomic_load_ptr(p)		\
+		InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#	define mem_atomic_store_ptr(p, v)	\
+		(void)InterlockedExchangePointer((PVOID volatile*)(p), (PVOID)(v))
+#	define mem_atomic_xchg_ptr(p, v)	\
+		InterlockedExchangePointer((PVOID volatile*)(p), (PVOID)(v))
+#	define mem_atomic_cas_ptr(p, expected, desired)	\
+		(InterlockedCompareExchangePointer((PVOID volatile*)(p), (PVOID)(desired), (PVOID)(expected)) == (PVOID)(expected))
+
+#	define mem_atomic_load32(p)		\
+		(uint32_t)InterlockedCompareExchange((LONG volatile*)(p), 0, 0)
+#	define mem_atomic_store32(p, v)		\
+		(void)InterlockedExchange((LONG volatile*)(p), (LONG)(v))
+#	define mem_atomic_cas32(p, expected, desired)	\
+		(InterlockedCompareExchange((LONG volatile*)(p), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+#	define mem_atomic_load32_acquire(p)	\
+		mem_atomic_load32(p)
+#	define mem_atomic_store32_release(p, v)	\
+		mem_atomic_store32(p, v)
+
+#	define mem_atomic_load64(p)		\
+		(uint64_t)InterlockedCompareExchange64((LONGLONG volatile*)(p), 0, 0)
+#	define mem_atomic_add64(p, v)		\
+		(void)InterlockedExchangeAdd64((LONGLONG volatile*)(p), (LONGLONG)(v))
+#	define mem_atomic_sub64(p, v)		\
+		(void)InterlockedExchangeAdd64((LONGLONG volatile*)(p), -(LONGLONG)(v))
+#	define mem_atomic_add_fetch64(p, v)	\
+		(uint64_t)(InterlockedExchangeAdd64((LONGLONG volatile*)(p), (LONGLONG)(v)) + (LONGLONG)(v))
+#	define mem_atomic_cas64(p, expected, desired)	\
+		(InterlockedCompareExchange64((LONGLONG volatile*)(p), (LONGLONG)(desired), (LONGLONG)(expected)) == (LONGLONG)(expected))
+#	define mem_atomic_store64(p, v)		\
+		(void)InterlockedExchange64((LONGLONG volatile*)(p), (LONGLONG)(v))
+
+#	define mem_atomic_fence_acquire()	\
+		MemoryBarrier()
+#	define mem_atomic_fence_release()	\
+		MemoryBarrier()
+
+#else
+
+#	define mem_atomic_load_ptr(p)		\
+		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#	define mem_atomic_store_ptr(p, v)	\
+		__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#	define mem_atomic_xchg_ptr(p, v)	\
+		__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+	/* expected is a value, not a pointer, to match the Windows version; we
+	 * copy it into a temporary so the caller's variable is never modified */
+#	define mem_atomic_cas_ptr(p, expected, desired)	\
+		__extension__ ({ __typeof__(*(p)) _e = (expected); \
+		__atomic_compare_exchange_n((p), &_e, (desired), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); })
+
+#	define mem_atomic_load32(p)		\
+		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#	define mem_atomic_store32(p, v)		\
+		__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#	define mem_atomic_cas32(p, expected, desired)	\
+		__extension__ ({ __typeof__(*(p)) _e = (expected); \
+		__atomic_compare_exchange_n((p), &_e, (desired), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); })
+
+	/* for single producer, single consumer indices; publishing the index
+	 * publishes everything written before it, without a full barrier */
+#	define mem_atomic_load32_acquire(p)	\
+		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#	define mem_atomic_store32_release(p, v)	\
+		__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+	/* statistics only; relaxed, as nothing else is ordered against them,
+	 * and a reader summing them only wants each individual value intact */
+#	define mem_atomic_load64(p)		\
+		__atomic_load_n((p), __ATOMIC_RELAXED)
+#	define mem_atomic_add64(p, v)		\
+		(void)__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#	define mem_atomic_sub64(p, v)		\
+		(void)__atomic_fetch_sub((p), (v), __ATOMIC_RELAXED)
+#	define mem_atomic_add_fetch64(p, v)	\
+		__atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#	define mem_atomic_cas64(p, expected, desired)	\
+		__extension__ ({ __typeof__(*(p)) _e = (expected); \
+		__atomic_compare_exchange_n((p), &_e, (desired), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED); })
+#	define mem_atomic_store64(p, v)		\
+		__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+	/* for sequence counts; orders the relaxed statistics either side of the
+	 * count, as a seqlock needs, at no cost on x86 */
+#	define mem_atomic_fence_acquire()	\
+		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#	define mem_atomic_fence_release()	\
+		__atomic_thread_fence(__ATOMIC_RELEASE)
+
+#endif	// _WIN32
+
+
+#endif	// MEM_ATOMIC_H_INCLUDED
@@ -0,0 +1,184 @@
+
+/**
+ * @file	mem_config.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdlib.h>			// malloc, free, strtoul
+#include <string.h>			// memcmp, memcpy, strlen
+
+
+// names of each E_TRACKING_MODE, in order of value
+static const char*	mode_names[] = { "full", "off", "counters" };
+// names of each E_FILL_POLICY, in order of value
+static const char*	fill_names[] = { "full", "none", "bounds", "prefix", "sampled" };
+
+
+
+/**
+ * Finds a value in a list of names.
+ *
+ * @param[in] names The names to search, indexed by value
+ * @param[in] count The number of names
+ * @param[in] value The name to find; not nul-terminated
+ * @param[in] length The length of the name
+ * @return The index of the name, or -1 if it is not in the list
+ */
+static int32_t
+config_lookup(
+	const char** names,
+	const uint32_t count,
+	const char* value,
+	const size_t length
+)
+{
+	uint32_t	i;
+
+	for ( i = 0; i < count; i++ )
+	{
+		if ( strlen(names[i]) == length && memcmp(names[i], value, length) == 0 )
+			return (int32_t)i;
+	}
+
+	return -1;
+}
+
+
+
+/**
+ * Parses a value that must be a number, and nothing else.
+ *
+ * @param[in] value The value; not nul-terminated
+ * @param[in] length The length of the value
+ * @param[out] number The number
+ * @retval true if the value was a number, that fits in 32 bits
+ * @retval false if it was not
+ */
+static bool
+config_number(
+	const char* value,
+	const size_t length,
+	uint32_t* number
+)
+{
+	unsigned long	parsed;
+	char*		end;
+
+	// the whole value must be the number
+	if ( length == 0 || value[0] < '0' || value[0] > '9' )
+		return false;
+	parsed = strtoul(value, &end, 10);
+	if ( end != value + length || parsed > UINT32_MAX )
+		return false;
+
+	*number = (uint32_t)parsed;
+	return true;
+}
+
+
+
+/**
+ * Applies a single key=value pair to the contexts options.
+ *
+ * @param[in] context The memory context to configure
+ * @param[in] key The key; not nul-terminated
+ * @param[in] key_length The length of the key
+ * @param[in] value The value; not nul-terminated
+ * @param[in] value_length The length of the value
+ * @retval true if the pair was recognised, and applied
+ * @retval false if it was not
+ */
+static bool
+config_apply(
+	struct mem_context* const context,
+	const char* key,
+	const size_t key_length,
+	const char* value,
+	const size_t value_length
+)
+{
+	int32_t		index;
+	char*		path;
+
+	if ( key_length == 4 && memcmp(key, "mode", 4) == 0 )
+	{
+		if (( index = config_lookup(mode_names, 3, value, value_length)) < 0 )
+			return false;
+		context->options.mode = (enum E_TRACKING_MODE)index;
+		return true;
+	}
+
+	if ( key_length == 4 && memcmp(key, "fill", 4) == 0 )
+	{
+		if (( index = config_lookup(fill_names, 5, value, value_length)) < 0 )
+			return false;
+		context->options.fill_policy = (enum E_FILL_POLICY)index;
+		return true;
+	}
+
+	if ( key_length == 6 && memcmp(key, "sample", 6) == 0 )
+		return config_number(value, value_length, &context->options.sample_rate);
+
+	if ( key_length == 7 && memcmp(key, "publish", 7) == 0 )
+		return config_number(value, value_length, &context->options.publish_msec);
+
+	if ( key_length == 6 && memcmp(key, "report", 6) == 0 )
+	{
+		if ( value_length == 0 || (path = (char*)malloc(value_length + 1)) == NULL )
+			return false;
+		memcpy(path, value, value_length);
+		path[value_length] = '\0';
+
+		free(context->report_path);
+		context->report_path		= path;
+		context->options.report_path	= path;
+		return true;
+	}
+
+	return false;
+}
+
+
+
+bool
+mem_context_configure(
+	struct mem_context* const context,
+	const char* options
+)
+{
+	const char*	pair;
+	const char*	pair_end;
+	const char*	equals;
+	bool		ret = true;
+
+	if ( options == NULL )
+		return true;
+
+	for ( pair = options; *pair != '\0'; pair = *pair_end == ',' ? pair_end + 1 : pair_end )
+	{
+		if (( pair_end = strchr(pair, ',')) == NULL )
+			pair_end = pair + strlen(pair);
+
+		// tolerate empty pairs, as from a trailing comma
+		if ( pair_end == pair )
+			continue;
+
+		if (( equals = memchr(pair, '=', (size_t)(pair_end - pair))) == NULL ||
+		     !config_apply(context, pair, (size_t)(equals - pair), equals + 1, (size_t)(pair_end - equals - 1)) )
+			ret = false;
+	}
+
+	return ret;
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,217 @@
+
+/**
+ * @file	mem_fill.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// fill values, block layout
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <string.h>			// memset
+
+#if defined(__AVX2__)
+#	include <immintrin.h>		// _mm256_cmpeq_epi8
+#	define MEM_FILL_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <emmintrin.h>		// _mm_stream_si128, _mm_cmpeq_epi8
+#	define MEM_FILL_STREAMING
+#	define MEM_FILL_SSE2
+#endif
+
+
+/* fills at least this large use non-temporal stores; beyond the point where
+ * the block would displace most of a typical L2, so caching it buys nothing */
+#define MEM_FILL_STREAM_MIN	(256 * 1024)
+
+
+
+void
+mem_fill(
+	void* memory,
+	const int value,
+	const size_t num_bytes
+)
+{
+#if defined(MEM_FILL_STREAMING)
+	uint8_t*	cur = (uint8_t*)memory;
+	uint8_t*	end = cur + num_bytes;
+	size_t		head;
+	__m128i		fill;
+
+	if ( num_bytes < MEM_FILL_STREAM_MIN )
+	{
+		memset(memory, value, num_bytes);
+		return;
+	}
+
+	// streaming stores must be 16-byte aligned; the ends go via the cache
+	head = (16 - ((uintptr_t)cur & 15)) & 15;
+	memset(cur, value, head);
+	cur += head;
+
+	fill = _mm_set1_epi8((char)value);
+
+	// a cache line per iteration, so each is written out whole
+	for ( ; cur + 64 <= end; cur += 64 )
+	{
+		_mm_stream_si128((__m128i*)cur, fill);
+		_mm_stream_si128((__m128i*)(cur + 16), fill);
+		_mm_stream_si128((__m128i*)(cur + 32), fill);
+		_mm_stream_si128((__m128i*)(cur + 48), fill);
+	}
+
+	// order the streamed stores before anything that follows
+	_mm_sfence();
+
+	memset(cur, value, end - cur);
+#else
+	memset(memory, value, num_bytes);
+#endif
+}
+
+
+
+#if defined(MEM_FILL_SSE2)
+/**
+ * Finds the lowest set bit of a non-zero mask.
+ *
+ * @param[in] mask The mask to search
+ * @return The index of the lowest set bit
+ */
+static uint32_t
+lowest_bit(
+	uint32_t mask
+)
+{
+#if defined(__GNUC__)
+	return (uint32_t)__builtin_ctz(mask);
+#elif defined(_MSC_VER)
+	unsigned long	index;
+
+	_BitScanForward(&index, mask);
+
+	return (uint32_t)index;
+#else
+	uint32_t	index = 0;
+
+	while ( (mask & 1) == 0 )
+	{
+		mask >>= 1;
+		index++;
+	}
+
+	return index;
+#endif
+}
+#endif	// MEM_FILL_SSE2
+
+
+
+size_t
+mem_fill_mismatch(
+	const void* memory,
+	const int value,
+	const size_t num_bytes
+)
+{
+	const uint8_t*	bytes = (const uint8_t*)memory;
+	size_t		i = 0;
+#if defined(MEM_FILL_AVX2)
+	__m256i		expect32 = _mm256_set1_epi8((char)value);
+#endif
+#if defined(MEM_FILL_SSE2)
+	__m128i		expect16 = _mm_set1_epi8((char)value);
+	uint32_t	mask;
+#endif
+
+	/* compare a vector at a time; a mask of the bytes that matched, so any
+	 * clear bit is the first mismatch */
+#if defined(MEM_FILL_AVX2)
+	for ( ; i + 32 <= num_bytes; i += 32 )
+	{
+		mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i*)(bytes + i)), expect32));
+		if ( mask != 0xFFFFFFFF )
+			return i + lowest_bit(~mask);
+	}
+#endif
+#if defined(MEM_FILL_SSE2)
+	for ( ; i + 16 <= num_bytes; i += 16 )
+	{
+		mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i*)(bytes + i)), expect16));
+		if ( mask != 0xFFFF )
+			return i + lowest_bit(~mask);
+	}
+#endif
+	for ( ; i < num_bytes; i++ )
+	{
+		if ( bytes[i] != (uint8_t)value )
+			break;
+	}
+
+	return i;
+}
+
+
+
+void
+mem_fill_freed(
+	struct memblock_header* mem_block
+)
+{
+	if ( mem_block->shard->context->options.fill_policy != FP_None )
+	{
+		// fill the app-allocated memory (highlights use after free)
+		mem_fill(block_offset_realmem(mem_block), MEM_AFTER_FREE, mem_block->fill_length);
+		memset(mem_block->footer, MEM_AFTER_FREE, sizeof(struct memblock_footer));
+
+		// a slot keeps the fields pre-initialized by the slab
+		if ( mem_block->size_class == 0 )
+			memset(mem_block, MEM_AFTER_FREE, sizeof(struct memblock_header));
+	}
+
+	mem_block->magic = MEM_AFTER_FREE;
+}
+
+
+
+size_t
+mem_fill_length(
+	struct mem_shard* shard,
+	const size_t num_bytes
+)
+{
+	struct mem_options*	options = &shard->context->options;
+
+	switch ( options->fill_policy )
+	{
+	case FP_Full:
+		return num_bytes;
+	case FP_Prefix:
+		return num_bytes < options->fill_length ? num_bytes : options->fill_length;
+	case FP_Sampled:
+		if ( shard->fill_countdown != 0 )
+		{
+			shard->fill_countdown--;
+			return 0;
+		}
+		shard->fill_countdown = options->fill_sample_rate > 1 ? options->fill_sample_rate - 1 : 0;
+		return num_bytes;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,312 @@
+
+/**
+ * @file	mem_guard.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// declarations
+#include "mem_atomic.h"			// quarantine creation
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdlib.h>			// calloc, free, strtoul
+#include <string.h>			// strcmp, strncmp
+
+#if defined(_WIN32)
+#	include <Windows.h>		// VirtualAlloc, VirtualProtect, VirtualFree
+#	define MEM_GUARD_AVAILABLE
+#elif defined(__linux__) || defined(BSD) || defined(__APPLE__)
+#	include <sys/mman.h>		// mmap, mprotect, munmap
+#	define MEM_GUARD_AVAILABLE
+#endif
+
+
+/**
+ * A freed guarded block, held inaccessible until enough others have followed
+ * it into the quarantine.
+ *
+ * @struct mem_guard_slot
+ */
+struct mem_guard_slot
+{
+	/** The start of the mapping */
+	uint8_t*	base;
+	/** The total length of the mapping, guard page included */
+	size_t		length;
+};
+
+
+/**
+ * The contexts quarantine of freed guarded blocks; a ring, the oldest being
+ * unmapped to make room for the newest. Created on the first guarded free.
+ *
+ * @struct mem_guard
+ */
+struct mem_guard
+{
+	/** Protects everything below */
+#if defined(_WIN32)
+	SRWLOCK			lock;
+#else
+	pthread_mutex_t		lock;
+#endif
+	/** The number of slots; mem_options.guard_quarantine, when created */
+	uint32_t		capacity;
+	/** The slot the next freed block goes in */
+	uint32_t		next;
+
+	struct mem_guard_slot	slots[];
+};
+
+
+
+/**
+ * Unmaps the memory of a guarded block.
+ *
+ * @param[in] base The start of the mapping
+ * @param[in] length The total length of the mapping
+ */
+static void
+guard_unmap(
+	uint8_t* base,
+	const size_t length
+)
+{
+#if defined(_WIN32)
+	(void)length;
+	VirtualFree(base, 0, MEM_RELEASE);
+#elif defined(MEM_GUARD_AVAILABLE)
+	munmap(base, length);
+#else
+	(void)base;
+	(void)length;
+#endif
+}
+
+
+
+/**
+ * Makes memory inaccessible; any access to it then faults.
+ *
+ * @param[in] base The start of the memory; page-aligned
+ * @param[in] length The length of the memory; a multiple of the page size
+ * @retval true if the memory is now inaccessible
+ * @retval false if the system refused
+ */
+static bool
+guard_protect(
+	uint8_t* base,
+	const size_t length
+)
+{
+#if defined(_WIN32)
+	DWORD	old_protect;
+
+	return VirtualProtect(base, length, PAGE_NOACCESS, &old_protect) != 0;
+#elif defined(MEM_GUARD_AVAILABLE)
+	return mprotect(base, length, PROT_NONE) == 0;
+#else
+	(void)base;
+	(void)length;
+	return false;
+#endif
+}
+
+
+
+/**
+ * Obtains the contexts quarantine, creating it if this is the first guarded
+ * block freed.
+ *
+ * @param[in] context The memory context to work with
+ * @return The quarantine, or NULL if it could not be created
+ */
+static struct mem_guard*
+guard_get(
+	struct mem_context* const context
+)
+{
+	struct mem_guard*	guard;
+	struct mem_guard*	created;
+	uint32_t		capacity = context->options.guard_quarantine;
+
+	if (( guard = mem_atomic_load_ptr(&context->guard)) != NULL )
+		return guard;
+
+	if (( created = (struct mem_guard*)calloc(1, sizeof(struct mem_guard) + capacity * sizeof(struct mem_guard_slot))) == NULL )
+		return NULL;
+
+	created->capacity = capacity;
+#if defined(_WIN32)
+	InitializeSRWLock(&created->lock);
+#else
+	pthread_mutex_init(&created->lock, NULL);
+#endif
+
+	// another thread may have got there first; theirs wins
+	if ( mem_atomic_cas_ptr(&context->guard, NULL, created) )
+		return created;
+
+#if !defined(_WIN32)
+	pthread_mutex_destroy(&created->lock);
+#endif
+	free(created);
+	return mem_atomic_load_ptr(&context->guard);
+}
+
+
+
+bool
+mem_guard_match(
+	struct mem_context* const context,
+	const size_t num_bytes,
+	struct mem_site* site
+)
+{
+	const char*	filter = context->options.guard_site;
+	size_t		length;
+	char*		end;
+
+	if ( num_bytes < context->options.guard_min_size ||
+	     num_bytes > context->options.guard_max_size )
+		return false;
+
+	if ( filter == NULL )
+		return true;
+
+	// the function, the file, or the file and line
+	if ( site->function != NULL && strcmp(filter, site->function) == 0 )
+		return true;
+	if ( site->file_name == NULL )
+		return false;
+
+	length = strlen(site->file_name);
+	if ( strncmp(filter, site->file_name, length) != 0 )
+		return false;
+	if ( filter[length] == '\0' )
+		return true;
+
+	return filter[length] == ':' &&
+	       strtoul(filter + length + 1, &end, 10) == site->line && *end == '\0';
+}
+
+
+
+uint8_t*
+mem_guard_alloc(
+	const size_t num_bytes,
+	size_t* length
+)
+{
+#if defined(MEM_GUARD_AVAILABLE)
+	size_t		page_size = mem_map_page_size();
+	uint8_t*	memory;
+
+	if ( num_bytes > SIZE_MAX - 2 * page_size )
+		return NULL;
+
+	// whole pages for the block, and one more to guard it
+	*length = ((num_bytes + page_size - 1) & ~(page_size - 1)) + page_size;
+
+#	if defined(_WIN32)
+	if (( memory = (uint8_t*)VirtualAlloc(NULL, *length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)) == NULL )
+		return NULL;
+#	else
+	if (( memory = (uint8_t*)mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED )
+		return NULL;
+#	endif
+
+	if ( !guard_protect(memory + *length - page_size, page_size) )
+	{
+		guard_unmap(memory, *length);
+		return NULL;
+	}
+
+	return memory + *length - page_size;
+#else
+	(void)num_bytes;
+	(void)length;
+	return NULL;
+#endif
+}
+
+
+
+void
+mem_guard_free(
+	struct mem_context* const context,
+	uint8_t* guard_end,
+	const size_t length,
+	const bool quarantine
+)
+{
+	struct mem_guard*	guard = NULL;
+	struct mem_guard_slot	evicted = { NULL, 0 };
+	uint8_t*		base = guard_end + mem_map_page_size() - length;
+
+	if ( quarantine && context->options.guard_quarantine != 0 )
+		guard = guard_get(context);
+
+	// nowhere to hold it, or it can't be made inaccessible; just unmap it
+	if ( guard == NULL || guard->capacity == 0 || !guard_protect(base, length) )
+	{
+		guard_unmap(base, length);
+		return;
+	}
+
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&guard->lock);
+#else
+	pthread_mutex_lock(&guard->lock);
+#endif
+
+	evicted = guard->slots[guard->next];
+	guard->slots[guard->next].base		= base;
+	guard->slots[guard->next].length	= length;
+	guard->next = (guard->next + 1) % guard->capacity;
+
+#if defined(_WIN32)
+	ReleaseSRWLockExclusive(&guard->lock);
+#else
+	pthread_mutex_unlock(&guard->lock);
+#endif
+
+	// the oldest has served its time; outside the lock, as it may be slow
+	if ( evicted.base != NULL )
+		guard_unmap(evicted.base, evicted.length);
+}
+
+
+
+void
+mem_guard_destroy(
+	struct mem_context* const context
+)
+{
+	struct mem_guard*	guard = context->guard;
+	uint32_t		i;
+
+	if ( guard == NULL )
+		return;
+
+	for ( i = 0; i < guard->capacity; i++ )
+	{
+		if ( guard->slots[i].base != NULL )
+			guard_unmap(guard->slots[i].base, guard->slots[i].length);
+	}
+
+#if !defined(_WIN32)
+	pthread_mutex_destroy(&guard->lock);
+#endif
+	free(guard);
+	context->guard = NULL;
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,688 @@
+#ifndef MEM_INTERNAL_H_INCLUDED
+#define MEM_INTERNAL_H_INCLUDED
+
+/**
+ * @file	mem_internal.h
+ * @author	James Warren
+ * @brief	Definitions shared between the memory tracker source files
+ *
+ * Not for use by the application; everything here is subject to change. The
+ * public interface is in tracked_memory.h.
+ */
+
+
+#include "tracked_memory.h"		// structures
+
+
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdio.h>			// FILE
+
+
+// Magic values, assigned and checked with memory operations
+#define MEM_HEADER_MAGIC	0xCAFEFACE
+// header magic while a block is being freed; catches double frees
+#define MEM_HEADER_FREEING	0xDEADFACE
+#define MEM_FOOTER_MAGIC	0xDEADBEEF
+// magic of a memblock_prefix, for blocks that weren't sampled
+#define MEM_UNSAMPLED_MAGIC	0xFEEDC0DE
+// Memory-fill values, used before and after alloc/free
+#define MEM_ON_INIT		0x0F
+#define MEM_AFTER_FREE		0xFF
+// fill value of the redzones
+#define MEM_REDZONE_FILL	0xFA
+
+// memblock_header.flags
+#define MEM_BLOCK_MAPPED	0x1
+#define MEM_BLOCK_GUARDED	0x2
+
+// the largest mem_options.redzone_size honoured
+#define MEM_REDZONE_MAX_SIZE	1024
+
+/* the alignment malloc provides, on the platforms that matter; anything more
+ * needs the platforms aligned allocator */
+#define MEM_MALLOC_ALIGNMENT_LOG2	4
+#define MEM_MALLOC_ALIGNMENT	(1u << MEM_MALLOC_ALIGNMENT_LOG2)
+// mapped memory is page-aligned; no platform has pages smaller than this
+#define MEM_MAP_ALIGNMENT_LOG2	12
+
+/* for the functions between the application and a stack capture, which
+ * skips a fixed number of frames; inlined, there'd be fewer to skip */
+#if defined(_MSC_VER)
+#	define MEM_NOINLINE	__declspec(noinline)
+#elif defined(__GNUC__)
+#	define MEM_NOINLINE	__attribute__((noinline))
+#else
+#	define MEM_NOINLINE
+#endif
+
+
+/* the redzone either side of each block, as configured; rounded up so the
+ * application memory stays aligned as malloc would have it */
+#define mem_redzone_size(context)		\
+		((((context)->options.redzone_size < MEM_REDZONE_MAX_SIZE ?	\
+		   (context)->options.redzone_size : MEM_REDZONE_MAX_SIZE) + 15) & ~15u)
+
+// redzone is that of the context the block belongs to
+#define block_offset_header(real_mem, redzone)	\
+		(struct memblock_header*)((uint8_t*)real_mem - (sizeof(struct memblock_header) + redzone))
+#define block_offset_realmem(memblock)          \
+		(void*)((uint8_t*)memblock + (sizeof(struct memblock_header) + (memblock)->redzone))
+/* bytes between an allocation aligned to 1 << align_log2 and its header, so
+ * the application memory after the header and redzone is aligned too */
+#define mem_align_padding(align_log2, redzone)	\
+		((align_log2) > MEM_MALLOC_ALIGNMENT_LOG2 ?	\
+		 (uint32_t)((0 - (sizeof(struct memblock_header) + (redzone))) & ((1u << (align_log2)) - 1)) : 0)
+// the blocks redzone must already be set
+#define block_offset_footer(memblock, num_bytes)\
+		(struct memblock_footer*)((uint8_t*)memblock + (sizeof(struct memblock_header) + 2 * (memblock)->redzone + num_bytes))
+/* where a guarded blocks guard page begins; the application memory and the
+ * trailing redzone run up to it, bar less than the alignment of slack */
+#define block_guard_end(memblock)		\
+		((uint8_t*)(((uintptr_t)block_offset_realmem(memblock) + (memblock)->requested_size + (memblock)->redzone + \
+			     ((uintptr_t)1 << (memblock)->align_log2) - 1) & ~(((uintptr_t)1 << (memblock)->align_log2) - 1)))
+// bytes of pattern after the application memory; for a guarded block, up to its guard page
+#define block_trailing_redzone(memblock)	\
+		((memblock)->flags & MEM_BLOCK_GUARDED ?	\
+		 (size_t)(block_guard_end(memblock) - ((uint8_t*)block_offset_realmem(memblock) + (memblock)->requested_size)) : \
+		 (size_t)(memblock)->redzone)
+#define block_offset_prefix(real_mem)		\
+		((struct memblock_prefix*)((uint8_t*)real_mem - sizeof(struct memblock_prefix)))
+// everything allocated for an unsampled block; padding, prefix and all
+#define prefix_real_size(prefix)		\
+		((prefix)->padding + sizeof(struct memblock_prefix) + (prefix)->requested_size)
+#define HEADER_FOOTER_SIZE			\
+		(sizeof(struct memblock_header) + sizeof(struct memblock_footer))
+
+/* updates to a shards stats, which only the thread using the shard may make;
+ * the sequence count is odd until the update is complete. Need mem_atomic.h */
+#define shard_stats_begin(shard)		\
+		do { mem_atomic_store64(&(shard)->stats_seq, (shard)->stats_seq + 1); \
+		     mem_atomic_fence_release(); } while ( 0 )
+#define shard_stats_end(shard)			\
+		do { mem_atomic_fence_release(); \
+		     mem_atomic_store64(&(shard)->stats_seq, (shard)->stats_seq + 1); } while ( 0 )
+#define shard_stats_add(shard, field, value)	\
+		mem_atomic_store64(&(shard)->stats.field, (shard)->stats.field + (uint64_t)(value))
+#define shard_stats_sub(shard, field, value)	\
+		mem_atomic_store64(&(shard)->stats.field, (shard)->stats.field - (uint64_t)(value))
+
+
+// sites per chunk of the site tables; chunks are never moved once created
+#define MEM_SITE_CHUNK_SIZE	1024
+// number of chunks, limiting the number of sites to CHUNK_SIZE * CHUNKS
+#define MEM_SITE_CHUNKS		1024
+
+
+// usage as variables allow them to be easily inserted into memcmp's
+extern const unsigned	mem_header_magic;
+extern const unsigned	mem_footer_magic;
+
+// the site given to allocations made without one
+extern struct mem_site	mem_unknown_site;
+
+
+/**
+ * Obtains a monotonic time, in microseconds, from an arbitrary point (fixed
+ * for the life of the process).
+ *
+ * @return The current time
+ */
+uint64_t
+mem_clock_usec(void);
+
+
+/**
+ * Locks a shard. The owning thread is the only regular user of the lock, so it
+ * is only ever contended while a report or full validation is in progress.
+ *
+ * @param[in] shard The shard to lock
+ */
+void
+mem_shard_lock(
+	struct mem_shard* shard
+);
+
+
+/**
+ * Unlocks a shard previously locked with mem_shard_lock().
+ *
+ * @param[in] shard The shard to unlock
+ */
+void
+mem_shard_unlock(
+	struct mem_shard* shard
+);
+
+
+/**
+ * Obtains the shard for the calling thread, creating or adopting one the first
+ * time the thread uses the context.
+ *
+ * @param[in] context The memory context to work with
+ * @return The calling threads shard, or NULL if one could not be created
+ */
+struct mem_shard*
+mem_shard_get(
+	struct mem_context* const context
+);
+
+
+/**
+ * Fills memory with a byte value, as memset does; fills of large blocks use
+ * non-temporal stores where available, so they don't evict the cache.
+ *
+ * @param[in] memory The memory to fill
+ * @param[in] value The byte value to fill with
+ * @param[in] num_bytes The number of bytes to fill
+ */
+void
+mem_fill(
+	void* memory,
+	const int value,
+	const size_t num_bytes
+);
+
+
+/**
+ * Finds the first byte of memory not holding a value; vectorized where
+ * available, for checking redzones.
+ *
+ * @param[in] memory The memory to check
+ * @param[in] value The byte value expected
+ * @param[in] num_bytes The number of bytes to check
+ * @return The offset of the first byte that differs, or num_bytes if none do
+ */
+size_t
+mem_fill_mismatch(
+	const void* memory,
+	const int value,
+	const size_t num_bytes
+);
+
+
+/**
+ * Marks a block as freed, filling as much of it as its fill_length and the
+ * contexts fill policy call for. The block must be unlinked, but its header
+ * intact; a slots header keeps its pre-initialized fields.
+ *
+ * @param[in] mem_block The block being released
+ */
+void
+mem_fill_freed(
+	struct memblock_header* mem_block
+);
+
+
+/**
+ * Determines how many bytes of a new block to fill, per the contexts fill
+ * policy; to be stored as the blocks fill_length. Only called by the owning
+ * thread, as it advances the shards FP_Sampled countdown.
+ *
+ * @param[in] shard The calling threads shard
+ * @param[in] num_bytes The size of the block
+ * @return The number of bytes, from the start of the block, to fill
+ */
+size_t
+mem_fill_length(
+	struct mem_shard* shard,
+	const size_t num_bytes
+);
+
+
+/**
+ * Obtains the size of a page of memory, as the system maps it.
+ *
+ * @return The page size, in bytes
+ */
+size_t
+mem_map_page_size(void);
+
+
+/**
+ * Maps memory directly from the system, for a block at or above the
+ * map_threshold; the memory is page-aligned, and zeroed.
+ *
+ * @param[in] num_bytes The number of bytes needed; rounded up to whole pages
+ * @return The memory, or NULL if it could not be mapped, or the platform has
+ * no way to map it
+ */
+void*
+mem_map_alloc(
+	const size_t num_bytes
+);
+
+
+/**
+ * Resizes memory from mem_map_alloc(); remapped without a copy where the
+ * platform allows, otherwise mapped anew, copied and the original unmapped.
+ *
+ * @param[in] memory The memory to resize
+ * @param[in] old_num_bytes The number of bytes it was mapped with
+ * @param[in] new_num_bytes The number of bytes needed
+ * @return The resized memory, which may have moved, or NULL if it could not
+ * be resized; the original is then left as it was
+ */
+void*
+mem_map_resize(
+	void* memory,
+	const size_t old_num_bytes,
+	const size_t new_num_bytes
+);
+
+
+/**
+ * Unmaps memory from mem_map_alloc() or mem_map_resize().
+ *
+ * @param[in] memory The memory to unmap
+ * @param[in] num_bytes The number of bytes it was mapped with
+ */
+void
+mem_map_free(
+	void* memory,
+	const size_t num_bytes
+);
+
+
+/**
+ * Decides if a tracked block is to be guarded, per the contexts guard page
+ * options.
+ *
+ * @param[in] context The memory context the block is being allocated in
+ * @param[in] num_bytes The size of the block
+ * @param[in] site The site the block is being allocated at; registered
+ * @retval true if the block is to be guarded
+ * @retval false if it is not
+ */
+bool
+mem_guard_match(
+	struct mem_context* const context,
+	const size_t num_bytes,
+	struct mem_site* site
+);
+
+
+/**
+ * Maps memory for a guarded block; accessible pages, followed by a guard page
+ * that faults on any access.
+ *
+ * @param[in] num_bytes The number of accessible bytes needed
+ * @param[out] length The total length of the mapping, guard page included
+ * @return The start of the guard page, with at least num_bytes of zeroed,
+ * accessible, memory before it; or NULL if it could not be mapped
+ */
+uint8_t*
+mem_guard_alloc(
+	const size_t num_bytes,
+	size_t* length
+);
+
+
+/**
+ * Releases the memory of a guarded block. If quarantined, the block is made
+ * inaccessible but left mapped, until mem_options.guard_quarantine more have
+ * followed it, so a use after free faults too.
+ *
+ * @param[in] context The memory context the block was allocated in
+ * @param[in] guard_end The start of the guard page, from mem_guard_alloc()
+ * @param[in] length The total length of the mapping
+ * @param[in] quarantine Set to quarantine the block, rather than unmap it
+ */
+void
+mem_guard_free(
+	struct mem_context* const context,
+	uint8_t* guard_end,
+	const size_t length,
+	const bool quarantine
+);
+
+
+/**
+ * Unmaps every block in the contexts guard quarantine, and releases it. Used
+ * when the context is destroyed.
+ *
+ * @param[in] context The memory context to release the quarantine of
+ */
+void
+mem_guard_destroy(
+	struct mem_context* const context
+);
+
+
+/** The largest request, in bytes, served from the slabs */
+#define MEM_SLAB_MAX_SIZE	2048
+
+/** The size of each slab carved into slots, in bytes */
+#define MEM_SLAB_SIZE		(64 * 1024)
+
+
+/**
+ * Determines the slab size class for an allocation of num_bytes.
+ *
+ * @param[in] num_bytes The number of bytes requested
+ * @return The size class (1-based), or 0 if too large for the slabs
+ */
+uint32_t
+mem_slab_class(
+	const size_t num_bytes
+);
+
+
+/**
+ * Takes a slot from the shards cache for the size class, carving a new slab if
+ * the cache is empty. The header is pre-initialized with everything that does
+ * not depend on the request; slots are sized for the contexts redzones. The
+ * shard must be locked.
+ *
+ * @param[in] shard The shard to allocate from
+ * @param[in] size_class The size class, from mem_slab_class()
+ * @return The slot, or NULL if a new slab could not be allocated
+ */
+struct memblock_header*
+mem_slab_alloc(
+	struct mem_shard* shard,
+	const uint32_t size_class
+);
+
+
+/**
+ * Returns a slot to its shards cache. The shard must be locked.
+ *
+ * @param[in] shard The shard owning the slot
+ * @param[in] mem_block The slot to return
+ */
+void
+mem_slab_free(
+	struct mem_shard* shard,
+	struct memblock_header* mem_block
+);
+
+
+/**
+ * Releases every slab belonging to the shard; any slots still in use become
+ * invalid. Used when the context is destroyed.
+ *
+ * @param[in] shard The shard to release the slabs of
+ */
+void
+mem_slab_destroy(
+	struct mem_shard* shard
+);
+
+
+/**
+ * Writes the slab occupancy, per size class and summed across all shards, for
+ * the memory info report. The context lock must be held.
+ *
+ * @param[in] context The memory context to report on
+ * @param[in] file The file to write to
+ */
+void
+mem_slab_output(
+	struct mem_context* const context,
+	FILE* file
+);
+
+
+/**
+ * Writes the details of every arena still present in the context, for the
+ * memory info report. The context lock must be held.
+ *
+ * @param[in] context The memory context to report on
+ * @param[in] file The file to write to
+ */
+void
+mem_arena_output(
+	struct mem_context* const context,
+	FILE* file
+);
+
+
+/**
+ * Destroys every arena still present in the context. The context lock must not
+ * be held; it's taken to unlink each arena, and released before the arena is,
+ * as accounting for its chunks may need to create the callers shard.
+ *
+ * @param[in] context The memory context to release the arenas of
+ */
+void
+mem_arena_release_all(
+	struct mem_context* const context
+);
+
+
+/**
+ * Prepares the per-site counters of a context.
+ *
+ * @param[in] context The memory context to initialize the counters of
+ * @retval true if the counters are ready for use
+ * @retval false if the table could not be allocated; nothing is counted
+ */
+bool
+mem_site_stats_init(
+	struct mem_context* const context
+);
+
+
+/**
+ * Releases the per-site counters of a context.
+ *
+ * @param[in] context The memory context to release the counters of
+ */
+void
+mem_site_stats_destroy(
+	struct mem_context* const context
+);
+
+
+/**
+ * Counts a tracked allocation against its site, and its stack if captured.
+ * Lock-free.
+ *
+ * @param[in] context The memory context the allocation was made in
+ * @param[in] site The site the allocation was made at
+ * @param[in] stack_id The call stack of the allocation, or 0
+ * @param[in] num_bytes The number of bytes requested
+ */
+void
+mem_site_stats_alloc(
+	struct mem_context* const context,
+	struct mem_site* site,
+	const uint32_t stack_id,
+	const size_t num_bytes
+);
+
+
+/**
+ * Counts the free of a tracked allocation against its site, and its stack if
+ * captured. Lock-free.
+ *
+ * @param[in] context The memory context the allocation was made in
+ * @param[in] site The site the allocation was made at
+ * @param[in] stack_id The call stack of the allocation, or 0
+ * @param[in] num_bytes The number of bytes originally requested
+ */
+void
+mem_site_stats_free(
+	struct mem_context* const context,
+	struct mem_site* site,
+	const uint32_t stack_id,
+	const size_t num_bytes
+);
+
+
+/**
+ * Takes a copy of the counters for a site or stack.
+ *
+ * @param[in] table The site_stats or stack_stats of a context
+ * @param[in] id The site or stack id
+ * @param[out] stats The counters
+ * @retval true if the id has had allocations counted against it
+ * @retval false if not; stats may be partially populated
+ */
+bool
+mem_site_stats_read(
+	struct mem_site_stats** table,
+	const uint32_t id,
+	struct mem_site_stats* stats
+);
+
+
+/**
+ * Writes the sites with the most live bytes, for the memory info report.
+ *
+ * @param[in] context The memory context to report on
+ * @param[in] file The file to write to
+ */
+void
+mem_site_stats_output(
+	struct mem_context* const context,
+	FILE* file
+);
+
+
+/**
+ * Records an event in the calling threads trace ring, creating the ring if
+ * this is its first event. Lock-free; the event is dropped if the ring is
+ * full. Only to be called while the context is being traced.
+ *
+ * @param[in] context The memory context being traced
+ * @param[in] op One of the MEM_TRACE_OP_ values
+ * @param[in] address The block allocated, freed or reallocated to
+ * @param[in] old_address The block reallocated from, or NULL
+ * @param[in] size The size requested, or 0 for a free
+ * @param[in] site The site of the call, or NULL for a free
+ * @param[in] time_usec When the event happened, from mem_clock_usec(); 0 for
+ * now. A block released must be stamped before its release, as another thread
+ * could otherwise be given the address, and record its allocation first
+ */
+void
+mem_trace_record(
+	struct mem_context* const context,
+	const uint32_t op,
+	void* address,
+	void* old_address,
+	const size_t size,
+	struct mem_site* site,
+	const uint64_t time_usec
+);
+
+
+/**
+ * Releases the trace ring of a shard, if it has one.
+ *
+ * @param[in] shard The shard being released
+ */
+void
+mem_trace_release(
+	struct mem_shard* shard
+);
+
+
+/**
+ * Captures the call stack of the calling thread, and adds it to the stack
+ * depot if it's not already present.
+ *
+ * @param[in] shard The calling threads shard
+ * @param[in] depth The maximum number of frames to capture
+ * @param[in] skip The number of innermost frames (besides this function) to
+ * leave out; the callers between here and the application must be MEM_NOINLINE
+ * for this to be exact
+ * @return The id of the stack, or 0 if none could be captured or stored
+ */
+MEM_NOINLINE uint32_t
+mem_stack_capture(
+	struct mem_shard* shard,
+	uint32_t depth,
+	const uint32_t skip
+);
+
+
+/**
+ * Writes a stack from the depot, one frame per line, symbolized where the
+ * platform allows.
+ *
+ * @param[in] id The stack id
+ * @param[in] file The file to write to
+ */
+void
+mem_stack_output(
+	const uint32_t id,
+	FILE* file
+);
+
+
+/**
+ * Initializes a registry, ready for use.
+ *
+ * @param[in] registry The registry to initialize
+ * @retval true if the registry is ready for use
+ * @retval false if the stripes could not be allocated
+ */
+bool
+mem_registry_init(
+	struct mem_registry* registry
+);
+
+
+/**
+ * Releases everything held by a registry; safe to call on one that failed to
+ * initialize.
+ *
+ * @param[in] registry The registry to destroy
+ */
+void
+mem_registry_destroy(
+	struct mem_registry* registry
+);
+
+
+/**
+ * Adds a live block to the registry.
+ *
+ * @param[in] registry The registry to add to
+ * @param[in] memory The pointer handed to the application
+ * @retval true if the block was added
+ * @retval false if the stripe needed to grow, and could not
+ */
+bool
+mem_registry_insert(
+	struct mem_registry* registry,
+	void* memory
+);
+
+
+/**
+ * Removes a block from the registry. Only one caller can succeed for each
+ * insertion, so this doubles as the claim on a block being freed.
+ *
+ * @param[in] registry The registry to remove from
+ * @param[in] memory The pointer handed to the application
+ * @retval true if the block was present, and has been removed
+ * @retval false if the block was not present
+ */
+bool
+mem_registry_remove(
+	struct mem_registry* registry,
+	void* memory
+);
+
+
+/**
+ * Checks if a block is in the registry.
+ *
+ * @param[in] registry The registry to search
+ * @param[in] memory The pointer handed to the application
+ * @retval true if the block is live
+ * @retval false if the block is not present
+ */
+bool
+mem_registry_contains(
+	struct mem_registry* registry,
+	void* memory
+);
+
+
+#endif	// USING_MEMORY_DEBUGGING
+
+#endif	// MEM_INTERNAL_H_INCLUDED
@@ -0,0 +1,161 @@
+
+/**
+ * @file	mem_map.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// declarations
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <string.h>			// memcpy
+
+#if defined(_WIN32)
+#	include <Windows.h>		// VirtualAlloc, VirtualFree
+#	define MEM_MAP_AVAILABLE
+#elif defined(__linux__) || defined(BSD) || defined(__APPLE__)
+#	include <sys/mman.h>		// mmap, mremap, munmap
+#	include <unistd.h>		// sysconf
+#	define MEM_MAP_AVAILABLE
+#endif
+
+
+
+#if defined(MEM_MAP_AVAILABLE)
+
+/**
+ * Rounds a size up to whole pages; what the system actually maps for it.
+ *
+ * @param[in] num_bytes The size to round
+ * @return The rounded size, or 0 if it would overflow
+ */
+static size_t
+page_round(
+	const size_t num_bytes
+)
+{
+	size_t	page_size = mem_map_page_size();
+
+	if ( num_bytes > SIZE_MAX - page_size )
+		return 0;
+
+	return (num_bytes + page_size - 1) & ~(page_size - 1);
+}
+
+#endif	// MEM_MAP_AVAILABLE
+
+
+
+size_t
+mem_map_page_size(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO	info;
+
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#elif defined(MEM_MAP_AVAILABLE)
+	return (size_t)sysconf(_SC_PAGESIZE);
+#else
+	return (size_t)1 << MEM_MAP_ALIGNMENT_LOG2;
+#endif
+}
+
+
+
+void*
+mem_map_alloc(
+	const size_t num_bytes
+)
+{
+#if defined(MEM_MAP_AVAILABLE)
+	size_t	length = page_round(num_bytes);
+	void*	memory;
+
+	if ( length == 0 )
+		return NULL;
+
+#	if defined(_WIN32)
+	memory = VirtualAlloc(NULL, length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#	else
+	if (( memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED )
+		memory = NULL;
+#	endif
+
+	return memory;
+#else
+	(void)num_bytes;
+	return NULL;
+#endif
+}
+
+
+
+void*
+mem_map_resize(
+	void* memory,
+	const size_t old_num_bytes,
+	const size_t new_num_bytes
+)
+{
+#if defined(MEM_MAP_AVAILABLE)
+	size_t	old_length = page_round(old_num_bytes);
+	size_t	new_length = page_round(new_num_bytes);
+	void*	resized;
+
+	if ( new_length == 0 )
+		return NULL;
+
+	// still within the same pages
+	if ( new_length == old_length )
+		return memory;
+
+#	if defined(__linux__) && defined(MREMAP_MAYMOVE)
+	/* the kernel moves the page table entries, not the contents, so even a
+	 * block that has to move isn't copied */
+	if (( resized = mremap(memory, old_length, new_length, MREMAP_MAYMOVE)) == MAP_FAILED )
+		return NULL;
+#	else
+	if (( resized = mem_map_alloc(new_num_bytes)) == NULL )
+		return NULL;
+
+	memcpy(resized, memory, old_length < new_length ? old_length : new_length);
+	mem_map_free(memory, old_num_bytes);
+#	endif
+
+	return resized;
+#else
+	(void)memory;
+	(void)old_num_bytes;
+	(void)new_num_bytes;
+	return NULL;
+#endif
+}
+
+
+
+void
+mem_map_free(
+	void* memory,
+	const size_t num_bytes
+)
+{
+#if defined(_WIN32)
+	(void)num_bytes;
+	VirtualFree(memory, 0, MEM_RELEASE);
+#elif defined(MEM_MAP_AVAILABLE)
+	munmap(memory, page_round(num_bytes));
+#else
+	(void)memory;
+	(void)num_bytes;
+#endif
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,854 @@
+
+/**
+ * @file	mem_pprof.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ *
+ * Heap profile export, in the protobuf format of pprof's profile.proto. The
+ * handful of messages needed are encoded by hand, so nothing beyond the C
+ * library is required; pprof reads the output uncompressed, or gzip it.
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// per-site and per-stack counters
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdio.h>			// fopen, fwrite
+#include <stdlib.h>			// malloc, realloc, free
+#include <string.h>			// memcpy, strlen, strcmp
+#include <time.h>			// time
+
+#if !defined(_WIN32)
+#	include <dlfcn.h>		// dladdr
+#endif
+
+
+// protobuf wire types used
+#define PB_WIRE_VARINT			0
+#define PB_WIRE_BYTES			2
+
+// Profile message fields
+#define PPROF_PROFILE_SAMPLE_TYPE	1
+#define PPROF_PROFILE_SAMPLE		2
+#define PPROF_PROFILE_MAPPING		3
+#define PPROF_PROFILE_LOCATION		4
+#define PPROF_PROFILE_FUNCTION		5
+#define PPROF_PROFILE_STRING_TABLE	6
+#define PPROF_PROFILE_TIME_NANOS	9
+#define PPROF_PROFILE_PERIOD_TYPE	11
+#define PPROF_PROFILE_PERIOD		12
+#define PPROF_PROFILE_DEFAULT_SAMPLE	14
+// ValueType message fields
+#define PPROF_VALUE_TYPE		1
+#define PPROF_VALUE_UNIT		2
+// Sample message fields
+#define PPROF_SAMPLE_LOCATION_ID	1
+#define PPROF_SAMPLE_VALUE		2
+// Mapping message fields
+#define PPROF_MAPPING_ID		1
+#define PPROF_MAPPING_START		2
+#define PPROF_MAPPING_LIMIT		3
+#define PPROF_MAPPING_OFFSET		4
+#define PPROF_MAPPING_FILENAME		5
+// Location message fields
+#define PPROF_LOCATION_ID		1
+#define PPROF_LOCATION_MAPPING_ID	2
+#define PPROF_LOCATION_ADDRESS		3
+#define PPROF_LOCATION_LINE		4
+// Line message fields
+#define PPROF_LINE_FUNCTION_ID		1
+#define PPROF_LINE_LINE			2
+// Function message fields
+#define PPROF_FUNCTION_ID		1
+#define PPROF_FUNCTION_NAME		2
+#define PPROF_FUNCTION_SYSTEM_NAME	3
+#define PPROF_FUNCTION_FILENAME		4
+
+// number of buckets in the string dedup table; always a power of 2
+#define PPROF_STRING_BUCKETS		4096
+// number of values in each sample
+#define PPROF_SAMPLE_VALUES		4
+
+
+/**
+ * A growable byte buffer, holding encoded messages. Once an allocation fails
+ * the buffer is marked as such, and all further writes are dropped; checked
+ * once, when the profile is complete.
+ *
+ * @struct pprof_buffer
+ */
+struct pprof_buffer
+{
+	uint8_t*	data;		/**< The encoded bytes */
+	size_t		size;		/**< Bytes used */
+	size_t		capacity;	/**< Bytes allocated */
+	bool		failed;		/**< An allocation has failed */
+};
+
+
+/**
+ * A string already present in the string table.
+ *
+ * @struct pprof_string
+ */
+struct pprof_string
+{
+	struct pprof_string*	next;	/**< Next string in the same bucket */
+	uint64_t		hash;	/**< Hash of the text */
+	int64_t			index;	/**< Index in the string table */
+	char			text[];	/**< A copy of the text */
+};
+
+
+/**
+ * An executable mapping of the process, for pprof to symbolize addresses
+ * against.
+ *
+ * @struct pprof_mapping
+ */
+struct pprof_mapping
+{
+	uint64_t	start;		/**< First address mapped */
+	uint64_t	limit;		/**< One beyond the last address mapped */
+};
+
+
+/**
+ * Everything needed while building a profile.
+ *
+ * @struct pprof_writer
+ */
+struct pprof_writer
+{
+	/** Every field of the Profile message but the string table */
+	struct pprof_buffer	profile;
+	/** The string table entries, in index order */
+	struct pprof_buffer	strings;
+	/** Scratch space, for the message being built */
+	struct pprof_buffer	message;
+	/** Scratch space, for a message nested within message */
+	struct pprof_buffer	inner;
+
+	struct pprof_string*	buckets[PPROF_STRING_BUCKETS];
+	int64_t			string_count;
+
+	/** Function ids, indexed by the string index of their name */
+	uint64_t*		function_ids;
+	size_t			function_capacity;
+	uint64_t		function_count;
+
+	/** Open-addressed map of frame address to location id */
+	uint64_t*		location_addresses;
+	uint64_t*		location_ids;
+	size_t			location_capacity;
+	uint64_t		location_count;
+
+	struct pprof_mapping*	mappings;
+	size_t			mapping_count;
+};
+
+
+
+/**
+ * Ensures a buffer has space for more bytes.
+ *
+ * @param[in] buffer The buffer to grow
+ * @param[in] length The number of bytes about to be written
+ * @retval true if there is space
+ * @retval false if the buffer could not be grown
+ */
+static bool
+pprof_reserve(
+	struct pprof_buffer* buffer,
+	const size_t length
+)
+{
+	uint8_t*	grown;
+	size_t		capacity;
+
+	if ( buffer->failed )
+		return false;
+
+	if ( buffer->size + length <= buffer->capacity )
+		return true;
+
+	capacity = (buffer->capacity == 0 ? 256 : buffer->capacity * 2);
+	while ( capacity < buffer->size + length )
+		capacity *= 2;
+
+	if (( grown = (uint8_t*)realloc(buffer->data, capacity)) == NULL )
+	{
+		buffer->failed = true;
+		return false;
+	}
+
+	buffer->data		= grown;
+	buffer->capacity	= capacity;
+
+	return true;
+}
+
+
+
+/**
+ * Appends raw bytes to a buffer.
+ *
+ * @param[in] buffer The buffer to append to
+ * @param[in] data The bytes to append
+ * @param[in] length The number of bytes
+ */
+static void
+pprof_raw(
+	struct pprof_buffer* buffer,
+	const void* data,
+	const size_t length
+)
+{
+	if ( length == 0 || !pprof_reserve(buffer, length) )
+		return;
+
+	memcpy(buffer->data + buffer->size, data, length);
+	buffer->size += length;
+}
+
+
+
+/**
+ * Appends a base 128 varint to a buffer.
+ *
+ * @param[in] buffer The buffer to append to
+ * @param[in] value The value to encode
+ */
+static void
+pprof_varint(
+	struct pprof_buffer* buffer,
+	uint64_t value
+)
+{
+	uint8_t		bytes[10];
+	size_t		length = 0;
+
+	while ( value >= 0x80 )
+	{
+		bytes[length++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	bytes[length++] = (uint8_t)value;
+
+	pprof_raw(buffer, bytes, length);
+}
+
+
+
+/**
+ * Appends a varint field; nothing is written for 0, as protobuf defaults
+ * absent fields to it.
+ *
+ * @param[in] buffer The buffer to append to
+ * @param[in] field The field number
+ * @param[in] value The value of the field
+ */
+static void
+pprof_field_varint(
+	struct pprof_buffer* buffer,
+	const uint32_t field,
+	const uint64_t value
+)
+{
+	if ( value == 0 )
+		return;
+
+	pprof_varint(buffer, (field << 3) | PB_WIRE_VARINT);
+	pprof_varint(buffer, value);
+}
+
+
+
+/**
+ * Appends a length-delimited field; used for strings, packed repeated values
+ * and embedded messages alike.
+ *
+ * @param[in] buffer The buffer to append to
+ * @param[in] field The field number
+ * @param[in] data The encoded field contents
+ * @param[in] length The number of bytes in data
+ */
+static void
+pprof_field_bytes(
+	struct pprof_buffer* buffer,
+	const uint32_t field,
+	const void* data,
+	const size_t length
+)
+{
+	pprof_varint(buffer, (field << 3) | PB_WIRE_BYTES);
+	pprof_varint(buffer, length);
+	pprof_raw(buffer, data, length);
+}
+
+
+
+/**
+ * Appends a scratch buffer as an embedded message, and empties the scratch
+ * buffer ready for reuse.
+ *
+ * @param[in] buffer The buffer to append to
+ * @param[in] field The field number
+ * @param[in] message The encoded message
+ */
+static void
+pprof_field_message(
+	struct pprof_buffer* buffer,
+	const uint32_t field,
+	struct pprof_buffer* message
+)
+{
+	if ( message->failed )
+		buffer->failed = true;
+	else
+		pprof_field_bytes(buffer, field, message->data, message->size);
+
+	message->size = 0;
+}
+
+
+
+/**
+ * Obtains the string table index of a string, adding it if not yet present.
+ *
+ * @param[in] writer The profile being written
+ * @param[in] text The string
+ * @return The index of the string; 0, the empty string, if it could not be
+ * added
+ */
+static int64_t
+pprof_string(
+	struct pprof_writer* writer,
+	const char* text
+)
+{
+	struct pprof_string**	bucket;
+	struct pprof_string*	string;
+	uint64_t	hash = 0xCBF29CE484222325ull;
+	size_t		length = strlen(text);
+	size_t		i;
+
+	for ( i = 0; i < length; i++ )
+	{
+		hash ^= (uint8_t)text[i];
+		hash *= 0x100000001B3ull;
+	}
+
+	bucket = &writer->buckets[hash & (PPROF_STRING_BUCKETS - 1)];
+
+	for ( string = *bucket; string != NULL; string = string->next )
+	{
+		if ( string->hash == hash && strcmp(string->text, text) == 0 )
+			return string->index;
+	}
+
+	if (( string = (struct pprof_string*)malloc(sizeof(struct pprof_string) + length + 1)) == NULL )
+	{
+		writer->strings.failed = true;
+		return 0;
+	}
+
+	string->hash	= hash;
+	string->index	= writer->string_count++;
+	string->next	= *bucket;
+	memcpy(string->text, text, length + 1);
+	*bucket = string;
+
+	pprof_field_bytes(&writer->strings, PPROF_PROFILE_STRING_TABLE, text, length);
+
+	return string->index;
+}
+
+
+
+/**
+ * Obtains the id of the function with the given name, adding a Function to
+ * the profile if this is the first time it has been seen.
+ *
+ * @param[in] writer The profile being written
+ * @param[in] name The function name
+ * @param[in] file_name The source file the function is in, or NULL if unknown
+ * @return The function id, or 0 if it could not be added
+ */
+static uint64_t
+pprof_function(
+	struct pprof_writer* writer,
+	const char* name,
+	const char* file_name
+)
+{
+	uint64_t*	grown;
+	size_t		capacity;
+	int64_t		name_index = pprof_string(writer, name);
+
+	if ( (size_t)name_index >= writer->function_capacity )
+	{
+		capacity = (writer->function_capacity == 0 ? 256 : writer->function_capacity);
+		while ( capacity <= (size_t)name_index )
+			capacity *= 2;
+
+		if (( grown = (uint64_t*)realloc(writer->function_ids, capacity * sizeof(uint64_t))) == NULL )
+		{
+			writer->profile.failed = true;
+			return 0;
+		}
+
+		memset(grown + writer->function_capacity, 0, (capacity - writer->function_capacity) * sizeof(uint64_t));
+		writer->function_ids		= grown;
+		writer->function_capacity	= capacity;
+	}
+
+	if ( writer->function_ids[name_index] != 0 )
+		return writer->function_ids[name_index];
+
+	writer->function_ids[name_index] = ++writer->function_count;
+
+	pprof_field_varint(&writer->inner, PPROF_FUNCTION_ID, writer->function_count);
+	pprof_field_varint(&writer->inner, PPROF_FUNCTION_NAME, (uint64_t)name_index);
+	pprof_field_varint(&writer->inner, PPROF_FUNCTION_SYSTEM_NAME, (uint64_t)name_index);
+	if ( file_name != NULL )
+		pprof_field_varint(&writer->inner, PPROF_FUNCTION_FILENAME, (uint64_t)pprof_string(writer, file_name));
+	pprof_field_message(&writer->profile, PPROF_PROFILE_FUNCTION, &writer->inner);
+
+	return writer->function_count;
+}
+
+
+
+/**
+ * Appends the sample types, period and timestamp of the profile.
+ *
+ * @param[in] writer The profile being written
+ * @param[in] context The memory context being profiled
+ */
+static void
+pprof_header(
+	struct pprof_writer* writer,
+	struct mem_context* const context
+)
+{
+	// must match the order pprof_sample writes the values in
+	static const char*	types[PPROF_SAMPLE_VALUES][2] = {
+		{ "alloc_objects", "count" },
+		{ "alloc_space", "bytes" },
+		{ "inuse_objects", "count" },
+		{ "inuse_space", "bytes" }
+	};
+	uint32_t	i;
+
+	// index 0 is always the empty string
+	pprof_string(writer, "");
+
+	for ( i = 0; i < PPROF_SAMPLE_VALUES; i++ )
+	{
+		pprof_field_varint(&writer->message, PPROF_VALUE_TYPE, (uint64_t)pprof_string(writer, types[i][0]));
+		pprof_field_varint(&writer->message, PPROF_VALUE_UNIT, (uint64_t)pprof_string(writer, types[i][1]));
+		pprof_field_message(&writer->profile, PPROF_PROFILE_SAMPLE_TYPE, &writer->message);
+	}
+
+	pprof_field_varint(&writer->profile, PPROF_PROFILE_DEFAULT_SAMPLE, (uint64_t)pprof_string(writer, "inuse_space"));
+	pprof_field_varint(&writer->profile, PPROF_PROFILE_TIME_NANOS, (uint64_t)time(NULL) * 1000000000ull);
+
+	if ( context->options.sample_rate != 0 )
+	{
+		pprof_field_varint(&writer->message, PPROF_VALUE_TYPE, (uint64_t)pprof_string(writer, "space"));
+		pprof_field_varint(&writer->message, PPROF_VALUE_UNIT, (uint64_t)pprof_string(writer, "bytes"));
+		pprof_field_message(&writer->profile, PPROF_PROFILE_PERIOD_TYPE, &writer->message);
+		pprof_field_varint(&writer->profile, PPROF_PROFILE_PERIOD, context->options.sample_rate);
+	}
+}
+
+
+
+/**
+ * Appends a sample.
+ *
+ * @param[in] writer The profile being written
+ * @param[in] location_ids The locations of the sample, innermost first
+ * @param[in] count The number of locations
+ * @param[in] stats The counters providing the values
+ */
+static void
+pprof_sample(
+	struct pprof_writer* writer,
+	const uint64_t* location_ids,
+	const uint32_t count,
+	const struct mem_site_stats* stats
+)
+{
+	uint32_t	i;
+
+	// both repeated fields are packed; a single length-delimited run each
+	for ( i = 0; i < count; i++ )
+		pprof_varint(&writer->inner, location_ids[i]);
+	pprof_field_message(&writer->message, PPROF_SAMPLE_LOCATION_ID, &writer->inner);
+
+	pprof_varint(&writer->inner, stats->allocs);
+	pprof_varint(&writer->inner, stats->alloc_bytes);
+	pprof_varint(&writer->inner, stats->live_blocks);
+	pprof_varint(&writer->inner, stats->live_bytes);
+	pprof_field_message(&writer->message, PPROF_SAMPLE_VALUE, &writer->inner);
+
+	pprof_field_message(&writer->profile, PPROF_PROFILE_SAMPLE, &writer->message);
+}
+
+
+
+/**
+ * Appends one sample per allocation site, each with a single location holding
+ * the function, file and line of the site.
+ *
+ * @param[in] writer The profile being written
+ * @param[in] context The memory context being profiled
+ */
+static void
+pprof_sites(
+	struct pprof_writer* writer,
+	struct mem_context* const context
+)
+{
+	struct mem_site_stats	stats;
+	struct mem_site*	site;
+	uint64_t	function_id;
+	uint64_t	location_id;
+	uint32_t	max_id = mem_site_max_id();
+	uint32_t	id;
+
+	for ( id = 0; id <= max_id; id++ )
+	{
+		if ( !mem_site_stats_read(context->site_stats, id, &stats) )
+			continue;
+
+		if (( site = (id == 0 ? &mem_unknown_site : mem_site_lookup(id))) == NULL )
+			continue;
+
+		// site ids start at 0, location ids at 1
+		location_id = (uint64_t)id + 1;
+		function_id = pprof_function(writer, site->function, site->file_name);
+
+		pprof_field_varint(&writer->inner, PPROF_LINE_FUNCTION_ID, function_id);
+		pprof_field_varint(&writer->inner, PPROF_LINE_LINE, site->line);
+
+		pprof_field_varint(&writer->message, PPROF_LOCATION_ID, location_id);
+		pprof_field_message(&writer->message, PPROF_LOCATION_LINE, &writer->inner);
+		pprof_field_message(&writer->profile, PPROF_PROFILE_LOCATION, &writer->message);
+
+		pprof_sample(writer, &location_id, 1, &stats);
+	}
+}
+
+
+
+/**
+ * Appends the executable mappings of the process, so pprof can symbolize
+ * anything dladdr could not. Only available on Linux; elsewhere, the profile
+ * carries no mappings.
+ *
+ * @param[in] writer The profile being written
+ */
+static void
+pprof_mappings(
+	struct pprof_writer* writer
+)
+{
+#if defined(__linux__)
+	struct pprof_mapping*	grown;
+	FILE*		maps;
+	char		line[4096];
+	char		perms[8];
+	char		path[4096];
+	uint64_t	start;
+	uint64_t	limit;
+	uint64_t	offset;
+	size_t		capacity = 0;
+
+	if (( maps = fopen("/proc/self/maps", "r")) == NULL )
+		return;
+
+	while ( fgets(line, sizeof(line), maps) != NULL )
+	{
+		path[0] = '\0';
+
+		if ( sscanf(line, "%" SCNx64 "-%" SCNx64 " %7s %" SCNx64 " %*s %*s %4095s",
+			    &start, &limit, perms, &offset, path) < 4 )
+			continue;
+
+		// only code can appear in a stack; anonymous mappings can't be symbolized
+		if ( perms[2] != 'x' || path[0] != '/' )
+			continue;
+
+		if ( writer->mapping_count == capacity )
+		{
+			capacity = (capacity == 0 ? 32 : capacity * 2);
+			if (( grown = (struct pprof_mapping*)realloc(writer->mappings, capacity * sizeof(struct pprof_mapping))) == NULL )
+			{
+				writer->profile.failed = true;
+				break;
+			}
+			writer->mappings = grown;
+		}
+
+		writer->mappings[writer->mapping_count].start = start;
+		writer->mappings[writer->mapping_count].limit = limit;
+		writer->mapping_count++;
+
+		pprof_field_varint(&writer->message, PPROF_MAPPING_ID, writer->mapping_count);
+		pprof_field_varint(&writer->message, PPROF_MAPPING_START, start);
+		pprof_field_varint(&writer->message, PPROF_MAPPING_LIMIT, limit);
+		pprof_field_varint(&writer->message, PPROF_MAPPING_OFFSET, offset);
+		pprof_field_varint(&writer->message, PPROF_MAPPING_FILENAME, (uint64_t)pprof_string(writer, path));
+		// has_functions stays unset, or pprof wouldn't fill the gaps dladdr left
+		pprof_field_message(&writer->profile, PPROF_PROFILE_MAPPING, &writer->message);
+	}
+
+	fclose(maps);
+#else
+	(void)writer;
+#endif
+}
+
+
+
+/**
+ * Obtains the location id of a frame, adding a Location (and its Function,
+ * where the symbol can be found) if this is the first time it has been seen.
+ *
+ * @param[in] writer The profile being written
+ * @param[in] frame The return address
+ * @return The location id, or 0 if it could not be added
+ */
+static uint64_t
+pprof_location(
+	struct pprof_writer* writer,
+	void* frame
+)
+{
+	uint64_t*	addresses;
+	uint64_t*	ids;
+	uint64_t	address = (uint64_t)(uintptr_t)frame;
+	uint64_t	function_id = 0;
+	size_t		capacity;
+	size_t		i;
+	size_t		slot;
+#if !defined(_WIN32)
+	Dl_info		info;
+#endif
+
+	// keep the map no more than half full
+	if ( (writer->location_count + 1) * 2 > writer->location_capacity )
+	{
+		capacity = (writer->location_capacity == 0 ? 1024 : writer->location_capacity * 2);
+		addresses = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+		ids = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+
+		if ( addresses == NULL || ids == NULL )
+		{
+			free(addresses);
+			free(ids);
+			writer->profile.failed = true;
+			return 0;
+		}
+
+		for ( i = 0; i < writer->location_capacity; i++ )
+		{
+			if ( writer->location_addresses[i] == 0 )
+				continue;
+
+			slot = (size_t)(writer->location_addresses[i] * 0x9E3779B97F4A7C15ull) & (capacity - 1);
+			while ( addresses[slot] != 0 )
+				slot = (slot + 1) & (capacity - 1);
+
+			addresses[slot] = writer->location_addresses[i];
+			ids[slot] = writer->location_ids[i];
+		}
+
+		free(writer->location_addresses);
+		free(writer->location_ids);
+		writer->location_addresses	= addresses;
+		writer->location_ids		= ids;
+		writer->location_capacity	= capacity;
+	}
+
+	slot = (size_t)(address * 0x9E3779B97F4A7C15ull) & (writer->location_capacity - 1);
+	while ( writer->location_addresses[slot] != 0 )
+	{
+		if ( writer->location_addresses[slot] == address )
+			return writer->location_ids[slot];
+
+		slot = (slot + 1) & (writer->location_capacity - 1);
+	}
+
+	writer->location_addresses[slot] = address;
+	writer->location_ids[slot] = ++writer->location_count;
+
+	pprof_field_varint(&writer->message, PPROF_LOCATION_ID, writer->location_count);
+
+	for ( i = 0; i < writer->mapping_count; i++ )
+	{
+		if ( address >= writer->mappings[i].start && address < writer->mappings[i].limit )
+		{
+			pprof_field_varint(&writer->message, PPROF_LOCATION_MAPPING_ID, i + 1);
+			break;
+		}
+	}
+
+	// a return address; step back into the call instruction
+	pprof_field_varint(&writer->message, PPROF_LOCATION_ADDRESS, address - 1);
+
+#if !defined(_WIN32)
+	if ( dladdr((void*)((uintptr_t)frame - 1), &info) != 0 && info.dli_sname != NULL )
+		function_id = pprof_function(writer, info.dli_sname, NULL);
+#endif
+
+	if ( function_id != 0 )
+	{
+		pprof_field_varint(&writer->inner, PPROF_LINE_FUNCTION_ID, function_id);
+		pprof_field_message(&writer->message, PPROF_LOCATION_LINE, &writer->inner);
+	}
+
+	pprof_field_message(&writer->profile, PPROF_PROFILE_LOCATION, &writer->message);
+
+	return writer->location_count;
+}
+
+
+
+/**
+ * Appends one sample per captured call stack, each with a location per frame.
+ *
+ * @param[in] writer The profile being written
+ * @param[in] context The memory context being profiled
+ */
+static void
+pprof_stacks(
+	struct pprof_writer* writer,
+	struct mem_context* const context
+)
+{
+	struct mem_site_stats	stats;
+	void* const*	frames;
+	uint64_t	location_ids[MEM_STACK_MAX_DEPTH];
+	uint32_t	max_id = mem_stack_count();
+	uint32_t	depth;
+	uint32_t	id;
+	uint32_t	i;
+
+	// the depot is shared by every context; only those allocated here count
+	for ( id = 1; id <= max_id; id++ )
+	{
+		if ( !mem_site_stats_read(context->stack_stats, id, &stats) )
+			continue;
+
+		if (( depth = mem_stack_lookup(id, &frames)) == 0 )
+			continue;
+
+		for ( i = 0; i < depth; i++ )
+			location_ids[i] = pprof_location(writer, frames[i]);
+
+		pprof_sample(writer, location_ids, depth, &stats);
+	}
+}
+
+
+
+/**
+ * Releases everything held by a writer.
+ *
+ * @param[in] writer The writer to release
+ */
+static void
+pprof_release(
+	struct pprof_writer* writer
+)
+{
+	struct pprof_string*	string;
+	uint32_t	i;
+
+	for ( i = 0; i < PPROF_STRING_BUCKETS; i++ )
+	{
+		while (( string = writer->buckets[i]) != NULL )
+		{
+			writer->buckets[i] = string->next;
+			free(string);
+		}
+	}
+
+	free(writer->profile.data);
+	free(writer->strings.data);
+	free(writer->message.data);
+	free(writer->inner.data);
+	free(writer->function_ids);
+	free(writer->location_addresses);
+	free(writer->location_ids);
+	free(writer->mappings);
+}
+
+
+
+bool
+mem_context_profile_write(
+	struct mem_context* const context,
+	const char* path,
+	const enum E_PROFILE_GROUPING grouping
+)
+{
+	struct pprof_writer*	writer;
+	FILE*	file = NULL;
+	bool	ret = false;
+
+	// far too big for the stack, with the string buckets
+	if (( writer = (struct pprof_writer*)calloc(1, sizeof(struct pprof_writer))) == NULL )
+		return false;
+
+	pprof_header(writer, context);
+
+	if ( grouping == PG_Stack )
+	{
+		pprof_mappings(writer);
+		pprof_stacks(writer, context);
+	}
+	else
+	{
+		pprof_sites(writer, context);
+	}
+
+	if ( writer->profile.failed || writer->strings.failed ||
+	     writer->message.failed || writer->inner.failed )
+		goto cleanup;
+
+#if defined(_WIN32)
+	if ( fopen_s(&file, path, "wb") != 0 )
+		goto cleanup;
+#else
+	if (( file = fopen(path, "wb")) == NULL )
+		goto cleanup;
+#endif
+
+	// fields may appear in any order; the string table goes last
+	if ( fwrite(writer->profile.data, 1, writer->profile.size, file) != writer->profile.size ||
+	     fwrite(writer->strings.data, 1, writer->strings.size, file) != writer->strings.size )
+		goto cleanup;
+
+	ret = true;
+
+cleanup:
+	if ( file != NULL && fclose(file) != 0 )
+		ret = false;
+	pprof_release(writer);
+	free(writer);
+
+	return ret;
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
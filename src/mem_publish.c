@@ -0,0 +1,397 @@
+
+/**
+ * @file	mem_publish.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_atomic.h"			// page sequence count
+#include "mem_shm.h"			// page layout
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdio.h>			// snprintf
+#include <stdlib.h>			// calloc, free
+#include <string.h>			// memcmp, memcpy, strlen
+
+#if defined(__linux__)
+#	include <errno.h>		// ETIMEDOUT, program_invocation_short_name
+#	include <fcntl.h>		// open
+#	include <sys/mman.h>		// mmap, munmap
+#	include <time.h>		// time, clock_gettime
+#	include <unistd.h>		// ftruncate, getpid, unlink
+#	define MEM_PUBLISH_AVAILABLE
+#endif
+
+
+// interval used if 0 is passed to mem_publish_start()
+#define MEM_PUBLISH_DEFAULT_MSEC	1000
+// longest path of a page; the directory, prefix, pid and index
+#define MEM_PUBLISH_PATH_LENGTH		64
+
+
+#if defined(MEM_PUBLISH_AVAILABLE)
+
+/**
+ * State of a running publisher; owned by the context, and only ever touched
+ * by the publisher thread, bar the stop flag.
+ *
+ * @struct mem_publisher
+ */
+struct mem_publisher
+{
+	/** The context being published */
+	struct mem_context*	context;
+	/** The time to wait between looks at the stats, in milliseconds */
+	uint32_t		interval_msec;
+
+	/** The process that started publishing; a forked child inherits the
+	 * mapping, but neither the thread nor the file are its own */
+	pid_t			pid;
+	/** The file the page is in */
+	char			path[MEM_PUBLISH_PATH_LENGTH];
+	/** The page, mapped shared */
+	struct mem_shm_page*	page;
+
+	/** The stats as last published; nothing is rewritten until they change */
+	struct mem_stats	published;
+	/** Set once anything has been published */
+	bool			has_published;
+	/** Filled by mem_context_top_sites(), then copied to the page */
+	struct mem_site_usage	usage[MEM_SHM_SITES];
+
+	/** Protects stop */
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	pthread_t		thread;
+	/** Set to have the thread exit at the next opportunity */
+	bool			stop;
+};
+
+
+// pages created by this process so far; gives each context its own
+static uint64_t		publish_count;
+
+
+
+/**
+ * Obtains the time, as used in the page.
+ *
+ * @return CLOCK_MONOTONIC, in microseconds
+ */
+static uint64_t
+publish_clock_usec(void)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+
+
+/**
+ * Copies a name into a page, truncating it if need be.
+ *
+ * @param[out] dest The space in the page, MEM_SHM_NAME_LENGTH bytes
+ * @param[in] name The name; NULL is published as empty
+ */
+static void
+publish_name(
+	char* dest,
+	const char* name
+)
+{
+	size_t	length;
+
+	if ( name == NULL )
+		name = "";
+	if (( length = strlen(name)) > MEM_SHM_NAME_LENGTH - 1 )
+		length = MEM_SHM_NAME_LENGTH - 1;
+
+	memcpy(dest, name, length);
+	dest[length] = '\0';
+}
+
+
+
+/**
+ * Rewrites the page with the current stats and top sites, unless nothing has
+ * been allocated or freed since the last time; a sites names are only copied
+ * when it first takes its slot.
+ *
+ * @param[in] publisher The publisher to update the page of
+ */
+static void
+publish_page(
+	struct mem_publisher* publisher
+)
+{
+	struct mem_shm_page*	page = publisher->page;
+	struct mem_shm_site*	slot;
+	struct mem_site*	site;
+	struct mem_stats	stats;
+	uint32_t		count = 0;
+	uint32_t		i;
+	uint64_t		now = publish_clock_usec();
+
+	// readers tell a quiet process from one not yet looked at by this
+	mem_atomic_store64(&page->heartbeat_usec, now);
+
+	mem_context_get_stats(publisher->context, &stats);
+	if ( publisher->has_published && memcmp(&stats, &publisher->published, sizeof(struct mem_stats)) == 0 )
+		return;
+
+	// only TM_Full keeps per-site counters
+	if ( publisher->context->options.mode == TM_Full )
+		count = mem_context_top_sites(publisher->context, publisher->usage, MEM_SHM_SITES);
+
+	mem_atomic_store64(&page->seq, page->seq + 1);
+	mem_atomic_fence_release();
+
+	page->publish_usec		= now;
+	page->allocs			= stats.allocs;
+	page->frees			= stats.frees;
+	page->current_allocated		= stats.current_allocated;
+	page->total_allocated		= stats.total_allocated;
+	page->current_requested		= stats.current_requested;
+	page->total_requested		= stats.total_requested;
+	page->peak_allocated		= stats.peak_allocated;
+	page->arena_allocated		= stats.arena_allocated;
+	page->invalid_frees		= stats.invalid_frees;
+	page->est_total_allocated	= stats.est_total_allocated;
+	page->est_current_allocated	= stats.est_current_allocated;
+	memcpy(page->live_by_class, stats.live_by_class, sizeof(page->live_by_class));
+	memcpy(page->allocs_by_class, stats.allocs_by_class, sizeof(page->allocs_by_class));
+
+	for ( i = 0; i < count; i++ )
+	{
+		slot = &page->sites[i];
+		site = publisher->usage[i].site;
+
+		slot->live_bytes	= publisher->usage[i].stats.live_bytes;
+		slot->live_blocks	= publisher->usage[i].stats.live_blocks;
+		slot->allocs		= publisher->usage[i].stats.allocs;
+		slot->frees		= publisher->usage[i].stats.frees;
+		slot->peak_bytes	= publisher->usage[i].stats.peak_bytes;
+		slot->alloc_bytes	= publisher->usage[i].stats.alloc_bytes;
+
+		if ( slot->id != site->id )
+		{
+			slot->id	= site->id;
+			slot->line	= site->line;
+			publish_name(slot->function, site->function);
+			publish_name(slot->file_name, site->file_name);
+		}
+	}
+	page->site_count = count;
+
+	mem_atomic_fence_release();
+	mem_atomic_store64(&page->seq, page->seq + 1);
+
+	publisher->published		= stats;
+	publisher->has_published	= true;
+}
+
+
+
+/**
+ * Waits for up to msec milliseconds, returning early if asked to stop.
+ *
+ * @param[in] publisher The publisher to wait on
+ * @param[in] msec The time to wait
+ * @retval true if the publisher has been asked to stop
+ * @retval false if the time elapsed
+ */
+static bool
+publish_wait(
+	struct mem_publisher* publisher,
+	const uint32_t msec
+)
+{
+	struct timespec	until;
+	bool		stop;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec	+= msec / 1000;
+	until.tv_nsec	+= (long)(msec % 1000) * 1000000;
+	if ( until.tv_nsec >= 1000000000 )
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&publisher->lock);
+	while ( !publisher->stop )
+	{
+		if ( pthread_cond_timedwait(&publisher->wake, &publisher->lock, &until) == ETIMEDOUT )
+			break;
+	}
+	stop = publisher->stop;
+	pthread_mutex_unlock(&publisher->lock);
+
+	return stop;
+}
+
+
+
+/**
+ * The publisher thread; updates the page every interval, until asked to stop.
+ *
+ * @param[in] param The mem_publisher to run
+ */
+static void*
+publish_thread(
+	void* param
+)
+{
+	struct mem_publisher*	publisher = (struct mem_publisher*)param;
+
+	do
+	{
+		publish_page(publisher);
+	} while ( !publish_wait(publisher, publisher->interval_msec) );
+
+	return NULL;
+}
+
+#endif	// MEM_PUBLISH_AVAILABLE
+
+
+
+bool
+mem_publish_start(
+	struct mem_context* const context,
+	const uint32_t interval_msec
+)
+{
+#if defined(MEM_PUBLISH_AVAILABLE)
+	struct mem_publisher*	publisher;
+	struct mem_shm_page*	page;
+	uint32_t		index;
+	uint32_t		i;
+	int			fd;
+
+	// in TM_Off, nothing is counted to publish
+	if ( context->publisher != NULL || context->options.mode == TM_Off )
+		goto already_running;
+
+	if (( publisher = (struct mem_publisher*)calloc(1, sizeof(struct mem_publisher))) == NULL )
+		goto alloc_failure;
+
+	publisher->context		= context;
+	publisher->interval_msec	= interval_msec == 0 ? MEM_PUBLISH_DEFAULT_MSEC : interval_msec;
+	publisher->pid			= getpid();
+	index				= (uint32_t)(mem_atomic_add_fetch64(&publish_count, 1) - 1);
+
+	snprintf(publisher->path, sizeof(publisher->path), "%s/%s%u.%u",
+		 MEM_SHM_DIR, MEM_SHM_PREFIX, (uint32_t)publisher->pid, index);
+
+	/* a page left by an earlier process with the same pid, and context,
+	 * is replaced. The directory is world-writable, so whatever is there
+	 * (a symlink, say) is removed rather than opened, and the open fails
+	 * if anything has appeared since */
+	unlink(publisher->path);
+	if (( fd = open(publisher->path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) == -1 )
+		goto open_failure;
+	if ( ftruncate(fd, sizeof(struct mem_shm_page)) != 0 ||
+	     (page = (struct mem_shm_page*)mmap(NULL, sizeof(struct mem_shm_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED )
+	{
+		close(fd);
+		goto map_failure;
+	}
+	close(fd);
+
+	// fresh from ftruncate, so zeroed
+	memcpy(page->magic, MEM_SHM_MAGIC, sizeof(MEM_SHM_MAGIC));
+	page->version		= MEM_SHM_VERSION;
+	page->page_size		= sizeof(struct mem_shm_page);
+	page->pid		= (uint32_t)publisher->pid;
+	page->context_index	= index;
+	page->mode		= (uint32_t)context->options.mode;
+	page->sample_rate	= context->options.sample_rate;
+	page->interval_msec	= publisher->interval_msec;
+	page->start_time	= (uint64_t)time(NULL);
+#if defined(__GLIBC__)
+	publish_name(page->process, program_invocation_short_name);
+#endif
+	// no site has this id, so each slot is named when first used
+	for ( i = 0; i < MEM_SHM_SITES; i++ )
+		page->sites[i].id = UINT32_MAX;
+
+	publisher->page = page;
+
+	pthread_mutex_init(&publisher->lock, NULL);
+	pthread_cond_init(&publisher->wake, NULL);
+
+	if ( pthread_create(&publisher->thread, NULL, publish_thread, publisher) != 0 )
+		goto thread_failure;
+
+	context->publisher = publisher;
+
+	return true;
+
+thread_failure:
+	pthread_cond_destroy(&publisher->wake);
+	pthread_mutex_destroy(&publisher->lock);
+	munmap(page, sizeof(struct mem_shm_page));
+map_failure:
+	unlink(publisher->path);
+open_failure:
+	free(publisher);
+alloc_failure:
+already_running:
+	return false;
+#else
+	(void)context;
+	(void)interval_msec;
+	return false;
+#endif
+}
+
+
+
+void
+mem_publish_stop(
+	struct mem_context* const context
+)
+{
+#if defined(MEM_PUBLISH_AVAILABLE)
+	struct mem_publisher*	publisher = context->publisher;
+
+	if ( publisher == NULL )
+		return;
+
+	// in a forked child, there's no thread to stop, and the file isn't ours
+	if ( publisher->pid == getpid() )
+	{
+		pthread_mutex_lock(&publisher->lock);
+		publisher->stop = true;
+		pthread_cond_signal(&publisher->wake);
+		pthread_mutex_unlock(&publisher->lock);
+
+		pthread_join(publisher->thread, NULL);
+
+		pthread_cond_destroy(&publisher->wake);
+		pthread_mutex_destroy(&publisher->lock);
+
+		unlink(publisher->path);
+	}
+
+	munmap(publisher->page, sizeof(struct mem_shm_page));
+
+	context->publisher = NULL;
+	free(publisher);
+#else
+	(void)context;
+#endif
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
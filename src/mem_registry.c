@@ -0,0 +1,304 @@
+
+/**
+ * @file	mem_registry.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// registry prototypes
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdlib.h>			// calloc, free
+
+
+// initial slots in each stripes table; always a power of 2
+#define STRIPE_INITIAL_SLOTS	64
+// an empty slot; no live block can be at address 0
+#define SLOT_EMPTY		0
+
+
+
+/**
+ * Hashes a pointer; blocks are at least 16-byte aligned, so the low bits carry
+ * nothing and are dropped before the (Fibonacci) multiplication.
+ *
+ * @param[in] memory The pointer to hash
+ * @return The hash
+ */
+static uint64_t
+hash_pointer(
+	const uintptr_t memory
+)
+{
+	return (uint64_t)(memory >> 4) * 0x9E3779B97F4A7C15ull;
+}
+
+
+
+/**
+ * Selects the stripe for a hash; the top bits are used, as they are the best
+ * mixed by the multiplication, and the table index uses the ones below.
+ */
+#define stripe_for(registry, hash)	\
+		(&(registry)->stripes[(hash) >> (64 - MEM_REGISTRY_STRIPE_BITS)])
+#define slot_for(stripe, hash)		\
+		((size_t)((hash) >> 16) & (stripe)->mask)
+
+
+
+static void
+stripe_lock(
+	struct mem_registry_stripe* stripe
+)
+{
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&stripe->lock);
+#else
+	pthread_mutex_lock(&stripe->lock);
+#endif
+}
+
+
+
+static void
+stripe_unlock(
+	struct mem_registry_stripe* stripe
+)
+{
+#if defined(_WIN32)
+	ReleaseSRWLockExclusive(&stripe->lock);
+#else
+	pthread_mutex_unlock(&stripe->lock);
+#endif
+}
+
+
+
+/**
+ * Finds the slot holding memory, or the empty slot that ends its probe
+ * sequence. The stripe must be locked.
+ *
+ * @param[in] stripe The stripe to search
+ * @param[in] memory The pointer to find
+ * @param[in] hash The hash of memory
+ * @return The index of the slot
+ */
+static size_t
+stripe_find(
+	struct mem_registry_stripe* stripe,
+	const uintptr_t memory,
+	const uint64_t hash
+)
+{
+	size_t	i = slot_for(stripe, hash);
+
+	while ( stripe->slots[i] != SLOT_EMPTY && stripe->slots[i] != memory )
+		i = (i + 1) & stripe->mask;
+
+	return i;
+}
+
+
+
+/**
+ * Doubles the size of a stripes table, rehashing every entry. The stripe must
+ * be locked.
+ *
+ * @param[in] stripe The stripe to grow
+ * @retval true if the table was grown
+ * @retval false if the new table could not be allocated
+ */
+static bool
+stripe_grow(
+	struct mem_registry_stripe* stripe
+)
+{
+	uintptr_t*	old_slots = stripe->slots;
+	size_t		old_mask = stripe->mask;
+	size_t		i;
+
+	if (( stripe->slots = (uintptr_t*)calloc((old_mask + 1) * 2, sizeof(uintptr_t))) == NULL )
+	{
+		stripe->slots = old_slots;
+		return false;
+	}
+
+	stripe->mask = (old_mask << 1) | 1;
+
+	for ( i = 0; i <= old_mask; i++ )
+	{
+		if ( old_slots[i] != SLOT_EMPTY )
+			stripe->slots[stripe_find(stripe, old_slots[i], hash_pointer(old_slots[i]))] = old_slots[i];
+	}
+
+	free(old_slots);
+	return true;
+}
+
+
+
+bool
+mem_registry_init(
+	struct mem_registry* registry
+)
+{
+	struct mem_registry_stripe*	stripe;
+	uint32_t	i;
+
+	if (( registry->stripes = (struct mem_registry_stripe*)calloc(MEM_REGISTRY_STRIPES, sizeof(struct mem_registry_stripe))) == NULL )
+		return false;
+
+	for ( i = 0; i < MEM_REGISTRY_STRIPES; i++ )
+	{
+		stripe = &registry->stripes[i];
+
+		if (( stripe->slots = (uintptr_t*)calloc(STRIPE_INITIAL_SLOTS, sizeof(uintptr_t))) == NULL )
+		{
+			mem_registry_destroy(registry);
+			return false;
+		}
+
+		stripe->mask = STRIPE_INITIAL_SLOTS - 1;
+#if defined(_WIN32)
+		InitializeSRWLock(&stripe->lock);
+#else
+		pthread_mutex_init(&stripe->lock, NULL);
+#endif
+	}
+
+	return true;
+}
+
+
+
+void
+mem_registry_destroy(
+	struct mem_registry* registry
+)
+{
+	uint32_t	i;
+
+	if ( registry->stripes == NULL )
+		return;
+
+	for ( i = 0; i < MEM_REGISTRY_STRIPES; i++ )
+	{
+		if ( registry->stripes[i].slots == NULL )
+			continue;
+#if !defined(_WIN32)
+		pthread_mutex_destroy(&registry->stripes[i].lock);
+#endif
+		free(registry->stripes[i].slots);
+	}
+
+	free(registry->stripes);
+	registry->stripes = NULL;
+}
+
+
+
+bool
+mem_registry_insert(
+	struct mem_registry* registry,
+	void* memory
+)
+{
+	const uint64_t			hash = hash_pointer((uintptr_t)memory);
+	struct mem_registry_stripe*	stripe = stripe_for(registry, hash);
+	bool	ret = true;
+
+	stripe_lock(stripe);
+
+	// keep the load under 70%, or the probe sequences get long
+	if ( (stripe->count + 1) * 10 > (stripe->mask + 1) * 7 )
+		ret = stripe_grow(stripe);
+
+	if ( ret )
+	{
+		stripe->slots[stripe_find(stripe, (uintptr_t)memory, hash)] = (uintptr_t)memory;
+		stripe->count++;
+	}
+
+	stripe_unlock(stripe);
+
+	return ret;
+}
+
+
+
+bool
+mem_registry_remove(
+	struct mem_registry* registry,
+	void* memory
+)
+{
+	const uint64_t			hash = hash_pointer((uintptr_t)memory);
+	struct mem_registry_stripe*	stripe = stripe_for(registry, hash);
+	size_t		i;
+	size_t		j;
+	size_t		home;
+	bool		ret = false;
+
+	stripe_lock(stripe);
+
+	i = stripe_find(stripe, (uintptr_t)memory, hash);
+
+	if ( stripe->slots[i] != SLOT_EMPTY )
+	{
+		/* backward-shift deletion; move up any later entry in the run
+		 * whose home slot is at or before the hole, so no tombstones are
+		 * ever needed and lookups stay short */
+		j = i;
+		for ( ;; )
+		{
+			j = (j + 1) & stripe->mask;
+			if ( stripe->slots[j] == SLOT_EMPTY )
+				break;
+
+			home = slot_for(stripe, hash_pointer(stripe->slots[j]));
+
+			// is home cyclically outside (i, j]? then it can fill the hole
+			if ( i <= j ? (home <= i || home > j) : (home <= i && home > j) )
+			{
+				stripe->slots[i] = stripe->slots[j];
+				i = j;
+			}
+		}
+
+		stripe->slots[i] = SLOT_EMPTY;
+		stripe->count--;
+		ret = true;
+	}
+
+	stripe_unlock(stripe);
+
+	return ret;
+}
+
+
+
+bool
+mem_registry_contains(
+	struct mem_registry* registry,
+	void* memory
+)
+{
+	const uint64_t			hash = hash_pointer((uintptr_t)memory);
+	struct mem_registry_stripe*	stripe = stripe_for(registry, hash);
+	bool	ret;
+
+	stripe_lock(stripe);
+	ret = (stripe->slots[stripe_find(stripe, (uintptr_t)memory, hash)] != SLOT_EMPTY);
+	stripe_unlock(stripe);
+
+	return ret;
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,456 @@
+
+/**
+ * @file	mem_scrub.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// block layout, shard locking
+#include "mem_atomic.h"			// header magic reads
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdio.h>			// printf
+#include <stdlib.h>			// calloc, free
+#include <string.h>			// memset
+
+#if !defined(_WIN32)
+#	include <errno.h>		// ETIMEDOUT
+#	include <sched.h>		// sched_yield
+#	include <time.h>		// clock_gettime
+#endif
+
+
+// batch length used if 0 is passed to mem_scrubber_start()
+#define MEM_SCRUB_DEFAULT_BATCH_USEC	200
+// blocks checked between each look at the clock
+#define MEM_SCRUB_CLOCK_INTERVAL	32
+
+
+/**
+ * State of a running scrubber; owned by the context, and only ever touched by
+ * the scrubber thread, bar the stop flag and the status.
+ *
+ * @struct mem_scrubber
+ */
+struct mem_scrubber
+{
+	/** The context being scrubbed */
+	struct mem_context*	context;
+	/** The longest a shard is held locked, in microseconds */
+	uint32_t		batch_usec;
+	/** The time to wait between passes, in milliseconds */
+	uint32_t		interval_msec;
+
+	/** The shard currently being scrubbed; NULL between passes */
+	struct mem_shard*	shard;
+
+	/** Protects stop and status */
+#if defined(_WIN32)
+	SRWLOCK			lock;
+	CONDITION_VARIABLE	wake;
+	HANDLE			thread;
+#else
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	pthread_t		thread;
+#endif
+	/** Set to have the thread exit at the next opportunity */
+	bool			stop;
+
+	struct mem_scrub_status	status;
+};
+
+
+
+/**
+ * Records a corrupt block in the scrubbers status; only the first is kept in
+ * detail. The shard owning the block must be locked.
+ *
+ * @param[in] scrubber The scrubber that found the block
+ * @param[in] mem_block The corrupt block
+ * @param[in] error The result of check_block()
+ */
+static void
+scrub_record(
+	struct mem_scrubber* scrubber,
+	struct memblock_header* mem_block,
+	enum E_MEMORY_ERROR error
+)
+{
+	struct mem_site*	site = NULL;
+
+	/* as with the report, the header is only trustworthy if its magic
+	 * survived; otherwise the site pointer could be anything */
+	if ( error != EC_CorruptHeader )
+		site = mem_block->site;
+
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&scrubber->lock);
+#else
+	pthread_mutex_lock(&scrubber->lock);
+#endif
+
+	if ( scrubber->status.corruptions++ == 0 )
+	{
+		scrubber->status.error	= error;
+		scrubber->status.block	= block_offset_realmem(mem_block);
+		scrubber->status.site	= site;
+		if ( error == EC_CorruptRedzone )
+			check_redzones(mem_block, &scrubber->status.offset);
+	}
+
+#if defined(_WIN32)
+	ReleaseSRWLockExclusive(&scrubber->lock);
+#else
+	pthread_mutex_unlock(&scrubber->lock);
+#endif
+
+#if !defined(DISABLE_MEMORY_OP_TO_STDOUT)
+	printf( "scrub [corruption]\n"
+		"\tUsable Block: %p\n"
+		"\tError: %u\n"
+		"\tSite: %s:%u\n",
+		block_offset_realmem(mem_block), error,
+		site == NULL ? "unknown" : site->file_name,
+		site == NULL ? 0 : site->line);
+#endif
+}
+
+
+
+/**
+ * Checks blocks in the current shard, resuming from where the last batch left
+ * off, until the shard is finished or the time budget runs out.
+ *
+ * @param[in] scrubber The scrubber to run a batch for
+ * @retval true if the shard has been completed
+ * @retval false if the budget ran out first; the shard's cursor is updated
+ */
+static bool
+scrub_batch(
+	struct mem_scrubber* scrubber
+)
+{
+	struct mem_shard*	shard = scrubber->shard;
+	struct memblock_header*	mem_block;
+	enum E_MEMORY_ERROR	error;
+	uint64_t		deadline;
+	uint64_t		checked = 0;
+
+	mem_shard_lock(shard);
+
+	deadline = mem_clock_usec() + scrubber->batch_usec;
+
+	for ( mem_block = shard->scrub_cursor;
+	      mem_block != NULL;
+	      mem_block = TAILQ_NEXT(mem_block, np_blocks) )
+	{
+		if ( checked != 0 && (checked % MEM_SCRUB_CLOCK_INTERVAL) == 0 &&
+		     mem_clock_usec() >= deadline )
+			break;
+
+		checked++;
+
+		/* being freed by another thread; it'll be off the list with the
+		 * next drain, and its contents are no longer the owners */
+		if ( mem_atomic_load32(&mem_block->magic) == MEM_HEADER_FREEING )
+			continue;
+
+		/* the claim may have landed while we were checking, in which
+		 * case the header magic will have 'failed' */
+		if (( error = check_block(mem_block)) != EC_NoError &&
+		    mem_atomic_load32(&mem_block->magic) != MEM_HEADER_FREEING )
+			scrub_record(scrubber, mem_block, error);
+	}
+
+	shard->scrub_cursor = mem_block;
+
+	mem_shard_unlock(shard);
+
+	mem_atomic_add64(&scrubber->status.blocks_checked, checked);
+
+	return (mem_block == NULL);
+}
+
+
+
+/**
+ * Moves the scrubber on to the next shard, starting a new pass if it has
+ * finished the last one.
+ *
+ * @param[in] scrubber The scrubber to advance
+ * @retval true if the scrubber is positioned on a shard
+ * @retval false if a pass has just been completed
+ */
+static bool
+scrub_next_shard(
+	struct mem_scrubber* scrubber
+)
+{
+	struct mem_shard*	shard;
+
+	/* shards are never released before the context, and new ones only ever
+	 * appear at the head; a pass just misses anything created during it */
+	if ( scrubber->shard == NULL )
+		shard = mem_atomic_load_ptr(&scrubber->context->shards);
+	else
+		shard = scrubber->shard->next;
+
+	scrubber->shard = shard;
+
+	if ( shard == NULL )
+	{
+		mem_atomic_add64(&scrubber->status.passes, 1);
+		return false;
+	}
+
+	mem_shard_lock(shard);
+	shard->scrub_cursor = TAILQ_FIRST(&shard->memblocks);
+	mem_shard_unlock(shard);
+
+	return true;
+}
+
+
+
+/**
+ * Waits for up to msec milliseconds, returning early if asked to stop.
+ *
+ * @param[in] scrubber The scrubber to wait on
+ * @param[in] msec The time to wait
+ * @retval true if the scrubber has been asked to stop
+ * @retval false if the time elapsed
+ */
+static bool
+scrub_wait(
+	struct mem_scrubber* scrubber,
+	const uint32_t msec
+)
+{
+	bool	stop;
+
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&scrubber->lock);
+	if ( !scrubber->stop && msec != 0 )
+		SleepConditionVariableSRW(&scrubber->wake, &scrubber->lock, msec, 0);
+	stop = scrubber->stop;
+	ReleaseSRWLockExclusive(&scrubber->lock);
+#else
+	struct timespec	until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec	+= msec / 1000;
+	until.tv_nsec	+= (long)(msec % 1000) * 1000000;
+	if ( until.tv_nsec >= 1000000000 )
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&scrubber->lock);
+	while ( !scrubber->stop && msec != 0 )
+	{
+		if ( pthread_cond_timedwait(&scrubber->wake, &scrubber->lock, &until) == ETIMEDOUT )
+			break;
+	}
+	stop = scrubber->stop;
+	pthread_mutex_unlock(&scrubber->lock);
+#endif
+
+	return stop;
+}
+
+
+
+/**
+ * The scrubber thread; batches until a pass is complete, then waits for the
+ * interval, until asked to stop.
+ *
+ * @param[in] param The mem_scrubber to run
+ */
+#if defined(_WIN32)
+static DWORD WINAPI
+#else
+static void*
+#endif
+scrub_thread(
+	void* param
+)
+{
+	struct mem_scrubber*	scrubber = (struct mem_scrubber*)param;
+	uint32_t		wait;
+
+	while ( !scrub_wait(scrubber, 0) )
+	{
+		wait = 0;
+
+		if ( scrubber->shard == NULL || scrub_batch(scrubber) )
+		{
+			if ( !scrub_next_shard(scrubber) )
+				wait = scrubber->interval_msec;
+		}
+
+		if ( wait != 0 )
+		{
+			if ( scrub_wait(scrubber, wait) )
+				break;
+		}
+		else
+		{
+			// let the owner have the lock back before the next batch
+#if defined(_WIN32)
+			SwitchToThread();
+#else
+			sched_yield();
+#endif
+		}
+	}
+
+	// don't leave a stale cursor behind for the unlink path to chase
+	if ( scrubber->shard != NULL )
+	{
+		mem_shard_lock(scrubber->shard);
+		scrubber->shard->scrub_cursor = NULL;
+		mem_shard_unlock(scrubber->shard);
+	}
+
+#if defined(_WIN32)
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+
+
+bool
+mem_scrubber_start(
+	struct mem_context* const context,
+	const uint32_t batch_usec,
+	const uint32_t interval_msec
+)
+{
+	struct mem_scrubber*	scrubber;
+
+	if ( context->scrubber != NULL )
+		goto already_running;
+
+	if (( scrubber = (struct mem_scrubber*)calloc(1, sizeof(struct mem_scrubber))) == NULL )
+		goto alloc_failure;
+
+	scrubber->context	= context;
+	scrubber->batch_usec	= batch_usec == 0 ? MEM_SCRUB_DEFAULT_BATCH_USEC : batch_usec;
+	scrubber->interval_msec	= interval_msec;
+	scrubber->status.error	= EC_NoError;
+
+#if defined(_WIN32)
+	InitializeSRWLock(&scrubber->lock);
+	InitializeConditionVariable(&scrubber->wake);
+
+	if (( scrubber->thread = CreateThread(NULL, 0, scrub_thread, scrubber, 0, NULL)) == NULL )
+		goto thread_failure;
+#else
+	pthread_mutex_init(&scrubber->lock, NULL);
+	pthread_cond_init(&scrubber->wake, NULL);
+
+	if ( pthread_create(&scrubber->thread, NULL, scrub_thread, scrubber) != 0 )
+		goto thread_failure;
+#endif
+
+	context->scrubber = scrubber;
+
+	return true;
+
+thread_failure:
+#if !defined(_WIN32)
+	pthread_cond_destroy(&scrubber->wake);
+	pthread_mutex_destroy(&scrubber->lock);
+#endif
+	free(scrubber);
+alloc_failure:
+already_running:
+	return false;
+}
+
+
+
+void
+mem_scrubber_status(
+	struct mem_context* const context,
+	struct mem_scrub_status* status
+)
+{
+	struct mem_scrubber*	scrubber = context->scrubber;
+
+	memset(status, 0, sizeof(struct mem_scrub_status));
+	status->error = EC_NoError;
+
+	if ( scrubber == NULL )
+		return;
+
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&scrubber->lock);
+#else
+	pthread_mutex_lock(&scrubber->lock);
+#endif
+
+	status->corruptions	= scrubber->status.corruptions;
+	status->error		= scrubber->status.error;
+	status->block		= scrubber->status.block;
+	status->offset		= scrubber->status.offset;
+	status->site		= scrubber->status.site;
+
+#if defined(_WIN32)
+	ReleaseSRWLockExclusive(&scrubber->lock);
+#else
+	pthread_mutex_unlock(&scrubber->lock);
+#endif
+
+	status->passes		= mem_atomic_load64(&scrubber->status.passes);
+	status->blocks_checked	= mem_atomic_load64(&scrubber->status.blocks_checked);
+}
+
+
+
+void
+mem_scrubber_stop(
+	struct mem_context* const context
+)
+{
+	struct mem_scrubber*	scrubber = context->scrubber;
+
+	if ( scrubber == NULL )
+		return;
+
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&scrubber->lock);
+	scrubber->stop = true;
+	WakeConditionVariable(&scrubber->wake);
+	ReleaseSRWLockExclusive(&scrubber->lock);
+
+	WaitForSingleObject(scrubber->thread, INFINITE);
+	CloseHandle(scrubber->thread);
+#else
+	pthread_mutex_lock(&scrubber->lock);
+	scrubber->stop = true;
+	pthread_cond_signal(&scrubber->wake);
+	pthread_mutex_unlock(&scrubber->lock);
+
+	pthread_join(scrubber->thread, NULL);
+
+	pthread_cond_destroy(&scrubber->wake);
+	pthread_mutex_destroy(&scrubber->lock);
+#endif
+
+	context->scrubber = NULL;
+	free(scrubber);
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,133 @@
+#ifndef MEM_SHM_H_INCLUDED
+#define MEM_SHM_H_INCLUDED
+
+/**
+ * @file	mem_shm.h
+ * @author	James Warren
+ * @brief	Layout of a published stats page
+ *
+ * Written by the publisher thread (see mem_publish_start()), read by
+ * memmgr-top. Kept free of anything else in the tracker, so tools can include
+ * it alone.
+ *
+ * Each published context has a single mem_shm_page, in a file of its own in
+ * MEM_SHM_DIR, named MEM_SHM_PREFIX followed by the pid and the contexts
+ * index within the process; e.g. memmgr.4242.0. The owning process writes
+ * it in place, and removes it when publishing stops. One left behind by a
+ * process that died is recognised by its pid no longer existing.
+ *
+ * Everything after seq is protected by it, seqlock style; the publisher
+ * makes it odd before rewriting any of it, and even again after. A reader
+ * copies the page, and keeps the copy only if seq was the same even value
+ * before and after. heartbeat_usec is outside of it, being written every
+ * interval whether anything has changed or not.
+ *
+ * Times in microseconds are from CLOCK_MONOTONIC, which every process on the
+ * host shares.
+ *
+ * As with snapshots, everything is in the byte order of the machine that
+ * wrote it, and the version is bumped on any incompatible change.
+ */
+
+
+#include <stdint.h>			// data types
+
+
+/** Identifies a stats page */
+#define MEM_SHM_MAGIC			"MEMSHM"
+/** The current layout version */
+#define MEM_SHM_VERSION			1
+
+/** Where pages are created, and the start of each ones name */
+#define MEM_SHM_DIR			"/dev/shm"
+#define MEM_SHM_PREFIX			"memmgr."
+
+/** The most sites published; those with the most live bytes */
+#define MEM_SHM_SITES			32
+/** Space for each name, nul included; longer ones are truncated */
+#define MEM_SHM_NAME_LENGTH		64
+/** Size classes in the histograms; as MEM_STATS_SIZE_CLASSES */
+#define MEM_SHM_SIZE_CLASSES		65
+
+
+/**
+ * A published allocation site, and its counters; as mem_site_stats.
+ *
+ * @struct mem_shm_site
+ */
+struct mem_shm_site
+{
+	uint64_t	live_bytes;	/**< Bytes currently allocated */
+	uint64_t	live_blocks;	/**< Blocks currently allocated */
+	uint64_t	allocs;		/**< Allocations made, ever */
+	uint64_t	frees;		/**< Allocations freed, ever */
+	uint64_t	peak_bytes;	/**< The most live_bytes has ever been */
+	uint64_t	alloc_bytes;	/**< Bytes allocated, ever */
+
+	/** The sites id within the process; the names are only rewritten
+	 * when a different site takes the slot */
+	uint32_t	id;
+	uint32_t	line;		/**< The line of the site */
+	char		function[MEM_SHM_NAME_LENGTH];	/**< Nul-terminated */
+	char		file_name[MEM_SHM_NAME_LENGTH];	/**< Nul-terminated */
+};
+
+
+/**
+ * The whole of a published file.
+ *
+ * @struct mem_shm_page
+ */
+struct mem_shm_page
+{
+	char		magic[8];	/**< MEM_SHM_MAGIC, nul-padded */
+	uint32_t	version;	/**< MEM_SHM_VERSION when created */
+	uint32_t	page_size;	/**< sizeof(struct mem_shm_page) */
+	uint32_t	pid;		/**< The publishing process */
+	uint32_t	context_index;	/**< Which of its contexts, from 0 */
+	/** The program name, if the platform can tell us; nul-terminated */
+	char		process[MEM_SHM_NAME_LENGTH];
+	/** mem_options.mode, an E_TRACKING_MODE; sites are only published
+	 * in TM_Full */
+	uint32_t	mode;
+	/** mem_options.sample_rate; if non-zero, the site counters are of
+	 * sampled blocks only */
+	uint32_t	sample_rate;
+	/** How often the page is looked at, in milliseconds */
+	uint32_t	interval_msec;
+	uint32_t	reserved;
+	/** When publishing started, in seconds since the epoch */
+	uint64_t	start_time;
+	/** When the publisher last looked, in microseconds; if later than
+	 * publish_usec, nothing had changed */
+	uint64_t	heartbeat_usec;
+
+	/** Odd while the publisher is rewriting anything below */
+	uint64_t	seq;
+	/** When the below was last rewritten, in microseconds */
+	uint64_t	publish_usec;
+
+	/** As mem_stats */
+	uint64_t	allocs;
+	uint64_t	frees;
+	uint64_t	current_allocated;
+	uint64_t	total_allocated;
+	uint64_t	current_requested;
+	uint64_t	total_requested;
+	uint64_t	peak_allocated;
+	uint64_t	arena_allocated;
+	uint64_t	invalid_frees;
+	uint64_t	est_total_allocated;
+	uint64_t	est_current_allocated;
+	uint64_t	live_by_class[MEM_SHM_SIZE_CLASSES];
+	uint64_t	allocs_by_class[MEM_SHM_SIZE_CLASSES];
+
+	/** Sites in use, most live bytes first */
+	uint32_t	site_count;
+	uint32_t	reserved2;
+	struct mem_shm_site	sites[MEM_SHM_SITES];
+};
+
+
+
+#endif	// MEM_SHM_H_INCLUDED
@@ -0,0 +1,235 @@
+
+/**
+ * @file	mem_site.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// table sizes
+#include "mem_atomic.h"			// lock-free lookups
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdlib.h>			// calloc
+#include <string.h>			// strcmp, strrchr
+
+
+// number of buckets in the intern hash table
+#define MEM_SITE_BUCKETS	1024
+
+#if defined(_WIN32)
+#	define PATH_CHAR	'\\'
+#else
+#	define PATH_CHAR	'/'
+#endif
+
+
+/* Only needed to register and intern sites, both of which are rare; the lookup
+ * table is read without it. Statically initialized, as sites can be registered
+ * before (or without) any context being created */
+#if defined(_WIN32)
+static SRWLOCK			site_lock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t		site_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/** Two-level table of every registered site, indexed by id */
+static struct mem_site**	site_table[MEM_SITE_CHUNKS];
+/** The highest id assigned so far */
+static uint32_t			site_max_id = 0;
+/** Hash table of sites created by mem_site_intern() */
+static struct mem_site*		site_buckets[MEM_SITE_BUCKETS];
+
+
+#if defined(MEM_SITE_SECTION)
+/* provided by the linker for any section named as a valid C identifier; weak,
+ * as the section won't exist if nothing in the binary uses the macros */
+extern struct mem_site		__start_memmgr_sites[] __attribute__((weak));
+extern struct mem_site		__stop_memmgr_sites[] __attribute__((weak));
+#endif
+
+
+
+static void
+site_table_lock(void)
+{
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&site_lock);
+#else
+	pthread_mutex_lock(&site_lock);
+#endif
+}
+
+
+
+static void
+site_table_unlock(void)
+{
+#if defined(_WIN32)
+	ReleaseSRWLockExclusive(&site_lock);
+#else
+	pthread_mutex_unlock(&site_lock);
+#endif
+}
+
+
+
+/**
+ * Assigns the next id to a site and adds it to the lookup table. The site lock
+ * must be held, and the site must not already be registered.
+ *
+ * @param[in] site The site to add
+ */
+static void
+site_table_add(
+	struct mem_site* site
+)
+{
+	struct mem_site**	chunk;
+	const char*		p;
+	uint32_t		id = site_max_id + 1;
+
+	if ( id >= MEM_SITE_CHUNK_SIZE * MEM_SITE_CHUNKS )
+		goto table_full;
+
+	if (( chunk = site_table[id / MEM_SITE_CHUNK_SIZE]) == NULL )
+	{
+		if (( chunk = (struct mem_site**)calloc(MEM_SITE_CHUNK_SIZE, sizeof(struct mem_site*))) == NULL )
+			goto table_full;
+
+		mem_atomic_store_ptr(&site_table[id / MEM_SITE_CHUNK_SIZE], chunk);
+	}
+
+	// we don't want the full path information that compilers set
+	site->file_name = site->file;
+	if ( site->file != NULL && (p = strrchr(site->file, PATH_CHAR)) != NULL )
+		site->file_name = ++p;
+
+	mem_atomic_store_ptr(&chunk[id % MEM_SITE_CHUNK_SIZE], site);
+	mem_atomic_store32(&site_max_id, id);
+	// publish the id last; a non-zero id means the site is usable
+	mem_atomic_store32(&site->id, id);
+
+	return;
+
+table_full:
+	/* the site still works for tracking, it just can't be looked up; give
+	 * it something to print at least */
+	site->file_name = site->file;
+	return;
+}
+
+
+
+void
+mem_site_register(
+	struct mem_site* site
+)
+{
+	site_table_lock();
+
+	// another thread may have beaten us to it
+	if ( site->id == 0 )
+		site_table_add(site);
+
+	site_table_unlock();
+}
+
+
+
+void
+mem_sites_register_all(void)
+{
+#if defined(MEM_SITE_SECTION)
+	struct mem_site*	site;
+
+	if ( __start_memmgr_sites == NULL )
+		return;
+
+	site_table_lock();
+
+	for ( site = __start_memmgr_sites; site < __stop_memmgr_sites; site++ )
+	{
+		if ( site->id == 0 )
+			site_table_add(site);
+	}
+
+	site_table_unlock();
+#endif
+}
+
+
+
+struct mem_site*
+mem_site_intern(
+	const char* file,
+	const char* function,
+	const uint32_t line
+)
+{
+	struct mem_site*	site;
+	uintptr_t		hash;
+
+	// the strings are literals, so the same site always has the same pointers
+	hash = ((uintptr_t)file ^ ((uintptr_t)function >> 4)) * 31 + line;
+	hash %= MEM_SITE_BUCKETS;
+
+	site_table_lock();
+
+	for ( site = site_buckets[hash]; site != NULL; site = site->next )
+	{
+		if ( site->line == line &&
+		     strcmp(site->file, file) == 0 &&
+		     strcmp(site->function, function) == 0 )
+			goto found;
+	}
+
+	if (( site = (struct mem_site*)calloc(1, sizeof(struct mem_site))) == NULL )
+		goto found;
+
+	site->file	= file;
+	site->function	= function;
+	site->line	= line;
+	site->next	= site_buckets[hash];
+	site_buckets[hash] = site;
+
+	site_table_add(site);
+
+found:
+	site_table_unlock();
+	return site;
+}
+
+
+
+struct mem_site*
+mem_site_lookup(
+	const uint32_t id
+)
+{
+	struct mem_site**	chunk;
+
+	if ( id == 0 || id > mem_atomic_load32(&site_max_id) )
+		return NULL;
+
+	if (( chunk = mem_atomic_load_ptr(&site_table[id / MEM_SITE_CHUNK_SIZE])) == NULL )
+		return NULL;
+
+	return mem_atomic_load_ptr(&chunk[id % MEM_SITE_CHUNK_SIZE]);
+}
+
+
+
+uint32_t
+mem_site_max_id(void)
+{
+	return mem_atomic_load32(&site_max_id);
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,329 @@
+
+/**
+ * @file	mem_site_stats.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// site table sizes
+#include "mem_atomic.h"			// lock-free counters
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdio.h>			// fprintf
+#include <stdlib.h>			// calloc, free
+
+
+// number of sites listed in the memory info report
+#define MEM_SITE_STATS_REPORTED		10
+
+
+
+/**
+ * Obtains the counters for an id, creating the chunk holding them if this is
+ * the first id within it to be used. Sites without an id (not registered, or
+ * the site table is full) share the counters at index 0.
+ *
+ * The site and stack tables are the same shape; the stack depot is limited to
+ * as many stacks as the site table is to sites.
+ *
+ * @param[in] table The site or stack counters of a context
+ * @param[in] id The site or stack id
+ * @return The counters, or NULL if the chunk could not be created
+ */
+static struct mem_site_stats*
+site_stats_get(
+	struct mem_site_stats** table,
+	const uint32_t id
+)
+{
+	struct mem_site_stats*	chunk;
+	struct mem_site_stats*	created;
+
+	if ( table == NULL || id >= MEM_SITE_CHUNK_SIZE * MEM_SITE_CHUNKS )
+		return NULL;
+
+	if (( chunk = mem_atomic_load_ptr(&table[id / MEM_SITE_CHUNK_SIZE])) == NULL )
+	{
+		if (( created = (struct mem_site_stats*)calloc(MEM_SITE_CHUNK_SIZE, sizeof(struct mem_site_stats))) == NULL )
+			return NULL;
+
+		// another thread may have got there first; theirs wins
+		if ( mem_atomic_cas_ptr(&table[id / MEM_SITE_CHUNK_SIZE], NULL, created) )
+			chunk = created;
+		else
+		{
+			free(created);
+			chunk = mem_atomic_load_ptr(&table[id / MEM_SITE_CHUNK_SIZE]);
+		}
+	}
+
+	return &chunk[id % MEM_SITE_CHUNK_SIZE];
+}
+
+
+
+/**
+ * Counts an allocation.
+ *
+ * @param[in] stats The counters to update
+ * @param[in] num_bytes The number of bytes requested
+ */
+static void
+site_stats_add(
+	struct mem_site_stats* stats,
+	const size_t num_bytes
+)
+{
+	uint64_t	live;
+	uint64_t	peak;
+
+	mem_atomic_add64(&stats->allocs, 1);
+	mem_atomic_add64(&stats->alloc_bytes, num_bytes);
+	mem_atomic_add64(&stats->live_blocks, 1);
+	live = mem_atomic_add_fetch64(&stats->live_bytes, num_bytes);
+
+	// raise the peak, unless another thread has already raised it further
+	peak = mem_atomic_load64(&stats->peak_bytes);
+	while ( live > peak && !mem_atomic_cas64(&stats->peak_bytes, peak, live) )
+		peak = mem_atomic_load64(&stats->peak_bytes);
+}
+
+
+
+/**
+ * Counts a free.
+ *
+ * @param[in] stats The counters to update
+ * @param[in] num_bytes The number of bytes originally requested
+ */
+static void
+site_stats_remove(
+	struct mem_site_stats* stats,
+	const size_t num_bytes
+)
+{
+	mem_atomic_add64(&stats->frees, 1);
+	mem_atomic_sub64(&stats->live_blocks, 1);
+	mem_atomic_sub64(&stats->live_bytes, num_bytes);
+}
+
+
+
+/**
+ * Releases a table of counters.
+ *
+ * @param[in] table The table to release; may be NULL
+ */
+static void
+site_stats_release(
+	struct mem_site_stats** table
+)
+{
+	uint32_t	i;
+
+	if ( table == NULL )
+		return;
+
+	for ( i = 0; i < MEM_SITE_CHUNKS; i++ )
+		free(table[i]);
+
+	free(table);
+}
+
+
+
+bool
+mem_site_stats_init(
+	struct mem_context* const context
+)
+{
+	// only the top level; the chunks appear as ids are used
+	context->site_stats = (struct mem_site_stats**)calloc(MEM_SITE_CHUNKS, sizeof(struct mem_site_stats*));
+	context->stack_stats = (struct mem_site_stats**)calloc(MEM_SITE_CHUNKS, sizeof(struct mem_site_stats*));
+
+	return (context->site_stats != NULL && context->stack_stats != NULL);
+}
+
+
+
+void
+mem_site_stats_destroy(
+	struct mem_context* const context
+)
+{
+	site_stats_release(context->site_stats);
+	site_stats_release(context->stack_stats);
+
+	context->site_stats = NULL;
+	context->stack_stats = NULL;
+}
+
+
+
+void
+mem_site_stats_alloc(
+	struct mem_context* const context,
+	struct mem_site* site,
+	const uint32_t stack_id,
+	const size_t num_bytes
+)
+{
+	struct mem_site_stats*	stats;
+
+	if (( stats = site_stats_get(context->site_stats, mem_atomic_load32(&site->id))) != NULL )
+		site_stats_add(stats, num_bytes);
+
+	if ( stack_id != 0 && (stats = site_stats_get(context->stack_stats, stack_id)) != NULL )
+		site_stats_add(stats, num_bytes);
+}
+
+
+
+void
+mem_site_stats_free(
+	struct mem_context* const context,
+	struct mem_site* site,
+	const uint32_t stack_id,
+	const size_t num_bytes
+)
+{
+	struct mem_site_stats*	stats;
+
+	if (( stats = site_stats_get(context->site_stats, mem_atomic_load32(&site->id))) != NULL )
+		site_stats_remove(stats, num_bytes);
+
+	if ( stack_id != 0 && (stats = site_stats_get(context->stack_stats, stack_id)) != NULL )
+		site_stats_remove(stats, num_bytes);
+}
+
+
+
+bool
+mem_site_stats_read(
+	struct mem_site_stats** table,
+	const uint32_t id,
+	struct mem_site_stats* stats
+)
+{
+	struct mem_site_stats*	chunk;
+
+	if ( table == NULL || id >= MEM_SITE_CHUNK_SIZE * MEM_SITE_CHUNKS )
+		return false;
+
+	if (( chunk = mem_atomic_load_ptr(&table[id / MEM_SITE_CHUNK_SIZE])) == NULL )
+		return false;
+
+	chunk += id % MEM_SITE_CHUNK_SIZE;
+
+	stats->live_bytes	= mem_atomic_load64(&chunk->live_bytes);
+	stats->live_blocks	= mem_atomic_load64(&chunk->live_blocks);
+	stats->allocs		= mem_atomic_load64(&chunk->allocs);
+	stats->frees		= mem_atomic_load64(&chunk->frees);
+	stats->peak_bytes	= mem_atomic_load64(&chunk->peak_bytes);
+	stats->alloc_bytes	= mem_atomic_load64(&chunk->alloc_bytes);
+
+	return (stats->allocs != 0);
+}
+
+
+
+uint32_t
+mem_context_top_sites(
+	struct mem_context* const context,
+	struct mem_site_usage* usage,
+	const uint32_t count
+)
+{
+	struct mem_site_stats*	chunk;
+	struct mem_site*	site;
+	uint32_t	max_id = mem_site_max_id();
+	uint32_t	found = 0;
+	uint32_t	id;
+	uint32_t	i;
+	uint64_t	live_bytes;
+
+	if ( context->site_stats == NULL || count == 0 )
+		return 0;
+
+	for ( id = 0; id <= max_id; id++ )
+	{
+		if (( chunk = mem_atomic_load_ptr(&context->site_stats[id / MEM_SITE_CHUNK_SIZE])) == NULL )
+		{
+			// nothing in this chunk has allocated; skip to the next
+			id |= MEM_SITE_CHUNK_SIZE - 1;
+			continue;
+		}
+
+		live_bytes = mem_atomic_load64(&chunk[id % MEM_SITE_CHUNK_SIZE].live_bytes);
+
+		if ( live_bytes == 0 && mem_atomic_load64(&chunk[id % MEM_SITE_CHUNK_SIZE].allocs) == 0 )
+			continue;
+
+		// the list is kept sorted; anything smaller than the last won't fit
+		if ( found == count && live_bytes <= usage[found - 1].stats.live_bytes )
+			continue;
+
+		if (( site = (id == 0 ? &mem_unknown_site : mem_site_lookup(id))) == NULL )
+			continue;
+
+		// shift the smaller entries down, dropping the last if full
+		i = (found < count ? found++ : found - 1);
+		for ( ; i > 0 && usage[i - 1].stats.live_bytes < live_bytes; i-- )
+			usage[i] = usage[i - 1];
+
+		usage[i].site			= site;
+		usage[i].stats.live_bytes	= live_bytes;
+		usage[i].stats.live_blocks	= mem_atomic_load64(&chunk[id % MEM_SITE_CHUNK_SIZE].live_blocks);
+		usage[i].stats.allocs		= mem_atomic_load64(&chunk[id % MEM_SITE_CHUNK_SIZE].allocs);
+		usage[i].stats.frees		= mem_atomic_load64(&chunk[id % MEM_SITE_CHUNK_SIZE].frees);
+		usage[i].stats.peak_bytes	= mem_atomic_load64(&chunk[id % MEM_SITE_CHUNK_SIZE].peak_bytes);
+		usage[i].stats.alloc_bytes	= mem_atomic_load64(&chunk[id % MEM_SITE_CHUNK_SIZE].alloc_bytes);
+	}
+
+	return found;
+}
+
+
+
+void
+mem_site_stats_output(
+	struct mem_context* const context,
+	FILE* file
+)
+{
+	struct mem_site_usage	usage[MEM_SITE_STATS_REPORTED];
+	uint32_t		found;
+	uint32_t		i;
+
+	found = mem_context_top_sites(context, usage, MEM_SITE_STATS_REPORTED);
+
+	if ( found == 0 )
+		return;
+
+	fprintf(file,
+		"# Top Sites (by live bytes)\n"
+		"    Live Bytes  Live Blocks    Peak Bytes       Allocs        Frees  Site\n"
+	);
+
+	for ( i = 0; i < found; i++ )
+	{
+		fprintf(file,
+			"%14" PRIu64 " %12" PRIu64 " %13" PRIu64 " %12" PRIu64 " %12" PRIu64 "  %s (%s:%u)\n",
+			usage[i].stats.live_bytes, usage[i].stats.live_blocks,
+			usage[i].stats.peak_bytes, usage[i].stats.allocs,
+			usage[i].stats.frees, usage[i].site->function,
+			usage[i].site->file_name, usage[i].site->line
+		);
+	}
+
+	fprintf(file, "\n");
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
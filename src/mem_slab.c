@@ -0,0 +1,247 @@
+
+/**
+ * @file	mem_slab.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// block layout
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdlib.h>			// malloc, free
+#include <string.h>			// memset
+
+
+/* space reserved at the start of each slab for the link to the next; kept at
+ * 16 so the slots that follow retain malloc's alignment */
+#define SLAB_LINK_SIZE		16
+// slot sizes are rounded up to this, again to retain alignment
+#define SLOT_ALIGNMENT		16
+
+
+/* The largest request served by each size class; spaced 16 bytes apart up to
+ * 128, then four classes to every doubling, so no slot wastes more than 20% */
+static const uint32_t	slab_class_size[MEM_SLAB_CLASSES] =
+{
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+	640, 768, 896, 1024,
+	1280, 1536, 1792, 2048
+};
+
+
+
+/**
+ * Calculates the size of a slot for the size class; space for the header,
+ * footer, redzones, and the largest request the class serves.
+ *
+ * @param[in] size_class The 1-based size class
+ * @param[in] redzone The size of each redzone
+ * @return The slot size, in bytes
+ */
+static uint32_t
+slot_size(
+	const uint32_t size_class,
+	const uint32_t redzone
+)
+{
+	uint32_t	size = slab_class_size[size_class - 1] + HEADER_FOOTER_SIZE + 2 * redzone;
+
+	return (size + SLOT_ALIGNMENT - 1) & ~(SLOT_ALIGNMENT - 1);
+}
+
+
+
+uint32_t
+mem_slab_class(
+	const size_t num_bytes
+)
+{
+	uint32_t	log2 = 0;
+	uint32_t	n;
+
+	if ( num_bytes <= 128 )
+		return num_bytes == 0 ? 1 : (uint32_t)(num_bytes + 15) >> 4;
+
+	if ( num_bytes > MEM_SLAB_MAX_SIZE )
+		return 0;
+
+	// floor(log2(num_bytes - 1)); 7 for 129-256, through to 10 for 1025-2048
+#if defined(__GNUC__)
+	log2 = 31 - __builtin_clz((uint32_t)num_bytes - 1);
+#else
+	for ( n = (uint32_t)num_bytes - 1; n > 1; n >>= 1 )
+		log2++;
+#endif
+
+	// four classes per doubling, each a quarter of the base apart
+	n = (uint32_t)num_bytes - (1u << log2);
+
+	return 8 + (log2 - 7) * 4 + ((n + (1u << (log2 - 2)) - 1) >> (log2 - 2));
+}
+
+
+
+struct memblock_header*
+mem_slab_alloc(
+	struct mem_shard* shard,
+	const uint32_t size_class
+)
+{
+	struct mem_slab_cache*	cache = &shard->slab[size_class - 1];
+	struct memblock_header*	mem_block;
+	uint8_t*	slab;
+	uint32_t	redzone = mem_redzone_size(shard->context);
+	uint32_t	size;
+	uint32_t	count;
+	uint32_t	i;
+
+	if ( cache->free_slots == NULL )
+	{
+		if (( slab = (uint8_t*)malloc(MEM_SLAB_SIZE)) == NULL )
+			return NULL;
+
+		*(void**)slab = cache->slabs;
+		cache->slabs = slab;
+
+		size = slot_size(size_class, redzone);
+		count = (MEM_SLAB_SIZE - SLAB_LINK_SIZE) / size;
+
+		/* carve from the end, so the lowest addresses come off the
+		 * free list first; everything in the header that doesn't
+		 * depend on the request is set here, once per slot */
+		for ( i = count; i > 0; i-- )
+		{
+			mem_block = (struct memblock_header*)(slab + SLAB_LINK_SIZE + (i - 1) * size);
+
+			memset(mem_block, MEM_AFTER_FREE, sizeof(struct memblock_header));
+			mem_block->size_class	= size_class;
+			mem_block->redzone	= redzone;
+			mem_block->flags	= 0;
+			mem_block->shard	= shard;
+			mem_block->remote_next	= cache->free_slots;
+			cache->free_slots	= mem_block;
+		}
+
+		cache->slots_total += count;
+	}
+
+	mem_block = cache->free_slots;
+	cache->free_slots = mem_block->remote_next;
+	cache->slots_used++;
+
+	return mem_block;
+}
+
+
+
+void
+mem_slab_free(
+	struct mem_shard* shard,
+	struct memblock_header* mem_block
+)
+{
+	struct mem_slab_cache*	cache = &shard->slab[mem_block->size_class - 1];
+
+	/* fill the app-allocated memory (highlights use after free); the header
+	 * keeps its pre-initialized fields, but loses its magic, so the slot
+	 * can't pass validation until it's handed out again */
+	mem_fill_freed(mem_block);
+
+	mem_block->remote_next = cache->free_slots;
+	cache->free_slots = mem_block;
+	cache->slots_used--;
+}
+
+
+
+void
+mem_slab_destroy(
+	struct mem_shard* shard
+)
+{
+	struct mem_slab_cache*	cache;
+	void*		slab;
+	void*		next;
+	uint32_t	i;
+
+	for ( i = 0; i < MEM_SLAB_CLASSES; i++ )
+	{
+		cache = &shard->slab[i];
+
+		for ( slab = cache->slabs; slab != NULL; slab = next )
+		{
+			next = *(void**)slab;
+			free(slab);
+		}
+
+		cache->slabs		= NULL;
+		cache->free_slots	= NULL;
+		cache->slots_total	= 0;
+		cache->slots_used	= 0;
+	}
+}
+
+
+
+void
+mem_slab_output(
+	struct mem_context* const context,
+	FILE* file
+)
+{
+	struct mem_shard*	shard;
+	uint64_t	total[MEM_SLAB_CLASSES] = { 0 };
+	uint64_t	used[MEM_SLAB_CLASSES] = { 0 };
+	uint64_t	all_total = 0;
+	uint64_t	all_used = 0;
+	uint32_t	i;
+
+	for ( shard = context->shards; shard != NULL; shard = shard->next )
+	{
+		mem_shard_lock(shard);
+		for ( i = 0; i < MEM_SLAB_CLASSES; i++ )
+		{
+			total[i] += shard->slab[i].slots_total;
+			used[i] += shard->slab[i].slots_used;
+		}
+		mem_shard_unlock(shard);
+	}
+
+	fprintf(file,
+		"# Slab Occupancy\n"
+		"Class  Size  Slot Size      Slots       Used  Utilisation\n"
+	);
+
+	for ( i = 0; i < MEM_SLAB_CLASSES; i++ )
+	{
+		if ( total[i] == 0 )
+			continue;
+
+		fprintf(file,
+			"%5u %5u %10u %10" PRIu64 " %10" PRIu64 " %11.1f%%\n",
+			i + 1, slab_class_size[i], slot_size(i + 1, mem_redzone_size(context)),
+			total[i], used[i], (100.0 * used[i]) / total[i]
+		);
+
+		all_total += total[i];
+		all_used += used[i];
+	}
+
+	fprintf(file,
+		"Total Slots.............: %" PRIu64 "\n"
+		"Used Slots..............: %" PRIu64 "\n"
+		"\n",
+		all_total, all_used
+	);
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,273 @@
+
+/**
+ * @file	mem_snapshot.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// block layout, shard locking
+#include "mem_atomic.h"			// header magic reads
+#include "mem_snapshot.h"		// file format
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdio.h>			// fopen, fwrite
+#include <stdlib.h>			// malloc, realloc, free
+#include <string.h>			// memset, strlen
+
+
+// records the block buffer starts with; doubled each time it fills
+#define SNAPSHOT_INITIAL_BLOCKS		4096
+
+
+
+/**
+ * Rounds an offset up to the 8-byte alignment every section starts at.
+ *
+ * @param[in] offset The offset to align
+ * @return The aligned offset
+ */
+static uint64_t
+snapshot_align(
+	const uint64_t offset
+)
+{
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+
+
+/**
+ * Writes zeroes, to pad the file up to an aligned offset.
+ *
+ * @param[in] file The file to write to
+ * @param[in] offset The current offset
+ * @retval true if the padding was written
+ * @retval false if the write failed
+ */
+static bool
+snapshot_pad(
+	FILE* file,
+	const uint64_t offset
+)
+{
+	static const uint8_t	zeroes[8];
+	size_t	pad = (size_t)(snapshot_align(offset) - offset);
+
+	return (pad == 0 || fwrite(zeroes, 1, pad, file) == pad);
+}
+
+
+
+/**
+ * Copies every live block of a shard into the buffer, growing it as needed.
+ * Only the copy is made under the shard lock; nothing is written to disk.
+ *
+ * @param[in] shard The shard to copy the blocks of
+ * @param[in,out] blocks The buffer, reallocated if it fills
+ * @param[in,out] capacity The number of records the buffer holds
+ * @param[in,out] count The number of records used
+ * @retval true if every block was copied
+ * @retval false if the buffer could not be grown
+ */
+static bool
+snapshot_copy_shard(
+	struct mem_shard* shard,
+	struct mem_snapshot_block** blocks,
+	uint64_t* capacity,
+	uint64_t* count
+)
+{
+	struct memblock_header*		mem_block;
+	struct mem_snapshot_block*	record;
+	struct mem_snapshot_block*	grown;
+	bool				ret = true;
+
+	mem_shard_lock(shard);
+
+	TAILQ_FOREACH(mem_block, &shard->memblocks, np_blocks)
+	{
+		// already freed, awaiting the owner to unlink it
+		if ( mem_atomic_load32(&mem_block->magic) == MEM_HEADER_FREEING )
+			continue;
+
+		if ( *count == *capacity )
+		{
+			if (( grown = (struct mem_snapshot_block*)realloc(*blocks, (size_t)(*capacity * 2 * sizeof(struct mem_snapshot_block)))) == NULL )
+			{
+				ret = false;
+				break;
+			}
+			*blocks = grown;
+			*capacity *= 2;
+		}
+
+		record = &(*blocks)[(*count)++];
+		record->address		= (uint64_t)(uintptr_t)block_offset_realmem(mem_block);
+		record->alloc_usec	= mem_block->alloc_time;
+		record->size		= mem_block->requested_size;
+		record->site_id		= mem_block->site->id;
+		record->thread_id	= shard->id;
+		record->stack_id	= mem_block->stack_id;
+		record->reserved	= 0;
+	}
+
+	mem_shard_unlock(shard);
+
+	return ret;
+}
+
+
+
+/**
+ * Writes the site records, followed by the strings they reference.
+ *
+ * @param[in] file The file to write to
+ * @param[in,out] header The header, to populate with the site and string
+ * details
+ * @retval true if everything was written
+ * @retval false if a write failed
+ */
+static bool
+snapshot_write_sites(
+	FILE* file,
+	struct mem_snapshot_header* header
+)
+{
+	struct mem_snapshot_site	record;
+	struct mem_site*	site;
+	uint32_t	max_id = mem_site_max_id();
+	uint32_t	strings = 0;
+	uint32_t	id;
+
+	header->site_offset	= snapshot_align(header->block_offset + header->block_count * sizeof(struct mem_snapshot_block));
+	header->site_count	= 0;
+
+	if ( !snapshot_pad(file, header->block_offset + header->block_count * sizeof(struct mem_snapshot_block)) )
+		return false;
+
+	// strings are laid out in the same order as the sites, so the offsets are known up front
+	for ( id = 0; id <= max_id; id++ )
+	{
+		if (( site = (id == 0 ? &mem_unknown_site : mem_site_lookup(id))) == NULL )
+			continue;
+
+		record.site_id	= id;
+		record.line	= site->line;
+		record.function	= strings;
+		strings += (uint32_t)strlen(site->function) + 1;
+		record.file	= strings;
+		strings += (uint32_t)strlen(site->file_name) + 1;
+
+		if ( fwrite(&record, sizeof(record), 1, file) != 1 )
+			return false;
+
+		header->site_count++;
+	}
+
+	header->string_offset	= header->site_offset + header->site_count * sizeof(struct mem_snapshot_site);
+	header->string_size	= strings;
+
+	for ( id = 0; id <= max_id; id++ )
+	{
+		if (( site = (id == 0 ? &mem_unknown_site : mem_site_lookup(id))) == NULL )
+			continue;
+
+		if ( fwrite(site->function, strlen(site->function) + 1, 1, file) != 1 ||
+		     fwrite(site->file_name, strlen(site->file_name) + 1, 1, file) != 1 )
+			return false;
+	}
+
+	return true;
+}
+
+
+
+bool
+mem_context_snapshot_write(
+	struct mem_context* const context,
+	const char* path
+)
+{
+	struct mem_snapshot_header	header;
+	struct mem_snapshot_block*	blocks = NULL;
+	struct mem_shard*	shard;
+	FILE*		file = NULL;
+	uint64_t	capacity = SNAPSHOT_INITIAL_BLOCKS;
+	uint64_t	count = 0;
+	bool		ret = false;
+
+	if (( blocks = (struct mem_snapshot_block*)malloc(capacity * sizeof(struct mem_snapshot_block))) == NULL )
+		goto cleanup;
+
+#if defined(_WIN32)
+	if ( fopen_s(&file, path, "wb") != 0 )
+		goto cleanup;
+#else
+	if (( file = fopen(path, "wb")) == NULL )
+		goto cleanup;
+#endif
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MEM_SNAPSHOT_MAGIC, sizeof(MEM_SNAPSHOT_MAGIC));
+	header.version		= MEM_SNAPSHOT_VERSION;
+	header.header_size	= sizeof(struct mem_snapshot_header);
+	header.block_size	= sizeof(struct mem_snapshot_block);
+	header.site_size	= sizeof(struct mem_snapshot_site);
+	header.sample_rate	= context->options.sample_rate;
+	header.block_offset	= snapshot_align(sizeof(struct mem_snapshot_header));
+
+	// no new shards can appear while we hold the context lock
+#if defined(_WIN32)
+	EnterCriticalSection(&context->cs);
+#else
+	pthread_mutex_lock(&context->lock);
+#endif
+
+	header.taken_usec = mem_clock_usec();
+
+	for ( shard = context->shards; shard != NULL; shard = shard->next )
+	{
+		if ( !snapshot_copy_shard(shard, &blocks, &capacity, &count) )
+			break;
+	}
+
+#if defined(_WIN32)
+	LeaveCriticalSection(&context->cs);
+#else
+	pthread_mutex_unlock(&context->lock);
+#endif
+
+	if ( shard != NULL )
+		goto cleanup;
+
+	header.block_count = count;
+
+	// the header goes first, but is only complete once the sites are written
+	if ( fwrite(&header, sizeof(header), 1, file) != 1 ||
+	     !snapshot_pad(file, sizeof(header)) ||
+	     (count != 0 && fwrite(blocks, sizeof(struct mem_snapshot_block), (size_t)count, file) != count) ||
+	     !snapshot_write_sites(file, &header) )
+		goto cleanup;
+
+	if ( fseek(file, 0, SEEK_SET) != 0 ||
+	     fwrite(&header, sizeof(header), 1, file) != 1 )
+		goto cleanup;
+
+	ret = true;
+
+cleanup:
+	if ( file != NULL && fclose(file) != 0 )
+		ret = false;
+	free(blocks);
+
+	return ret;
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,99 @@
+#ifndef MEM_SNAPSHOT_H_INCLUDED
+#define MEM_SNAPSHOT_H_INCLUDED
+
+/**
+ * @file	mem_snapshot.h
+ * @author	James Warren
+ * @brief	On-disk format of a heap snapshot
+ *
+ * Written by mem_context_snapshot_write(), read by memmgr-analyze. Kept free of
+ * anything else in the tracker, so tools can include it alone.
+ *
+ * A snapshot is, in order:
+ * - a mem_snapshot_header
+ * - block_count mem_snapshot_block records
+ * - site_count mem_snapshot_site records
+ * - string_size bytes of nul-terminated strings, referenced by the sites
+ *
+ * Every record is fixed size, and each section begins at the offset stated in
+ * the header, 8-byte aligned, so the file can be memory-mapped and used in
+ * place. All values are in the byte order of the machine that wrote the file;
+ * a reader on another machine detects the mismatch via the magic.
+ *
+ * The version is bumped on any incompatible change; new fields only ever go
+ * on the end of a record, with header_size and the record sizes telling a
+ * reader how far to step.
+ */
+
+
+#include <stdint.h>			// data types
+
+
+/** Identifies a snapshot file */
+#define MEM_SNAPSHOT_MAGIC		"MEMSNAP"
+/** The current format version */
+#define MEM_SNAPSHOT_VERSION		2
+
+
+/**
+ * Located at the start of a snapshot file.
+ *
+ * @struct mem_snapshot_header
+ */
+struct mem_snapshot_header
+{
+	char		magic[8];	/**< MEM_SNAPSHOT_MAGIC, nul-padded */
+	uint32_t	version;	/**< MEM_SNAPSHOT_VERSION when written */
+	uint32_t	header_size;	/**< sizeof(struct mem_snapshot_header) */
+	uint32_t	block_size;	/**< sizeof(struct mem_snapshot_block) */
+	uint32_t	site_size;	/**< sizeof(struct mem_snapshot_site) */
+	/** mem_options.sample_rate at the time; 0 if every block is present */
+	uint32_t	sample_rate;
+	uint32_t	reserved;
+
+	/** When the snapshot was taken; the same clock as the blocks times */
+	uint64_t	taken_usec;
+
+	uint64_t	block_count;	/**< Number of block records */
+	uint64_t	block_offset;	/**< Offset of the first block record */
+	uint64_t	site_count;	/**< Number of site records */
+	uint64_t	site_offset;	/**< Offset of the first site record */
+	uint64_t	string_size;	/**< Bytes of strings */
+	uint64_t	string_offset;	/**< Offset of the strings */
+};
+
+
+/**
+ * A live block.
+ *
+ * @struct mem_snapshot_block
+ */
+struct mem_snapshot_block
+{
+	uint64_t	address;	/**< The pointer handed to the application */
+	uint64_t	alloc_usec;	/**< When it was allocated */
+	uint64_t	size;		/**< The size requested */
+	uint32_t	site_id;	/**< The site it was allocated at */
+	uint32_t	thread_id;	/**< The shard it was allocated from */
+	uint32_t	stack_id;	/**< Its call stack, or 0 */
+	uint32_t	reserved;
+};
+
+
+/**
+ * An allocation site; every registered site is present, whether or not any of
+ * its blocks are.
+ *
+ * @struct mem_snapshot_site
+ */
+struct mem_snapshot_site
+{
+	uint32_t	site_id;	/**< The site id; 0 for unknown */
+	uint32_t	line;		/**< The line number */
+	uint32_t	function;	/**< Offset of the function name in the strings */
+	uint32_t	file;		/**< Offset of the file name in the strings */
+};
+
+
+
+#endif	// MEM_SNAPSHOT_H_INCLUDED
@@ -0,0 +1,375 @@
+
+/**
+ * @file	mem_stack.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// capture prototypes
+#include "mem_atomic.h"			// lock-free lookups
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdio.h>			// fprintf
+#include <stdlib.h>			// malloc, calloc, free
+#include <string.h>			// memcmp, memcpy
+
+#if defined(__GLIBC__)
+#	include <execinfo.h>		// backtrace_symbols
+#endif
+
+
+// stacks per chunk of the lookup table; chunks are never moved once created
+#define MEM_STACK_CHUNK_SIZE	1024
+// number of chunks, limiting the number of unique stacks to CHUNK_SIZE * CHUNKS
+#define MEM_STACK_CHUNKS	1024
+// number of buckets in the dedup hash table; always a power of 2
+#define MEM_STACK_BUCKETS	4096
+// furthest apart two consecutive frames can be, when bounds are unknown
+#define MEM_STACK_MAX_FRAME	(1024 * 1024)
+
+
+/**
+ * A unique call stack held in the depot. Immutable once published.
+ *
+ * @struct mem_stack
+ */
+struct mem_stack
+{
+	struct mem_stack*	next;	/**< Next stack in the same hash bucket */
+	uint64_t		hash;	/**< Hash of the frames */
+	uint32_t		id;	/**< Unique, non-zero identifier */
+	uint32_t		depth;	/**< Number of frames */
+	void*			frames[];	/**< Return addresses, innermost first */
+};
+
+
+/* Only needed to add a stack, which is rare once a program has warmed up;
+ * lookups are made without it */
+#if defined(_WIN32)
+static SRWLOCK			stack_lock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t		stack_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/** Two-level table of every stack in the depot, indexed by id */
+static struct mem_stack**	stack_table[MEM_STACK_CHUNKS];
+/** The highest id assigned so far */
+static uint32_t			stack_max_id = 0;
+/** Hash table of every stack in the depot, for deduplication */
+static struct mem_stack*	stack_buckets[MEM_STACK_BUCKETS];
+
+
+
+/**
+ * Hashes a set of frames.
+ *
+ * @param[in] frames The return addresses
+ * @param[in] depth The number of frames
+ * @return The hash
+ */
+static uint64_t
+stack_hash(
+	void* const* frames,
+	const uint32_t depth
+)
+{
+	uint64_t	hash = 0xCBF29CE484222325ull;
+	uint32_t	i;
+
+	for ( i = 0; i < depth; i++ )
+	{
+		hash ^= (uint64_t)(uintptr_t)frames[i];
+		hash *= 0x100000001B3ull;
+		hash ^= hash >> 29;
+	}
+
+	return hash;
+}
+
+
+
+/**
+ * Searches a bucket for a stack; safe without the lock, as stacks are only
+ * ever pushed, fully formed, onto the head of a bucket.
+ *
+ * @param[in] bucket The head of the bucket to search
+ * @param[in] hash The hash of the frames
+ * @param[in] frames The return addresses
+ * @param[in] depth The number of frames
+ * @return The stack, or NULL if not present
+ */
+static struct mem_stack*
+stack_find(
+	struct mem_stack* bucket,
+	const uint64_t hash,
+	void* const* frames,
+	const uint32_t depth
+)
+{
+	struct mem_stack*	stack;
+
+	for ( stack = bucket; stack != NULL; stack = stack->next )
+	{
+		if ( stack->hash == hash && stack->depth == depth &&
+		     memcmp(stack->frames, frames, depth * sizeof(void*)) == 0 )
+			break;
+	}
+
+	return stack;
+}
+
+
+
+/**
+ * Adds a stack to the depot, unless another thread beat us to it.
+ *
+ * @param[in] hash The hash of the frames
+ * @param[in] frames The return addresses
+ * @param[in] depth The number of frames
+ * @return The id of the stack, or 0 if the depot is full
+ */
+static uint32_t
+stack_insert(
+	const uint64_t hash,
+	void* const* frames,
+	const uint32_t depth
+)
+{
+	struct mem_stack**	bucket = &stack_buckets[hash & (MEM_STACK_BUCKETS - 1)];
+	struct mem_stack**	chunk;
+	struct mem_stack*	stack;
+	uint32_t		id = 0;
+
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&stack_lock);
+#else
+	pthread_mutex_lock(&stack_lock);
+#endif
+
+	if (( stack = stack_find(*bucket, hash, frames, depth)) != NULL )
+	{
+		id = stack->id;
+		goto unlock;
+	}
+
+	if ( stack_max_id + 1 >= MEM_STACK_CHUNK_SIZE * MEM_STACK_CHUNKS )
+		goto unlock;
+
+	if (( chunk = stack_table[(stack_max_id + 1) / MEM_STACK_CHUNK_SIZE]) == NULL )
+	{
+		if (( chunk = (struct mem_stack**)calloc(MEM_STACK_CHUNK_SIZE, sizeof(struct mem_stack*))) == NULL )
+			goto unlock;
+
+		mem_atomic_store_ptr(&stack_table[(stack_max_id + 1) / MEM_STACK_CHUNK_SIZE], chunk);
+	}
+
+	if (( stack = (struct mem_stack*)malloc(sizeof(struct mem_stack) + depth * sizeof(void*))) == NULL )
+		goto unlock;
+
+	id = stack_max_id + 1;
+
+	stack->hash	= hash;
+	stack->id	= id;
+	stack->depth	= depth;
+	stack->next	= *bucket;
+	memcpy(stack->frames, frames, depth * sizeof(void*));
+
+	// publish by id first, so anything that finds it can also look it up
+	mem_atomic_store_ptr(&chunk[id % MEM_STACK_CHUNK_SIZE], stack);
+	mem_atomic_store32(&stack_max_id, id);
+	mem_atomic_store_ptr(bucket, stack);
+
+unlock:
+#if defined(_WIN32)
+	ReleaseSRWLockExclusive(&stack_lock);
+#else
+	pthread_mutex_unlock(&stack_lock);
+#endif
+
+	return id;
+}
+
+
+
+/**
+ * Walks the frame pointer chain of the calling thread. Each frame holds the
+ * callers frame pointer, followed by the return address; code built without
+ * frame pointers breaks the chain, which the bounds checks catch.
+ *
+ * @param[in] shard The calling threads shard, caching its stack bounds
+ * @param[out] frames The array to populate
+ * @param[in] depth The maximum number of frames to capture
+ * @param[in] skip The number of innermost frames to leave out
+ * @return The number of frames captured
+ */
+#if !defined(_WIN32)
+static MEM_NOINLINE uint32_t
+stack_walk(
+	struct mem_shard* shard,
+	void** frames,
+	const uint32_t depth,
+	uint32_t skip
+)
+{
+	void**		fp = (void**)__builtin_frame_address(0);
+	void**		next;
+	uint32_t	count = 0;
+
+#if defined(__linux__)
+	pthread_attr_t	attr;
+	void*		addr;
+	size_t		size;
+
+	// the first capture on this thread; find out where its stack lives
+	if ( shard->stack_high == NULL && pthread_getattr_np(pthread_self(), &attr) == 0 )
+	{
+		if ( pthread_attr_getstack(&attr, &addr, &size) == 0 )
+		{
+			shard->stack_low	= addr;
+			shard->stack_high	= (uint8_t*)addr + size;
+		}
+		pthread_attr_destroy(&attr);
+	}
+#endif
+
+	while ( count < depth && fp != NULL )
+	{
+		// the frame itself, and the return address above it, must be readable
+		if ( shard->stack_high != NULL &&
+		     ((void*)fp < shard->stack_low || (void*)(fp + 2) > shard->stack_high) )
+			break;
+
+		if ( fp[1] == NULL )
+			break;
+
+		if ( skip != 0 )
+			skip--;
+		else
+			frames[count++] = fp[1];
+
+		next = (void**)fp[0];
+
+		// stacks grow down, so each caller's frame is above its callee's
+		if ( next <= fp || ((uintptr_t)next & (sizeof(void*) - 1)) != 0 ||
+		     (uint8_t*)next - (uint8_t*)fp > MEM_STACK_MAX_FRAME )
+			break;
+
+		fp = next;
+	}
+
+	return count;
+}
+#endif
+
+
+
+MEM_NOINLINE uint32_t
+mem_stack_capture(
+	struct mem_shard* shard,
+	uint32_t depth,
+	const uint32_t skip
+)
+{
+	void*			frames[MEM_STACK_MAX_DEPTH];
+	struct mem_stack*	stack;
+	uint64_t		hash;
+
+	if ( depth > MEM_STACK_MAX_DEPTH )
+		depth = MEM_STACK_MAX_DEPTH;
+
+	// leave ourselves out too
+#if defined(_WIN32)
+	depth = RtlCaptureStackBackTrace(skip + 1, depth, frames, NULL);
+#else
+	depth = stack_walk(shard, frames, depth, skip + 1);
+#endif
+
+	if ( depth == 0 )
+		return 0;
+
+	hash = stack_hash(frames, depth);
+
+	// the common case; this stack has been seen before
+	stack = stack_find(mem_atomic_load_ptr(&stack_buckets[hash & (MEM_STACK_BUCKETS - 1)]),
+			   hash, frames, depth);
+
+	if ( stack != NULL )
+		return stack->id;
+
+	return stack_insert(hash, frames, depth);
+}
+
+
+
+uint32_t
+mem_stack_count(void)
+{
+	return mem_atomic_load32(&stack_max_id);
+}
+
+
+
+uint32_t
+mem_stack_lookup(
+	const uint32_t id,
+	void* const** frames
+)
+{
+	struct mem_stack**	chunk;
+	struct mem_stack*	stack;
+
+	*frames = NULL;
+
+	if ( id == 0 || id > mem_atomic_load32(&stack_max_id) )
+		return 0;
+
+	if (( chunk = mem_atomic_load_ptr(&stack_table[id / MEM_STACK_CHUNK_SIZE])) == NULL )
+		return 0;
+
+	if (( stack = mem_atomic_load_ptr(&chunk[id % MEM_STACK_CHUNK_SIZE])) == NULL )
+		return 0;
+
+	*frames = stack->frames;
+
+	return stack->depth;
+}
+
+
+
+void
+mem_stack_output(
+	const uint32_t id,
+	FILE* file
+)
+{
+	void* const*	frames;
+	char**		symbols = NULL;
+	uint32_t	depth;
+	uint32_t	i;
+
+	if (( depth = mem_stack_lookup(id, &frames)) == 0 )
+		return;
+
+#if defined(__GLIBC__)
+	symbols = backtrace_symbols(frames, (int)depth);
+#endif
+
+	for ( i = 0; i < depth; i++ )
+	{
+		if ( symbols != NULL )
+			fprintf(file, "\t#%-2u %s\n", i, symbols[i]);
+		else
+			fprintf(file, "\t#%-2u %p\n", i, frames[i]);
+	}
+
+	free(symbols);
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,672 @@
+
+/**
+ * @file	mem_trace.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ */
+
+
+#include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// shard lookup, clock
+#include "mem_atomic.h"			// ring indices
+#include "mem_trace.h"			// file format
+
+// This file is only valid if USING_MEMORY_DEBUGGING is enabled
+#if defined(USING_MEMORY_DEBUGGING)
+
+#include <stdio.h>			// fopen, fwrite
+#include <stdlib.h>			// malloc, calloc, free
+#include <string.h>			// memset, memcpy, strlen
+
+#if !defined(_WIN32)
+#	include <errno.h>		// ETIMEDOUT
+#	include <time.h>		// clock_gettime
+#endif
+
+
+// ring capacity used if 0 is passed to mem_trace_start()
+#define MEM_TRACE_DEFAULT_EVENTS	65536
+// longest the writer sleeps between drains, in milliseconds
+#define MEM_TRACE_FLUSH_MSEC		10
+// longest an encoded event can be; op, then up to five 10 byte varints
+#define MEM_TRACE_MAX_EVENT_BYTES	51
+
+
+/**
+ * An event, as recorded by the thread that made the call; only encoded when
+ * the writer drains it.
+ *
+ * @struct mem_trace_event
+ */
+struct mem_trace_event
+{
+	uint64_t	time_usec;	/**< When the call was made */
+	uint64_t	address;	/**< The block allocated, freed or reallocated to */
+	uint64_t	old_address;	/**< The block reallocated from */
+	uint64_t	size;		/**< The size requested */
+	uint32_t	site_id;	/**< The site of the call */
+	uint32_t	op;		/**< One of the MEM_TRACE_OP_ values */
+};
+
+
+/**
+ * A single producer, single consumer ring of events, owned by a shard. The
+ * thread using the shard is the only producer, and the writer thread the only
+ * consumer; neither ever waits for the other, and a full ring drops events
+ * rather than block the producer.
+ *
+ * The indices run freely, wrapping at 2^32; only the difference between them
+ * matters.
+ *
+ * @struct mem_trace_ring
+ */
+struct mem_trace_ring
+{
+	/** Next event to be written; only the producer modifies it */
+	uint32_t		head;
+	/** Events discarded because the ring was full; producer only */
+	uint64_t		dropped;
+	uint8_t			producer_padding[64];
+
+	/** Next event to be read; only the consumer modifies it */
+	uint32_t		tail;
+	/** The value of dropped last written to the trace; consumer only */
+	uint64_t		dropped_written;
+	uint8_t			consumer_padding[64];
+
+	/** Capacity - 1; the capacity is always a power of 2 */
+	uint32_t		mask;
+	struct mem_trace_event	events[];
+};
+
+
+/**
+ * State of a running trace; owned by the context, and only ever touched by the
+ * writer thread, bar the stop flag and the ring capacity.
+ *
+ * @struct mem_tracer
+ */
+struct mem_tracer
+{
+	/** The context being traced */
+	struct mem_context*	context;
+	/** The capacity of new rings, in events; a power of 2 */
+	uint32_t		ring_events;
+
+	/** The trace being written */
+	FILE*			file;
+	/** Set if any write to the file has failed */
+	bool			failed;
+
+	/** Encoded events of the chunk being built; big enough for a full
+	 * ring of the worst case encoding */
+	uint8_t*		buffer;
+
+	/** Protects stop */
+#if defined(_WIN32)
+	SRWLOCK			lock;
+	CONDITION_VARIABLE	wake;
+	HANDLE			thread;
+#else
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	pthread_t		thread;
+#endif
+	/** Set to have the thread exit, after a final drain */
+	bool			stop;
+};
+
+
+
+/**
+ * Encodes a varint.
+ *
+ * @param[out] out Where to write the encoded bytes; at least 10 are needed
+ * @param[in] value The value to encode
+ * @return The number of bytes written
+ */
+static size_t
+trace_varint(
+	uint8_t* out,
+	uint64_t value
+)
+{
+	size_t	length = 0;
+
+	while ( value >= 0x80 )
+	{
+		out[length++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[length++] = (uint8_t)value;
+
+	return length;
+}
+
+
+
+/**
+ * Encodes a signed difference as a zigzag varint.
+ *
+ * @param[out] out Where to write the encoded bytes; at least 10 are needed
+ * @param[in] from The value being moved from
+ * @param[in] to The value being moved to
+ * @return The number of bytes written
+ */
+static size_t
+trace_zigzag(
+	uint8_t* out,
+	const uint64_t from,
+	const uint64_t to
+)
+{
+	int64_t	delta = (int64_t)(to - from);
+
+	return trace_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
+
+
+
+/**
+ * Writes a chunk header and its payload.
+ *
+ * @param[in] tracer The tracer writing the file
+ * @param[in] chunk The chunk header; the length must be set
+ * @param[in] payload The encoded payload
+ */
+static void
+trace_write_chunk(
+	struct mem_tracer* tracer,
+	const struct mem_trace_chunk* chunk,
+	const uint8_t* payload
+)
+{
+	if ( tracer->failed )
+		return;
+
+	if ( fwrite(chunk, sizeof(struct mem_trace_chunk), 1, tracer->file) != 1 ||
+	     (chunk->length != 0 && fwrite(payload, chunk->length, 1, tracer->file) != 1) )
+		tracer->failed = true;
+}
+
+
+
+/**
+ * Encodes and writes every event pending in a shards ring, as a single chunk.
+ *
+ * @param[in] tracer The tracer writing the file
+ * @param[in] shard The shard to drain
+ * @return The number of events that were pending
+ */
+static uint32_t
+trace_drain_ring(
+	struct mem_tracer* tracer,
+	struct mem_shard* shard
+)
+{
+	struct mem_trace_ring*	ring = mem_atomic_load_ptr(&shard->trace_ring);
+	struct mem_trace_event*	event;
+	struct mem_trace_chunk	chunk;
+	uint64_t	prev_time;
+	uint64_t	prev_address = 0;
+	uint64_t	dropped;
+	uint32_t	head;
+	uint32_t	tail;
+	uint32_t	pending;
+	size_t		length = 0;
+
+	if ( ring == NULL )
+		return 0;
+
+	head = mem_atomic_load32_acquire(&ring->head);
+	tail = ring->tail;
+	pending = head - tail;
+	dropped = mem_atomic_load64(&ring->dropped);
+
+	if ( pending == 0 && dropped == ring->dropped_written )
+		return 0;
+
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.type	= MEM_TRACE_CHUNK_EVENTS;
+	chunk.thread_id	= shard->id;
+	chunk.count	= pending;
+	chunk.dropped	= (uint32_t)(dropped - ring->dropped_written);
+	chunk.base_usec	= pending == 0 ? 0 : ring->events[tail & ring->mask].time_usec;
+	prev_time	= chunk.base_usec;
+
+	for ( ; tail != head; tail++ )
+	{
+		event = &ring->events[tail & ring->mask];
+
+		tracer->buffer[length++] = (uint8_t)event->op;
+		length += trace_varint(tracer->buffer + length, event->time_usec - prev_time);
+		length += trace_zigzag(tracer->buffer + length, prev_address, event->address);
+
+		if ( event->op != MEM_TRACE_OP_FREE )
+		{
+			length += trace_varint(tracer->buffer + length, event->size);
+			length += trace_varint(tracer->buffer + length, event->site_id);
+		}
+		if ( event->op == MEM_TRACE_OP_REALLOC )
+			length += trace_zigzag(tracer->buffer + length, event->address, event->old_address);
+
+		prev_time	= event->time_usec;
+		prev_address	= event->address;
+	}
+
+	// the slots are the producers again
+	mem_atomic_store32_release(&ring->tail, head);
+	ring->dropped_written = dropped;
+
+	chunk.length = (uint32_t)length;
+	trace_write_chunk(tracer, &chunk, tracer->buffer);
+
+	return pending;
+}
+
+
+
+/**
+ * Drains the ring of every shard in the context.
+ *
+ * @param[in] tracer The tracer writing the file
+ * @retval true if any ring was at least half full; worth draining again
+ * straight away
+ * @retval false if the rings were quiet enough to wait
+ */
+static bool
+trace_drain(
+	struct mem_tracer* tracer
+)
+{
+	struct mem_shard*	shard;
+	struct mem_trace_ring*	ring;
+	bool			busy = false;
+
+	/* shards are never released before the context, and new ones only ever
+	 * appear at the head; one created during a drain is caught next time */
+	for ( shard = mem_atomic_load_ptr(&tracer->context->shards); shard != NULL; shard = shard->next )
+	{
+		ring = mem_atomic_load_ptr(&shard->trace_ring);
+
+		if ( trace_drain_ring(tracer, shard) > (ring == NULL ? 0 : ring->mask / 2) )
+			busy = true;
+	}
+
+	return busy;
+}
+
+
+
+/**
+ * Writes every registered site, ending the trace.
+ *
+ * @param[in] tracer The tracer writing the file
+ */
+static void
+trace_write_sites(
+	struct mem_tracer* tracer
+)
+{
+	struct mem_trace_chunk	chunk;
+	struct mem_site*	site;
+	uint8_t*	payload = NULL;
+	uint8_t*	grown;
+	size_t		capacity = 0;
+	size_t		length = 0;
+	size_t		function_length;
+	size_t		file_length;
+	size_t		needed;
+	uint32_t	max_id = mem_site_max_id();
+	uint32_t	id;
+
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.type = MEM_TRACE_CHUNK_SITES;
+
+	for ( id = 0; id <= max_id; id++ )
+	{
+		if (( site = (id == 0 ? &mem_unknown_site : mem_site_lookup(id))) == NULL )
+			continue;
+
+		function_length	= strlen(site->function);
+		file_length	= strlen(site->file_name);
+		needed		= length + function_length + file_length + 40;
+
+		if ( needed > capacity )
+		{
+			capacity = (capacity == 0 ? 4096 : capacity);
+			while ( capacity < needed )
+				capacity *= 2;
+
+			if (( grown = (uint8_t*)realloc(payload, capacity)) == NULL )
+			{
+				tracer->failed = true;
+				free(payload);
+				return;
+			}
+			payload = grown;
+		}
+
+		length += trace_varint(payload + length, id);
+		length += trace_varint(payload + length, site->line);
+		length += trace_varint(payload + length, function_length);
+		memcpy(payload + length, site->function, function_length);
+		length += function_length;
+		length += trace_varint(payload + length, file_length);
+		memcpy(payload + length, site->file_name, file_length);
+		length += file_length;
+
+		chunk.count++;
+	}
+
+	chunk.length = (uint32_t)length;
+	trace_write_chunk(tracer, &chunk, payload);
+
+	free(payload);
+}
+
+
+
+/**
+ * Waits for up to msec milliseconds, returning early if asked to stop.
+ *
+ * @param[in] tracer The tracer to wait on
+ * @param[in] msec The time to wait
+ * @retval true if the tracer has been asked to stop
+ * @retval false if the time elapsed
+ */
+static bool
+trace_wait(
+	struct mem_tracer* tracer,
+	const uint32_t msec
+)
+{
+	bool	stop;
+
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&tracer->lock);
+	if ( !tracer->stop && msec != 0 )
+		SleepConditionVariableSRW(&tracer->wake, &tracer->lock, msec, 0);
+	stop = tracer->stop;
+	ReleaseSRWLockExclusive(&tracer->lock);
+#else
+	struct timespec	until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec	+= msec / 1000;
+	until.tv_nsec	+= (long)(msec % 1000) * 1000000;
+	if ( until.tv_nsec >= 1000000000 )
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&tracer->lock);
+	while ( !tracer->stop && msec != 0 )
+	{
+		if ( pthread_cond_timedwait(&tracer->wake, &tracer->lock, &until) == ETIMEDOUT )
+			break;
+	}
+	stop = tracer->stop;
+	pthread_mutex_unlock(&tracer->lock);
+#endif
+
+	return stop;
+}
+
+
+
+/**
+ * The writer thread; drains the rings until asked to stop, then drains them
+ * one final time.
+ *
+ * @param[in] param The mem_tracer to run
+ */
+#if defined(_WIN32)
+static DWORD WINAPI
+#else
+static void*
+#endif
+trace_thread(
+	void* param
+)
+{
+	struct mem_tracer*	tracer = (struct mem_tracer*)param;
+
+	while ( !trace_wait(tracer, trace_drain(tracer) ? 0 : MEM_TRACE_FLUSH_MSEC) )
+		;
+
+	trace_drain(tracer);
+
+#if defined(_WIN32)
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+
+
+void
+mem_trace_record(
+	struct mem_context* const context,
+	const uint32_t op,
+	void* address,
+	void* old_address,
+	const size_t size,
+	struct mem_site* site,
+	const uint64_t time_usec
+)
+{
+	struct mem_tracer*	tracer;
+	struct mem_shard*	shard;
+	struct mem_trace_ring*	ring;
+	struct mem_trace_event*	event;
+	uint32_t		capacity;
+	uint32_t		head;
+
+	if (( shard = mem_shard_get(context)) == NULL )
+		return;
+
+	if (( ring = shard->trace_ring) == NULL )
+	{
+		// the first event from this thread; the ring lives as long as the shard
+		if (( tracer = mem_atomic_load_ptr(&context->tracer)) == NULL )
+			return;
+
+		capacity = tracer->ring_events;
+
+		if (( ring = (struct mem_trace_ring*)calloc(1, sizeof(struct mem_trace_ring) + capacity * sizeof(struct mem_trace_event))) == NULL )
+			return;
+
+		ring->mask = capacity - 1;
+		mem_atomic_store_ptr(&shard->trace_ring, ring);
+	}
+
+	head = ring->head;
+
+	if ( head - mem_atomic_load32_acquire(&ring->tail) > ring->mask )
+	{
+		mem_atomic_add64(&ring->dropped, 1);
+		return;
+	}
+
+	event = &ring->events[head & ring->mask];
+	event->time_usec	= time_usec != 0 ? time_usec : mem_clock_usec();
+	event->address		= (uint64_t)(uintptr_t)address;
+	event->old_address	= (uint64_t)(uintptr_t)old_address;
+	event->size		= size;
+	event->site_id		= site == NULL ? 0 : mem_atomic_load32(&site->id);
+	event->op		= op;
+
+	mem_atomic_store32_release(&ring->head, head + 1);
+}
+
+
+
+void
+mem_trace_release(
+	struct mem_shard* shard
+)
+{
+	free(shard->trace_ring);
+	shard->trace_ring = NULL;
+}
+
+
+
+bool
+mem_trace_start(
+	struct mem_context* const context,
+	const char* path,
+	const uint32_t ring_events
+)
+{
+	struct mem_trace_header	header;
+	struct mem_tracer*	tracer;
+	struct mem_trace_ring*	ring;
+	struct mem_shard*	shard;
+
+	if ( context->tracer != NULL )
+		goto already_running;
+
+	if (( tracer = (struct mem_tracer*)calloc(1, sizeof(struct mem_tracer))) == NULL )
+		goto alloc_failure;
+
+	tracer->context		= context;
+	tracer->ring_events	= ring_events == 0 ? MEM_TRACE_DEFAULT_EVENTS : ring_events;
+
+	// rounded up to a power of 2, for masking
+	while ( (tracer->ring_events & (tracer->ring_events - 1)) != 0 )
+		tracer->ring_events += tracer->ring_events & -tracer->ring_events;
+
+	// every pending event fits, however badly it encodes
+	if (( tracer->buffer = (uint8_t*)malloc((size_t)tracer->ring_events * MEM_TRACE_MAX_EVENT_BYTES)) == NULL )
+		goto buffer_failure;
+
+#if defined(_WIN32)
+	if ( fopen_s(&tracer->file, path, "wb") != 0 )
+		goto open_failure;
+#else
+	if (( tracer->file = fopen(path, "wb")) == NULL )
+		goto open_failure;
+#endif
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MEM_TRACE_MAGIC, sizeof(header.magic));
+	header.version		= MEM_TRACE_VERSION;
+	header.header_size	= sizeof(struct mem_trace_header);
+	header.chunk_size	= sizeof(struct mem_trace_chunk);
+	header.start_usec	= mem_clock_usec();
+
+	if ( fwrite(&header, sizeof(header), 1, tracer->file) != 1 )
+		goto write_failure;
+
+	/* rings left from an earlier trace keep their capacity; discard what
+	 * was recorded after that trace stopped draining them */
+#if defined(_WIN32)
+	EnterCriticalSection(&context->cs);
+#else
+	pthread_mutex_lock(&context->lock);
+#endif
+	for ( shard = context->shards; shard != NULL; shard = shard->next )
+	{
+		if (( ring = mem_atomic_load_ptr(&shard->trace_ring)) != NULL )
+		{
+			mem_atomic_store32_release(&ring->tail, mem_atomic_load32_acquire(&ring->head));
+			ring->dropped_written = mem_atomic_load64(&ring->dropped);
+		}
+	}
+#if defined(_WIN32)
+	LeaveCriticalSection(&context->cs);
+#else
+	pthread_mutex_unlock(&context->lock);
+#endif
+
+#if defined(_WIN32)
+	InitializeSRWLock(&tracer->lock);
+	InitializeConditionVariable(&tracer->wake);
+
+	if (( tracer->thread = CreateThread(NULL, 0, trace_thread, tracer, 0, NULL)) == NULL )
+		goto thread_failure;
+#else
+	pthread_mutex_init(&tracer->lock, NULL);
+	pthread_cond_init(&tracer->wake, NULL);
+
+	if ( pthread_create(&tracer->thread, NULL, trace_thread, tracer) != 0 )
+		goto thread_failure;
+#endif
+
+	mem_atomic_store_ptr(&context->tracer, tracer);
+
+	return true;
+
+thread_failure:
+#if !defined(_WIN32)
+	pthread_cond_destroy(&tracer->wake);
+	pthread_mutex_destroy(&tracer->lock);
+#endif
+write_failure:
+	fclose(tracer->file);
+open_failure:
+	free(tracer->buffer);
+buffer_failure:
+	free(tracer);
+alloc_failure:
+already_running:
+	return false;
+}
+
+
+
+bool
+mem_trace_stop(
+	struct mem_context* const context
+)
+{
+	struct mem_tracer*	tracer = context->tracer;
+	bool			ret;
+
+	if ( tracer == NULL )
+		return true;
+
+	// no new events; any being recorded right now may miss the final drain
+	mem_atomic_store_ptr(&context->tracer, NULL);
+
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&tracer->lock);
+	tracer->stop = true;
+	WakeConditionVariable(&tracer->wake);
+	ReleaseSRWLockExclusive(&tracer->lock);
+
+	WaitForSingleObject(tracer->thread, INFINITE);
+	CloseHandle(tracer->thread);
+#else
+	pthread_mutex_lock(&tracer->lock);
+	tracer->stop = true;
+	pthread_cond_signal(&tracer->wake);
+	pthread_mutex_unlock(&tracer->lock);
+
+	pthread_join(tracer->thread, NULL);
+
+	pthread_cond_destroy(&tracer->wake);
+	pthread_mutex_destroy(&tracer->lock);
+#endif
+
+	trace_write_sites(tracer);
+
+	if ( fclose(tracer->file) != 0 )
+		tracer->failed = true;
+
+	ret = !tracer->failed;
+
+	free(tracer->buffer);
+	free(tracer);
+
+	return ret;
+}
+
+
+
+#endif	// USING_MEMORY_DEBUGGING
@@ -0,0 +1,98 @@
+#ifndef MEM_TRACE_H_INCLUDED
+#define MEM_TRACE_H_INCLUDED
+
+/**
+ * @file	mem_trace.h
+ * @author	James Warren
+ * @brief	On-disk format of an allocation event trace
+ *
+ * Written by the trace writer thread (see mem_trace_start()). Kept free of
+ * anything else in the tracker, so tools can include it alone.
+ *
+ * A trace is a mem_trace_header, followed by any number of chunks, each a
+ * mem_trace_chunk followed by length bytes of payload, until the end of the
+ * file. Chunks from different threads are interleaved in the order they were
+ * drained; within a thread, events are always in the order they happened.
+ *
+ * An MEM_TRACE_CHUNK_EVENTS payload is count events, each encoded as:
+ * - the op, as a single byte
+ * - the microseconds since the previous event in the chunk (or base_usec, for
+ *   the first) as a varint
+ * - the address minus the previous events address (0 for the first), zigzag
+ *   encoded as a varint
+ * - for MEM_TRACE_OP_ALLOC and MEM_TRACE_OP_REALLOC, the size requested and
+ *   the site id, each as a varint
+ * - for MEM_TRACE_OP_REALLOC, the old address minus the new, zigzag encoded
+ *   as a varint
+ *
+ * Varints are the protobuf base 128 encoding; 7 bits per byte, least
+ * significant first, with the top bit set on all but the last byte. Zigzag
+ * maps signed values to unsigned ones, small magnitudes to small numbers.
+ *
+ * A single MEM_TRACE_CHUNK_SITES payload ends the trace, with count sites,
+ * each encoded as varints of the site id and line, then the function and file
+ * names, each as a varint length followed by that many bytes.
+ *
+ * As with snapshots, the fixed-size structures are in the byte order of the
+ * machine that wrote the file; a reader on another machine detects the
+ * mismatch via the magic.
+ */
+
+
+#include <stdint.h>			// data types
+
+
+/** Identifies a trace file */
+#define MEM_TRACE_MAGIC			"MEMTRACE"
+/** The current format version */
+#define MEM_TRACE_VERSION		1
+
+/** Event ops */
+#define MEM_TRACE_OP_ALLOC		1
+#define MEM_TRACE_OP_FREE		2
+#define MEM_TRACE_OP_REALLOC		3
+
+/** Chunk types */
+#define MEM_TRACE_CHUNK_EVENTS		1
+#define MEM_TRACE_CHUNK_SITES		2
+
+
+/**
+ * Located at the start of a trace file.
+ *
+ * @struct mem_trace_header
+ */
+struct mem_trace_header
+{
+	char		magic[8];	/**< MEM_TRACE_MAGIC; not nul-terminated */
+	uint32_t	version;	/**< MEM_TRACE_VERSION when written */
+	uint32_t	header_size;	/**< sizeof(struct mem_trace_header) */
+	uint32_t	chunk_size;	/**< sizeof(struct mem_trace_chunk) */
+	uint32_t	reserved;
+	/** When tracing started; the same clock as the event times */
+	uint64_t	start_usec;
+};
+
+
+/**
+ * Precedes the payload of every chunk.
+ *
+ * @struct mem_trace_chunk
+ */
+struct mem_trace_chunk
+{
+	uint32_t	type;		/**< MEM_TRACE_CHUNK_EVENTS or _SITES */
+	uint32_t	thread_id;	/**< The shard the events came from */
+	uint32_t	count;		/**< Number of events or sites */
+	uint32_t	length;		/**< Bytes of payload that follow */
+	/** The time the first event is relative to */
+	uint64_t	base_usec;
+	/** Events this thread had to discard, since its previous chunk,
+	 * because its ring was full */
+	uint32_t	dropped;
+	uint32_t	reserved;
+};
+
+
+
+#endif	// MEM_TRACE_H_INCLUDED
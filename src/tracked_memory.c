@@ -8,39 +8,34 @@
 
 
 #include "tracked_memory.h"		// prototypes, definitions
+#include "mem_internal.h"		// block layout, slabs
+#include "mem_atomic.h"			// lock-free remote frees
+#include "mem_trace.h"			// trace event ops
 
 // This file is only valid if USING_MEMORY_DEBUGGING is enabled
 #if defined(USING_MEMORY_DEBUGGING)
 
-#include <stdio.h>			// printf, stdout
-#include <stdlib.h>			// malloc, free
+#include <math.h>			// exp, log
+#include <stdio.h>			// printf, fprintf, stdout
+#include <stdlib.h>			// malloc, free, posix_memalign
+#include <time.h>			// time, clock_gettime
 
 #if defined(__linux__) || defined(BSD)
 #	include <string.h>		// memcmp, memset, memmove
 #endif
+#if defined(_WIN32)
+#	include <malloc.h>		// _aligned_malloc, _aligned_free
+#endif
 
 
 
 // definitions that can be replaced or implemented elsewhere
 #define MAX_LEN_GENERIC		250
-
-// Magic values, assigned and checked with memory operations
-#define MEM_HEADER_MAGIC	0xCAFEFACE
-#define MEM_FOOTER_MAGIC	0xDEADBEEF
-// Memory-fill values, used before and after alloc/free
-#define MEM_ON_INIT		0x0F
-#define MEM_AFTER_FREE		0xFF
-
-
-#define block_offset_header(real_mem)           \
-		(struct memblock_header*)((uint8_t*)real_mem - sizeof(struct memblock_header))
-#define block_offset_realmem(memblock)          \
-		(void*)((uint8_t*)memblock + sizeof(struct memblock_header))
-#define block_offset_footer(memblock, num_bytes)\
-		(struct memblock_footer*)((uint8_t*)memblock + (sizeof(struct memblock_header) + num_bytes))
-#define HEADER_FOOTER_SIZE			\
-		(sizeof(struct memblock_header) + sizeof(struct memblock_footer))
-
+// times mem_context_get_stats() reads every shard, before settling for a mix
+#define MEM_STATS_READ_ATTEMPTS	4
+/* frames of ours above a stack capture: block_alloc() or block_resize(), and
+ * the tracked_ entry point that called it */
+#define MEM_STACK_SKIP		2
 
 // usage as variables allow them to be easily inserted into memcmp's
 const unsigned	mem_header_magic = MEM_HEADER_MAGIC;
@@ -49,295 +44,2151 @@ const unsigned	mem_footer_magic = MEM_FOOTER_MAGIC;
 
 struct mem_context		g_mem_ctx;
 
+// used for allocations made without a site (i.e. a site could not be interned)
+struct mem_site			mem_unknown_site = { "unknown", "unknown", 0, 0, "unknown", NULL };
+
+
+
+uint64_t
+mem_clock_usec(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER	freq;
+	LARGE_INTEGER	now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+
+	return ((uint64_t)(now.QuadPart / freq.QuadPart) * 1000000) +
+		((uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#else
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+#endif
+}
+
 
 
 void
-mem_context_init(
-	struct mem_context* const context
+mem_shard_lock(
+	struct mem_shard* shard
 )
 {
 #if defined(_WIN32)
-	InitializeCriticalSection(&context->cs);
+	EnterCriticalSection(&shard->cs);
 #else
-	pthread_mutexattr_settype(&context->lock_attrib, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutexattr_settype(&context->lock_attrib, PTHREAD_PROCESS_PRIVATE);
-	pthread_mutex_init(&context->lock, &context->lock_attrib);
+	pthread_mutex_lock(&shard->lock);
 #endif
-	
-	context->allocs 		= 0;
-	context->frees			= 0;
-	context->current_allocated	= 0;
-	context->total_allocated	= 0;
-	
-	TAILQ_INIT(&context->memblocks);
 }
 
 
 
 void
-mem_context_destroy(
-	struct mem_context* const context
+mem_shard_unlock(
+	struct mem_shard* shard
+)
+{
+#if defined(_WIN32)
+	LeaveCriticalSection(&shard->cs);
+#else
+	pthread_mutex_unlock(&shard->lock);
+#endif
+}
+
+
+
+/**
+ * Draws the number of bytes until the next sampled allocation, from an
+ * exponential distribution with a mean of rate; this makes the sampling a
+ * Poisson process over the bytes allocated, so each is equally likely to be
+ * picked, whatever the size of the allocation it is part of.
+ *
+ * @param[in] shard The shard to draw for; its generator is advanced
+ * @param[in] rate The mean number of bytes between samples
+ * @return The number of bytes until the next sample; at least 1
+ */
+static int64_t
+sample_next_interval(
+	struct mem_shard* shard,
+	const uint32_t rate
+)
+{
+	double		uniform;
+	int64_t		interval;
+
+	// xorshift64*; plenty for spacing samples, and needs no lock
+	shard->sample_rng ^= shard->sample_rng >> 12;
+	shard->sample_rng ^= shard->sample_rng << 25;
+	shard->sample_rng ^= shard->sample_rng >> 27;
+
+	// top 53 bits, as a double in (0,1]
+	uniform = (double)(((shard->sample_rng * 2685821657736338717ULL) >> 11) + 1) / 9007199254740992.0;
+
+	interval = (int64_t)(-log(uniform) * rate);
+
+	return interval < 1 ? 1 : interval;
+}
+
+
+
+/**
+ * Decides if an allocation of num_bytes made by this shards thread is to be
+ * sampled. Only ever called by the owning thread.
+ *
+ * @param[in] shard The calling threads shard
+ * @param[in] num_bytes The size of the allocation
+ * @param[in] rate The mean number of bytes between samples
+ * @retval true if the allocation is to be sampled
+ * @retval false if it is not
+ */
+static bool
+sample_allocation(
+	struct mem_shard* shard,
+	const size_t num_bytes,
+	const uint32_t rate
 )
 {
-	if ( !TAILQ_EMPTY(&context->memblocks) )
+	if ( shard->sample_rng == 0 )
 	{
-		printf("Memory Leak Detected\n\nCheck '%s' for details\n",
-		       MEM_LEAK_LOG_NAME);
+		// any non-zero seed will do; differ per thread, and per run
+		shard->sample_rng = ((uint64_t)(uintptr_t)shard ^ (uint64_t)time(NULL)) | 1;
+		shard->sample_countdown = sample_next_interval(shard, rate);
 	}
 
-	output_memory_info(context);
+	if (( shard->sample_countdown -= (int64_t)num_bytes ) > 0 )
+		return false;
+
+	shard->sample_countdown = sample_next_interval(shard, rate);
+
+	return true;
+}
+
+
+
+/**
+ * Calculates how many bytes a sampled allocation of num_bytes stands for - the
+ * inverse of the probability it was sampled with.
+ *
+ * @param[in] num_bytes The size of the sampled allocation
+ * @param[in] rate The mean number of bytes between samples
+ * @return The estimated number of bytes allocated, sampled or not
+ */
+static uint64_t
+sample_weight(
+	const size_t num_bytes,
+	const uint32_t rate
+)
+{
+	double	size = num_bytes == 0 ? 1.0 : (double)num_bytes;
+
+	return (uint64_t)(size / (1.0 - exp(-size / rate)) + 0.5);
+}
+
+
+
+/**
+ * Allocates memory from the system, as malloc, calloc, or the platforms
+ * aligned allocator would; release it with raw_free().
+ *
+ * @param[in] num_bytes The number of bytes to allocate
+ * @param[in] align_log2 log2 of the alignment needed
+ * @param[in] zero Set to zero the memory
+ * @return The memory, or NULL if the allocation failed
+ */
+static void*
+raw_alloc(
+	const size_t num_bytes,
+	const uint32_t align_log2,
+	const bool zero
+)
+{
+	void*	memory;
+
+	if ( align_log2 <= MEM_MALLOC_ALIGNMENT_LOG2 )
+		return zero ? calloc(1, num_bytes) : malloc(num_bytes);
 
 #if defined(_WIN32)
-	DeleteCriticalSection(&context->cs);
+	memory = _aligned_malloc(num_bytes, (size_t)1 << align_log2);
 #else
-	pthread_mutex_destroy(&context->lock);
+	if ( posix_memalign(&memory, (size_t)1 << align_log2, num_bytes) != 0 )
+		memory = NULL;
 #endif
+
+	if ( memory != NULL && zero )
+		memset(memory, 0, num_bytes);
+
+	return memory;
 }
 
 
 
-enum E_MEMORY_ERROR
-check_block(
-	struct memblock_header* memory_block
+/**
+ * Releases memory from raw_alloc().
+ *
+ * @param[in] memory The memory to release
+ * @param[in] align_log2 log2 of the alignment it was allocated with
+ */
+static void
+raw_free(
+	void* memory,
+	const uint32_t align_log2
 )
 {
-	uint32_t	block_size = 0;
+#if defined(_WIN32)
+	if ( align_log2 > MEM_MALLOC_ALIGNMENT_LOG2 )
+	{
+		_aligned_free(memory);
+		return;
+	}
+#endif
+	free(memory);
+}
 
-	if ( memory_block == NULL )
-		goto null_block;
 
-#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
-	printf("\tChecking Memory Block %p..\n",
-		memory_block);
-	printf("\t\tGlobal Header magic number is %lu bytes in size :: %#x\n",
-		sizeof(mem_header_magic), mem_header_magic);
-	printf("\t\tGlobal Footer magic number is %lu bytes in size :: %#x\n",
-		sizeof(mem_footer_magic), mem_footer_magic);
+
+/**
+ * Allocates memory in TM_Off mode; straight from the system, as if tracking
+ * wasn't built in at all. Windows needs its aligned allocator for every block,
+ * so that any of them can be freed the same way; see off_free().
+ *
+ * @param[in] num_bytes The number of bytes to allocate
+ * @param[in] align_log2 log2 of the alignment needed
+ * @param[in] zero Set to zero the memory
+ * @return The memory, or NULL if the allocation failed
+ */
+static void*
+off_alloc(
+	const size_t num_bytes,
+	const uint32_t align_log2,
+	const bool zero
+)
+{
+#if defined(_WIN32)
+	void*	memory = _aligned_malloc(num_bytes, (size_t)1 <<
+		(align_log2 > MEM_MALLOC_ALIGNMENT_LOG2 ? align_log2 : MEM_MALLOC_ALIGNMENT_LOG2));
+
+	if ( memory != NULL && zero )
+		memset(memory, 0, num_bytes);
+
+	return memory;
+#else
+	return raw_alloc(num_bytes, align_log2, zero);
 #endif
+}
 
-	if ( memcmp(&memory_block->magic,
-		&mem_header_magic,
-		sizeof(mem_header_magic)) != 0 )
+
+
+/**
+ * Releases memory from off_alloc().
+ *
+ * @param[in] memory The memory to release
+ */
+static void
+off_free(
+	void* memory
+)
+{
+	// as if aligned, which is what it is on Windows; plain free otherwise
+	raw_free(memory, MEM_MALLOC_ALIGNMENT_LOG2 + 1);
+}
+
+
+
+/**
+ * Resizes memory from off_alloc(); with the alignment malloc would give it,
+ * as realloc() would.
+ *
+ * @param[in] memory The memory to resize; may be NULL
+ * @param[in] num_bytes The new size; if 0, the memory is released
+ * @return The resized memory, or NULL if it could not be resized (or was
+ * released)
+ */
+static void*
+off_realloc(
+	void* memory,
+	const size_t num_bytes
+)
+{
+	if ( num_bytes == 0 )
 	{
-		/* memory_block magic number has been modified; block contents
-		 * are unstable */
-		goto corrupt_header;
+		off_free(memory);
+		return NULL;
 	}
 
-#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
-	printf("\t\tHas a valid header (%lu bytes, %#x)...\n",
-		sizeof(memory_block->magic), memory_block->magic);
-	printf("\t\tHeader Info:: %u (%u requested) bytes, line %u in %s\n",
-		memory_block->real_size, memory_block->requested_size,
-		memory_block->line, memory_block->file);
+#if defined(_WIN32)
+	return _aligned_realloc(memory, num_bytes, MEM_MALLOC_ALIGNMENT);
+#else
+	return realloc(memory, num_bytes);
 #endif
+}
 
-	if ( memory_block->footer == NULL ||
-		memcmp(&memory_block->footer->magic, &mem_footer_magic,	sizeof(mem_footer_magic)) != 0 )
+
+
+/**
+ * Allocates a block that was not sampled; no header, footer, or tracking, just
+ * the prefix identifying it as such.
+ *
+ * @param[in] num_bytes The number of bytes to allocate
+ * @param[in] align_log2 log2 of the alignment needed
+ * @param[in] zero Set to zero the memory
+ * @return A pointer to the allocated memory, or a nullptr if the allocation
+ * failed
+ */
+static void*
+unsampled_alloc(
+	const size_t num_bytes,
+	const uint32_t align_log2,
+	const bool zero
+)
+{
+	struct memblock_prefix*	prefix;
+	uint32_t		padding = 0;
+	uint8_t*		memory;
+
+	// the prefix sits at the end of a whole alignment unit, if need be
+	if ( align_log2 > MEM_MALLOC_ALIGNMENT_LOG2 )
+		padding = (1u << align_log2) - sizeof(struct memblock_prefix);
+
+	if ( num_bytes > SIZE_MAX - padding - sizeof(struct memblock_prefix) )
+		return NULL;
+
+	if (( memory = (uint8_t*)raw_alloc(padding + sizeof(struct memblock_prefix) + num_bytes, align_log2, zero)) == NULL )
+		return NULL;
+
+	prefix = (struct memblock_prefix*)(memory + padding);
+	prefix->requested_size	= num_bytes;
+	prefix->padding		= padding;
+	prefix->magic		= MEM_UNSAMPLED_MAGIC;
+
+	return (uint8_t*)prefix + sizeof(struct memblock_prefix);
+}
+
+
+
+/**
+ * Releases a block that was not sampled.
+ *
+ * @param[in] memory The pointer handed to the application
+ */
+static void
+unsampled_free(
+	void* memory
+)
+{
+	struct memblock_prefix*	prefix = block_offset_prefix(memory);
+	uint32_t		padding = prefix->padding;
+
+	// nothing to untrack; just make a second free of it stand out
+	prefix->magic = MEM_AFTER_FREE;
+
+	// only aligned prefixes are padded
+	raw_free((uint8_t*)prefix - padding, padding != 0 ? MEM_MALLOC_ALIGNMENT_LOG2 + 1 : 0);
+}
+
+
+
+/**
+ * Decides if a tracked block of num_bytes is to be mapped directly from the
+ * system, rather than malloc'd.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] num_bytes The size of the block
+ * @retval true if the block is to be mapped
+ * @retval false if it is not
+ */
+static bool
+block_mapped(
+	struct mem_context* const context,
+	const size_t num_bytes
+)
+{
+	return context->options.map_threshold != 0 && num_bytes >= context->options.map_threshold;
+}
+
+
+
+/**
+ * Releases the memory of a malloc'd, mapped or guarded block, which must be
+ * unlinked; including any padding before it, for aligned blocks. A mapped
+ * block is never filled; once unmapped, any use of it faults anyway.
+ *
+ * @param[in] mem_block The block to release
+ * @param[in] fill Set to fill the block first, per the fill policy, and to
+ * quarantine it if guarded; clear if the application never had it
+ */
+static void
+block_release(
+	struct memblock_header* mem_block,
+	const bool fill
+)
+{
+	struct mem_context*	context = mem_block->shard->context;
+	uint8_t*	memory = (uint8_t*)mem_block - mem_align_padding(mem_block->align_log2, mem_block->redzone);
+	uint8_t*	guard_end;
+	uint32_t	align_log2 = mem_block->align_log2;
+	size_t		length = mem_block->real_size;
+
+	if ( mem_block->flags & MEM_BLOCK_GUARDED )
+	{
+		// the fill overwrites the header, so this has to come first
+		guard_end = block_guard_end(mem_block);
+		if ( fill )
+			mem_fill_freed(mem_block);
+		mem_guard_free(context, guard_end, length, fill);
+		return;
+	}
+
+	if ( mem_block->flags & MEM_BLOCK_MAPPED )
+	{
+		mem_map_free(memory, length);
+		return;
+	}
+
+	if ( fill )
+		mem_fill_freed(mem_block);
+
+	raw_free(memory, align_log2);
+}
+
+
+
+/**
+ * Checks if a pointer handed to the application is from unsampled_alloc(). The
+ * memory before it is only read when sampling or counting, the only times such
+ * blocks exist; and when sampling, only if the registry doesn't know it as a
+ * tracked block, so a sampled block is never read here.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] memory The pointer handed to the application
+ * @retval true if the block was not sampled
+ * @retval false if it was (or it is not a block at all)
+ */
+static bool
+is_unsampled(
+	struct mem_context* const context,
+	void* memory
+)
+{
+	if ( context->options.sample_rate == 0 && context->options.mode != TM_Counters )
+		return false;
+
+	// when counting, nothing is tracked, so the registry is always empty
+	if ( context->options.mode != TM_Counters && context->options.use_registry &&
+	     mem_registry_contains(&context->registry, memory) )
+		return false;
+
+	return (block_offset_prefix(memory)->magic == MEM_UNSAMPLED_MAGIC);
+}
+
+
+
+/**
+ * Obtains the mem_stats size class of an allocation.
+ *
+ * @param[in] num_bytes The size requested
+ * @return 0 for a zero-byte block, otherwise floor(log2(num_bytes)) + 1
+ */
+static uint32_t
+stats_size_class(
+	const size_t num_bytes
+)
+{
+#if defined(__GNUC__)
+	return num_bytes == 0 ? 0 : 64 - (uint32_t)__builtin_clzll((uint64_t)num_bytes);
+#else
+	uint32_t	size_class = 0;
+	uint64_t	n;
+
+	for ( n = (uint64_t)num_bytes; n != 0; n >>= 1 )
+		size_class++;
+
+	return size_class;
+#endif
+}
+
+
+
+/**
+ * Raises the peak of a context, unless another thread has already raised it
+ * further.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] live The bytes allocated at some moment
+ */
+static void
+stats_raise_peak(
+	struct mem_context* const context,
+	const int64_t live
+)
+{
+	int64_t		peak = mem_atomic_load64(&context->peak_allocated);
+
+	while ( live > peak && !mem_atomic_cas64(&context->peak_allocated, peak, live) )
+		peak = mem_atomic_load64(&context->peak_allocated);
+}
+
+
+
+/**
+ * Accumulates a change in the bytes allocated by the calling thread, passing
+ * it on to the contexts live_allocated, and so its peak, once it amounts to
+ * MEM_STATS_PEAK_BATCH bytes either way. Most allocations and frees then touch
+ * nothing shared with other threads.
+ *
+ * The highest the batch reaches is kept too; the peak is raised by that, not
+ * just the batch as passed on, and mem_context_get_stats() adds it in for a
+ * batch that's never passed on at all.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] shard The calling threads shard
+ * @param[in] change The bytes allocated, or negated, the bytes freed
+ */
+static void
+stats_peak(
+	struct mem_context* const context,
+	struct mem_shard* shard,
+	const int64_t change
+)
+{
+	int64_t		live;
+
+	shard->peak_batch += change;
+	if ( shard->peak_batch > shard->peak_high )
+		mem_atomic_store64(&shard->peak_high, shard->peak_batch);
+
+	if ( shard->peak_batch < MEM_STATS_PEAK_BATCH && shard->peak_batch > -MEM_STATS_PEAK_BATCH )
+		return;
+
+	live = mem_atomic_add_fetch64(&context->live_allocated, shard->peak_batch);
+	// where the batch was highest, with the rest of the context as it was
+	stats_raise_peak(context, live - shard->peak_batch + shard->peak_high);
+
+	shard->peak_batch = 0;
+	mem_atomic_store64(&shard->peak_high, 0);
+}
+
+
+
+/**
+ * Counts an allocation in the stats of the calling threads shard.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] shard The calling threads shard
+ * @param[in] real_size Everything allocated for the block
+ * @param[in] num_bytes The size requested
+ */
+static void
+stats_alloc(
+	struct mem_context* const context,
+	struct mem_shard* shard,
+	const size_t real_size,
+	const size_t num_bytes
+)
+{
+	uint32_t	size_class = stats_size_class(num_bytes);
+	uint64_t	weight = 0;
+
+	if ( context->options.mode == TM_Full && context->options.sample_rate != 0 )
+		weight = sample_weight(num_bytes, context->options.sample_rate);
+
+	shard_stats_begin(shard);
+	shard_stats_add(shard, allocs, 1);
+	shard_stats_add(shard, current_allocated, real_size);
+	shard_stats_add(shard, total_allocated, real_size);
+	shard_stats_add(shard, current_requested, num_bytes);
+	shard_stats_add(shard, total_requested, num_bytes);
+	shard_stats_add(shard, est_total_allocated, weight);
+	shard_stats_add(shard, est_current_allocated, weight);
+	shard_stats_add(shard, live_by_class[size_class], 1);
+	shard_stats_add(shard, allocs_by_class[size_class], 1);
+	shard_stats_end(shard);
+
+	stats_peak(context, shard, (int64_t)real_size);
+}
+
+
+
+/**
+ * Counts a free in the stats of the calling threads shard, whichever thread
+ * allocated the block; only the sum over every shard is meaningful.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] shard The calling threads shard
+ * @param[in] real_size Everything allocated for the block
+ * @param[in] num_bytes The size requested
+ */
+static void
+stats_free(
+	struct mem_context* const context,
+	struct mem_shard* shard,
+	const size_t real_size,
+	const size_t num_bytes
+)
+{
+	uint32_t	size_class = stats_size_class(num_bytes);
+	uint64_t	weight = 0;
+
+	if ( context->options.mode == TM_Full && context->options.sample_rate != 0 )
+		weight = sample_weight(num_bytes, context->options.sample_rate);
+
+	shard_stats_begin(shard);
+	shard_stats_add(shard, frees, 1);
+	shard_stats_sub(shard, current_allocated, real_size);
+	shard_stats_sub(shard, current_requested, num_bytes);
+	shard_stats_sub(shard, est_current_allocated, weight);
+	shard_stats_sub(shard, live_by_class[size_class], 1);
+	shard_stats_end(shard);
+
+	stats_peak(context, shard, -(int64_t)real_size);
+}
+
+
+
+/**
+ * Counts the allocation or free of a block from unsampled_alloc(), in
+ * TM_Counters mode; the only tracking such blocks get. When sampling, they
+ * are only estimated, from the sampled blocks.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] real_size The size of the block, from prefix_real_size()
+ * @param[in] num_bytes The size requested
+ * @param[in] alloc Set if the block was allocated, clear if it is being freed
+ */
+static void
+unsampled_count(
+	struct mem_context* const context,
+	const size_t real_size,
+	const size_t num_bytes,
+	const bool alloc
+)
+{
+	struct mem_shard*	shard;
+
+	if ( context->options.mode != TM_Counters || (shard = mem_shard_get(context)) == NULL )
+		return;
+
+	if ( alloc )
+		stats_alloc(context, shard, real_size, num_bytes);
+	else
+		stats_free(context, shard, real_size, num_bytes);
+}
+
+
+
+/**
+ * Unlinks a block from its shards list, moving the scrubbers cursor past it if
+ * it was next to be checked. The shard must be locked.
+ *
+ * @param[in] shard The shard owning the block
+ * @param[in] mem_block The block to unlink
+ */
+static void
+shard_unlink(
+	struct mem_shard* shard,
+	struct memblock_header* mem_block
+)
+{
+	if ( shard->scrub_cursor == mem_block )
+		shard->scrub_cursor = TAILQ_NEXT(mem_block, np_blocks);
+
+	TAILQ_REMOVE(&shard->memblocks, mem_block, np_blocks);
+}
+
+
+
+/**
+ * Takes every block freed by other threads off the shards remote_frees stack,
+ * unlinking each; the freeing thread will have already updated the stats. The
+ * shard must be locked.
+ *
+ * Slab slots go straight back to the shards cache; malloc'd blocks are not
+ * released here, so the lock can be dropped first - pass the return value to
+ * release_blocks() once unlocked.
+ *
+ * @param[in] shard The shard to drain
+ * @return A chain of blocks (linked via remote_next) to release, or NULL
+ */
+static struct memblock_header*
+shard_drain_remote(
+	struct mem_shard* shard
+)
+{
+	struct memblock_header*	chain = NULL;
+	struct memblock_header*	mem_block;
+	struct memblock_header*	next;
+
+	mem_block = mem_atomic_xchg_ptr(&shard->remote_frees, NULL);
+
+	for ( ; mem_block != NULL; mem_block = next )
+	{
+		next = mem_block->remote_next;
+
+		shard_unlink(shard, mem_block);
+
+		if ( mem_block->size_class != 0 )
+		{
+			mem_slab_free(shard, mem_block);
+		}
+		else
+		{
+			mem_block->remote_next = chain;
+			chain = mem_block;
+		}
+	}
+
+	return chain;
+}
+
+
+
+/**
+ * Releases a chain of blocks returned by shard_drain_remote(), filling each
+ * before it goes (highlights use after free).
+ *
+ * @param[in] chain The chain of blocks to release
+ */
+static void
+release_blocks(
+	struct memblock_header* chain
+)
+{
+	struct memblock_header*	next;
+
+	while ( chain != NULL )
+	{
+		next = chain->remote_next;
+		block_release(chain, true);
+		chain = next;
+	}
+}
+
+
+
+/**
+ * Called when a thread exits (as the destructor of the thread-specific shard
+ * key); marks the shard as adoptable, and releases anything freed remotely
+ * that the owner never got around to.
+ *
+ * @param[in] value The exiting threads shard
+ */
+#if defined(_WIN32)
+static void WINAPI
+#else
+static void
+#endif
+shard_detach(
+	void* value
+)
+{
+	struct mem_shard*	shard = (struct mem_shard*)value;
+	struct memblock_header*	chain;
+
+	if ( shard == NULL )
+		return;
+
+	mem_shard_lock(shard);
+	mem_atomic_store32(&shard->orphaned, 1);
+	chain = shard_drain_remote(shard);
+	mem_shard_unlock(shard);
+
+	release_blocks(chain);
+}
+
+
+
+struct mem_shard*
+mem_shard_get(
+	struct mem_context* const context
+)
+{
+	struct mem_shard*	shard;
+
+#if defined(_WIN32)
+	shard = (struct mem_shard*)FlsGetValue(context->shard_key);
+#else
+	shard = (struct mem_shard*)pthread_getspecific(context->shard_key);
+#endif
+
+	if ( shard != NULL )
+		return shard;
+
+#if defined(_WIN32)
+	EnterCriticalSection(&context->cs);
+#else
+	pthread_mutex_lock(&context->lock);
+#endif
+
+	// prefer adopting the shard of a thread that has since exited
+	for ( shard = context->shards; shard != NULL; shard = shard->next )
+	{
+		if ( mem_atomic_cas32(&shard->orphaned, 1, 0) )
+			break;
+	}
+
+	if ( shard == NULL && (shard = (struct mem_shard*)calloc(1, sizeof(struct mem_shard))) != NULL )
+	{
+#if defined(_WIN32)
+		InitializeCriticalSection(&shard->cs);
+#else
+		pthread_mutex_init(&shard->lock, NULL);
+#endif
+		shard->context = context;
+		shard->id = ++context->shard_max_id;
+		TAILQ_INIT(&shard->memblocks);
+
+		shard->next = context->shards;
+		mem_atomic_store_ptr(&context->shards, shard);
+	}
+
+#if defined(_WIN32)
+	LeaveCriticalSection(&context->cs);
+#else
+	pthread_mutex_unlock(&context->lock);
+#endif
+
+	if ( shard != NULL )
+	{
+		// an adopted shard still has the old owners stack bounds
+		shard->stack_low	= NULL;
+		shard->stack_high	= NULL;
+#if defined(_WIN32)
+		FlsSetValue(context->shard_key, shard);
+#else
+		pthread_setspecific(context->shard_key, shard);
+#endif
+	}
+
+	return shard;
+}
+
+
+
+/**
+ * Adds the stats of a shard to a running total, all read from between the
+ * same two updates; one part way through is waited out, which is never for
+ * more than a handful of instructions.
+ *
+ * @param[in] shard The shard to read
+ * @param[in,out] stats The total to add to
+ * @return The shards sequence count, as of the read
+ */
+static uint64_t
+shard_stats_read(
+	struct mem_shard* shard,
+	struct mem_stats* stats
+)
+{
+	struct mem_stats	read;
+	uint64_t		seq;
+	uint32_t		i;
+
+	do
+	{
+		seq = mem_atomic_load64(&shard->stats_seq);
+		mem_atomic_fence_acquire();
+
+		read.allocs			= mem_atomic_load64(&shard->stats.allocs);
+		read.frees			= mem_atomic_load64(&shard->stats.frees);
+		read.current_allocated		= mem_atomic_load64(&shard->stats.current_allocated);
+		read.total_allocated		= mem_atomic_load64(&shard->stats.total_allocated);
+		read.current_requested		= mem_atomic_load64(&shard->stats.current_requested);
+		read.total_requested		= mem_atomic_load64(&shard->stats.total_requested);
+		read.arena_allocated		= mem_atomic_load64(&shard->stats.arena_allocated);
+		read.invalid_frees		= mem_atomic_load64(&shard->stats.invalid_frees);
+		read.est_total_allocated	= mem_atomic_load64(&shard->stats.est_total_allocated);
+		read.est_current_allocated	= mem_atomic_load64(&shard->stats.est_current_allocated);
+		for ( i = 0; i < MEM_STATS_SIZE_CLASSES; i++ )
+		{
+			read.live_by_class[i]	= mem_atomic_load64(&shard->stats.live_by_class[i]);
+			read.allocs_by_class[i]	= mem_atomic_load64(&shard->stats.allocs_by_class[i]);
+		}
+
+		mem_atomic_fence_acquire();
+	} while ( (seq & 1) != 0 || mem_atomic_load64(&shard->stats_seq) != seq );
+
+	stats->allocs			+= read.allocs;
+	stats->frees			+= read.frees;
+	stats->current_allocated	+= read.current_allocated;
+	stats->total_allocated		+= read.total_allocated;
+	stats->current_requested	+= read.current_requested;
+	stats->total_requested		+= read.total_requested;
+	stats->arena_allocated		+= read.arena_allocated;
+	stats->invalid_frees		+= read.invalid_frees;
+	stats->est_total_allocated	+= read.est_total_allocated;
+	stats->est_current_allocated	+= read.est_current_allocated;
+	for ( i = 0; i < MEM_STATS_SIZE_CLASSES; i++ )
+	{
+		stats->live_by_class[i]		+= read.live_by_class[i];
+		stats->allocs_by_class[i]	+= read.allocs_by_class[i];
+	}
+
+	return seq;
+}
+
+
+
+void
+mem_context_get_stats(
+	struct mem_context* const context,
+	struct mem_stats* stats
+)
+{
+	struct mem_shard*	shard;
+	uint64_t		seq_sum;
+	uint64_t		recheck_sum;
+	int64_t			pending;
+	uint32_t		attempt;
+	uint32_t		i;
+
+	/* shards are only ever pushed onto the head of the list (fully formed)
+	 * and never released before the context, so the walk is safe without
+	 * the context lock */
+	for ( attempt = 1; ; attempt++ )
+	{
+		memset(stats, 0, sizeof(struct mem_stats));
+		seq_sum = 0;
+		for ( shard = mem_atomic_load_ptr(&context->shards); shard != NULL; shard = shard->next )
+			seq_sum += shard_stats_read(shard, stats);
+
+		/* sequence counts only ever rise, so an unchanged sum means no
+		 * shard was updated while the others were read (a new shard
+		 * counts 0 until its first update) */
+		recheck_sum = 0;
+		for ( shard = mem_atomic_load_ptr(&context->shards); shard != NULL; shard = shard->next )
+			recheck_sum += mem_atomic_load64(&shard->stats_seq);
+
+		if ( recheck_sum == seq_sum || attempt == MEM_STATS_READ_ATTEMPTS )
+			break;
+	}
+
+	/* shards read at different moments may each hold their half of a block
+	 * handed between threads; don't let the mix show as a negative */
+	if ( (int64_t)stats->current_allocated < 0 )
+		stats->current_allocated = 0;
+	if ( (int64_t)stats->current_requested < 0 )
+		stats->current_requested = 0;
+	if ( (int64_t)stats->est_current_allocated < 0 )
+		stats->est_current_allocated = 0;
+	for ( i = 0; i < MEM_STATS_SIZE_CLASSES; i++ )
+	{
+		if ( (int64_t)stats->live_by_class[i] < 0 )
+			stats->live_by_class[i] = 0;
+	}
+
+	/* fold in the rise each shard is holding on to, as if they all
+	 * happened at once; otherwise a peak made of batches never passed on
+	 * is lost. Kept, so the peak never appears to fall */
+	pending = mem_atomic_load64(&context->live_allocated);
+	for ( shard = mem_atomic_load_ptr(&context->shards); shard != NULL; shard = shard->next )
+		pending += mem_atomic_load64(&shard->peak_high);
+	stats_raise_peak(context, pending);
+
+	stats->peak_allocated = (uint64_t)mem_atomic_load64(&context->peak_allocated);
+	if ( stats->peak_allocated < stats->current_allocated )
+		stats->peak_allocated = stats->current_allocated;
+}
+
+
+
+void
+mem_context_init(
+	struct mem_context* const context
+)
+{
+#if defined(_WIN32)
+	InitializeCriticalSection(&context->cs);
+	context->shard_key = FlsAlloc(shard_detach);
+#else
+	pthread_mutex_init(&context->lock, NULL);
+	pthread_key_create(&context->shard_key, shard_detach);
+#endif
+
+	context->shards = NULL;
+	context->shard_max_id = 0;
+	context->scrubber = NULL;
+	context->tracer = NULL;
+	context->publisher = NULL;
+	context->guard = NULL;
+	context->report_path = NULL;
+	context->live_allocated = 0;
+	context->peak_allocated = 0;
+	mem_site_stats_init(context);
+	TAILQ_INIT(&context->arenas);
+
+	context->options.mode		= TM_Full;
+	context->options.report_path	= MEM_LEAK_LOG_NAME;
+	context->options.use_slab	= false;
+	context->options.use_registry	= mem_registry_init(&context->registry);
+	context->options.sample_rate	= 0;
+	context->options.stack_depth	= 0;
+	context->options.fill_policy	= FP_Full;
+	context->options.fill_length	= 64;
+	context->options.fill_sample_rate	= 16;
+	context->options.redzone_size	= 0;
+	context->options.map_threshold	= MEM_MAP_THRESHOLD;
+	context->options.use_guard_pages	= false;
+	context->options.guard_min_size	= 0;
+	context->options.guard_max_size	= SIZE_MAX;
+	context->options.guard_site	= NULL;
+	context->options.guard_quarantine	= MEM_GUARD_QUARANTINE;
+	context->options.publish_msec	= 0;
+
+	/* so tracking can be changed with a restart, rather than a rebuild;
+	 * diagnostics go to stderr, as the host programs stdout may be in
+	 * use (e.g. under libmemmgr-preload.so) */
+	if ( !mem_context_configure(context, getenv(MEM_OPTIONS_ENV)) )
+		fprintf(stderr, "Ignoring unrecognised options in %s\n", MEM_OPTIONS_ENV);
+
+	// make every site in the binary known, ahead of its first use
+	mem_sites_register_all();
+
+	if ( context->options.publish_msec != 0 && !mem_publish_start(context, context->options.publish_msec) )
+		fprintf(stderr, "Unable to publish stats, as set in %s\n", MEM_OPTIONS_ENV);
+}
+
+
+
+void
+mem_context_destroy(
+	struct mem_context* const context
+)
+{
+	struct mem_shard*	shard;
+	struct mem_shard*	next;
+	bool			leaked = false;
+
+	mem_scrubber_stop(context);
+	mem_trace_stop(context);
+	mem_publish_stop(context);
+
+	for ( shard = context->shards; shard != NULL; shard = shard->next )
+	{
+		mem_shard_lock(shard);
+		release_blocks(shard_drain_remote(shard));
+		if ( !TAILQ_EMPTY(&shard->memblocks) )
+			leaked = true;
+		mem_shard_unlock(shard);
+	}
+
+	if ( !TAILQ_EMPTY(&context->arenas) )
+		leaked = true;
+
+	// nothing was tracked to report on, so there's nowhere to point to
+	if ( context->options.mode != TM_Off )
+	{
+		if ( leaked )
+		{
+			printf("Memory Leak Detected\n\nCheck '%s' for details\n",
+			       context->options.report_path);
+		}
+
+		output_memory_info(context);
+	}
+	// only now every block is released can the quarantine go
+	mem_guard_destroy(context);
+
+	/* remove the key first; no thread-exit destructor can then run on a
+	 * shard we're about to release */
+#if defined(_WIN32)
+	FlsFree(context->shard_key);
+#else
+	pthread_key_delete(context->shard_key);
+#endif
+
+	for ( shard = context->shards; shard != NULL; shard = next )
+	{
+		next = shard->next;
+		mem_slab_destroy(shard);
+		mem_trace_release(shard);
+#if defined(_WIN32)
+		DeleteCriticalSection(&shard->cs);
+#else
+		pthread_mutex_destroy(&shard->lock);
+#endif
+		free(shard);
+	}
+	context->shards = NULL;
+
+	mem_registry_destroy(&context->registry);
+	mem_site_stats_destroy(context);
+	free(context->report_path);
+	context->report_path = NULL;
+
+#if defined(_WIN32)
+	DeleteCriticalSection(&context->cs);
+#else
+	pthread_mutex_destroy(&context->lock);
+#endif
+}
+
+
+
+enum E_MEMORY_ERROR
+check_block(
+	struct memblock_header* memory_block
+)
+{
+	size_t		block_size = 0;
+	int64_t		offset;
+
+	if ( memory_block == NULL )
+		goto null_block;
+
+#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
+	printf("\tChecking Memory Block %p..\n",
+		memory_block);
+	printf("\t\tGlobal Header magic number is %lu bytes in size :: %#x\n",
+		sizeof(mem_header_magic), mem_header_magic);
+	printf("\t\tGlobal Footer magic number is %lu bytes in size :: %#x\n",
+		sizeof(mem_footer_magic), mem_footer_magic);
+#endif
+
+	if ( memcmp(&memory_block->magic,
+		&mem_header_magic,
+		sizeof(mem_header_magic)) != 0 )
+	{
+		/* memory_block magic number has been modified; block contents
+		 * are unstable */
+		goto corrupt_header;
+	}
+
+#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
+	printf("\t\tHas a valid header (%lu bytes, %#x)...\n",
+		sizeof(memory_block->magic), memory_block->magic);
+	printf("\t\tHeader Info:: %" PRIu64 " (%" PRIu64 " requested) bytes, line %u in %s\n",
+		(uint64_t)memory_block->real_size, (uint64_t)memory_block->requested_size,
+		memory_block->site->line, memory_block->site->file_name);
+#endif
+
+	if ( memory_block->footer == NULL ||
+		memcmp(&memory_block->footer->magic, &mem_footer_magic,	sizeof(mem_footer_magic)) != 0 )
+	{
+		/* memory_block footer magic has been modified - as the header
+		 * is not corrupt, we can retrieve the allocation info safely */
+		goto corrupt_footer;
+	}
+
+#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
+	printf("\t\tHas a valid footer (%lu bytes, %#x)...\n",
+		sizeof(memory_block->footer->magic),
+		memory_block->footer->magic);
+#endif
+
+	if ( memory_block->flags & MEM_BLOCK_GUARDED )
+	{
+		/* the footer is before the header instead, so there's nothing to
+		 * calculate from; but the size must still reach the guard page */
+		if ( memory_block->footer != (struct memblock_footer*)memory_block - 1 ||
+		     ((uintptr_t)block_guard_end(memory_block) & (mem_map_page_size() - 1)) != 0 )
+			goto invalid_size;
+		block_size = memory_block->requested_size;
+	}
+	else
+	{
+		// calculate the size requested by removing the header + footer, and redzones
+		block_size = ((uint8_t*)memory_block->footer) - ((uint8_t*)block_offset_realmem(memory_block) + memory_block->redzone);
+	}
+
+#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
+	printf("\t\tCalculated block_size is %" PRIu64 " bytes\n", (uint64_t)block_size);
+#endif
+
+	if ( memory_block->requested_size != block_size )
+	{
+		/* The size stored by the memory_block header is different from
+		 * that calculated (remember we've already validated the magic
+		 * numbers) */
+		goto invalid_size;
+	}
+
+#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
+	printf("\t\tHas a valid app_mem size (%" PRIu64 " bytes)\n",
+	       (uint64_t)block_size);
+#endif
+
+	if ( check_redzones(memory_block, &offset) )
+	{
+#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
+		printf("\t\tRedzone is corrupt at offset %" PRId64 "\n", offset);
+#endif
+		goto corrupt_redzone;
+	}
+
+#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
+	printf("\t\tHas valid redzones (%u bytes each)\n",
+	       memory_block->redzone);
+#endif
+
+	if ( ((uintptr_t)block_offset_realmem(memory_block) & ((1u << memory_block->align_log2) - 1)) != 0 )
+	{
+		/* the header is intact, but the application memory isn't at
+		 * the alignment requested */
+		goto misaligned;
+	}
+
+#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
+	printf("\t\tHas a valid alignment (%u bytes)\n\t\tValidated!\n",
+	       1u << memory_block->align_log2);
+#endif
+
+	// memory_block is as expected
+
+	return EC_NoError;
+
+null_block:
+	// Optional: Raise error
+	return EC_NoMemoryBlock;
+corrupt_header:
+	// Optional: Raise error
+	return EC_CorruptHeader;
+corrupt_footer:
+	// Optional: Raise error
+	return EC_CorruptFooter;
+invalid_size:
+	// Optional: Raise error
+	return EC_SizeMismatch;
+corrupt_redzone:
+	// Optional: Raise error
+	return EC_CorruptRedzone;
+misaligned:
+	// Optional: Raise error
+	return EC_Misaligned;
+}
+
+
+
+bool
+check_redzones(
+	struct memblock_header* memory_block,
+	int64_t* offset
+)
+{
+	uint8_t*	app_mem = (uint8_t*)block_offset_realmem(memory_block);
+	size_t		trailing = block_trailing_redzone(memory_block);
+	size_t		pos;
+
+	if ( memory_block->redzone == 0 && trailing == 0 )
+		return false;
+
+	// in address order; for an underflow, that's how far back it reached
+	pos = mem_fill_mismatch(app_mem - memory_block->redzone, MEM_REDZONE_FILL, memory_block->redzone);
+	if ( pos != memory_block->redzone )
+	{
+		*offset = (int64_t)pos - (int64_t)memory_block->redzone;
+		return true;
+	}
+
+	// a guarded block has the slack up to its guard page checked too
+	pos = mem_fill_mismatch(app_mem + memory_block->requested_size, MEM_REDZONE_FILL, trailing);
+	if ( pos != trailing )
+	{
+		*offset = (int64_t)(memory_block->requested_size + pos);
+		return true;
+	}
+
+	return false;
+}
+
+
+
+/**
+ * Writes the size class histogram to the report; only the classes anything
+ * has ever been allocated in.
+ *
+ * @param[in] stats The stats for the context
+ * @param[in] leak_file The report being written
+ */
+static void
+output_size_classes(
+	struct mem_stats* stats,
+	FILE* leak_file
+)
+{
+	char		label[48];
+	size_t		length;
+	uint64_t	low;
+	uint32_t	i;
+
+	fprintf(leak_file, "# Size Classes, Requested (unfreed / allocated)\n");
+
+	for ( i = 0; i < MEM_STATS_SIZE_CLASSES; i++ )
+	{
+		if ( stats->allocs_by_class[i] == 0 )
+			continue;
+
+		// the top class ends at UINT64_MAX, as the doubling wraps to 0
+		low = i == 0 ? 0 : (uint64_t)1 << (i - 1);
+		if ( i <= 1 )
+			snprintf(label, sizeof(label), "%" PRIu64, low);
+		else
+			snprintf(label, sizeof(label), "%" PRIu64 "-%" PRIu64, low, (low << 1) - 1);
+
+		for ( length = strlen(label); length < 24; length++ )
+			label[length] = '.';
+		label[length] = '\0';
+
+		fprintf(leak_file, "%s: %" PRIu64 " / %" PRIu64 "\n",
+			label, stats->live_by_class[i], stats->allocs_by_class[i]);
+	}
+
+	fprintf(leak_file, "\n");
+}
+
+
+
+/**
+ * Writes the report; output_memory_info(), optionally without releasing the
+ * unfreed blocks after.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] release Set to release every unfreed block, and arena
+ */
+static void
+memory_report(
+	struct mem_context* const context,
+	const bool release
+)
+{
+	enum E_MEMORY_ERROR	result;
+	struct memblock_header*	block_ptr;
+	struct memblock_header*	chain;
+	struct mem_shard*	shard;
+	FILE*		leak_file;
+	int32_t		close_file = 1;
+	uint32_t	i = 0;
+	uint32_t	j;
+	struct mem_stats	stats;
+	int64_t		offset;
+
+	/* since Windows has been kind enough to not provide more standards
+	 * complaint security functionality, we shall have to use their own
+	 * fopen_s. POSIX builds can happily use the 'x' flag to provide a
+	 * decent security level - fopen_s is still vulnerable to potential
+	 * exploits ironically... */
+#if defined(_WIN32)
+	if ( fopen_s(&leak_file, context->options.report_path, "w+") != 0 )
+	{
+#else
+	if (( leak_file = fopen(context->options.report_path, "w+")) == NULL )
+	{
+#endif
+		leak_file = stdout;
+		close_file = 0;
+	}
+
+	// no new shards can appear while we hold the context lock
+#if defined(_WIN32)
+	EnterCriticalSection(&context->cs);
+#else
+	pthread_mutex_lock(&context->lock);
+#endif
+
+	// release anything freed remotely, so the block lists are up to date
+	for ( shard = context->shards; shard != NULL; shard = shard->next )
+	{
+		mem_shard_lock(shard);
+		chain = shard_drain_remote(shard);
+		mem_shard_unlock(shard);
+
+		release_blocks(chain);
+	}
+
+	mem_context_get_stats(context, &stats);
+
+	fprintf(leak_file,
+		"# Details\n"
+		"Header+Footer Size......: %lu\n"
+		"Redzone Size (each side): %u\n"
+		"\n"
+		"# Code Stats\n"
+		"Allocations.............: %" PRIu64 "\n"
+		"Frees...................: %" PRIu64 "\n"
+		"Pending Frees...........: %" PRIu64 "\n"
+		"Invalid Frees...........: %" PRIu64 "\n"
+		"\n"
+		"# Totals, Real\n"
+		"Bytes Allocated.........: %" PRIu64 "\n"
+		"Unfreed Bytes...........: %" PRIu64 "\n"
+		"Peak Unfreed Bytes......: %" PRIu64 "\n"
+		"\n"
+		"# Totals, Requested\n"
+		"Bytes Allocated.........: %" PRIu64 "\n"
+		"Unfreed Bytes...........: %" PRIu64 "\n"
+		"\n"
+		"# Arenas\n"
+		"Chunk Bytes.............: %" PRIu64 "\n"
+		"\n",
+		HEADER_FOOTER_SIZE,
+		mem_redzone_size(context),
+		stats.allocs, stats.frees, (stats.allocs - stats.frees),
+		stats.invalid_frees,
+		stats.total_allocated, stats.current_allocated, stats.peak_allocated,
+		stats.total_requested, stats.current_requested,
+		stats.arena_allocated
+	);
+
+	if ( context->options.sample_rate != 0 )
+	{
+		fprintf(leak_file,
+			"# Sampling (every %u bytes, on average)\n"
+			"Est. Bytes Allocated....: %" PRIu64 "\n"
+			"Est. Unfreed Bytes......: %" PRIu64 "\n"
+			"\n",
+			context->options.sample_rate,
+			stats.est_total_allocated, stats.est_current_allocated
+		);
+	}
+
+	output_size_classes(&stats, leak_file);
+	mem_site_stats_output(context, leak_file);
+
+	if ( context->options.stack_depth != 0 )
+	{
+		fprintf(leak_file,
+			"# Stack Depot\n"
+			"Unique Stacks...........: %u\n"
+			"\n",
+			mem_stack_count()
+		);
+	}
+
+	if ( context->options.use_slab )
+		mem_slab_output(context, leak_file);
+
+	fprintf(leak_file,
+		"##################\n"
+		"  Unfreed Blocks  \n"
+	);
+
+	for ( shard = context->shards; shard != NULL; shard = shard->next )
+	{
+		mem_shard_lock(shard);
+
+		TAILQ_FOREACH(block_ptr, &shard->memblocks, np_blocks)
+		{
+			i++;
+
+			fprintf(leak_file,
+				"##################\n"
+				"%u)\n"
+				"Block...: " PRINT_POINTER
+				"\n",
+				i, (uintptr_t)block_ptr
+			);
+
+			result = check_block(block_ptr);
+			switch ( result )
+			{
+			case EC_NoMemoryBlock:
+				{
+					fprintf(leak_file,
+						"Error...: Block Pointer was NULL\n"
+					);
+					break;
+				}
+			case EC_CorruptFooter:
+				{
+					fprintf(leak_file,
+						"Error...: Corrupt Footer\n"
+					);
+					break;
+				}
+			case EC_CorruptHeader:
+				{
+					fprintf(leak_file,
+						"Error...: Corrupt Header\n"
+					);
+					break;
+				}
+			case EC_SizeMismatch:
+				{
+					fprintf(leak_file,
+						"Error...: Size Mismatch (%" PRIu64 " actual bytes)\n",
+						(uint64_t)block_ptr->requested_size
+					);
+					break;
+				}
+			case EC_CorruptRedzone:
+				{
+					check_redzones(block_ptr, &offset);
+					fprintf(leak_file,
+						"Error...: Corrupt Redzone (from offset %" PRId64 ")\n",
+						offset
+					);
+					break;
+				}
+			case EC_Misaligned:
+				{
+					fprintf(leak_file,
+						"Error...: Misaligned (%u byte alignment requested)\n",
+						1u << block_ptr->align_log2
+					);
+					break;
+				}
+			case EC_NoError:
+			default:
+				break;
+			}
+
+			/* can't fall through in switch, so have to do a secondary check
+			 * as we can't print data that's corrupt or a NULL */
+			if ( result != EC_NoMemoryBlock && result != EC_CorruptHeader )
+			{
+				fprintf(leak_file,
+					"Size....: %" PRIu64 "\n"
+					"Function: %s\n"
+					"File....: %s\n"
+					"Line....: %u\n",
+					(uint64_t)block_ptr->requested_size,
+					block_ptr->site->function,
+					block_ptr->site->file_name,
+					block_ptr->site->line
+				);
+				if ( context->options.sample_rate != 0 )
+				{
+					fprintf(leak_file,
+						"Estimate: %" PRIu64 " bytes\n",
+						sample_weight(block_ptr->requested_size, context->options.sample_rate)
+					);
+				}
+				if ( block_ptr->stack_id != 0 )
+				{
+					fprintf(leak_file, "Stack...:\n");
+					mem_stack_output(block_ptr->stack_id, leak_file);
+				}
+				fprintf(leak_file, "Data....: ");
+				for (   j = 0;
+					j < block_ptr->requested_size && j < MEM_OUTPUT_LIMIT;
+					j++ )
+				{
+					/** @todo causes warning 'cast to pointer from
+					 * integer of different size' and 'format %x
+					 * expects argument of type unsigned int' */
+					fprintf(leak_file,
+						"%02x ",
+						block_offset_realmem(block_ptr)[j]);
+				}
+				fprintf(leak_file, "\n");
+			}
+		}
+
+		mem_shard_unlock(shard);
+	}
+
+	// arenas are reported as a whole, not per allocation
+	mem_arena_output(context, leak_file);
+
+	if ( close_file )
+		fclose(leak_file);
+
+	/* try to free whatever we didn't during runtime; if any of these are
+	 * screwed (heap corruption) then this will probably trigger a crash */
+	for ( shard = context->shards; release && shard != NULL; shard = shard->next )
+	{
+		mem_shard_lock(shard);
+		while (( block_ptr = TAILQ_FIRST(&shard->memblocks)) != NULL )
+		{
+			shard_unlink(shard, block_ptr);
+			if ( context->options.use_registry )
+				mem_registry_remove(&context->registry, block_offset_realmem(block_ptr));
+			if ( block_ptr->size_class != 0 )
+				mem_slab_free(shard, block_ptr);
+			else
+				block_release(block_ptr, false);
+		}
+		mem_shard_unlock(shard);
+	}
+
+#if defined(_WIN32)
+	LeaveCriticalSection(&context->cs);
+#else
+	pthread_mutex_unlock(&context->lock);
+#endif
+
+	// outside the lock; the chunks are accounted to our shard, which may not exist yet
+	if ( release )
+		mem_arena_release_all(context);
+}
+
+
+
+void
+output_memory_info(
+	struct mem_context* const context
+)
+{
+	memory_report(context, true);
+}
+
+
+
+void
+mem_context_report(
+	struct mem_context* const context
+)
+{
+	memory_report(context, false);
+}
+
+
+
+/**
+ * Performs a tracked allocation; tracked_alloc(), without the tracing, so
+ * tracked_realloc() can record a single event.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] num_bytes The number of bytes to allocate
+ * @param[in] align_log2 log2 of the alignment needed; 0 for mallocs own
+ * @param[in] zero Set to zero the memory, rather than fill it with MEM_ON_INIT
+ * @param[in] site The site the allocation was made at
+ * @return A pointer to the allocated memory, or NULL if the allocation failed
+ */
+static MEM_NOINLINE void*
+block_alloc(
+	struct mem_context* const context,
+	const size_t num_bytes,
+	const uint32_t align_log2,
+	const bool zero,
+	struct mem_site* site
+)
+{
+	struct memblock_header*	mem_block = NULL;
+	struct memblock_footer*	mem_footer = NULL;
+	struct memblock_header*	chain;
+	struct mem_shard*	shard;
+	size_t			patched_alloc = 0;	// num_bytes + memblocks
+	size_t			fill_length;
+	uint32_t		size_class = 0;
+	uint32_t		stack_id = 0;
+	uint32_t		flags = 0;
+	uint32_t		redzone = mem_redzone_size(context);
+	uint32_t		padding = mem_align_padding(align_log2, redzone);
+	uint32_t		guard_log2 = align_log2 > MEM_MALLOC_ALIGNMENT_LOG2 ? align_log2 : MEM_MALLOC_ALIGNMENT_LOG2;
+	size_t			guard_length;
+	uint8_t*		guard_end;
+	uint8_t*		memory = NULL;
+
+	if (( shard = mem_shard_get(context)) == NULL )
+		goto alloc_failure;
+
+	// counting only; every block is as if it wasn't sampled
+	if ( context->options.mode == TM_Counters )
+	{
+		if (( memory = (uint8_t*)unsampled_alloc(num_bytes, align_log2, zero)) != NULL )
+			unsampled_count(context, prefix_real_size(block_offset_prefix(memory)), num_bytes, true);
+		return memory;
+	}
+
+	// most allocations take this path when sampling; keep it short
+	if ( context->options.sample_rate != 0 &&
+	     !sample_allocation(shard, num_bytes, context->options.sample_rate) )
+		return unsampled_alloc(num_bytes, align_log2, zero);
+
+	// first use of this site; give it an id, and work out its file name
+	if ( site == NULL )
+		site = &mem_unknown_site;
+	else if ( mem_atomic_load32(&site->id) == 0 )
+		mem_site_register(site);
+
+	// before the lock; only the depot insert of a new stack is ever slow
+	if ( context->options.stack_depth != 0 )
+		stack_id = mem_stack_capture(shard, context->options.stack_depth, MEM_STACK_SKIP);
+
+	// allocate the requested amount, plus the size of the header & footer memblocks
+	if ( num_bytes > SIZE_MAX - (padding + HEADER_FOOTER_SIZE + 2 * redzone) )
+		goto alloc_failure;
+	patched_alloc = padding + num_bytes + HEADER_FOOTER_SIZE + 2 * redzone;
+
+	// selected blocks get pages of their own, ending at a guard page
+	if ( context->options.use_guard_pages && align_log2 <= MEM_MAP_ALIGNMENT_LOG2 &&
+	     mem_guard_match(context, num_bytes, site) )
+		flags = MEM_BLOCK_GUARDED;
+
+	// slots are only ever aligned as malloc would
+	if ( flags == 0 && context->options.use_slab && align_log2 <= MEM_MALLOC_ALIGNMENT_LOG2 )
+		size_class = mem_slab_class(num_bytes);
+
+	// large blocks come straight from the system, if it'll align them
+	if ( flags == 0 && size_class == 0 && block_mapped(context, num_bytes) && align_log2 <= MEM_MAP_ALIGNMENT_LOG2 )
+		flags = MEM_BLOCK_MAPPED;
+
+	fill_length = mem_fill_length(shard, num_bytes);
+
+	/* lock this threads shard; only a report or full validation will ever
+	 * be competing for it - lock for as little time as possible! */
+	if ( size_class != 0 )
+	{
+		/* the slot comes from this threads own cache, but a report can
+		 * be returning slots to it, so it must be taken under the lock */
+		mem_shard_lock(shard);
+		// pick up anything other threads have freed for us
+		chain = shard_drain_remote(shard);
+
+		if (( mem_block = mem_slab_alloc(shard, size_class)) != NULL )
+		{
+			/* the slot header is pre-initialized, and every other
+			 * field is set below; just initialize the app memory */
+			mem_block->align_log2 = align_log2;
+			if ( zero )
+				memset(block_offset_realmem(mem_block), 0, num_bytes);
+			else
+				mem_fill(block_offset_realmem(mem_block), MEM_ON_INIT, fill_length);
+		}
+	}
+	else
+	{
+		/* the actual, real, physical allocation of memory; mapped
+		 * memory is always zeroed, and falls back to malloc where the
+		 * platform can't map it */
+		if ( flags & MEM_BLOCK_GUARDED )
+		{
+			/* the application memory ends as near the guard page as
+			 * the alignment allows; the header, and the footer before
+			 * it, go back from there */
+			if ( patched_alloc <= SIZE_MAX - ((size_t)1 << guard_log2) &&
+			     (guard_end = mem_guard_alloc(patched_alloc + ((size_t)1 << guard_log2), &guard_length)) != NULL )
+			{
+				memory = (uint8_t*)(((uintptr_t)(guard_end - redzone - num_bytes) & ~(((uintptr_t)1 << guard_log2) - 1)) -
+						    redzone - sizeof(struct memblock_header));
+				patched_alloc = guard_length;
+				padding = 0;
+			}
+			else
+				flags = 0;
+		}
+		if ( flags & MEM_BLOCK_MAPPED )
+		{
+			if (( memory = (uint8_t*)mem_map_alloc(patched_alloc)) == NULL )
+				flags = 0;
+		}
+		if ( memory == NULL )
+			memory = (uint8_t*)raw_alloc(patched_alloc, align_log2, zero);
+
+		if ( memory != NULL )
+		{
+			// the header follows any padding the alignment needs
+			mem_block = (struct memblock_header*)(memory + padding);
+			mem_block->size_class	= 0;
+			// a guarded block is at least as aligned as malloc would
+			mem_block->align_log2	= (flags & MEM_BLOCK_GUARDED) ? guard_log2 : align_log2;
+			mem_block->redzone	= redzone;
+			mem_block->flags	= flags;
+			mem_block->shard	= shard;
+
+			/* initialize the value for the new memory, unless the
+			 * system already zeroed it; every other header field
+			 * is set below */
+			if ( !zero )
+				mem_fill(block_offset_realmem(mem_block), MEM_ON_INIT, fill_length);
+		}
+
+		mem_shard_lock(shard);
+		// pick up anything other threads have freed for us
+		chain = shard_drain_remote(shard);
+	}
+
+	if ( mem_block != NULL )
+	{
+		mem_block->requested_size	= num_bytes;
+
+		if ( redzone != 0 )
+			memset((uint8_t*)block_offset_realmem(mem_block) - redzone, MEM_REDZONE_FILL, redzone);
+		if ( block_trailing_redzone(mem_block) != 0 )
+			memset((uint8_t*)block_offset_realmem(mem_block) + num_bytes, MEM_REDZONE_FILL, block_trailing_redzone(mem_block));
+
+		// calculate the offset of the footer; before the header, if guarded
+		if ( flags & MEM_BLOCK_GUARDED )
+			mem_footer = (struct memblock_footer*)mem_block - 1;
+		else
+			mem_footer = block_offset_footer(mem_block, num_bytes);
+
+		// prepare the structure internals
+		mem_footer->magic	= mem_footer_magic;
+		mem_block->footer	= mem_footer;
+		mem_block->magic	= mem_header_magic;
+		mem_block->site		= site;
+		mem_block->real_size		= patched_alloc;
+		mem_block->stack_id		= stack_id;
+		mem_block->alloc_time		= mem_clock_usec();
+		mem_block->fill_length		= fill_length;
+		mem_block->remote_next		= NULL;
+
+		// append it to the list
+		TAILQ_INSERT_TAIL(&shard->memblocks, mem_block, np_blocks);
+	}
+
+	mem_shard_unlock(shard);
+
+	release_blocks(chain);
+
+	if ( mem_block == NULL )
+		goto alloc_failure;
+
+	/* a block that can't be registered would be rejected when freed; hand
+	 * it straight back, and fail the allocation as if malloc had */
+	if ( context->options.use_registry &&
+	     !mem_registry_insert(&context->registry, block_offset_realmem(mem_block)) )
+	{
+		mem_shard_lock(shard);
+		shard_unlink(shard, mem_block);
+		if ( mem_block->size_class != 0 )
+		{
+			mem_slab_free(shard, mem_block);
+			mem_block = NULL;
+		}
+		mem_shard_unlock(shard);
+
+		if ( mem_block != NULL )
+			block_release(mem_block, false);
+		goto alloc_failure;
+	}
+
+	// update the stats, using patched values; no lock needed for these
+	stats_alloc(context, shard, patched_alloc, num_bytes);
+	mem_site_stats_alloc(context, site, stack_id, num_bytes);
+
+	return block_offset_realmem(mem_block);
+
+alloc_failure:
+	return NULL;
+}
+
+
+
+/**
+ * Performs a tracked free; tracked_free(), without the tracing, so
+ * tracked_realloc() can record a single event.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] memory The memory to free; must not be NULL
+ * @retval true if the memory was freed
+ * @retval false if it was not a valid, live, block; it has been left alone
+ */
+static bool
+block_free(
+	struct mem_context* const context,
+	void* memory
+)
+{
+	struct memblock_header*	mem_block = NULL;
+	struct memblock_header*	chain;
+	struct mem_shard*	shard;
+	struct mem_shard*	owner;
+
+	if ( is_unsampled(context, memory) )
+	{
+		unsampled_count(context, prefix_real_size(block_offset_prefix(memory)),
+				block_offset_prefix(memory)->requested_size, false);
+		unsampled_free(memory);
+		return true;
+	}
+
+	if ( !validate_memory(context, memory) )
+		goto invalid_free;
+
+	mem_block = block_offset_header(memory, mem_redzone_size(context));
+
+	/* claim the block; if another thread (or this one) got here first, it's
+	 * a double free, and the block is no longer ours to touch */
+	if ( context->options.use_registry &&
+	     !mem_registry_remove(&context->registry, memory) )
+		goto invalid_free;
+	if ( !mem_atomic_cas32(&mem_block->magic, mem_header_magic, MEM_HEADER_FREEING) )
+		goto invalid_free;
+
+#if !defined(DISABLE_MEMORY_OP_TO_STDOUT)
+	printf( "free [%s (%" PRIu64 " bytes) line %u]\n"
+		"\tBlock: %p | Usable Block: %p\n",
+		mem_block->site->file_name, (uint64_t)mem_block->requested_size, mem_block->site->line,
+		mem_block, memory);
+#endif
+
+	owner = mem_block->shard;
+	shard = mem_shard_get(context);
+
+	// update the stats of whichever thread is freeing the block
+	if ( shard != NULL )
+		stats_free(context, shard, mem_block->real_size, mem_block->requested_size);
+	mem_site_stats_free(context, mem_block->site, mem_block->stack_id, mem_block->requested_size);
+
+	if ( shard != owner )
+	{
+		/* not our block; hand it back to its owner without blocking -
+		 * it'll be unlinked, filled and released from there. It stays
+		 * intact until then, as a full validation may be reading it */
+		do
+		{
+			mem_block->remote_next = mem_atomic_load_ptr(&owner->remote_frees);
+		} while ( !mem_atomic_cas_ptr(&owner->remote_frees, mem_block->remote_next, mem_block) );
+
+		// nobody will drain an orphaned shard, so do it ourselves
+		if ( mem_atomic_load32(&owner->orphaned) )
+		{
+			mem_shard_lock(owner);
+			chain = shard_drain_remote(owner);
+			mem_shard_unlock(owner);
+			release_blocks(chain);
+		}
+		return true;
+	}
+
+	// only a report or full validation will ever be competing for this
+	mem_shard_lock(shard);
+
+	chain = shard_drain_remote(shard);
+	// remove the mem_block from the list
+	shard_unlink(shard, mem_block);
+
+	if ( mem_block->size_class != 0 )
+	{
+		// slots go back to the cache, filled in the process
+		mem_slab_free(shard, mem_block);
+		mem_block = NULL;
+	}
+
+	mem_shard_unlock(shard);
+
+	release_blocks(chain);
+
+	if ( mem_block != NULL )
+	{
+		/* fill the app-allocated memory (highlights use after free), then
+		 * perform the actual freeing of memory, header + footer and all */
+		block_release(mem_block, true);
+	}
+
+	return true;
+
+invalid_free:
+	/* not a live block (or a corrupt one); leave it be, so it can still be
+	 * reported, and count it against whichever thread tried */
+	if (( shard = mem_shard_get(context)) != NULL )
+	{
+		shard_stats_begin(shard);
+		shard_stats_add(shard, invalid_frees, 1);
+		shard_stats_end(shard);
+	}
+
+#if !defined(DISABLE_MEMORY_OP_TO_STDOUT)
+	printf( "free [invalid]\n"
+		"\tUsable Block: %p is not a valid, live, block\n",
+		memory);
+#endif
+	return false;
+}
+
+
+
+/**
+ * Resizes a tracked block without allocating another; a malloc'd block is
+ * handed to the system realloc, which can often grow or shrink it where it
+ * is, and copies it (header and all) only when it can't. A mapped block is
+ * remapped instead, and stays mapped whatever its new size. A slab slot is
+ * resized within the slot, so its size class must not change.
+ *
+ * The block is claimed first, exactly as if it were being freed; validations,
+ * reports and the scrubber all skip it until it's complete again. A malloc'd
+ * block is unlinked while it may move, and joins the callers shard, as a new
+ * allocation would; the locks are only held for the list updates.
+ *
+ * The stats record it as the free of the old size and the allocation of the
+ * new, as if the block had been moved.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] memory The validated, tracked, block to resize
+ * @param[in] new_num_bytes The new size; not 0
+ * @param[in] site The site the reallocation was made at
+ * @return A pointer to the resized memory, or NULL if it could not be resized;
+ * the original is then left as it was [ISO C]
+ */
+static MEM_NOINLINE void*
+block_resize(
+	struct mem_context* const context,
+	void* memory,
+	const size_t new_num_bytes,
+	struct mem_site* site
+)
+{
+	struct memblock_header*	mem_block = block_offset_header(memory, mem_redzone_size(context));
+	struct memblock_header*	resized;
+	struct memblock_header*	chain;
+	struct mem_shard*	shard;
+	struct mem_shard*	owner;
+	struct mem_shard*	new_owner;
+	struct mem_site*	old_site;
+	size_t			old_num_bytes;
+	size_t			old_real_size;
+	size_t			patched_alloc = new_num_bytes + HEADER_FOOTER_SIZE + 2 * mem_block->redzone;
+	size_t			fill_length;
+	uint32_t		old_stack_id;
+	uint32_t		stack_id = 0;
+
+	if ( new_num_bytes > SIZE_MAX - (HEADER_FOOTER_SIZE + 2 * mem_block->redzone) )
+		return NULL;
+
+	if (( shard = mem_shard_get(context)) == NULL )
+		return NULL;
+
+	if ( site == NULL )
+		site = &mem_unknown_site;
+	else if ( mem_atomic_load32(&site->id) == 0 )
+		mem_site_register(site);
+
+	// before anything is claimed; as with block_alloc()
+	if ( context->options.stack_depth != 0 )
+		stack_id = mem_stack_capture(shard, context->options.stack_depth, MEM_STACK_SKIP);
+
+	// claim the block, as block_free() does; losing means a racing free
+	if ( context->options.use_registry &&
+	     !mem_registry_remove(&context->registry, memory) )
+		return NULL;
+	if ( !mem_atomic_cas32(&mem_block->magic, mem_header_magic, MEM_HEADER_FREEING) )
+		return NULL;
+
+	owner		= mem_block->shard;
+	old_site	= mem_block->site;
+	old_num_bytes	= mem_block->requested_size;
+	old_real_size	= mem_block->real_size;
+	old_stack_id	= mem_block->stack_id;
+
+	if ( mem_block->size_class == 0 )
+	{
+		// nothing can be left pointing at it, should it move
+		mem_shard_lock(owner);
+		shard_unlink(owner, mem_block);
+		mem_shard_unlock(owner);
+
+		if ( mem_block->flags & MEM_BLOCK_MAPPED )
+			resized = (struct memblock_header*)mem_map_resize(mem_block, old_real_size, patched_alloc);
+		else
+			resized = (struct memblock_header*)realloc(mem_block, patched_alloc);
+
+		if ( resized == NULL )
+		{
+			// untouched; put it back as it was
+			mem_shard_lock(owner);
+			TAILQ_INSERT_TAIL(&owner->memblocks, mem_block, np_blocks);
+			mem_shard_unlock(owner);
+
+			mem_atomic_store32_release(&mem_block->magic, mem_header_magic);
+			if ( context->options.use_registry )
+				mem_registry_insert(&context->registry, memory);
+			return NULL;
+		}
+
+		mem_block = resized;
+		new_owner = shard;
+	}
+	else
 	{
-		/* memory_block footer magic has been modified - as the header
-		 * is not corrupt, we can retrieve the allocation info safely */
-		goto corrupt_footer;
+		// slots stay with the slab they were carved from
+		new_owner = owner;
+		mem_shard_lock(owner);
 	}
 
-#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
-	printf("\t\tHas a valid footer (%lu bytes, %#x)...\n",
-		sizeof(memory_block->footer->magic),
-		memory_block->footer->magic);
-#endif
+	/* initialize the newly gained memory the policy calls for; this
+	 * overwrites the old footer, if the fill reaches it */
+	fill_length = mem_fill_length(shard, new_num_bytes);
+	if ( fill_length > old_num_bytes )
+	{
+		mem_fill((uint8_t*)block_offset_realmem(mem_block) + old_num_bytes,
+			 MEM_ON_INIT, fill_length - old_num_bytes);
+	}
 
-	// calculate the size requested by removing the header + footer
-	block_size = ((uint8_t*)memory_block->footer) - ((uint8_t*)memory_block + sizeof(struct memblock_header));
+	// the trailing redzone moves with the end of the block
+	if ( mem_block->redzone != 0 )
+	{
+		memset((uint8_t*)block_offset_realmem(mem_block) + new_num_bytes,
+		       MEM_REDZONE_FILL, mem_block->redzone);
+	}
 
-#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
-	printf("\t\tCalculated block_size is %u bytes\n", block_size);
-#endif
+	mem_block->footer		= block_offset_footer(mem_block, new_num_bytes);
+	mem_block->footer->magic	= mem_footer_magic;
+	mem_block->site			= site;
+	mem_block->real_size		= patched_alloc;
+	mem_block->requested_size	= new_num_bytes;
+	mem_block->stack_id		= stack_id;
+	mem_block->alloc_time		= mem_clock_usec();
+	mem_block->fill_length		= fill_length;
+	mem_block->shard		= new_owner;
 
-	if ( memory_block->requested_size != block_size )
+	if ( mem_block->size_class == 0 )
 	{
-		/* The size stored by the memory_block header is different from
-		 * that calculated (remember we've already validated the magic
-		 * numbers) */
-		goto invalid_size;
+		mem_shard_lock(shard);
+		// pick up anything other threads have freed for us
+		chain = shard_drain_remote(shard);
+		TAILQ_INSERT_TAIL(&shard->memblocks, mem_block, np_blocks);
+		mem_atomic_store32_release(&mem_block->magic, mem_header_magic);
+		mem_shard_unlock(shard);
+
+		release_blocks(chain);
+	}
+	else
+	{
+		mem_atomic_store32_release(&mem_block->magic, mem_header_magic);
+		mem_shard_unlock(owner);
 	}
 
-#if !defined(DISABLE_MEMORY_CHECK_TO_STDOUT)
-	printf("\t\tHas a valid app_mem size (%u bytes)\n\t\tValidated!\n",
-	       block_size);
-#endif
+	/* as in block_alloc(); the original is gone by now, so failing is all
+	 * that's left - the old pointer will at least be rejected if freed */
+	if ( context->options.use_registry &&
+	     !mem_registry_insert(&context->registry, block_offset_realmem(mem_block)) )
+	{
+		mem_shard_lock(new_owner);
+		shard_unlink(new_owner, mem_block);
+		if ( mem_block->size_class != 0 )
+		{
+			mem_slab_free(new_owner, mem_block);
+			mem_block = NULL;
+		}
+		mem_shard_unlock(new_owner);
 
-	// memory_block is as expected
+		if ( mem_block != NULL )
+			block_release(mem_block, false);
+		return NULL;
+	}
 
-	return EC_NoError;
+	stats_free(context, shard, old_real_size, old_num_bytes);
+	stats_alloc(context, shard, patched_alloc, new_num_bytes);
+	mem_site_stats_free(context, old_site, old_stack_id, old_num_bytes);
+	mem_site_stats_alloc(context, site, stack_id, new_num_bytes);
 
-null_block:
-	// Optional: Raise error
-	return EC_NoMemoryBlock;
-corrupt_header:
-	// Optional: Raise error
-	return EC_CorruptHeader;
-corrupt_footer:
-	// Optional: Raise error
-	return EC_CorruptFooter;
-invalid_size:
-	// Optional: Raise error
-	return EC_SizeMismatch;
+	return block_offset_realmem(mem_block);
 }
 
 
 
-void
-output_memory_info(
-	struct mem_context* const context
+void*
+tracked_aligned_alloc(
+	struct mem_context* const context,
+	const uint32_t alignment,
+	const size_t num_bytes,
+	struct mem_site* site
 )
 {
-	enum E_MEMORY_ERROR	result;
-	struct memblock_header*	block_ptr;
-	FILE*		leak_file;
-	int32_t		close_file = 1;
-	uint32_t	i = 0;
-	uint32_t	j;
-	// we don't store/track the user-requested amounts, only the real
-	uint32_t	requested_alloc;
-	uint32_t	requested_unfreed;
-
-	/* since Windows has been kind enough to not provide more standards
-	 * complaint security functionality, we shall have to use their own
-	 * fopen_s. POSIX builds can happily use the 'x' flag to provide a
-	 * decent security level - fopen_s is still vulnerable to potential
-	 * exploits ironically... */
-#if defined(_WIN32)
-	if ( fopen_s(&leak_file, MEM_LEAK_LOG_NAME, "w+") != 0 )
-	{
-#else
-	if (( leak_file = fopen(MEM_LEAK_LOG_NAME, "w+")) == NULL )
-	{
-#endif
-		leak_file = stdout;
-		close_file = 0;
-	}
-
-	/* Remove memory block sizes, multiplied by the number of allocations,
-	 * which is taken away from the total amount allocated. */
-	requested_alloc		= context->total_allocated - (HEADER_FOOTER_SIZE * context->allocs);
-	/* Remove memory block sizes, multiplied by the number of pending frees,
-	 * which is to be taken away from the current amount still allocated. */
-	requested_unfreed	= context->current_allocated - (HEADER_FOOTER_SIZE * (context->allocs - context->frees));
-
-	fprintf(leak_file,
-		"# Details\n"
-		"Header+Footer Size......: %lu\n"
-		"\n"
-		"# Code Stats\n"
-		"Allocations.............: %u\n"
-		"Frees...................: %u\n"
-		"Pending Frees...........: %u\n"
-		"\n"
-		"# Totals, Real\n"
-		"Bytes Allocated.........: %u\n"
-		"Unfreed Bytes...........: %u\n"
-		"\n"
-		"# Totals, Requested\n"
-		"Bytes Allocated.........: %u\n"
-		"Unfreed Bytes...........: %u\n"
-		"\n"
-		"##################\n"
-		"  Unfreed Blocks  \n",
-		HEADER_FOOTER_SIZE,
-		context->allocs, context->frees, (context->allocs - context->frees),
-		context->total_allocated, context->current_allocated,
-		requested_alloc, requested_unfreed
-	);
+	uint32_t	align_log2 = 0;
+	void*		memory;
 
-	TAILQ_FOREACH(block_ptr, &context->memblocks, np_blocks)
-	{
-		i++;
+	// a power of two, within what a header can describe
+	if ( alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+	     alignment > MEM_ALIGNMENT_MAX )
+		return NULL;
 
-		fprintf(leak_file,
-			"##################\n"
-			"%u)\n"
-			"Block...: " PRINT_POINTER
-			"\n",
-			i, (uintptr_t)block_ptr
-		);
+	while ( (1u << align_log2) < alignment )
+		align_log2++;
 
-		result = check_block(block_ptr);
-		switch ( result )
-		{
-		case EC_NoMemoryBlock:
-			{
-				fprintf(leak_file,
-					"Error...: Block Pointer was NULL\n"
-				);
-				break;
-			}
-		case EC_CorruptFooter:
-			{
-				fprintf(leak_file,
-					"Error...: Corrupt Footer\n"
-				);
-				break;
-			}
-		case EC_CorruptHeader:
-			{
-				fprintf(leak_file,
-					"Error...: Corrupt Header\n"
-				);
-				break;
-			}
-		case EC_SizeMismatch:
-			{
-				fprintf(leak_file,
-					"Error...: Size Mismatch (%u actual bytes)\n",
-					block_ptr->requested_size
-				);
-				break;
-			}
-		case EC_NoError:
-		default:
-			break;
-		}
+	if ( context->options.mode == TM_Off )
+		return off_alloc(num_bytes, align_log2, false);
 
-		/* can't fall through in switch, so have to do a secondary check
-		 * as we can't print data that's corrupt or a NULL */
-		if ( result != EC_NoMemoryBlock && result != EC_CorruptHeader )
-		{
-			fprintf(leak_file,
-				"Size....: %u\n"
-				"Function: %s\n"
-				"File....: %s\n"
-				"Line....: %u\n",
-				block_ptr->requested_size,
-				block_ptr->function,
-				block_ptr->file,
-				block_ptr->line
-			);
-			fprintf(leak_file, "Data....: ");
-			for (   j = 0;
-				j < block_ptr->requested_size && j < MEM_OUTPUT_LIMIT;
-				j++ )
-			{
-				/** @todo causes warning 'cast to pointer from
-				 * integer of different size' and 'format %x
-				 * expects argument of type unsigned int' */
-				fprintf(leak_file,
-					"%02x ",
-					block_offset_realmem(block_ptr)[j]);
-			}
-			fprintf(leak_file, "\n");
-		}
-	}
+	memory = block_alloc(context, num_bytes, align_log2, false, site);
 
-	if ( close_file )
-		fclose(leak_file);
+	if ( memory != NULL && mem_atomic_load_ptr(&context->tracer) != NULL )
+		mem_trace_record(context, MEM_TRACE_OP_ALLOC, memory, NULL, num_bytes, site, 0);
 
-	/* try to free whatever we didn't during runtime; if any of these are
-	 * screwed (heap corruption) then this will probably trigger a crash */
-	TAILQ_FOREACH(block_ptr, &context->memblocks, np_blocks)
-	{
-		TAILQ_REMOVE(&context->memblocks, block_ptr, np_blocks);
-		free(block_ptr);
-	}
+	return memory;
 }
 
 
@@ -345,90 +2196,50 @@ output_memory_info(
 void*
 tracked_alloc(
 	struct mem_context* const context,
-	const uint32_t num_bytes,
-	const char* file,
-	const char* function,
-	const uint32_t line
+	const size_t num_bytes,
+	struct mem_site* site
 )
 {
-	struct memblock_header*	mem_block = NULL;
-	struct memblock_footer*	mem_footer = NULL;
-	void*			mem_return = NULL;
-	char*			p = NULL;
-	uint32_t		patched_alloc = 0;	// num_bytes + memblocks
+	void*	memory;
 
-	// allocate the requested amount, plus the size of the header & footer memblocks
-	patched_alloc = num_bytes + HEADER_FOOTER_SIZE;
+	// the only cost when tracking is off
+	if ( context->options.mode == TM_Off )
+		return off_alloc(num_bytes, 0, false);
 
-	// the actual, real, physical allocation of memory
-	mem_block = (struct memblock_header*)malloc(patched_alloc);
+	memory = block_alloc(context, num_bytes, 0, false, site);
 
-	if ( mem_block == NULL )
-		goto alloc_failure;
+	// one predictable branch, when not tracing
+	if ( memory != NULL && mem_atomic_load_ptr(&context->tracer) != NULL )
+		mem_trace_record(context, MEM_TRACE_OP_ALLOC, memory, NULL, num_bytes, site, 0);
 
-	// initialize the value for the new memory
-	memset(mem_block, MEM_ON_INIT, patched_alloc);
+	return memory;
+}
 
-#if defined(_WIN32)
-#	define PATH_CHAR	'\\'
-#else
-#	define PATH_CHAR	'/'
-#endif
-	// we don't want the full path information that compilers set
-	if (( p = (char*)strrchr(file, PATH_CHAR)) != NULL )
-		file = ++p;
 
-	// calculate the offsets of the return memory and the footer
-	mem_return = block_offset_realmem(mem_block);
-	mem_footer = block_offset_footer(mem_block, num_bytes);
 
-	// prepare the structure internals
-	mem_footer->magic	= mem_footer_magic;
-	mem_block->footer	= mem_footer;
-	mem_block->magic	= mem_header_magic;
-	mem_block->line		= line;
-	mem_block->real_size		= patched_alloc;
-	mem_block->requested_size	= num_bytes;
-
-	/* you should be using strlcpy if you're doing character buffer copying
-	 * and other functionality!! For the sake of securing your application,
-	 * please USE IT!
-	 * We provide a 'normal, well-known' alternative for the sake of the
-	 * example using strncpy (which is in standard headers everywhere) */
-#if defined(HAVE_STRLCPY)
-	strlcpy(mem_block->file, file, sizeof(mem_block->file));
-	strlcpy(mem_block->function, function, sizeof(mem_block->function));
-#else
-	strncpy(mem_block->file, file, sizeof(mem_block->file)-1);
-	strncpy(mem_block->function, function, sizeof(mem_block->function)-1);
-#endif
+void*
+tracked_calloc(
+	struct mem_context* const context,
+	const size_t count,
+	const size_t size,
+	struct mem_site* site
+)
+{
+	void*	memory;
 
-	/* lock this context, only 1 thread to update sensitive internals at a
-	 * time - lock for as little time as possible! */
-#if defined(_WIN32)
-	EnterCriticalSection(&context->cs);
-#else
-	pthread_mutex_lock(&context->lock);
-#endif
+	// the total must be representable, or it'd silently be far too small
+	if ( size != 0 && count > SIZE_MAX / size )
+		return NULL;
 
-	// update the stats, using patched values
-	context->allocs++;
-	context->current_allocated += patched_alloc;
-	context->total_allocated += patched_alloc;
-	// append it to the list
-	TAILQ_INSERT_TAIL(&context->memblocks, mem_block, np_blocks);
+	if ( context->options.mode == TM_Off )
+		return off_alloc(count * size, 0, true);
 
-	// unlock the context, other threads can now allocate from this class
-#if defined(_WIN32)
-	LeaveCriticalSection(&context->cs);
-#else
-	pthread_mutex_unlock(&context->lock);
-#endif
+	memory = block_alloc(context, count * size, 0, true, site);
 
-	return mem_return;
+	if ( memory != NULL && mem_atomic_load_ptr(&context->tracer) != NULL )
+		mem_trace_record(context, MEM_TRACE_OP_ALLOC, memory, NULL, count * size, site, 0);
 
-alloc_failure:
-	return NULL;
+	return memory;
 }
 
 
@@ -439,50 +2250,24 @@ tracked_free(
 	void* memory
 )
 {
-	struct memblock_header*	mem_block = NULL;
+	uint64_t	time_usec = 0;
 
-	// as per the C standard, if it's a NULL, do nothing
-	if ( memory == NULL )
+	if ( context->options.mode == TM_Off )
+	{
+		off_free(memory);
 		return;
+	}
 
-	if ( !validate_memory(context, memory) )
+	// as per the C standard, if it's a NULL, do nothing
+	if ( memory == NULL )
 		return;
 
-	mem_block = block_offset_header(memory);
-
-#if !defined(DISABLE_MEMORY_OP_TO_STDOUT)
-	printf( "free [%s (%u bytes) line %u]\n"
-		"\tBlock: %p | Usable Block: %p\n",
-		mem_block->file, mem_block->requested_size, mem_block->line,
-		mem_block, memory);
-#endif
-
-	// stop other modifications on this memory context
-#if defined(_WIN32)
-	EnterCriticalSection(&context->cs);
-#else
-	pthread_mutex_lock(&context->lock);
-#endif
-
-	// update the context stats
-	context->frees++;
-	context->current_allocated -= (mem_block->real_size);
-	// remove the mem_block from the list
-	TAILQ_REMOVE(&context->memblocks, mem_block, np_blocks);
-
-	// we're done with the class internals, open it up again
-#if defined(_WIN32)
-	LeaveCriticalSection(&context->cs);
-#else
-	pthread_mutex_unlock(&context->lock);
-#endif
-
-	// fill the app-allocated memory (highlights use after free)
-	memset(mem_block, MEM_AFTER_FREE, mem_block->real_size);
-	// perform the actual freeing of memory, including our header + footer
-	free(mem_block);
+	// stamped before the release; whoever is given the address next is later
+	if ( mem_atomic_load_ptr(&context->tracer) != NULL )
+		time_usec = mem_clock_usec();
 
-	return;
+	if ( block_free(context, memory) && time_usec != 0 )
+		mem_trace_record(context, MEM_TRACE_OP_FREE, memory, NULL, 0, NULL, time_usec);
 }
 
 
@@ -491,19 +2276,29 @@ void*
 tracked_realloc(
 	struct mem_context* const context,
 	void* memory,
-	const uint32_t new_num_bytes,
-	const char* file,
-	const char* function,
-	const uint32_t line
+	const size_t new_num_bytes,
+	struct mem_site* site
 )
 {
+	struct memblock_prefix*	prefix;
 	struct memblock_header*	mem_block = NULL;
 	void*			mem_return = NULL;
+	size_t			old_num_bytes;
+	size_t			old_real_size;
+	uint64_t		time_usec = 0;
+	bool			move;
+
+	if ( context->options.mode == TM_Off )
+		return off_realloc(memory, new_num_bytes);
 
 	if ( memory == NULL )
 	{
-		// if the memory is NULL, call malloc [ISO C]
-		return tracked_alloc(context, new_num_bytes, file, function, line);
+		/* if the memory is NULL, call malloc [ISO C]; block_alloc()
+		 * directly, so the stack has the same frames above it */
+		if (( mem_return = block_alloc(context, new_num_bytes, 0, false, site)) != NULL &&
+		    mem_atomic_load_ptr(&context->tracer) != NULL )
+			mem_trace_record(context, MEM_TRACE_OP_ALLOC, mem_return, NULL, new_num_bytes, site, 0);
+		return mem_return;
 	}
 
 	if ( new_num_bytes == 0 )
@@ -516,45 +2311,131 @@ tracked_realloc(
 		return NULL;
 	}
 
+	// don't copy from something that isn't a valid block
+	if ( !validate_memory(context, memory) )
+		return NULL;
 
-#if defined(_WIN32)
-	EnterCriticalSection(&context->cs);
-#else
-	pthread_mutex_lock(&context->lock);
-#endif
-
+	// as block_alloc(); the guard filter matches on the names
+	if ( site == NULL )
+		site = &mem_unknown_site;
+	else if ( mem_atomic_load32(&site->id) == 0 )
+		mem_site_register(site);
 
 #if !defined(DISABLE_MEMORY_OP_TO_STDOUT)
-	// since we call TrackedAlloc, make the log info accurate
-	printf( "realloc [%s (%u bytes) line %u]\n"
-		"\tTo be allocated in the following malloc; using memory at: %p\n",
-		file, new_num_bytes, line,
+	printf( "realloc [%s (%" PRIu64 " bytes) line %u]\n"
+		"\tResizing the memory at: %p\n",
+		site->file_name, (uint64_t)new_num_bytes, site->line,
 		memory);
 #endif
 
-	mem_return = (void*)tracked_alloc(context, new_num_bytes, file, function, line);
+	if ( is_unsampled(context, memory) )
+	{
+		/* the system can't resize an aligned allocation and keep the
+		 * padding before it; such a block always moves */
+		old_num_bytes = block_offset_prefix(memory)->requested_size;
+		move = (block_offset_prefix(memory)->padding != 0);
+	}
+	else
+	{
+		/* a block outgrown (or shrunk out of) its slot has to move, as
+		 * does one aligned beyond mallocs own. So does a malloc'd block
+		 * growing past the map threshold, to be remapped from then on,
+		 * and a mapped one shrinking to below half of it; in between,
+		 * it stays where it is, so sizes around the threshold don't
+		 * copy every time */
+		mem_block = block_offset_header(memory, mem_redzone_size(context));
+		old_num_bytes = mem_block->requested_size;
+		if ( mem_block->flags & MEM_BLOCK_MAPPED )
+			move = new_num_bytes < context->options.map_threshold / 2;
+		else
+			move = (mem_block->size_class != 0 && mem_slab_class(new_num_bytes) != mem_block->size_class) ||
+			       (mem_block->size_class == 0 && block_mapped(context, new_num_bytes));
+		move = move || mem_block->align_log2 > MEM_MALLOC_ALIGNMENT_LOG2;
+		/* a guarded block can't grow past its guard page, and a block
+		 * resized into the guarded sizes needs pages of its own */
+		move = move || (mem_block->flags & MEM_BLOCK_GUARDED) ||
+		       (context->options.use_guard_pages && mem_guard_match(context, new_num_bytes, site));
+	}
 
-	if ( mem_return != NULL )
+	if ( move )
+	{
+		if (( mem_return = block_alloc(context, new_num_bytes, 0, false, site)) != NULL )
+		{
+			// only what the application could have written is copied
+			memcpy(mem_return, memory,
+			       old_num_bytes < new_num_bytes ? old_num_bytes : new_num_bytes);
+			/* as tracked_free(); between the new block being had and
+			 * the old one released, so both are in order */
+			if ( mem_atomic_load_ptr(&context->tracer) != NULL )
+				time_usec = mem_clock_usec();
+			block_free(context, memory);
+		}
+	}
+	else if ( mem_block == NULL )
+	{
+		// untracked, so the system can resize it as it sees fit
+		prefix = NULL;
+		old_real_size = prefix_real_size(block_offset_prefix(memory));
+		if ( new_num_bytes <= SIZE_MAX - sizeof(struct memblock_prefix) )
+			prefix = (struct memblock_prefix*)realloc(block_offset_prefix(memory),
+				sizeof(struct memblock_prefix) + new_num_bytes);
+
+		if ( prefix != NULL )
+		{
+			prefix->requested_size = new_num_bytes;
+			mem_return = (uint8_t*)prefix + sizeof(struct memblock_prefix);
+			// as if the old were freed, and the new allocated
+			unsampled_count(context, old_real_size, old_num_bytes, false);
+			unsampled_count(context, prefix_real_size(prefix), new_num_bytes, true);
+		}
+	}
+	else
 	{
-		mem_block = block_offset_header(memory);
+		mem_return = block_resize(context, memory, new_num_bytes, site);
+	}
 
-		// move the original data into the new allocation
-		mem_block->requested_size < new_num_bytes ?
-			memmove(mem_return, memory, new_num_bytes) :
-			memmove(mem_return, memory, mem_block->requested_size);
+	if ( mem_return != NULL && mem_atomic_load_ptr(&context->tracer) != NULL )
+		mem_trace_record(context, MEM_TRACE_OP_REALLOC, mem_return, memory, new_num_bytes, site, time_usec);
 
-		// free the original block
-		tracked_free(context, memory);
+	return mem_return;
+}
+
+
+
+bool
+mem_context_owns(
+	struct mem_context* const context,
+	void* memory,
+	size_t* num_bytes
+)
+{
+	struct memblock_header*	mem_block;
+
+	if ( memory == NULL || context->options.mode == TM_Off )
+		return false;
+
+	if ( is_unsampled(context, memory) )
+	{
+		if ( num_bytes != NULL )
+			*num_bytes = block_offset_prefix(memory)->requested_size;
+		return true;
 	}
 
+	// when counting, a block without the prefix is someone elses
+	if ( context->options.mode == TM_Counters )
+		return false;
 
-#if defined(_WIN32)
-	LeaveCriticalSection(&context->cs);
-#else
-	pthread_mutex_unlock(&context->lock);
-#endif
+	if ( context->options.use_registry &&
+	     !mem_registry_contains(&context->registry, memory) )
+		return false;
 
-	return mem_return;
+	mem_block = block_offset_header(memory, mem_redzone_size(context));
+	if ( mem_atomic_load32(&mem_block->magic) != mem_header_magic )
+		return false;
+
+	if ( num_bytes != NULL )
+		*num_bytes = mem_block->requested_size;
+	return true;
 }
 
 
@@ -567,39 +2448,70 @@ validate_memory(
 {
 	bool	ret = true;
 	struct memblock_header*	mem_block;
+	struct memblock_header*	chain;
+	struct mem_shard*	shard;
 
+	// nothing recorded to check against
+	if ( context->options.mode == TM_Off )
+		return true;
+
+	// if no pointer was specified, check the entire list of every shard
+	if ( memory == NULL )
+	{
 #if defined(_WIN32)
-	EnterCriticalSection(&context->cs);
+		EnterCriticalSection(&context->cs);
 #else
-	pthread_mutex_lock(&context->lock);
+		pthread_mutex_lock(&context->lock);
 #endif
 
-	// if no pointer was specified, check the entire list
-	if ( memory == NULL )
-	{
-		TAILQ_FOREACH(mem_block, &context->memblocks, np_blocks)
+		for ( shard = context->shards; shard != NULL && ret; shard = shard->next )
 		{
-			// bail if a block is invalid
-			if ( check_block(mem_block) != EC_NoError )
+			mem_shard_lock(shard);
+			chain = shard_drain_remote(shard);
+
+			TAILQ_FOREACH(mem_block, &shard->memblocks, np_blocks)
 			{
-				ret = false;
-				break;
+				/* bail if a block is invalid; though a block that
+				 * is mid-way through being freed is still linked,
+				 * with its header already claimed - that's fine */
+				if ( check_block(mem_block) != EC_NoError &&
+				     mem_atomic_load32(&mem_block->magic) != MEM_HEADER_FREEING )
+				{
+					ret = false;
+					break;
+				}
 			}
+
+			mem_shard_unlock(shard);
+			release_blocks(chain);
 		}
+
+#if defined(_WIN32)
+		LeaveCriticalSection(&context->cs);
+#else
+		pthread_mutex_unlock(&context->lock);
+#endif
+	}
+	else if ( is_unsampled(context, memory) )
+	{
+		// nothing recorded to check against
+		ret = true;
+	}
+	else if ( context->options.use_registry &&
+		  !mem_registry_contains(&context->registry, memory) )
+	{
+		// not a live block; don't even look at it
+		ret = false;
 	}
 	else
 	{
-		mem_block = block_offset_header(memory);
+		/* a single block needs no lock; it can only change underneath us
+		 * if the application is freeing it at the same time */
+		mem_block = block_offset_header(memory, mem_redzone_size(context));
 
 		ret = (check_block(mem_block) == EC_NoError);
 	}
 
-#if defined(_WIN32)
-	EnterCriticalSection(&context->cs);
-#else
-	pthread_mutex_unlock(&context->lock);
-#endif
-
 	return ret;
 }
 
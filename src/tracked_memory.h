@@ -39,8 +39,16 @@
 
 // required definitions
 #define MEM_LEAK_LOG_NAME		"memdynamic.log"
-#define MEM_MAX_FILENAME_LENGTH		31
-#define MEM_MAX_FUNCTION_LENGTH		31
+#define MEM_OPTIONS_ENV			"MEMMGR_OPTIONS"
+#define MEM_SLAB_CLASSES		24
+#define MEM_REGISTRY_STRIPE_BITS	6
+#define MEM_REGISTRY_STRIPES		(1 << MEM_REGISTRY_STRIPE_BITS)
+#define MEM_STACK_MAX_DEPTH		32
+#define MEM_ALIGNMENT_MAX		(64 * 1024)
+#define MEM_MAP_THRESHOLD		(1024 * 1024)
+#define MEM_GUARD_QUARANTINE		256
+#define MEM_STATS_SIZE_CLASSES		65
+#define MEM_STATS_PEAK_BATCH		(64 * 1024)
 
 /* don't ask. I did this a while ago and had issues (I believe it was with
  * visual studio, as usual), this is what I came up with for a workaround, and
@@ -57,6 +65,37 @@
 
 
 
+/**
+ * Describes a single place in the source that allocates memory. One of these
+ * exists per use of the MALLOC/REALLOC macros, as a static object created by
+ * the macro itself, so the file, function and line are fixed at compile time
+ * and each block header need only point at its site.
+ *
+ * With GCC-compatible compilers the sites are also placed in a dedicated
+ * linker section (MEM_SITE_SECTION), which mem_sites_register_all() walks to
+ * register every site in the binary up front. Other compilers intern the site
+ * on each call instead, via mem_site_intern().
+ *
+ * Sites are registered on first use if not already; this assigns the id, and
+ * works out the file_name, so no string handling is done on each allocation.
+ *
+ * @struct mem_site
+ */
+struct mem_site
+{
+	const char*	file;		/**< The file, as given by __FILE__ */
+	const char*	function;	/**< The function, as given by __FUNCTION__ */
+	uint32_t	line;		/**< The line, as given by __LINE__ */
+	/** Unique, non-zero identifier; 0 until the site is registered */
+	uint32_t	id;
+	/** The file, without the path the compiler may have supplied */
+	const char*	file_name;
+	/** Next site in the same intern hash bucket (interned sites only) */
+	struct mem_site*	next;
+};
+
+
+
 /**
  * This structure is added to the end of an allocated block of memory, when
  * USING_MEMORY_DEBUGGING is defined.
@@ -76,37 +115,85 @@ struct memblock_footer
  * This structure is added at the start of a block of allocated memory, when
  * USING_MEMORY_DEBUGGING is defined.
  *
+ * The magic number is the last member, so it sits immediately before the
+ * memory handed to the application - in the same place as the magic of a
+ * memblock_prefix, which is how the two are told apart. With redzones (see
+ * mem_options.redzone_size), the leading redzone sits in between instead;
+ * its pattern can't be mistaken for the prefix magic either.
+ *
  * @struct memblock_header
  */
 struct memblock_header
 {
+	/** A pointer to this memory blocks footer */
+	struct memblock_footer*	footer;
+
+	/** The site (file, function and line) this memory block was created at */
+	struct mem_site*	site;
+	/** The shard (and therefore thread) this block was allocated from */
+	struct mem_shard*	shard;
+	/**
+	 * Link for the owning shards remote-free stack; only used when a
+	 * thread other than the owner frees this block */
+	struct memblock_header*	remote_next;
+	/** Linked list entry */
+	TAILQ_ENTRY(memblock_header)	np_blocks;
+
+	/**
+	 * The slab size class this block was served from, or 0 if it was
+	 * allocated directly with malloc */
+	uint8_t			size_class;
+	/** log2 of the alignment asked of tracked_aligned_alloc(), or 0. One
+	 * beyond what malloc provides puts padding before this header */
+	uint8_t			align_log2;
+	/** The size, in bytes, of each of the redzones either side of the
+	 * application memory; 0 if there are none */
+	uint16_t		redzone;
+	/** The call stack this block was allocated from, in the stack depot;
+	 * 0 if not captured */
+	uint32_t	stack_id;
+	/** The size, in bytes, the original request desired */
+	size_t		requested_size;
+	/** The size, in bytes, of the total allocation (header+data+footer) */
+	size_t		real_size;
+	/** Bytes of application memory filled when allocated, and so to be
+	 * filled again when freed; per mem_options.fill_policy */
+	size_t		fill_length;
+	/** When the block was allocated, from mem_clock_usec() */
+	uint64_t	alloc_time;
+	/** How the block was obtained; MEM_BLOCK_MAPPED if mapped directly
+	 * from the system (see mem_options.map_threshold), MEM_BLOCK_GUARDED
+	 * if given pages of its own (see mem_options.use_guard_pages),
+	 * otherwise 0 */
+	uint32_t	flags;
+
 	/**
 	 * The header magic number is used to detect if an operation on memory has
 	 * written into this structure. Corrupt headers usually mean something else
 	 * has written into the block - an exception being if an operation has
 	 * stepped too far back, to the extent of overwriting the magic number */
 	unsigned		magic;
+};
 
-	/** A pointer to this memory blocks footer */
-	struct memblock_footer*	footer;
 
-	/**
-	 * The file this memory block was created in; is not allocated dynamically,
-	 * and so is bound by the MEM_MAX_FILENAME_LENGTH definition.
-	 */
-	char		file[MEM_MAX_FILENAME_LENGTH+1];
-	/** The function name this memory block was created in; like the file
-	 * member, is not allocated dynamically, and so is bound by the
-	 * MEM_MAX_FUNCTION_LENGTH definition */
-	char		function[MEM_MAX_FUNCTION_LENGTH+1];
-	/** The line in the file this memory block was created in */
-	uint32_t	line;
+/**
+ * The only thing placed before an allocation that was not sampled (see
+ * mem_options.sample_rate); such blocks are not tracked, listed, or checked,
+ * and cost no more than the malloc itself.
+ *
+ * Sized to keep the application memory aligned as malloc would have.
+ *
+ * @struct memblock_prefix
+ */
+struct memblock_prefix
+{
 	/** The size, in bytes, the original request desired */
-	uint32_t	requested_size;
-	/** The size, in bytes, of the total allocation (header+data+footer) */
-	uint32_t	real_size;
-	/** Linked list entry */
-	TAILQ_ENTRY(memblock_header)	np_blocks;
+	size_t		requested_size;
+	/** Bytes before this prefix, if the allocation was aligned beyond what
+	 * malloc provides; 0 otherwise */
+	uint32_t	padding;
+	/** Always MEM_UNSAMPLED_MAGIC; in the same place as the header magic */
+	unsigned	magic;
 };
 
 
@@ -122,11 +209,412 @@ enum E_MEMORY_ERROR
 	EC_NoMemoryBlock,
 	EC_CorruptHeader,
 	EC_CorruptFooter,
-	EC_SizeMismatch
+	EC_SizeMismatch,
+	EC_CorruptRedzone,
+	EC_Misaligned
+};
+
+
+
+/**
+ * How mem_context_profile_write() groups allocations into samples.
+ *
+ * @enum E_PROFILE_GROUPING
+ */
+enum E_PROFILE_GROUPING
+{
+	PG_Site = 0,	/**< One sample per allocation site */
+	PG_Stack	/**< One sample per captured call stack */
+};
+
+
+/**
+ * How much of each block is filled with MEM_ON_INIT when allocated, and with
+ * MEM_AFTER_FREE when freed; the fills make reads of uninitialized and freed
+ * memory stand out, but each is a pass over the memory.
+ *
+ * @enum E_FILL_POLICY
+ */
+enum E_FILL_POLICY
+{
+	FP_Full = 0,	/**< The whole block */
+	FP_None,	/**< Nothing; a freed block only loses its header magic */
+	FP_Bounds,	/**< Only the header and footer, when freed */
+	FP_Prefix,	/**< The first mem_options.fill_length bytes, and the bounds */
+	FP_Sampled	/**< The whole of one block in every fill_sample_rate,
+			 * and the bounds of the rest */
+};
+
+
+/**
+ * How much a context does for each allocation; selectable at startup, so a
+ * single build can be shipped with tracking off, and turned on by restarting
+ * with MEM_OPTIONS_ENV set.
+ *
+ * @enum E_TRACKING_MODE
+ */
+enum E_TRACKING_MODE
+{
+	TM_Full = 0,	/**< Every block tracked and checked, per the options */
+	TM_Off,		/**< Straight to malloc and free; nothing tracked */
+	TM_Counters	/**< Only the stats; each block has just a memblock_prefix */
+};
+
+
+
+struct mem_trace_ring;
+
+
+/**
+ * A threads cache of slots for a single slab size class. Slabs are carved into
+ * equally sized slots, each with its header pre-initialized, and handed out
+ * without going near malloc; freed slots return to the cache they came from.
+ *
+ * @struct mem_slab_cache
+ */
+struct mem_slab_cache
+{
+	/** Slots available for allocation, linked via their remote_next */
+	struct memblock_header*	free_slots;
+	/** Slabs carved for this class, linked through their first word */
+	void*		slabs;
+	uint32_t	slots_total;	/**< Slots carved, across every slab */
+	uint32_t	slots_used;	/**< Slots currently allocated */
+};
+
+
+
+/**
+ * Behaviour settings for a mem_context. mem_context_init() applies the
+ * defaults; change them after that, but before the first allocation.
+ *
+ * @struct mem_options
+ */
+struct mem_options
+{
+	/**
+	 * How much is done for each allocation. Not to be changed once
+	 * anything has been allocated, as blocks from one mode can't be freed
+	 * in another. Default is TM_Full */
+	enum E_TRACKING_MODE	mode;
+
+	/** The file the report is written to by mem_context_destroy() and
+	 * output_memory_info(); default is MEM_LEAK_LOG_NAME */
+	const char*	report_path;
+
+	/**
+	 * Serve allocations of up to 2 KiB from per-thread size-class slabs,
+	 * rather than malloc; default is false */
+	bool		use_slab;
+
+	/**
+	 * Record every live block in the contexts mem_registry, so frees and
+	 * validations of pointers that aren't live blocks are caught without
+	 * touching the memory; default is true */
+	bool		use_registry;
+
+	/**
+	 * If non-zero, only sample allocations, at an average of one every
+	 * sample_rate bytes (the gaps being geometrically distributed, so
+	 * every byte is equally likely to be sampled). Sampled blocks are
+	 * tracked as normal; the rest only get a memblock_prefix. The report
+	 * then scales the sampled bytes back up to an estimate for all of
+	 * them. Default is 0, tracking every allocation */
+	uint32_t	sample_rate;
+
+	/**
+	 * If non-zero, capture up to this many frames (at most
+	 * MEM_STACK_MAX_DEPTH) of the call stack for every tracked allocation,
+	 * so leaks are reported with the code that really made them, not just
+	 * the MALLOC site. Uses the frame pointers, so build with
+	 * -fno-omit-frame-pointer. Default is 0 */
+	uint32_t	stack_depth;
+
+	/**
+	 * How much of each tracked block is filled when allocated and freed;
+	 * fills of large blocks bypass the cache where the platform allows.
+	 * Default is FP_Full */
+	enum E_FILL_POLICY	fill_policy;
+
+	/** Bytes filled at the start of each block, for FP_Prefix; default is
+	 * 64 */
+	uint32_t	fill_length;
+
+	/** One in this many blocks is filled, for FP_Sampled; default is 16 */
+	uint32_t	fill_sample_rate;
+
+	/**
+	 * If non-zero, the bytes of redzone placed either side of each
+	 * tracked block; rounded up to a multiple of 16 (to keep the
+	 * alignment), and at most MEM_REDZONE_MAX_SIZE. The redzones are
+	 * filled with a pattern, and verified with the footer, so writes a
+	 * little before or after a block are caught wherever they land, and
+	 * before they reach the header. Default is 0 */
+	uint32_t	redzone_size;
+
+	/**
+	 * If non-zero, tracked blocks of at least this many bytes are mapped
+	 * directly from the system, rather than malloc'd; they are unmapped
+	 * the moment they're freed, so any later use faults, and are resized
+	 * by remapping, without a copy, where the platform allows. Unsampled
+	 * blocks are left to malloc. Default is MEM_MAP_THRESHOLD */
+	size_t		map_threshold;
+
+	/**
+	 * Give each tracked block selected by the guard_ options pages of its
+	 * own, placed so it ends at an inaccessible guard page; an overflow
+	 * faults on the spot, rather than being found when the block is next
+	 * checked. The footer goes before the header instead, and the few
+	 * bytes left between the block and the guard page to keep it aligned
+	 * are checked as part of its trailing redzone. Costs at least two
+	 * pages a block, so select as few as will do. Default is false */
+	bool		use_guard_pages;
+
+	/** The smallest and largest blocks guarded, in bytes; default is 0
+	 * and SIZE_MAX */
+	size_t		guard_min_size;
+	size_t		guard_max_size;
+
+	/**
+	 * If set, only blocks allocated at a matching site are guarded; the
+	 * name of the function, the file name, or "file_name:line". Default is
+	 * NULL, guarding blocks from every site */
+	const char*	guard_site;
+
+	/**
+	 * The number of freed guarded blocks kept mapped, but inaccessible,
+	 * so a use after free faults too; once more have followed, the oldest
+	 * is unmapped. 0 unmaps them as they're freed. Default is
+	 * MEM_GUARD_QUARANTINE */
+	uint32_t	guard_quarantine;
+
+	/**
+	 * If non-zero, mem_context_init() starts publishing the contexts
+	 * stats for memmgr-top, updated every this many milliseconds; see
+	 * mem_publish_start(). Only read by mem_context_init(), so only of
+	 * use set from MEM_OPTIONS_ENV. Default is 0 */
+	uint32_t	publish_msec;
 };
 
 
 
+/**
+ * One stripe of a mem_registry; an open-addressing (linear probing) hash set
+ * of pointers, under its own lock.
+ *
+ * @struct mem_registry_stripe
+ */
+struct mem_registry_stripe
+{
+#if defined(_WIN32)
+	SRWLOCK		lock;
+#else
+	pthread_mutex_t	lock;
+#endif
+	uintptr_t*	slots;		/**< The table; 0 marks an empty slot */
+	size_t		mask;		/**< Number of slots, less one */
+	size_t		count;		/**< Number of slots in use */
+	/** Keeps each stripe on its own cache line(s) */
+	uint8_t		padding[64];
+};
+
+
+
+/**
+ * The set of every live block in a context, keyed by the pointer handed to the
+ * application. Consulted by tracked_free(), tracked_realloc() and
+ * validate_memory() before they touch a block, so a pointer that was never
+ * allocated - or has already been freed - is caught in O(1), rather than by
+ * reading whatever memory it points to.
+ *
+ * Pointers are spread across MEM_REGISTRY_STRIPES independently locked tables,
+ * so threads rarely contend on the same lock.
+ *
+ * @struct mem_registry
+ */
+struct mem_registry
+{
+	/** Array of MEM_REGISTRY_STRIPES stripes; NULL if not in use */
+	struct mem_registry_stripe*	stripes;
+};
+
+
+
+/**
+ * The counters kept for a mem_context. All are 64-bit, so none will wrap on a
+ * long-running process.
+ *
+ * Every shard holds its own set, only ever modified by the thread using the
+ * shard - a block freed by another thread is subtracted from the freeing
+ * threads set - so updating them needs no lock, nor even an atomic add. Each
+ * update is bracketed by the shards sequence count, from which
+ * mem_context_get_stats() can tell it read a set part way through one, and
+ * read it again; it then folds the shards together into the totals for the
+ * context.
+ *
+ * Size classes are by the requested size; class 0 holds only zero-byte
+ * blocks, and class n those of 2^(n-1) to 2^n - 1 bytes.
+ *
+ * @struct mem_stats
+ */
+struct mem_stats
+{
+	uint64_t	allocs;			/**< The amount of times new has been called successfully */
+	uint64_t	frees;			/**< The amount of times delete has been called successfully */
+	uint64_t	current_allocated;	/**< Currently allocated amount of bytes */
+	uint64_t	total_allocated;	/**< The total amount of allocated bytes */
+	/** As current_allocated, but only the bytes requested; without
+	 * headers, redzones, alignment padding or guard pages */
+	uint64_t	current_requested;
+	/** As total_allocated, but only the bytes requested */
+	uint64_t	total_requested;
+	uint64_t	arena_allocated;	/**< Bytes currently held in arena chunks */
+	uint64_t	invalid_frees;		/**< Frees of pointers that were not live blocks */
+	/** Estimate of total_allocated for every allocation, sampled or not;
+	 * only maintained when sampling */
+	uint64_t	est_total_allocated;
+	/** Estimate of the requested bytes currently allocated, sampled or
+	 * not; only maintained when sampling */
+	uint64_t	est_current_allocated;
+	/** The most current_allocated has been, to within
+	 * MEM_STATS_PEAK_BATCH bytes for each thread, either way; only kept
+	 * for the context as a whole, so 0 in each shard */
+	uint64_t	peak_allocated;
+	/** Blocks currently allocated, by size class */
+	uint64_t	live_by_class[MEM_STATS_SIZE_CLASSES];
+	/** Blocks allocated, ever, by size class */
+	uint64_t	allocs_by_class[MEM_STATS_SIZE_CLASSES];
+};
+
+
+
+/**
+ * Counters kept for each allocation site, per mem_context; updated with
+ * relaxed atomics on every tracked allocation and free, so they can be queried
+ * at any time with mem_context_top_sites(). Sizes are the requested bytes.
+ *
+ * The same counters are kept per call stack, when stacks are captured.
+ *
+ * When sampling, only the sampled allocations are counted.
+ *
+ * @struct mem_site_stats
+ */
+struct mem_site_stats
+{
+	uint64_t	live_bytes;	/**< Bytes currently allocated */
+	uint64_t	live_blocks;	/**< Blocks currently allocated */
+	uint64_t	allocs;		/**< Allocations made, ever */
+	uint64_t	frees;		/**< Allocations freed, ever */
+	uint64_t	peak_bytes;	/**< The most live_bytes has ever been */
+	uint64_t	alloc_bytes;	/**< Bytes allocated, ever */
+};
+
+
+
+/**
+ * A site and its counters, as returned by mem_context_top_sites().
+ *
+ * @struct mem_site_usage
+ */
+struct mem_site_usage
+{
+	/** The site; never NULL */
+	struct mem_site*	site;
+	/** A copy of the counters for the site */
+	struct mem_site_stats	stats;
+};
+
+
+
+/**
+ * Per-thread portion of a mem_context. Each thread that allocates from a
+ * context is given its own shard the first time it does so; the shard holds
+ * the list of blocks that thread allocated, plus the stats for them, so the
+ * hot paths never contend on a lock shared with other threads.
+ *
+ * A block freed by a thread other than the one that allocated it is pushed,
+ * without locking, onto the owning shards remote_frees stack; the owner
+ * unlinks and releases these the next time it allocates or frees. Reports and
+ * full validations lock each shard in turn and drain it first, so they still
+ * see the merged view of the whole context.
+ *
+ * When a thread exits, its shard is marked orphaned and is adopted by the next
+ * new thread to use the context - shards are never released until the context
+ * is destroyed.
+ *
+ * @struct mem_shard
+ */
+struct mem_shard
+{
+	/** This threads share of the context stats */
+	struct mem_stats	stats;
+	/** Incremented before and after each update of stats, so odd while
+	 * one is in progress */
+	uint64_t		stats_seq;
+	/** Change in current_allocated not yet added to the contexts
+	 * live_allocated; only touched by the thread using the shard */
+	int64_t			peak_batch;
+	/** The most peak_batch has been since it was last passed on, so a
+	 * rise smaller than a batch still counts towards the peak; only
+	 * written by the thread using the shard */
+	int64_t			peak_high;
+
+	/** The context this shard belongs to */
+	struct mem_context*	context;
+	/** Unique, non-zero, identifier within the context; assigned in order
+	 * of creation, so an adopted shard keeps the id of its first thread */
+	uint32_t		id;
+	/** The next shard in the contexts list */
+	struct mem_shard*	next;
+	/** Lock-free stack of blocks freed by other threads, pending release */
+	struct memblock_header*	remote_frees;
+	/** Set when the owning thread has exited; the shard can be adopted */
+	uint32_t		orphaned;
+
+#if defined(_WIN32)
+	CRITICAL_SECTION	cs;
+#else
+	pthread_mutex_t		lock;
+#endif
+
+	/** Bytes this thread may allocate before the next one is sampled */
+	int64_t			sample_countdown;
+	/** State of this threads sampling random number generator; 0 until
+	 * the first sampling decision */
+	uint64_t		sample_rng;
+
+	/** Blocks this thread may allocate before the next is filled, for
+	 * FP_Sampled */
+	uint32_t		fill_countdown;
+
+	/** Bounds of this threads stack, for unwinding; NULL until the first
+	 * stack capture */
+	void*			stack_low;
+	void*			stack_high;
+
+	/** A list of all the memblock_header objects created by this thread */
+	TAILQ_HEAD(st_headname, memblock_header)	memblocks;
+	/**
+	 * The next block the scrubber will check, while it is part way through
+	 * this shard; moved on by anything unlinking that block */
+	struct memblock_header*	scrub_cursor;
+
+	/** Events recorded by this thread, pending the trace writer; NULL
+	 * until the first event while tracing. Kept once tracing stops */
+	struct mem_trace_ring*	trace_ring;
+
+	/** Slot caches for each slab size class, if mem_options.use_slab */
+	struct mem_slab_cache	slab[MEM_SLAB_CLASSES];
+};
+
+
+
+struct mem_scrubber;
+struct mem_tracer;
+struct mem_guard;
+struct mem_publisher;
+
+
 /**
  * Holds the stats and pointers to the memory operations performed. You can
  * create multiple contexts in an application if desired, so you can separate
@@ -152,6 +640,9 @@ enum E_MEMORY_ERROR
  *
  * Naturally, anything allocated/freed by malloc/realloc/free outside of our
  * macros will not be tracked.
+ *
+ * Stats and the block list are held per-thread, in a mem_shard; see that
+ * structure for details.
  * 
  * You must initialize the context with mem_context_init(), and cleanup with
  * mem_context_destroy().
@@ -160,20 +651,86 @@ enum E_MEMORY_ERROR
  */
 struct mem_context
 {
-	uint32_t	allocs;			/**< The amount of times new has been called successfully */
-	uint32_t	frees;			/**< The amount of times delete has been called successfully */
-	uint32_t	current_allocated;	/**< Currently allocated amount of bytes */
-	uint32_t	total_allocated;	/**< The total amount of allocated bytes */
+	/** Behaviour settings; see mem_options */
+	struct mem_options	options;
 
+	/**
+	 * Only taken to attach a shard to a new thread, and by the operations
+	 * that need the merged view (reports, full validation); never by the
+	 * allocation and free paths themselves */
 #if defined(_WIN32)
 	CRITICAL_SECTION	cs;
+	DWORD			shard_key;	/**< Fiber-local slot for this threads shard */
 #else
 	pthread_mutex_t		lock;
-	pthread_mutexattr_t	lock_attrib;
+	pthread_key_t		shard_key;	/**< Thread-specific key for this threads shard */
 #endif
 
-	/** A list of all the memblock_header objects created and active */
-	TAILQ_HEAD(st_headname, memblock_header)	memblocks;
+	/** Singly-linked list of every shard created for this context */
+	struct mem_shard*	shards;
+	/** The id given to the last shard created; protected by the lock */
+	uint32_t		shard_max_id;
+
+	/** Every arena accounted in this context; protected by the lock */
+	TAILQ_HEAD(st_arenas, mem_arena)	arenas;
+
+	/** Every live block, if mem_options.use_registry */
+	struct mem_registry	registry;
+
+	/** The background scrubber, if running; see mem_scrubber_start() */
+	struct mem_scrubber*	scrubber;
+	/** The event trace, if running; see mem_trace_start() */
+	struct mem_tracer*	tracer;
+	/** The stats publisher, if running; see mem_publish_start() */
+	struct mem_publisher*	publisher;
+	/** Freed guarded blocks, held inaccessible; NULL until the first is
+	 * freed. See mem_options.guard_quarantine */
+	struct mem_guard*	guard;
+	/** The copy of the report path set by mem_context_configure(), if
+	 * any; released with the context */
+	char*			report_path;
+
+	/** Sum of current_allocated across the shards, as of each shards last
+	 * MEM_STATS_PEAK_BATCH bytes; signed, as one shard may pass on a free
+	 * before another passes on the allocation */
+	int64_t			live_allocated;
+	/** The most live_allocated has been */
+	int64_t			peak_allocated;
+
+	/**
+	 * Two-level table of per-site counters, indexed by site id; each chunk
+	 * is created the first time a site within it allocates. NULL if it
+	 * could not be allocated */
+	struct mem_site_stats**	site_stats;
+	/** As site_stats, but indexed by stack id; only populated when
+	 * stacks are captured */
+	struct mem_site_stats**	stack_stats;
+};
+
+
+
+/**
+ * Progress of a contexts background scrubber, and the first corruption it
+ * found, if any.
+ *
+ * @struct mem_scrub_status
+ */
+struct mem_scrub_status
+{
+	uint64_t	passes;		/**< Complete passes over every shard */
+	uint64_t	blocks_checked;	/**< Blocks checked, over all passes */
+	uint64_t	corruptions;	/**< Corrupt blocks found, over all passes */
+
+	/** The error of the first corrupt block found; EC_NoError if none */
+	enum E_MEMORY_ERROR	error;
+	/** The first corrupt block found, as handed to the application */
+	void*			block;
+	/** The site of the first corrupt block, or NULL if the header was
+	 * corrupt (and so the site could not be trusted) */
+	struct mem_site*	site;
+	/** For EC_CorruptRedzone, the offset of the first corrupt byte from
+	 * the start of the application memory; see check_redzones() */
+	int64_t			offset;
 };
 
 
@@ -181,7 +738,7 @@ struct mem_context
 /**
  * Checks a block of memory, ensuring both the header and footer are not
  * corrupt, and the rest of the block matches the original requestors
- * specifications.
+ * specifications - including the alignment, for tracked_aligned_alloc().
  *
  * Define DISABLE_MEMORY_CHECK_TO_STDOUT to prevent stage-by-stage
  * output of the checking process.
@@ -196,6 +753,23 @@ check_block(
 );
 
 
+/**
+ * Checks the redzones either side of a block, finding the first byte that no
+ * longer holds the redzone pattern. The header must be intact.
+ *
+ * @param[in] memory_block The block of memory to check
+ * @param[out] offset Set to the offset of the first corrupt byte, from the
+ * start of the application memory; negative if it precedes it
+ * @retval true if a corrupt byte was found
+ * @retval false if both redzones are intact, or the block has none
+ */
+bool
+check_redzones(
+	struct memblock_header* memory_block,
+	int64_t* offset
+);
+
+
 /**
  * Destroys a previously initialized memory context. If any memory blocks exist
  * within the list, it is declared as a memory leak, and will call the
@@ -209,9 +783,106 @@ mem_context_destroy(
 );
 
 
+/**
+ * Retrieves the current stats for the memory context, summed across every
+ * thread that has used it.
+ *
+ * Takes no lock and does not disturb any allocating thread, so is cheap enough
+ * to poll. Each threads counters are always read consistently with each other,
+ * retrying any caught part way through an update. The threads are then read
+ * again, and if any allocated in the meantime, the whole read is retried, a
+ * few times at most; so the totals are consistent unless threads allocate
+ * continuously, when they may each be from slightly different moments.
+ *
+ * peak_allocated is never less than current_allocated. Each threads rise
+ * since it last passed its changes on is included, as if every thread rose at
+ * once, so it may be off the true peak by up to MEM_STATS_PEAK_BATCH bytes for
+ * each thread, either way; with a single thread, it is exact.
+ *
+ * @param[in] context The memory context to read
+ * @param[out] stats The structure to populate
+ */
+void
+mem_context_get_stats(
+	struct mem_context* const context,
+	struct mem_stats* stats
+);
+
+
+/**
+ * Writes every live block in the context (address, size, site, thread and
+ * allocation time) to a binary snapshot file, in the format described in
+ * mem_snapshot.h, for offline analysis with memmgr-analyze.
+ *
+ * Each shard is locked only while its blocks are copied out; the file is
+ * written with no shard locked.
+ *
+ * @param[in] context The memory context to snapshot
+ * @param[in] path The file to write; replaced if it exists
+ * @retval true if the snapshot was written
+ * @retval false if the file could not be created or written
+ */
+bool
+mem_context_snapshot_write(
+	struct mem_context* const context,
+	const char* path
+);
+
+
+/**
+ * Writes the live set and allocation totals of the context as a heap profile,
+ * in the (uncompressed) protobuf format read by pprof, with the sample types
+ * alloc_objects, alloc_space, inuse_objects and inuse_space.
+ *
+ * With PG_Site, each site is a single-frame sample. With PG_Stack, each call
+ * stack captured (see mem_options.stack_depth) is a sample, with its frames
+ * symbolized where the platform allows, and the executable mappings included
+ * so pprof can symbolize the rest from the binaries.
+ *
+ * When sampling, only the sampled allocations are counted; the profile period
+ * records the sample rate.
+ *
+ * @param[in] context The memory context to profile
+ * @param[in] path The file to write; replaced if it exists
+ * @param[in] grouping How allocations are grouped into samples
+ * @retval true if the profile was written
+ * @retval false if the file could not be written, or memory was exhausted
+ */
+bool
+mem_context_profile_write(
+	struct mem_context* const context,
+	const char* path,
+	const enum E_PROFILE_GROUPING grouping
+);
+
+
+/**
+ * Finds the allocation sites with the most bytes currently allocated.
+ *
+ * Takes no lock; each counter is read atomically, but unlike
+ * mem_context_get_stats(), the counters of a site being allocated from as the
+ * call runs need not be consistent with each other.
+ *
+ * @param[in] context The memory context to query
+ * @param[out] usage Array of at least count entries to populate, most live
+ * bytes first
+ * @param[in] count The maximum number of sites to return
+ * @return The number of entries populated
+ */
+uint32_t
+mem_context_top_sites(
+	struct mem_context* const context,
+	struct mem_site_usage* usage,
+	const uint32_t count
+);
+
+
 /**
  * Initializes the memory context, ready for usage.
  * 
+ * The default options are then overridden by any set in the MEM_OPTIONS_ENV
+ * environment variable; see mem_context_configure().
+ *
  * Must be destroyed via mem_context_destroy().
  *
  * @param[in] context The memory context to initialize
@@ -222,13 +893,180 @@ mem_context_init(
 );
 
 
+/**
+ * Sets the contexts options from a string, of comma-separated key=value
+ * pairs:
+ * - mode=off|counters|full (see E_TRACKING_MODE)
+ * - sample=bytes (mem_options.sample_rate; 0 tracks everything)
+ * - fill=full|none|bounds|prefix|sampled (mem_options.fill_policy)
+ * - report=path (mem_options.report_path; up to the next comma)
+ * - publish=msec (mem_options.publish_msec)
+ *
+ * For example, "mode=full,sample=65536,fill=none,report=/tmp/leaks.log".
+ * Only the options given are changed. As with setting them directly, this
+ * must happen before the first allocation.
+ *
+ * @param[in] context The memory context to configure
+ * @param[in] options The options to set; NULL or empty changes nothing
+ * @retval true if every pair was recognised
+ * @retval false if any were not; the rest have still been applied
+ */
+bool
+mem_context_configure(
+	struct mem_context* const context,
+	const char* options
+);
+
+
+/**
+ * Starts a background thread that continuously validates every block in the
+ * context, as validate_memory() does, but incrementally; each shard is locked
+ * for at most batch_usec at a time, so allocating threads never stall for a
+ * full walk of the heap.
+ *
+ * The first corrupt block found is recorded, along with its site, and can be
+ * retrieved with mem_scrubber_status(). Scrubbing continues afterwards.
+ *
+ * Stopped automatically by mem_context_destroy().
+ *
+ * @param[in] context The memory context to scrub
+ * @param[in] batch_usec The longest a shard will be held locked, in
+ * microseconds; if 0, defaults to 200
+ * @param[in] interval_msec The time to wait between complete passes, in
+ * milliseconds
+ * @retval true if the scrubber is running
+ * @retval false if it was already running, or the thread could not be started
+ */
+bool
+mem_scrubber_start(
+	struct mem_context* const context,
+	const uint32_t batch_usec,
+	const uint32_t interval_msec
+);
+
+
+/**
+ * Retrieves the progress of the background scrubber, and the first corruption
+ * it has found. If the scrubber is not running, everything is zero.
+ *
+ * @param[in] context The memory context to query
+ * @param[out] status The structure to populate
+ */
+void
+mem_scrubber_status(
+	struct mem_context* const context,
+	struct mem_scrub_status* status
+);
+
+
+/**
+ * Stops the background scrubber, waiting for its thread to finish. Does
+ * nothing if the scrubber is not running.
+ *
+ * @param[in] context The memory context to stop scrubbing
+ */
+void
+mem_scrubber_stop(
+	struct mem_context* const context
+);
+
+
+/**
+ * Starts recording every tracked_alloc(), tracked_free() and tracked_realloc()
+ * to a binary trace file; see mem_trace.h for the format. Intended for
+ * studying allocation behaviour where the output enabled by not defining
+ * DISABLE_MEMORY_OP_TO_STDOUT would be far too slow.
+ *
+ * Each call appends a fixed-size event to a ring owned by the calling
+ * thread, without locking or waiting; a writer thread drains the rings every
+ * few milliseconds, delta and varint encoding the events as it writes them.
+ * A thread whose ring fills before it is drained drops events, with the count
+ * recorded in the trace.
+ *
+ * Frees that fail validation are not recorded.
+ *
+ * @param[in] context The memory context to trace
+ * @param[in] path The file to write; replaced if it exists
+ * @param[in] ring_events The capacity of each threads ring, in events, rounded
+ * up to a power of 2; 0 uses the default. Threads that recorded events for an
+ * earlier trace keep their existing ring
+ * @retval true if tracing has started
+ * @retval false if tracing is already running, the file could not be created,
+ * or the writer thread could not be started
+ */
+bool
+mem_trace_start(
+	struct mem_context* const context,
+	const char* path,
+	const uint32_t ring_events
+);
+
+
+/**
+ * Stops tracing, waiting for the writer thread to drain the rings and finish
+ * the file. Does nothing if tracing is not running.
+ *
+ * @param[in] context The memory context being traced
+ * @retval true if the complete trace was written, or tracing wasn't running
+ * @retval false if any write to the file failed
+ */
+bool
+mem_trace_stop(
+	struct mem_context* const context
+);
+
+
+/**
+ * Starts publishing the contexts stats, and its MEM_SHM_SITES sites with the
+ * most live bytes, to a page of shared memory in MEM_SHM_DIR; see mem_shm.h
+ * for the layout. memmgr-top finds and displays every such page on the host,
+ * so many processes can be watched live, without attaching to any of them.
+ *
+ * A background thread looks at the stats every interval, without locking, as
+ * mem_context_get_stats() does; the page is only rewritten if anything was
+ * allocated or freed since the last look, and a sites names only when it
+ * first appears. The allocating threads themselves do nothing more, so this
+ * is cheap enough to leave running.
+ *
+ * A forked child does not publish, unless it starts again. Stopped
+ * automatically by mem_context_destroy(). Only available on Linux.
+ *
+ * @param[in] context The memory context to publish
+ * @param[in] interval_msec The time between looks at the stats, in
+ * milliseconds; 0 uses the default of a second
+ * @retval true if publishing has started
+ * @retval false if it was already running, the context is in TM_Off, the page
+ * could not be created, or the thread could not be started
+ */
+bool
+mem_publish_start(
+	struct mem_context* const context,
+	const uint32_t interval_msec
+);
+
+
+/**
+ * Stops publishing, waiting for the publisher thread to finish, and removes
+ * the page. Does nothing if publishing is not running.
+ *
+ * @param[in] context The memory context being published
+ */
+void
+mem_publish_stop(
+	struct mem_context* const context
+);
+
+
 /**
  * Called only in the destructor, but available for calling manually if
  * desired; will always output the memory stats for the application run,
  * but will also write out the information on any unfreed memory.
  *
- * Outputs to MEM_LEAK_LOG_NAME, but if it's not writable, it is printed
- * to stderr instead.
+ * Outputs to mem_options.report_path, but if it's not writable, it is printed
+ * to stdout instead.
+ *
+ * Every unfreed block is then released; use mem_context_report() to leave
+ * them be.
  *
  * @param[in] context The memory context to work with
  */
@@ -238,6 +1076,68 @@ output_memory_info(
 );
 
 
+/**
+ * Writes the same report as output_memory_info(), but leaves every block as it
+ * is; for a report while the application is still running, or at exit when
+ * blocks may yet be used (such as by an interposer, see memmgr_preload.c).
+ *
+ * @param[in] context The memory context to work with
+ */
+void
+mem_context_report(
+	struct mem_context* const context
+);
+
+
+/**
+ * Checks if a pointer is to a live block of the context, without reading the
+ * memory around it unless the context could have allocated it; for freeing
+ * memory from more than one allocator, as an interposer must. Pointers not
+ * from the system allocator may still be read when the context is not using
+ * the registry.
+ *
+ * @param[in] context The memory context to check
+ * @param[in] memory The pointer to check; may be NULL
+ * @param[out] num_bytes If not NULL, set to the size requested for the block,
+ * if it is one
+ * @retval true if the pointer is to a live block
+ * @retval false if it is not, or the context is in TM_Off mode
+ */
+bool
+mem_context_owns(
+	struct mem_context* const context,
+	void* memory,
+	size_t* num_bytes
+);
+
+
+/**
+ * Tracked version of aligned_alloc - use the ALIGNED_ALLOC macro to call
+ * this. The memory handed back is aligned to a multiple of alignment; any
+ * other block is only aligned as malloc would align it.
+ *
+ * Alignments beyond malloc's own are served by the platforms aligned
+ * allocator, never the slabs, and have padding before the header.
+ * tracked_realloc() of such a block, as with realloc, returns memory with
+ * only the default alignment.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] alignment The alignment; a power of two, up to
+ * MEM_ALIGNMENT_MAX
+ * @param[in] num_bytes The number of bytes to allocate
+ * @param[in] site The site this method was called from
+ * @return A pointer to the allocated memory, or a nullptr if the
+ * allocation failed, or the alignment is not supported
+ */
+void*
+tracked_aligned_alloc(
+	struct mem_context* const context,
+	const uint32_t alignment,
+	const size_t num_bytes,
+	struct mem_site* site
+);
+
+
 /**
  * Tracked version of malloc - use the MALLOC macro to call this, as it
  * will setup the parameters for you, barring the num_bytes.
@@ -246,21 +1146,43 @@ output_memory_info(
  * leave space for a header and footer; the client code does not need to
  * handle, or be aware, of this fact.
  *
+ * Blocks of mem_options.map_threshold bytes or more are mapped directly from
+ * the system, but are otherwise tracked and reported the same as any other.
+ *
  * @param[in] context The memory context to work with
  * @param[in] num_bytes The number of bytes to allocate
- * @param[in] file The file this method was called in
- * @param[in] function The function this method was called in
- * @param[in] line The line number in the file this method was called in
+ * @param[in] site The site this method was called from
  * @return A pointer to the allocated memory, or a nullptr if the
  * allocation failed.
  */
 void*
 tracked_alloc(
 	struct mem_context* const context,
-	const uint32_t num_bytes,
-	const char* file,
-	const char* function,
-	const uint32_t line
+	const size_t num_bytes,
+	struct mem_site* site
+);
+
+
+/**
+ * Tracked version of calloc - use the CALLOC macro to call this.
+ *
+ * The memory is zeroed instead of being filled with MEM_ON_INIT, and by
+ * calloc itself where it can be, so memory fresh from the system is never
+ * written at all.
+ *
+ * @param[in] context The memory context to work with
+ * @param[in] count The number of elements to allocate
+ * @param[in] size The size of each element
+ * @param[in] site The site this method was called from
+ * @return A pointer to the allocated memory, or a nullptr if the
+ * allocation failed, or count * size overflows
+ */
+void*
+tracked_calloc(
+	struct mem_context* const context,
+	const size_t count,
+	const size_t size,
+	struct mem_site* site
 );
 
 
@@ -274,6 +1196,10 @@ tracked_alloc(
  * otherwise invalid), as doing so could crash the application, and
  * miss logging the information.
  *
+ * If the context is using the registry, a pointer that isn't a live block
+ * (never allocated, or already freed) is detected without reading it, and
+ * counted in mem_stats.invalid_frees.
+ *
  * @param[in] context The memory context to work with
  * @param[in] memory A pointer to the memory previously allocated by
  * tracked_alloc (which should be called via MALLOC)
@@ -293,20 +1219,22 @@ tracked_free(
  * The same applies if new_num_bytes is 0 - tracked_free (i.e. free) 
  * will be called on the memory block.
  *
- * No validation is performed on the original block of memory, and
- * unlike the real realloc, we call TrackedAlloc regardless of size
- * differences and other parameters. The previous memory is then moved
- * into this newly allocated block, and the original freed.
- *
- * As a result, a TrackedRealloc guarantees that the returned pointer
- * will never be the same as the one passed in.
+ * The original block is validated first, as with tracked_free, and
+ * nullptr returned if it is not valid. The block is then resized with the
+ * system realloc, so it is only copied when it can't be resized where it
+ * is; a slab slot is resized within its slot, and only moved to a new
+ * allocation when it changes size class, with just the bytes the caller
+ * could have written being copied. A mapped block (see
+ * mem_options.map_threshold) is remapped, which never copies where the
+ * platform supports it; a block moves when it grows past the threshold,
+ * or a mapped one shrinks below half of it. Either
+ * way, the returned pointer may or may not be the one passed in, as with
+ * the real realloc.
  *
  * @param[in] context The memory context to work with
  * @param[in] memory The pointer to memory returned by TrackedAlloc()
  * @param[in] new_num_bytes The new number of bytes to allocate
- * @param[in] file The file this method was called in
- * @param[in] function The function this method was called in
- * @param[in] line The line number in the file this method was called in
+ * @param[in] site The site this method was called from
  * @retval nullptr if the function fails due to invalid parameters, or
  * the call to realloc fails
  * @return A pointer to the usable block of memory allocated
@@ -315,10 +1243,8 @@ void*
 tracked_realloc(
 	struct mem_context* const context,
 	void* memory,
-	const uint32_t new_num_bytes,
-	const char* file,
-	const char* function,
-	const uint32_t line
+	const size_t new_num_bytes,
+	struct mem_site* site
 );
 
 
@@ -328,7 +1254,8 @@ tracked_realloc(
  * class is validated.
  *
  * If present, the memory passed in must be at the pointer to the memory
- * returned by the tracked_alloc/tracked_realloc caller.
+ * returned by the tracked_alloc/tracked_realloc caller; if the context is
+ * using the registry, any other pointer fails validation without being read.
  *
  * Internally calls check_block().
  *
@@ -344,13 +1271,127 @@ validate_memory(
 );
 
 
+/**
+ * Obtains the site for a file, function and line, creating and registering it
+ * the first time it is seen. Used by the MALLOC/REALLOC macros when the
+ * compiler cannot give each call its own static site.
+ *
+ * Slower than a static site, as a lock is taken and a hash table searched on
+ * every call.
+ *
+ * @param[in] file The file the allocation is made in
+ * @param[in] function The function the allocation is made in
+ * @param[in] line The line number in the file the allocation is made on
+ * @return The site, or NULL if a new site could not be allocated
+ */
+struct mem_site*
+mem_site_intern(
+	const char* file,
+	const char* function,
+	const uint32_t line
+);
+
+
+/**
+ * Looks up a registered site by its id. Does not take a lock.
+ *
+ * @param[in] id The id assigned when the site was registered
+ * @return The site, or NULL if no site has the id
+ */
+struct mem_site*
+mem_site_lookup(
+	const uint32_t id
+);
 
 
+/**
+ * Retrieves the highest id assigned to a site so far; every id from 1 up to
+ * and including this value has been issued.
+ *
+ * @return The highest site id, or 0 if none have been registered
+ */
+uint32_t
+mem_site_max_id(void);
+
+
+/**
+ * Retrieves the number of unique call stacks held in the stack depot.
+ *
+ * @return The number of stacks; also the highest stack id
+ */
+uint32_t
+mem_stack_count(void);
+
+
+/**
+ * Looks up a call stack in the stack depot, as referenced by
+ * memblock_header.stack_id. Stacks are never removed, so the frames remain
+ * valid for the lifetime of the process.
+ *
+ * @param[in] id The stack id
+ * @param[out] frames Set to the return addresses, innermost first; NULL if
+ * the id is unknown
+ * @return The number of frames, or 0 if the id is unknown
+ */
+uint32_t
+mem_stack_lookup(
+	const uint32_t id,
+	void* const** frames
+);
+
+
+/**
+ * Registers a site, assigning its id and working out its file_name. Called
+ * automatically on the first allocation made at the site; does nothing if the
+ * site is already registered.
+ *
+ * @param[in] site The site to register
+ */
+void
+mem_site_register(
+	struct mem_site* site
+);
+
+
+/**
+ * Registers every static site in the binary, by walking the MEM_SITE_SECTION
+ * linker section; does nothing if the section is not supported. Called by
+ * mem_context_init(), so sites can be enumerated before they are first used.
+ */
+void
+mem_sites_register_all(void);
+
+
+
+
+/* GCC-compatible compilers let us create a static site within an expression,
+ * and place it in its own section so they can all be found; anything else has
+ * to look the site up at runtime */
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+/** The linker section every static mem_site is placed in */
+#	define MEM_SITE_SECTION		memmgr_sites
+#	define MEM_SITE_SECTION_STR	"memmgr_sites"
+/** Expands to a pointer to the static site for the current line */
+#	define MEM_SITE()	__extension__ ({				\
+		static struct mem_site _mem_site				\
+		__attribute__((section(MEM_SITE_SECTION_STR), used, aligned(sizeof(void*)))) = \
+		{ __FILE__, __FUNCTION__, __LINE__, 0, NULL, NULL };		\
+		&_mem_site; })
+#else
+#	define MEM_SITE()	mem_site_intern(__FILE__, __FUNCTION__, __LINE__)
+#endif
+
 /** Macro to create tracked memory */
-	#define MALLOC(size)		tracked_alloc(&g_mem_ctx, size, __FILE__, __FUNCTION__, __LINE__)
+	#define MALLOC(size)		tracked_alloc(&g_mem_ctx, size, MEM_SITE())
+
+/** Macro to create aligned, tracked, memory */
+	#define ALIGNED_ALLOC(alignment, size)	tracked_aligned_alloc(&g_mem_ctx, alignment, size, MEM_SITE())
+
+/** Macro to create zeroed, tracked, memory */
+	#define CALLOC(count, size)	tracked_calloc(&g_mem_ctx, count, size, MEM_SITE())
 
 /** Macro to reallocate tracked memory */
-	#define REALLOC(ptr, size)	tracked_realloc(&g_mem_ctx, ptr, size, __FILE__, __FUNCTION__, __LINE__)
+	#define REALLOC(ptr, size)	tracked_realloc(&g_mem_ctx, ptr, size, MEM_SITE())
 
 /** Macro to delete tracked memory */
 	#define FREE(varname)		tracked_free(&g_mem_ctx, varname)
@@ -366,8 +1407,16 @@ extern struct mem_context		g_mem_ctx;
 	 * macros to call the original, non-hooked functions. */
 
 #	define MALLOC(size)		malloc(size)
+#	define CALLOC(count, size)	calloc(count, size)
 #	define REALLOC(ptr, size)	realloc(ptr, size)
 #	define FREE(varname)		free(varname)
+	/* note that on Windows, aligned memory must be released with
+	 * _aligned_free rather than FREE */
+#	if defined(_WIN32)
+#		define ALIGNED_ALLOC(alignment, size)	_aligned_malloc(size, alignment)
+#	else
+#		define ALIGNED_ALLOC(alignment, size)	aligned_alloc(alignment, size)
+#	endif
 
 #endif	// USING_MEMORY_DEBUGGING
 
@@ -0,0 +1,83 @@
+/**
+ * @file	arena_destroy.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ * @brief	Destroying a context with a leaked arena, from a thread without a shard
+ *
+ * A worker thread creates an arena, allocates from it, and exits without
+ * destroying it. The main thread, which has never allocated (so has no shard
+ * of its own), then destroys the context; releasing the arena has to account
+ * for its chunks, creating that shard. This once deadlocked on the context
+ * lock, so the test gives up, and fails, after a few seconds.
+ *
+ * Exits 0 on success.
+ */
+
+
+#include "tracked_memory.h"		// mem_context
+#include "mem_arena.h"			// mem_arena_create
+
+#include <pthread.h>			// pthread_create
+#include <stdio.h>			// printf
+#include <stdlib.h>			// EXIT_SUCCESS
+#include <unistd.h>			// alarm
+
+
+// seconds before the test is taken to have hung
+#define TIMEOUT_SEC	5
+
+
+static struct mem_context	context;
+
+
+
+/**
+ * Leaks an arena, with one allocation made from it.
+ *
+ * @param[in] param Unused
+ */
+static void*
+leak_arena(
+	void* param
+)
+{
+	struct mem_arena*	arena;
+
+	(void)param;
+
+	if (( arena = mem_arena_create(&context, "leaked", 0, NULL)) != NULL )
+		mem_arena_alloc(arena, 100);
+
+	return NULL;
+}
+
+
+
+int
+main(void)
+{
+	pthread_t	thread;
+	struct mem_stats	stats;
+
+	// SIGALRM's default action ends the process, failing the test
+	alarm(TIMEOUT_SEC);
+
+	mem_context_init(&context);
+	context.options.report_path = "/dev/null";
+
+	if ( pthread_create(&thread, NULL, leak_arena, NULL) != 0 )
+		return EXIT_FAILURE;
+	pthread_join(thread, NULL);
+
+	mem_context_get_stats(&context, &stats);
+	if ( stats.arena_allocated == 0 )
+	{
+		printf("the arena was not accounted for\n");
+		return EXIT_FAILURE;
+	}
+
+	mem_context_destroy(&context);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file	stack_capture.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ * @brief	The innermost frame of a captured stack is the trackers caller
+ *
+ * Each allocating function, of the test, makes one kind of tracked allocation
+ * and checks the stack recorded for it: the first frame must be in the
+ * function itself, which is the case when the second is the address it will
+ * return to. Too few frames skipped leaves the tracker at the top, too many
+ * loses the caller; both fail. Build it at -O0 and -O2 alike.
+ *
+ * Exits 0 on success.
+ */
+
+
+#include "tracked_memory.h"		// mem_context, tracked_alloc
+#include "mem_internal.h"		// block_offset_header, MEM_NOINLINE
+
+#include <stdio.h>			// fprintf
+#include <stdlib.h>			// EXIT_SUCCESS
+
+
+static struct mem_context	context;
+
+
+
+/**
+ * Checks the stack recorded for a block; the innermost frame must belong to
+ * the function that returns to return_address.
+ *
+ * @param[in] memory The tracked block
+ * @param[in] return_address Where the allocating function will return to
+ * @param[in] what Describes the allocation, for the failure message
+ * @return true if the stack is as expected
+ */
+static bool
+check_stack(
+	void* memory,
+	void* return_address,
+	const char* what
+)
+{
+	struct memblock_header*	mem_block;
+	void* const*		frames;
+	uint32_t		depth;
+
+	if ( memory == NULL )
+	{
+		fprintf(stderr, "%s: the allocation failed\n", what);
+		return false;
+	}
+
+	mem_block = block_offset_header(memory, mem_redzone_size(&context));
+	depth = mem_stack_lookup(mem_block->stack_id, &frames);
+
+	if ( depth < 2 || frames[1] != return_address )
+	{
+		fprintf(stderr, "%s: the stack does not start in the caller (%u frames, %p)\n",
+			what, depth, depth != 0 ? frames[0] : NULL);
+		return false;
+	}
+
+	return true;
+}
+
+
+
+static MEM_NOINLINE void*
+do_alloc(void)
+{
+	void*	memory = tracked_alloc(&context, 100, NULL);
+
+	return check_stack(memory, __builtin_return_address(0), "alloc") ? memory : NULL;
+}
+
+
+
+static MEM_NOINLINE void*
+do_calloc(void)
+{
+	void*	memory = tracked_calloc(&context, 10, 10, NULL);
+
+	return check_stack(memory, __builtin_return_address(0), "calloc") ? memory : NULL;
+}
+
+
+
+static MEM_NOINLINE void*
+do_aligned_alloc(void)
+{
+	void*	memory = tracked_aligned_alloc(&context, 256, 100, NULL);
+
+	return check_stack(memory, __builtin_return_address(0), "aligned alloc") ? memory : NULL;
+}
+
+
+
+static MEM_NOINLINE void*
+do_realloc(
+	void* memory,
+	const size_t num_bytes,
+	const char* what
+)
+{
+	memory = tracked_realloc(&context, memory, num_bytes, NULL);
+
+	return check_stack(memory, __builtin_return_address(0), what) ? memory : NULL;
+}
+
+
+
+int
+main(void)
+{
+	void*	memory[4];
+	int	i;
+
+	mem_context_init(&context);
+	context.options.report_path = "/dev/null";
+	context.options.stack_depth = 8;
+
+	memory[0] = do_alloc();
+	memory[1] = do_calloc();
+	memory[2] = do_aligned_alloc();
+	memory[3] = do_realloc(NULL, 100, "realloc of NULL");
+
+	for ( i = 0; i < 4; i++ )
+	{
+		if ( memory[i] == NULL )
+			return EXIT_FAILURE;
+	}
+
+	// the same size class resizes in place; past the slabs, it moves
+	if (( memory[3] = do_realloc(memory[3], 110, "realloc in place")) == NULL ||
+	    ( memory[3] = do_realloc(memory[3], 100000, "realloc moving")) == NULL )
+		return EXIT_FAILURE;
+
+	for ( i = 0; i < 4; i++ )
+		tracked_free(&context, memory[i]);
+
+	mem_context_destroy(&context);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,662 @@
+
+/**
+ * @file	memmgr_analyze.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ * @brief	Offline analysis of heap snapshots
+ *
+ * Memory-maps a snapshot written by mem_context_snapshot_write() and reports on
+ * it; nothing is copied out of the file, so even snapshots of millions of
+ * blocks are answered in a single pass or two.
+ *
+ * Usage: memmgr-analyze <snapshot> [summary | sites [count] | sizes | ages | threads]
+ */
+
+
+#include "mem_snapshot.h"		// file format
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>			// PRIu64
+#include <math.h>			// exp
+#include <stdio.h>			// printf
+#include <stdlib.h>			// calloc, qsort
+#include <string.h>			// memcmp, strcmp
+
+#if defined(_WIN32)
+#	define _WIN32_LEAN_AND_MEAN
+#	include <Windows.h>		// CreateFileMapping
+#else
+#	include <fcntl.h>		// open
+#	include <stdbool.h>		// C99 supplies bool
+#	include <sys/mman.h>		// mmap
+#	include <sys/stat.h>		// fstat
+#	include <unistd.h>		// close
+#endif
+
+#if defined(_WIN32)
+#	define bool int32_t
+#	define true 1
+#	define false 0
+#endif
+
+
+// sites listed by default
+#define DEFAULT_TOP_SITES	20
+// size classes in the histogram; one per power of 2
+#define SIZE_BUCKETS		65
+// width of the histogram bars
+#define BAR_WIDTH		40
+
+
+/**
+ * A mapped snapshot, with the sections located.
+ *
+ * @struct snapshot
+ */
+struct snapshot
+{
+	const uint8_t*				base;	/**< The start of the mapping */
+	uint64_t				size;	/**< The size of the mapping */
+	const struct mem_snapshot_header*	header;
+	const uint8_t*				blocks;
+	const uint8_t*				sites;
+	const char*				strings;
+#if defined(_WIN32)
+	HANDLE					file;
+	HANDLE					mapping;
+#endif
+};
+
+
+/**
+ * Totals for one site, thread or bucket.
+ *
+ * @struct tally
+ */
+struct tally
+{
+	uint32_t	id;		/**< What is being tallied */
+	uint64_t	blocks;		/**< Number of blocks */
+	uint64_t	bytes;		/**< Bytes requested */
+	double		estimate;	/**< Estimated bytes, if sampled */
+};
+
+
+// age buckets, in microseconds; anything older goes in the last
+static const uint64_t	age_limits[] = {
+	1000, 10000, 100000, 1000000, 10000000,
+	60000000, 600000000, 3600000000ull, 86400000000ull
+};
+static const char*	age_names[] = {
+	"< 1ms", "< 10ms", "< 100ms", "< 1s", "< 10s",
+	"< 1m", "< 10m", "< 1h", "< 1d", ">= 1d"
+};
+#define AGE_BUCKETS	(sizeof(age_names) / sizeof(age_names[0]))
+
+
+
+/**
+ * Obtains a block record by index; records are stepped by the size the file
+ * declares, so newer files with longer records can still be read.
+ *
+ * @param[in] snap The snapshot
+ * @param[in] index The index of the block
+ * @return The block record
+ */
+static const struct mem_snapshot_block*
+snapshot_block(
+	const struct snapshot* snap,
+	const uint64_t index
+)
+{
+	return (const struct mem_snapshot_block*)(snap->blocks + index * snap->header->block_size);
+}
+
+
+
+/**
+ * Obtains a site record by index.
+ *
+ * @param[in] snap The snapshot
+ * @param[in] index The index of the site
+ * @return The site record
+ */
+static const struct mem_snapshot_site*
+snapshot_site(
+	const struct snapshot* snap,
+	const uint64_t index
+)
+{
+	return (const struct mem_snapshot_site*)(snap->sites + index * snap->header->site_size);
+}
+
+
+
+/**
+ * Calculates how many bytes a block stands for; itself, unless the snapshot
+ * was of a sampling context, in which case the inverse of the probability it
+ * was sampled with (as the tracker itself does).
+ *
+ * @param[in] snap The snapshot
+ * @param[in] size The size of the block
+ * @return The estimated bytes
+ */
+static double
+snapshot_weight(
+	const struct snapshot* snap,
+	const uint64_t size
+)
+{
+	double	bytes = size == 0 ? 1.0 : (double)size;
+
+	if ( snap->header->sample_rate == 0 )
+		return (double)size;
+
+	return bytes / (1.0 - exp(-bytes / snap->header->sample_rate));
+}
+
+
+
+/**
+ * Maps a snapshot file, and checks it is one we can read.
+ *
+ * @param[in] path The file to open
+ * @param[out] snap The snapshot to populate
+ * @retval true if the snapshot is mapped and valid
+ * @retval false if not; the reason has been printed
+ */
+static bool
+snapshot_open(
+	const char* path,
+	struct snapshot* snap
+)
+{
+	const struct mem_snapshot_header*	header;
+
+	memset(snap, 0, sizeof(struct snapshot));
+
+#if defined(_WIN32)
+	LARGE_INTEGER	size;
+
+	if (( snap->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE )
+		goto open_failed;
+	if ( !GetFileSizeEx(snap->file, &size) || size.QuadPart == 0 )
+		goto open_failed;
+	if (( snap->mapping = CreateFileMappingA(snap->file, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL )
+		goto open_failed;
+	if (( snap->base = (const uint8_t*)MapViewOfFile(snap->mapping, FILE_MAP_READ, 0, 0, 0)) == NULL )
+		goto open_failed;
+
+	snap->size = (uint64_t)size.QuadPart;
+#else
+	struct stat	st;
+	int		fd;
+	void*		base;
+
+	if (( fd = open(path, O_RDONLY)) == -1 )
+		goto open_failed;
+
+	if ( fstat(fd, &st) != 0 || st.st_size == 0 )
+	{
+		close(fd);
+		goto open_failed;
+	}
+
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping holds its own reference to the file
+	close(fd);
+
+	if ( base == MAP_FAILED )
+		goto open_failed;
+
+	snap->base = (const uint8_t*)base;
+	snap->size = (uint64_t)st.st_size;
+#endif
+
+	header = (const struct mem_snapshot_header*)snap->base;
+
+	if ( snap->size < sizeof(struct mem_snapshot_header) ||
+	     memcmp(header->magic, MEM_SNAPSHOT_MAGIC, sizeof(MEM_SNAPSHOT_MAGIC)) != 0 )
+	{
+		fprintf(stderr, "%s: not a snapshot\n", path);
+		return false;
+	}
+
+	// the magic is bytes, the version isn't; a swapped version means a swapped file
+	if ( header->version != MEM_SNAPSHOT_VERSION )
+	{
+		if ( (header->version >> 24) == MEM_SNAPSHOT_VERSION )
+			fprintf(stderr, "%s: written on a machine of the other byte order\n", path);
+		else
+			fprintf(stderr, "%s: unsupported version %u (expected %u)\n",
+				path, header->version, MEM_SNAPSHOT_VERSION);
+		return false;
+	}
+
+	if ( header->block_size < sizeof(struct mem_snapshot_block) ||
+	     header->site_size < sizeof(struct mem_snapshot_site) ||
+	     header->block_offset + header->block_count * header->block_size > snap->size ||
+	     header->site_offset + header->site_count * header->site_size > snap->size ||
+	     header->string_offset + header->string_size > snap->size )
+	{
+		fprintf(stderr, "%s: truncated or corrupt\n", path);
+		return false;
+	}
+
+	snap->header	= header;
+	snap->blocks	= snap->base + header->block_offset;
+	snap->sites	= snap->base + header->site_offset;
+	snap->strings	= (const char*)(snap->base + header->string_offset);
+
+	return true;
+
+open_failed:
+	fprintf(stderr, "%s: unable to open\n", path);
+	return false;
+}
+
+
+
+/**
+ * Unmaps a snapshot.
+ *
+ * @param[in] snap The snapshot to close
+ */
+static void
+snapshot_close(
+	struct snapshot* snap
+)
+{
+#if defined(_WIN32)
+	if ( snap->base != NULL )
+		UnmapViewOfFile(snap->base);
+	if ( snap->mapping != NULL )
+		CloseHandle(snap->mapping);
+	if ( snap->file != NULL && snap->file != INVALID_HANDLE_VALUE )
+		CloseHandle(snap->file);
+#else
+	if ( snap->base != NULL )
+		munmap((void*)snap->base, (size_t)snap->size);
+#endif
+}
+
+
+
+/**
+ * Orders tallies by bytes, most first; for qsort.
+ */
+static int
+tally_compare(
+	const void* lhs,
+	const void* rhs
+)
+{
+	const struct tally*	l = (const struct tally*)lhs;
+	const struct tally*	r = (const struct tally*)rhs;
+
+	if ( l->bytes != r->bytes )
+		return l->bytes < r->bytes ? 1 : -1;
+
+	return l->id < r->id ? -1 : (l->id > r->id);
+}
+
+
+
+/**
+ * Prints a bar, proportional to value out of total.
+ */
+static void
+print_bar(
+	const uint64_t value,
+	const uint64_t total
+)
+{
+	uint32_t	width = total == 0 ? 0 : (uint32_t)((value * BAR_WIDTH + total - 1) / total);
+
+	while ( width-- > 0 )
+		putchar('#');
+}
+
+
+
+/**
+ * Prints the overall totals of the snapshot.
+ *
+ * @param[in] snap The snapshot
+ */
+static void
+report_summary(
+	const struct snapshot* snap
+)
+{
+	const struct mem_snapshot_block*	block;
+	uint64_t	bytes = 0;
+	uint64_t	oldest = snap->header->taken_usec;
+	double		estimate = 0;
+	uint64_t	i;
+
+	for ( i = 0; i < snap->header->block_count; i++ )
+	{
+		block = snapshot_block(snap, i);
+		bytes += block->size;
+		estimate += snapshot_weight(snap, block->size);
+		if ( block->alloc_usec < oldest )
+			oldest = block->alloc_usec;
+	}
+
+	printf(	"# Snapshot\n"
+		"Version.................: %u\n"
+		"Live Blocks.............: %" PRIu64 "\n"
+		"Live Bytes..............: %" PRIu64 "\n"
+		"Sites...................: %" PRIu64 "\n"
+		"Oldest Block (sec)......: %.3f\n",
+		snap->header->version,
+		snap->header->block_count,
+		bytes,
+		snap->header->site_count,
+		(double)(snap->header->taken_usec - oldest) / 1000000.0);
+
+	if ( snap->header->sample_rate != 0 )
+	{
+		printf(	"Sample Rate.............: %u\n"
+			"Est. Live Bytes.........: %.0f\n",
+			snap->header->sample_rate, estimate);
+	}
+
+	printf("\n");
+}
+
+
+
+/**
+ * Prints the sites holding the most live bytes.
+ *
+ * @param[in] snap The snapshot
+ * @param[in] count The number of sites to print
+ */
+static void
+report_sites(
+	const struct snapshot* snap,
+	uint32_t count
+)
+{
+	const struct mem_snapshot_block*	block;
+	const struct mem_snapshot_site*		site;
+	const struct mem_snapshot_site**	by_id;
+	struct tally*	tallies;
+	uint32_t	max_id = 0;
+	uint64_t	total = 0;
+	uint64_t	i;
+
+	for ( i = 0; i < snap->header->site_count; i++ )
+	{
+		if ( snapshot_site(snap, i)->site_id > max_id )
+			max_id = snapshot_site(snap, i)->site_id;
+	}
+
+	tallies	= (struct tally*)calloc((size_t)max_id + 1, sizeof(struct tally));
+	by_id	= (const struct mem_snapshot_site**)calloc((size_t)max_id + 1, sizeof(struct mem_snapshot_site*));
+
+	if ( tallies == NULL || by_id == NULL )
+	{
+		fprintf(stderr, "out of memory\n");
+		goto cleanup;
+	}
+
+	for ( i = 0; i <= max_id; i++ )
+		tallies[i].id = (uint32_t)i;
+	for ( i = 0; i < snap->header->site_count; i++ )
+		by_id[snapshot_site(snap, i)->site_id] = snapshot_site(snap, i);
+
+	for ( i = 0; i < snap->header->block_count; i++ )
+	{
+		block = snapshot_block(snap, i);
+		// a site registered after the site table was written; call it unknown
+		tallies[block->site_id <= max_id ? block->site_id : 0].blocks++;
+		tallies[block->site_id <= max_id ? block->site_id : 0].bytes += block->size;
+		tallies[block->site_id <= max_id ? block->site_id : 0].estimate += snapshot_weight(snap, block->size);
+		total += block->size;
+	}
+
+	qsort(tallies, (size_t)max_id + 1, sizeof(struct tally), tally_compare);
+
+	printf(	"# Top Sites (by live bytes)\n"
+		"    Live Bytes  Live Blocks      %%  Est. Bytes  Site\n");
+
+	for ( i = 0; i <= max_id && i < count && tallies[i].blocks != 0; i++ )
+	{
+		site = by_id[tallies[i].id];
+
+		printf("%14" PRIu64 " %12" PRIu64 " %6.2f %11.0f  %s (%s:%u)\n",
+		       tallies[i].bytes, tallies[i].blocks,
+		       total == 0 ? 0.0 : 100.0 * tallies[i].bytes / total,
+		       tallies[i].estimate,
+		       site == NULL ? "unknown" : snap->strings + site->function,
+		       site == NULL ? "unknown" : snap->strings + site->file,
+		       site == NULL ? 0 : site->line);
+	}
+
+	printf("\n");
+
+cleanup:
+	free(tallies);
+	free(by_id);
+}
+
+
+
+/**
+ * Prints a histogram of the live block sizes, by power of 2.
+ *
+ * @param[in] snap The snapshot
+ */
+static void
+report_sizes(
+	const struct snapshot* snap
+)
+{
+	struct tally	buckets[SIZE_BUCKETS];
+	uint64_t	max_blocks = 0;
+	uint32_t	bucket;
+	uint64_t	size;
+	uint64_t	i;
+
+	memset(buckets, 0, sizeof(buckets));
+
+	for ( i = 0; i < snap->header->block_count; i++ )
+	{
+		size = snapshot_block(snap, i)->size;
+		// bucket n holds sizes in [2^(n-1), 2^n); bucket 0 is empty blocks
+		bucket = size == 0 ? 0 : 64 - (uint32_t)__builtin_clzll(size);
+		buckets[bucket].blocks++;
+		buckets[bucket].bytes += size;
+	}
+
+	for ( bucket = 0; bucket < SIZE_BUCKETS; bucket++ )
+	{
+		if ( buckets[bucket].blocks > max_blocks )
+			max_blocks = buckets[bucket].blocks;
+	}
+
+	printf(	"# Size Histogram\n"
+		"          Size       Blocks         Bytes\n");
+
+	for ( bucket = 0; bucket < SIZE_BUCKETS; bucket++ )
+	{
+		if ( buckets[bucket].blocks == 0 )
+			continue;
+
+		printf("< %12" PRIu64 " %12" PRIu64 " %13" PRIu64 "  ",
+		       bucket == 0 ? 1 : (uint64_t)1 << bucket,
+		       buckets[bucket].blocks, buckets[bucket].bytes);
+		print_bar(buckets[bucket].blocks, max_blocks);
+		printf("\n");
+	}
+
+	printf("\n");
+}
+
+
+
+/**
+ * Prints the distribution of live block ages, as of when the snapshot was
+ * taken.
+ *
+ * @param[in] snap The snapshot
+ */
+static void
+report_ages(
+	const struct snapshot* snap
+)
+{
+	const struct mem_snapshot_block*	block;
+	struct tally	buckets[AGE_BUCKETS];
+	uint64_t	max_blocks = 0;
+	uint64_t	age;
+	uint32_t	bucket;
+	uint64_t	i;
+
+	memset(buckets, 0, sizeof(buckets));
+
+	for ( i = 0; i < snap->header->block_count; i++ )
+	{
+		block = snapshot_block(snap, i);
+		age = snap->header->taken_usec > block->alloc_usec ? snap->header->taken_usec - block->alloc_usec : 0;
+
+		for ( bucket = 0; bucket < AGE_BUCKETS - 1 && age >= age_limits[bucket]; bucket++ )
+			;
+
+		buckets[bucket].blocks++;
+		buckets[bucket].bytes += block->size;
+	}
+
+	for ( bucket = 0; bucket < AGE_BUCKETS; bucket++ )
+	{
+		if ( buckets[bucket].blocks > max_blocks )
+			max_blocks = buckets[bucket].blocks;
+	}
+
+	printf(	"# Age Distribution\n"
+		"Age            Blocks         Bytes\n");
+
+	for ( bucket = 0; bucket < AGE_BUCKETS; bucket++ )
+	{
+		printf("%-8s %12" PRIu64 " %13" PRIu64 "  ",
+		       age_names[bucket], buckets[bucket].blocks, buckets[bucket].bytes);
+		print_bar(buckets[bucket].blocks, max_blocks);
+		printf("\n");
+	}
+
+	printf("\n");
+}
+
+
+
+/**
+ * Prints the live bytes held by each thread (shard).
+ *
+ * @param[in] snap The snapshot
+ */
+static void
+report_threads(
+	const struct snapshot* snap
+)
+{
+	const struct mem_snapshot_block*	block;
+	struct tally*	tallies;
+	uint32_t	max_id = 0;
+	uint64_t	i;
+
+	for ( i = 0; i < snap->header->block_count; i++ )
+	{
+		if ( snapshot_block(snap, i)->thread_id > max_id )
+			max_id = snapshot_block(snap, i)->thread_id;
+	}
+
+	if (( tallies = (struct tally*)calloc((size_t)max_id + 1, sizeof(struct tally))) == NULL )
+	{
+		fprintf(stderr, "out of memory\n");
+		return;
+	}
+
+	for ( i = 0; i <= max_id; i++ )
+		tallies[i].id = (uint32_t)i;
+
+	for ( i = 0; i < snap->header->block_count; i++ )
+	{
+		block = snapshot_block(snap, i);
+		tallies[block->thread_id].blocks++;
+		tallies[block->thread_id].bytes += block->size;
+	}
+
+	qsort(tallies, (size_t)max_id + 1, sizeof(struct tally), tally_compare);
+
+	printf(	"# Threads (by live bytes)\n"
+		"Thread      Live Bytes  Live Blocks\n");
+
+	for ( i = 0; i <= max_id && tallies[i].blocks != 0; i++ )
+	{
+		printf("%6u %15" PRIu64 " %12" PRIu64 "\n",
+		       tallies[i].id, tallies[i].bytes, tallies[i].blocks);
+	}
+
+	printf("\n");
+
+	free(tallies);
+}
+
+
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	struct snapshot	snap;
+	const char*	query = argc > 2 ? argv[2] : NULL;
+	int		ret = EXIT_SUCCESS;
+
+	if ( argc < 2 )
+	{
+		fprintf(stderr,
+			"Usage: %s <snapshot> [summary | sites [count] | sizes | ages | threads]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ( !snapshot_open(argv[1], &snap) )
+	{
+		snapshot_close(&snap);
+		return EXIT_FAILURE;
+	}
+
+	if ( query == NULL )
+	{
+		report_summary(&snap);
+		report_sites(&snap, DEFAULT_TOP_SITES);
+		report_sizes(&snap);
+		report_ages(&snap);
+		report_threads(&snap);
+	}
+	else if ( strcmp(query, "summary") == 0 )
+		report_summary(&snap);
+	else if ( strcmp(query, "sites") == 0 )
+		report_sites(&snap, argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : DEFAULT_TOP_SITES);
+	else if ( strcmp(query, "sizes") == 0 )
+		report_sizes(&snap);
+	else if ( strcmp(query, "ages") == 0 )
+		report_ages(&snap);
+	else if ( strcmp(query, "threads") == 0 )
+		report_threads(&snap);
+	else
+	{
+		fprintf(stderr, "Unknown query '%s'\n", query);
+		ret = EXIT_FAILURE;
+	}
+
+	snapshot_close(&snap);
+
+	return ret;
+}
@@ -0,0 +1,521 @@
+/**
+ * @file	memmgr_bench.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ * @brief	Microbenchmarks of the tracked allocation paths
+ *
+ * Measures the time per call of tracked_alloc(), tracked_free() and
+ * tracked_realloc() over a range of sizes, and of validate_memory() and
+ * output_memory_info() over a range of live block counts, for each context
+ * configuration (tracking mode, slabs, registry, sampling, stack capture, fill
+ * policy and redzones); plain malloc/free/realloc are measured alongside, and
+ * every tracked figure is also given as a multiple of the malloc one.
+ *
+ * Each case repeats batches until it has run for the time budget, and reports
+ * the mean; run on a quiet machine, and compare like with like.
+ *
+ * Usage: memmgr-bench [-f text|csv|json] [-t msec] [config ...]
+ */
+
+
+#include "tracked_memory.h"		// tracked_alloc, mem_context
+
+#include <stdio.h>			// printf
+#include <stdlib.h>			// malloc, free, strtoul
+#include <string.h>			// strcmp
+
+#if !defined(_WIN32)
+#	include <time.h>		// clock_gettime
+#endif
+
+
+// time each case runs for, by default, in milliseconds
+#define DEFAULT_BUDGET_MSEC	100
+// the most blocks held at once by a size case
+#define BATCH_BLOCKS		1024
+// the most bytes held at once by a size case
+#define BATCH_BYTES		(64 * 1024 * 1024)
+// the most live blocks output_memory_info() is measured with
+#define OUTPUT_MAX_BLOCKS	10000
+// where the trackers reports go; writing them is measured, keeping them isn't
+#if defined(_WIN32)
+#	define REPORT_PATH		"NUL"
+#else
+#	define REPORT_PATH		"/dev/null"
+#endif
+
+
+/**
+ * Output formats.
+ *
+ * @enum E_FORMAT
+ */
+enum E_FORMAT
+{
+	F_Text = 0,
+	F_Csv,
+	F_Json
+};
+
+
+/**
+ * A context configuration to measure; plain malloc is the first.
+ *
+ * @struct bench_config
+ */
+struct bench_config
+{
+	const char*	name;
+	bool		tracked;	/**< false for plain malloc */
+	bool		use_slab;
+	bool		use_registry;
+	uint32_t	sample_rate;
+	uint32_t	stack_depth;
+	enum E_FILL_POLICY	fill_policy;
+	uint32_t	redzone_size;
+	enum E_TRACKING_MODE	mode;
+};
+
+
+static const struct bench_config	configs[] = {
+	{ "malloc",	false,	false,	false,	0,	0,	FP_Full,	0,	TM_Full },
+	{ "off",	true,	false,	true,	0,	0,	FP_Full,	0,	TM_Off },
+	{ "counters",	true,	false,	true,	0,	0,	FP_Full,	0,	TM_Counters },
+	{ "tracked",	true,	false,	true,	0,	0,	FP_Full,	0,	TM_Full },
+	{ "slab",	true,	true,	true,	0,	0,	FP_Full,	0,	TM_Full },
+	{ "noregistry",	true,	false,	false,	0,	0,	FP_Full,	0,	TM_Full },
+	{ "sampled",	true,	false,	true,	65536,	0,	FP_Full,	0,	TM_Full },
+	{ "stacks",	true,	false,	true,	0,	16,	FP_Full,	0,	TM_Full },
+	{ "nofill",	true,	false,	true,	0,	0,	FP_None,	0,	TM_Full },
+	{ "fillbounds",	true,	false,	true,	0,	0,	FP_Bounds,	0,	TM_Full },
+	{ "fillprefix",	true,	false,	true,	0,	0,	FP_Prefix,	0,	TM_Full },
+	{ "fillsampled",	true,	false,	true,	0,	0,	FP_Sampled,	0,	TM_Full },
+	{ "redzone64",	true,	false,	true,	0,	0,	FP_Full,	64,	TM_Full }
+};
+
+#define CONFIG_COUNT	(sizeof(configs) / sizeof(configs[0]))
+
+static const uint32_t	sizes[] = {
+	8, 64, 512, 4096, 32768, 262144, 1048576
+};
+
+#define SIZE_COUNT	(sizeof(sizes) / sizeof(sizes[0]))
+
+static const uint32_t	list_sizes[] = {
+	100, 1000, 10000, 100000
+};
+
+#define LIST_SIZE_COUNT	(sizeof(list_sizes) / sizeof(list_sizes[0]))
+
+// the benchmarks of each size case
+static const char*	size_ops[] = { "alloc", "free", "realloc_grow", "realloc_shrink" };
+
+#define SIZE_OP_COUNT	(sizeof(size_ops) / sizeof(size_ops[0]))
+
+
+static enum E_FORMAT		format = F_Text;
+static uint64_t			budget_nsec = DEFAULT_BUDGET_MSEC * 1000000ull;
+static struct mem_context	context;
+static void*			blocks[BATCH_BLOCKS];
+static uint32_t			results_written = 0;
+/** malloc timings of each size case, for the ratios */
+static double			malloc_nsec[SIZE_OP_COUNT][SIZE_COUNT];
+
+
+
+/**
+ * Reads a monotonic clock.
+ *
+ * @return The time, in nanoseconds
+ */
+static uint64_t
+clock_nsec(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER	freq;
+	LARGE_INTEGER	now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+
+	return ((uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000) +
+		((uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart);
+#else
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+
+/**
+ * Writes a single result, in the chosen format.
+ *
+ * @param[in] benchmark The function measured
+ * @param[in] config The configuration measured
+ * @param[in] size The block size, or 0 if not applicable
+ * @param[in] live The live blocks at the time, or 0 if not applicable
+ * @param[in] ops The number of calls timed
+ * @param[in] nsec The mean time per call
+ * @param[in] ratio The time per call as a multiple of malloc (1 for malloc
+ * itself), or 0 if there is no malloc equivalent; the field is then left
+ * empty in csv, and null in json
+ */
+static void
+print_result(
+	const char* benchmark,
+	const char* config,
+	const uint32_t size,
+	const uint32_t live,
+	const uint64_t ops,
+	const double nsec,
+	const double ratio
+)
+{
+	switch ( format )
+	{
+	case F_Csv:
+		if ( results_written == 0 )
+			printf("benchmark,config,size,live_blocks,ops,ns_per_op,vs_malloc\n");
+		printf("%s,%s,%u,%u,%" PRIu64 ",%.2f,",
+			benchmark, config, size, live, ops, nsec);
+		if ( ratio != 0.0 )
+			printf("%.3f", ratio);
+		printf("\n");
+		break;
+	case F_Json:
+		printf("%s\n  {\"benchmark\": \"%s\", \"config\": \"%s\", \"size\": %u, \"live_blocks\": %u, "
+			"\"ops\": %" PRIu64 ", \"ns_per_op\": %.2f, \"vs_malloc\": ",
+			results_written == 0 ? "[" : ",",
+			benchmark, config, size, live, ops, nsec);
+		if ( ratio != 0.0 )
+			printf("%.3f}", ratio);
+		else
+			printf("null}");
+		break;
+	default:
+		if ( results_written == 0 )
+		{
+			printf("Benchmark           Config              Size   Live Blocks           Ops      ns/op  vs malloc\n");
+		}
+		printf("%-19s %-12s %11u %13u %13" PRIu64 " %10.1f",
+			benchmark, config, size, live, ops, nsec);
+		if ( ratio != 0.0 )
+			printf(" %9.2fx", ratio);
+		printf("\n");
+		break;
+	}
+
+	results_written++;
+}
+
+
+
+/**
+ * Allocates a block with the configuration being measured.
+ *
+ * @param[in] config The configuration being measured
+ * @param[in] size The size to allocate
+ * @return The block, or NULL on failure
+ */
+static void*
+bench_alloc(
+	const struct bench_config* config,
+	const uint32_t size
+)
+{
+	if ( !config->tracked )
+		return malloc(size);
+
+	return tracked_alloc(&context, size, MEM_SITE());
+}
+
+
+
+/**
+ * Reallocates a block with the configuration being measured.
+ *
+ * @param[in] config The configuration being measured
+ * @param[in] memory The block to reallocate
+ * @param[in] size The new size
+ * @return The block, or NULL on failure
+ */
+static void*
+bench_realloc(
+	const struct bench_config* config,
+	void* memory,
+	const uint32_t size
+)
+{
+	if ( !config->tracked )
+		return realloc(memory, size);
+
+	return tracked_realloc(&context, memory, size, MEM_SITE());
+}
+
+
+
+/**
+ * Frees a block with the configuration being measured.
+ *
+ * @param[in] config The configuration being measured
+ * @param[in] memory The block to free
+ */
+static void
+bench_free(
+	const struct bench_config* config,
+	void* memory
+)
+{
+	if ( !config->tracked )
+		free(memory);
+	else
+		tracked_free(&context, memory);
+}
+
+
+
+/**
+ * Measures alloc, free and realloc of a single size; each batch allocates a
+ * set of blocks, grows each by half, shrinks them back, then frees them, with
+ * each phase timed apart.
+ *
+ * @param[in] config The configuration to measure
+ * @param[in] config_index The index of the configuration
+ * @param[in] size_index The index of the size to measure
+ */
+static void
+bench_size(
+	const struct bench_config* config,
+	const uint32_t config_index,
+	const uint32_t size_index
+)
+{
+	uint32_t	size = sizes[size_index];
+	uint32_t	count = BATCH_BYTES / size;
+	uint64_t	elapsed[SIZE_OP_COUNT] = { 0, 0, 0, 0 };
+	uint64_t	total = 0;
+	uint64_t	ops = 0;
+	uint64_t	start;
+	double		nsec;
+	uint32_t	i;
+
+	if ( count > BATCH_BLOCKS )
+		count = BATCH_BLOCKS;
+
+	while ( total < budget_nsec )
+	{
+		start = clock_nsec();
+		for ( i = 0; i < count; i++ )
+			blocks[i] = bench_alloc(config, size);
+		elapsed[0] += clock_nsec() - start;
+
+		start = clock_nsec();
+		for ( i = 0; i < count; i++ )
+			blocks[i] = bench_realloc(config, blocks[i], size + size / 2);
+		elapsed[2] += clock_nsec() - start;
+
+		start = clock_nsec();
+		for ( i = 0; i < count; i++ )
+			blocks[i] = bench_realloc(config, blocks[i], size);
+		elapsed[3] += clock_nsec() - start;
+
+		start = clock_nsec();
+		for ( i = 0; i < count; i++ )
+			bench_free(config, blocks[i]);
+		elapsed[1] += clock_nsec() - start;
+
+		total = elapsed[0] + elapsed[1] + elapsed[2] + elapsed[3];
+		ops += count;
+	}
+
+	for ( i = 0; i < SIZE_OP_COUNT; i++ )
+	{
+		nsec = (double)elapsed[i] / (double)ops;
+
+		if ( config_index == 0 )
+			malloc_nsec[i][size_index] = nsec;
+
+		// malloc itself comes out at 1
+		print_result(size_ops[i], config->name, size, 0, ops, nsec,
+			     malloc_nsec[i][size_index] == 0.0 ? 0.0 : nsec / malloc_nsec[i][size_index]);
+	}
+}
+
+
+
+/**
+ * Measures validate_memory(), of every block and of a single one, and
+ * output_memory_info(), with a number of live blocks.
+ *
+ * output_memory_info() releases every block it reports, so the list is
+ * rebuilt, untimed, before each call to it; and it is only measured up to
+ * OUTPUT_MAX_BLOCKS, as it writes every block out.
+ *
+ * @param[in] config The configuration to measure; must be tracked
+ * @param[in] live The number of blocks to have live
+ */
+static void
+bench_list(
+	const struct bench_config* config,
+	const uint32_t live
+)
+{
+	void**		list;
+	uint64_t	calls;
+	uint64_t	start;
+	uint64_t	elapsed;
+	uint32_t	i;
+
+	if (( list = (void**)malloc(live * sizeof(void*))) == NULL )
+		return;
+
+	for ( i = 0; i < live; i++ )
+		list[i] = bench_alloc(config, 64);
+
+	for ( calls = 0, elapsed = 0; elapsed < budget_nsec; calls++ )
+	{
+		start = clock_nsec();
+		validate_memory(&context, NULL);
+		elapsed += clock_nsec() - start;
+	}
+	print_result("validate_all", config->name, 64, live, calls, (double)elapsed / (double)calls, 0.0);
+
+	for ( calls = 0, elapsed = 0; elapsed < budget_nsec; calls += live )
+	{
+		start = clock_nsec();
+		for ( i = 0; i < live; i++ )
+			validate_memory(&context, list[i]);
+		elapsed += clock_nsec() - start;
+	}
+	print_result("validate_one", config->name, 64, live, calls, (double)elapsed / (double)calls, 0.0);
+
+	if ( live > OUTPUT_MAX_BLOCKS )
+	{
+		for ( i = 0; i < live; i++ )
+			bench_free(config, list[i]);
+		free(list);
+		return;
+	}
+
+	// writes MEM_LEAK_LOG_NAME every time; always at least once
+	for ( calls = 0, elapsed = 0; elapsed < budget_nsec || calls == 0; calls++ )
+	{
+		if ( calls != 0 )
+		{
+			for ( i = 0; i < live; i++ )
+				list[i] = bench_alloc(config, 64);
+		}
+
+		start = clock_nsec();
+		output_memory_info(&context);
+		elapsed += clock_nsec() - start;
+	}
+	print_result("output_memory_info", config->name, 64, live, calls, (double)elapsed / (double)calls, 0.0);
+
+	free(list);
+}
+
+
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	const struct bench_config*	config;
+	bool		wanted[CONFIG_COUNT];
+	uint32_t	selected = 0;
+	uint32_t	c;
+	uint32_t	i;
+	int		arg;
+
+	memset(wanted, 0, sizeof(wanted));
+
+	for ( arg = 1; arg < argc; arg++ )
+	{
+		if ( strcmp(argv[arg], "-f") == 0 && arg + 1 < argc )
+		{
+			arg++;
+			if ( strcmp(argv[arg], "csv") == 0 )
+				format = F_Csv;
+			else if ( strcmp(argv[arg], "json") == 0 )
+				format = F_Json;
+			else if ( strcmp(argv[arg], "text") == 0 )
+				format = F_Text;
+			else
+				goto usage;
+			continue;
+		}
+		if ( strcmp(argv[arg], "-t") == 0 && arg + 1 < argc )
+		{
+			budget_nsec = strtoul(argv[++arg], NULL, 10) * 1000000ull;
+			continue;
+		}
+
+		for ( c = 0; c < CONFIG_COUNT; c++ )
+		{
+			if ( strcmp(argv[arg], configs[c].name) == 0 )
+				break;
+		}
+		if ( c == CONFIG_COUNT )
+			goto usage;
+
+		wanted[c] = true;
+		selected++;
+	}
+
+	// malloc always runs, as every ratio is relative to it
+	wanted[0] = true;
+
+	for ( c = 0; c < CONFIG_COUNT; c++ )
+	{
+		if ( selected != 0 && !wanted[c] )
+			continue;
+
+		config = &configs[c];
+
+		if ( config->tracked )
+		{
+			mem_context_init(&context);
+			context.options.use_slab	= config->use_slab;
+			context.options.use_registry	= config->use_registry;
+			context.options.sample_rate	= config->sample_rate;
+			context.options.stack_depth	= config->stack_depth;
+			context.options.fill_policy	= config->fill_policy;
+			context.options.redzone_size	= config->redzone_size;
+			context.options.mode		= config->mode;
+			context.options.report_path	= REPORT_PATH;
+		}
+
+		for ( i = 0; i < SIZE_COUNT; i++ )
+			bench_size(config, c, i);
+
+		if ( config->tracked )
+		{
+			for ( i = 0; i < LIST_SIZE_COUNT; i++ )
+				bench_list(config, list_sizes[i]);
+
+			mem_context_destroy(&context);
+		}
+	}
+
+	if ( format == F_Json )
+		printf("%s]\n", results_written == 0 ? "[" : "\n");
+
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-f text|csv|json] [-t msec] [config ...]\n"
+			"Configurations:", argv[0]);
+	for ( c = 0; c < CONFIG_COUNT; c++ )
+		fprintf(stderr, " %s", configs[c].name);
+	fprintf(stderr, "\n");
+
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,556 @@
+/**
+ * @file	memmgr_preload.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ * @brief	LD_PRELOAD interposer, tracking every allocation in a process
+ *
+ * Built as libmemmgr-preload.so; replaces malloc, calloc, realloc, free,
+ * posix_memalign, aligned_alloc, memalign and malloc_usable_size, routing them
+ * through g_mem_ctx, so allocations made by libraries (libc's own included)
+ * are tracked without recompiling anything:
+ @code
+ MEMMGR_OPTIONS=mode=counters LD_PRELOAD=./libmemmgr-preload.so ./program
+ @endcode
+ * The site of each block is the address malloc returned to; it is named after
+ * the function containing it, from the dynamic symbol table, with the offset
+ * into that function as the line. Its file is the object it was loaded from;
+ * functions that aren't exported are named "??", with the offset into the
+ * object as the line instead.
+ *
+ * Anything the tracker allocates for itself goes straight to the system
+ * allocator, as does everything allocated before the context is initialized
+ * by this librarys constructor; such blocks are told apart when freed, so a
+ * block can be freed by whichever is current. Only 64 KiB can be allocated
+ * before the system allocator has even been looked up, which the dynamic
+ * linker needs to do so.
+ *
+ * The report is written at exit, to mem_options.report_path, but the blocks
+ * are left as they are; other libraries may still free them, or use them.
+ *
+ * Adding publish=msec to MEMMGR_OPTIONS publishes the stats while the process
+ * runs, for memmgr-top; a whole host can be watched at once with:
+ @code
+ export MEMMGR_OPTIONS=mode=counters,publish=1000 LD_PRELOAD=./libmemmgr-preload.so
+ @endcode
+ *
+ * Only for ELF systems with a dynamic linker supporting RTLD_NEXT.
+ */
+
+
+#if defined(_WIN32)
+#	error "interposition needs LD_PRELOAD; not available on Windows"
+#endif
+
+#include "tracked_memory.h"		// tracked_alloc, g_mem_ctx
+#include "mem_atomic.h"			// start-up state, site table
+
+#include <dlfcn.h>			// dlsym, dladdr
+#include <errno.h>			// ENOMEM, EINVAL
+#include <string.h>			// memcpy, strdup
+
+
+// bytes that can be allocated before the system allocator is found
+#define BOOTSTRAP_SIZE		(64 * 1024)
+// return addresses given a site of their own; must be a power of 2
+#define SITE_SLOTS		(16 * 1024)
+// start-up states; each is only ever moved on to the next
+#define STATE_UNRESOLVED	0	/**< System allocator not looked up */
+#define STATE_RESOLVING		1	/**< Being looked up; bootstrap in use */
+#define STATE_RESOLVED		2	/**< System allocator usable */
+#define STATE_READY		3	/**< g_mem_ctx initialized; tracking */
+
+
+/**
+ * A return address given a site; the address is set last, so a slot with an
+ * address has a usable site.
+ *
+ * @struct preload_site
+ */
+struct preload_site
+{
+	void*			address;	/**< The return address */
+	struct mem_site*	site;		/**< Its site, from mem_site_intern() */
+};
+
+
+/** The system allocators functions, found by dlsym(RTLD_NEXT) */
+static void*	(*real_malloc)(size_t);
+static void*	(*real_calloc)(size_t, size_t);
+static void*	(*real_realloc)(void*, size_t);
+static void	(*real_free)(void*);
+static int	(*real_posix_memalign)(void**, size_t, size_t);
+static size_t	(*real_malloc_usable_size)(void*);
+
+/** One of the STATE_ definitions */
+static uint32_t			preload_state = STATE_UNRESOLVED;
+
+/** Set while this thread is in the tracker; its allocations are its own */
+static __thread uint32_t	preload_busy __attribute__((tls_model("initial-exec")));
+
+/** Memory handed out while the system allocator is being looked up */
+static uint8_t			bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+/** Bytes of bootstrap handed out so far */
+static uint64_t			bootstrap_used;
+
+/** Sites by return address; open-addressing, never removed from */
+static struct preload_site	site_slots[SITE_SLOTS];
+/** Serializes adding to site_slots; lookups are done without it */
+static pthread_mutex_t		site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/**
+ * Allocates from the bootstrap buffer, which is never released; each block is
+ * preceded by its size, for realloc.
+ *
+ * @param[in] num_bytes The number of bytes needed
+ * @return The memory, zeroed, or NULL if the buffer is exhausted
+ */
+static void*
+bootstrap_alloc(
+	const size_t num_bytes
+)
+{
+	uint64_t	offset;
+	size_t		length;
+
+	if ( num_bytes > BOOTSTRAP_SIZE )
+		return NULL;
+
+	// keep every block aligned as malloc would
+	length = 16 + ((num_bytes + 15) & ~(size_t)15);
+	offset = mem_atomic_add_fetch64(&bootstrap_used, length) - length;
+	if ( offset + length > BOOTSTRAP_SIZE )
+		return NULL;
+
+	*(size_t*)(bootstrap + offset) = num_bytes;
+	return bootstrap + offset + 16;
+}
+
+
+
+/**
+ * Checks if memory is from bootstrap_alloc().
+ *
+ * @param[in] memory The memory to check
+ * @retval true if it is
+ * @retval false if it is not
+ */
+static bool
+is_bootstrap(
+	void* memory
+)
+{
+	return (uint8_t*)memory >= bootstrap && (uint8_t*)memory < bootstrap + BOOTSTRAP_SIZE;
+}
+
+
+
+/**
+ * Looks up the system allocator, if not yet done. The dynamic linker may
+ * allocate while doing so; such allocations come from the bootstrap buffer.
+ *
+ * @retval true if the system allocator is usable
+ * @retval false if it is still being looked up, by this thread or another
+ */
+static bool
+preload_resolve(void)
+{
+	if ( mem_atomic_load32(&preload_state) >= STATE_RESOLVED )
+		return true;
+
+	if ( !mem_atomic_cas32(&preload_state, STATE_UNRESOLVED, STATE_RESOLVING) )
+		return false;
+
+	real_malloc		= (void* (*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	real_calloc		= (void* (*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+	real_realloc		= (void* (*)(void*, size_t))dlsym(RTLD_NEXT, "realloc");
+	real_free		= (void (*)(void*))dlsym(RTLD_NEXT, "free");
+	real_posix_memalign	= (int (*)(void**, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+	real_malloc_usable_size	= (size_t (*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+
+	mem_atomic_store32(&preload_state, STATE_RESOLVED);
+	return true;
+}
+
+
+
+/**
+ * Checks if an allocation is to be tracked; not if made by the tracker
+ * itself, or before the context is ready.
+ *
+ * @retval true if it is to be tracked
+ * @retval false if it is for the system allocator
+ */
+static bool
+preload_tracking(void)
+{
+	return preload_busy == 0 && mem_atomic_load32_acquire(&preload_state) == STATE_READY;
+}
+
+
+
+/**
+ * Obtains the site for a return address, creating it on first use.
+ *
+ * @param[in] address The address malloc returned to
+ * @return The site, or NULL if the table is full (the block is then tracked
+ * against the unknown site)
+ */
+static struct mem_site*
+preload_site(
+	void* address
+)
+{
+	struct preload_site*	slot;
+	Dl_info			info;
+	const char*		function = "??";
+	const char*		file = "??";
+	uint32_t		offset = 0;
+	uint32_t		i = (uint32_t)(((uintptr_t)address >> 4) * 0x9E3779B1u) & (SITE_SLOTS - 1);
+	uint32_t		probes;
+
+	for ( probes = 0; probes < SITE_SLOTS; probes++, i = (i + 1) & (SITE_SLOTS - 1) )
+	{
+		slot = &site_slots[i];
+
+		if ( mem_atomic_load_ptr(&slot->address) == address )
+			return slot->site;
+
+		if ( mem_atomic_load_ptr(&slot->address) != NULL )
+			continue;
+
+		pthread_mutex_lock(&site_lock);
+
+		// another thread may have filled it meanwhile
+		if ( slot->address == NULL )
+		{
+			if ( dladdr(address, &info) != 0 )
+			{
+				if ( info.dli_fname != NULL )
+					file = info.dli_fname;
+				if ( info.dli_sname != NULL )
+				{
+					function = info.dli_sname;
+					offset = (uint32_t)((uint8_t*)address - (uint8_t*)info.dli_saddr);
+				}
+				else
+				{
+					offset = (uint32_t)((uint8_t*)address - (uint8_t*)info.dli_fbase);
+				}
+			}
+
+			/* the names are copied, as the object they're in may
+			 * be unloaded before the report is written */
+			if (( file = strdup(file)) != NULL && (function = strdup(function)) != NULL )
+				slot->site = mem_site_intern(file, function, offset);
+			mem_atomic_store_ptr(&slot->address, address);
+		}
+
+		pthread_mutex_unlock(&site_lock);
+
+		if ( slot->address == address )
+			return slot->site;
+	}
+
+	return NULL;
+}
+
+
+
+/**
+ * Initializes the context, before main() (and the constructors of anything
+ * loaded after this library); until then, nothing is tracked.
+ */
+__attribute__((constructor))
+static void
+preload_init(void)
+{
+	preload_resolve();
+
+	preload_busy = 1;
+	mem_context_init(&g_mem_ctx);
+
+	/* without the registry, telling our blocks from the system allocators
+	 * would mean reading memory that may not be there */
+	if ( !g_mem_ctx.options.use_registry && g_mem_ctx.options.mode == TM_Full )
+		g_mem_ctx.options.mode = TM_Off;
+	preload_busy = 0;
+
+	mem_atomic_store32_release(&preload_state, STATE_READY);
+}
+
+
+
+/**
+ * Writes the report at exit, and removes any published stats page;
+ * everything stays tracked, and allocated, as there's no knowing what may
+ * still be freed after.
+ */
+__attribute__((destructor))
+static void
+preload_fini(void)
+{
+	if ( mem_atomic_load32(&preload_state) != STATE_READY )
+		return;
+
+	preload_busy = 1;
+	mem_publish_stop(&g_mem_ctx);
+	// nothing was tracked to report on
+	if ( g_mem_ctx.options.mode != TM_Off )
+		mem_context_report(&g_mem_ctx);
+	preload_busy = 0;
+}
+
+
+
+void*
+malloc(
+	size_t num_bytes
+)
+{
+	void*	memory;
+
+	if ( !preload_tracking() )
+	{
+		if ( !preload_resolve() )
+			return bootstrap_alloc(num_bytes);
+		return real_malloc(num_bytes);
+	}
+
+	preload_busy = 1;
+	if (( memory = tracked_alloc(&g_mem_ctx, num_bytes, preload_site(__builtin_return_address(0)))) == NULL )
+		errno = ENOMEM;
+	preload_busy = 0;
+
+	return memory;
+}
+
+
+
+void*
+calloc(
+	size_t count,
+	size_t size
+)
+{
+	void*	memory;
+
+	if ( !preload_tracking() )
+	{
+		// the bootstrap buffer is never reused, so is already zeroed
+		if ( !preload_resolve() )
+			return (size != 0 && count > SIZE_MAX / size) ? NULL : bootstrap_alloc(count * size);
+		return real_calloc(count, size);
+	}
+
+	preload_busy = 1;
+	if (( memory = tracked_calloc(&g_mem_ctx, count, size, preload_site(__builtin_return_address(0)))) == NULL )
+		errno = ENOMEM;
+	preload_busy = 0;
+
+	return memory;
+}
+
+
+
+void
+free(
+	void* memory
+)
+{
+	if ( memory == NULL || is_bootstrap(memory) )
+		return;
+
+	/* whatever isn't ours came from the system allocator; this includes
+	 * blocks allocated before tracking started */
+	if ( preload_tracking() )
+	{
+		preload_busy = 1;
+		if ( mem_context_owns(&g_mem_ctx, memory, NULL) )
+		{
+			tracked_free(&g_mem_ctx, memory);
+			preload_busy = 0;
+			return;
+		}
+		preload_busy = 0;
+	}
+
+	preload_resolve();
+	real_free(memory);
+}
+
+
+
+void*
+realloc(
+	void* memory,
+	size_t num_bytes
+)
+{
+	void*	resized;
+	size_t	old_num_bytes;
+
+	if ( memory != NULL && is_bootstrap(memory) )
+	{
+		// never released; just copied out of
+		old_num_bytes = *(size_t*)((uint8_t*)memory - 16);
+		if (( resized = malloc(num_bytes)) != NULL )
+			memcpy(resized, memory, old_num_bytes < num_bytes ? old_num_bytes : num_bytes);
+		return resized;
+	}
+
+	if ( !preload_tracking() )
+	{
+		if ( !preload_resolve() )
+			return bootstrap_alloc(num_bytes);
+		return real_realloc(memory, num_bytes);
+	}
+
+	preload_busy = 1;
+	if ( memory == NULL || mem_context_owns(&g_mem_ctx, memory, NULL) )
+	{
+		resized = tracked_realloc(&g_mem_ctx, memory, num_bytes, preload_site(__builtin_return_address(0)));
+		if ( resized == NULL && num_bytes != 0 )
+			errno = ENOMEM;
+	}
+	else
+	{
+		// allocated before tracking started; it stays the systems
+		resized = real_realloc(memory, num_bytes);
+	}
+	preload_busy = 0;
+
+	return resized;
+}
+
+
+
+/**
+ * Performs an aligned allocation, for each of the aligned allocators.
+ *
+ * @param[out] memory Set to the memory allocated, or NULL if none was
+ * @param[in] alignment The alignment needed; a power of 2
+ * @param[in] num_bytes The number of bytes needed
+ * @param[in] address The address the aligned allocator returned to
+ * @return 0 on success, otherwise ENOMEM
+ */
+static int
+preload_aligned(
+	void** memory,
+	const size_t alignment,
+	const size_t num_bytes,
+	void* address
+)
+{
+	// beyond what a header can describe, the system has to do it
+	if ( !preload_tracking() || alignment > MEM_ALIGNMENT_MAX )
+	{
+		if ( !preload_resolve() )
+			return (*memory = alignment <= 16 ? bootstrap_alloc(num_bytes) : NULL) == NULL ? ENOMEM : 0;
+		return real_posix_memalign(memory, alignment < sizeof(void*) ? sizeof(void*) : alignment, num_bytes);
+	}
+
+	preload_busy = 1;
+	*memory = tracked_aligned_alloc(&g_mem_ctx, (uint32_t)alignment, num_bytes, preload_site(address));
+	preload_busy = 0;
+
+	return *memory == NULL ? ENOMEM : 0;
+}
+
+
+
+int
+posix_memalign(
+	void** memory,
+	size_t alignment,
+	size_t num_bytes
+)
+{
+	if ( alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void*) != 0 )
+		return EINVAL;
+
+	return preload_aligned(memory, alignment, num_bytes, __builtin_return_address(0));
+}
+
+
+
+void*
+aligned_alloc(
+	size_t alignment,
+	size_t num_bytes
+)
+{
+	void*	memory;
+	int	error;
+
+	if ( alignment == 0 || (alignment & (alignment - 1)) != 0 )
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (( error = preload_aligned(&memory, alignment, num_bytes, __builtin_return_address(0))) != 0 )
+	{
+		errno = error;
+		return NULL;
+	}
+
+	return memory;
+}
+
+
+
+void*
+memalign(
+	size_t alignment,
+	size_t num_bytes
+)
+{
+	void*	memory;
+	int	error;
+
+	if ( alignment == 0 || (alignment & (alignment - 1)) != 0 )
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (( error = preload_aligned(&memory, alignment, num_bytes, __builtin_return_address(0))) != 0 )
+	{
+		errno = error;
+		return NULL;
+	}
+
+	return memory;
+}
+
+
+
+size_t
+malloc_usable_size(
+	void* memory
+)
+{
+	size_t	num_bytes = 0;
+	bool	owned = false;
+
+	if ( memory == NULL )
+		return 0;
+	if ( is_bootstrap(memory) )
+		return *(size_t*)((uint8_t*)memory - 16);
+
+	// the system allocator would misread the header as its own
+	if ( preload_tracking() )
+	{
+		preload_busy = 1;
+		owned = mem_context_owns(&g_mem_ctx, memory, &num_bytes);
+		preload_busy = 0;
+	}
+	if ( owned )
+		return num_bytes;
+
+	preload_resolve();
+	return real_malloc_usable_size != NULL ? real_malloc_usable_size(memory) : 0;
+}
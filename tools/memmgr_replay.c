@@ -0,0 +1,1278 @@
+
+/**
+ * @file	memmgr_replay.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ * @brief	Replays allocation traces, to measure what tracking costs
+ *
+ * Reads a trace written while mem_trace_start() was running, and replays it
+ * against plain malloc/free and the tracker in a number of configurations,
+ * reporting the throughput, latency percentiles and peak RSS of each.
+ *
+ * Every traced thread is replayed by a thread of its own. Each op runs as
+ * soon as its thread gets to it, except that a free (or realloc) of a block
+ * waits until the allocation it refers to has been replayed, wherever that
+ * was; the order between threads is only as strict as the program's own was.
+ *
+ * Each configuration runs in a child process, on POSIX, so the peak RSS is
+ * its own; on Windows they run in turn, and the peak only ever grows.
+ *
+ * Usage: memmgr-replay <trace> [-r repeats] [config ...]
+ */
+
+
+#include "tracked_memory.h"		// tracked_alloc, mem_context
+#include "mem_atomic.h"			// slot hand-over between threads
+#include "mem_trace.h"			// file format
+
+#include <stdio.h>			// printf, fopen
+#include <stdlib.h>			// malloc, calloc, free
+#include <string.h>			// memcmp, strcmp
+
+#if defined(_WIN32)
+#	include <Psapi.h>		// GetProcessMemoryInfo
+#else
+#	include <sched.h>		// sched_yield
+#	include <sys/resource.h>	// getrusage
+#	include <sys/wait.h>		// waitpid
+#	include <time.h>		// clock_gettime
+#	include <unistd.h>		// fork, pipe
+#endif
+
+
+// ops between each latency measurement; timing every op would distort them
+#define LATENCY_INTERVAL	16
+// exact buckets for latencies below this, in nanoseconds
+#define LATENCY_LINEAR		64
+// buckets per power of 2 above LATENCY_LINEAR
+#define LATENCY_SUB_BUCKETS	32
+// total latency buckets; enough for anything up to 2^40 nanoseconds
+#define LATENCY_BUCKETS		(LATENCY_LINEAR + 34 * LATENCY_SUB_BUCKETS)
+// the most threads a trace can have
+#define MAX_THREADS		256
+// a slot that has not been allocated yet
+#define SLOT_NONE		UINT32_MAX
+// where the trackers reports go; only the replay itself is of interest
+#if defined(_WIN32)
+#	define REPORT_PATH		"NUL"
+#else
+#	define REPORT_PATH		"/dev/null"
+#endif
+
+
+/**
+ * An op to replay. Blocks are identified by slot, one per allocation in the
+ * trace, rather than address; an address can be reused, a slot never is.
+ *
+ * @struct replay_op
+ */
+struct replay_op
+{
+	uint64_t	size;		/**< The size requested */
+	uint32_t	op;		/**< One of the MEM_TRACE_OP_ values */
+	uint32_t	slot;		/**< The block allocated or freed */
+	uint32_t	old_slot;	/**< The block reallocated from */
+	uint32_t	site_id;	/**< The site of the allocation */
+};
+
+
+/**
+ * An event as decoded from the trace, before addresses are resolved.
+ *
+ * @struct trace_event
+ */
+struct trace_event
+{
+	uint64_t	time_usec;
+	uint64_t	address;
+	uint64_t	old_address;
+	uint64_t	size;
+	uint32_t	op;
+	uint32_t	site_id;
+};
+
+
+/**
+ * Everything about one traced thread.
+ *
+ * @struct replay_thread
+ */
+struct replay_thread
+{
+	uint32_t		thread_id;	/**< The shard id in the trace */
+
+	struct trace_event*	events;		/**< Decoded events; freed once resolved */
+	size_t			event_count;
+	size_t			event_capacity;
+
+	struct replay_op*	ops;		/**< The ops to replay, in order */
+	size_t			op_count;
+
+	/** Results of the current run */
+	uint64_t		latency[LATENCY_BUCKETS];
+
+#if defined(_WIN32)
+	HANDLE			handle;
+#else
+	pthread_t		handle;
+#endif
+};
+
+
+/**
+ * A loaded trace.
+ *
+ * @struct replay_trace
+ */
+struct replay_trace
+{
+	struct replay_thread	threads[MAX_THREADS];
+	uint32_t		thread_count;
+
+	/** Sites, indexed by the site id in the trace */
+	struct mem_site*	sites;
+	uint32_t		site_count;
+
+	uint32_t	slot_count;	/**< Allocations in the trace */
+	uint64_t	allocs;
+	uint64_t	frees;
+	uint64_t	reallocs;
+	uint64_t	dropped;	/**< Events the program dropped */
+	uint64_t	unmatched;	/**< Frees of blocks from before the trace */
+	uint64_t	conflicts;	/**< Allocations of addresses still live */
+};
+
+
+/**
+ * A way of allocating to replay against.
+ *
+ * @struct replay_config
+ */
+struct replay_config
+{
+	const char*	name;
+	bool		tracked;	/**< false for plain malloc */
+	bool		use_slab;
+	bool		use_registry;
+	uint32_t	sample_rate;
+	uint32_t	stack_depth;
+};
+
+
+/**
+ * Outcome of replaying a trace with one configuration.
+ *
+ * @struct replay_result
+ */
+struct replay_result
+{
+	uint64_t	elapsed_nsec;
+	uint64_t	percentiles[5];	/**< p50, p90, p99, p99.9, max */
+	uint64_t	rss_kib;	/**< Peak RSS growth over the replay */
+	bool		ok;
+};
+
+
+static const struct replay_config	configs[] = {
+	{ "malloc",	false,	false,	false,	0,	0 },
+	{ "tracked",	true,	false,	true,	0,	0 },
+	{ "slab",	true,	true,	true,	0,	0 },
+	{ "noregistry",	true,	false,	false,	0,	0 },
+	{ "sampled",	true,	false,	true,	65536,	0 },
+	{ "stacks",	true,	false,	true,	0,	16 }
+};
+
+static const double	percentiles[5] = { 50.0, 90.0, 99.0, 99.9, 100.0 };
+
+
+// state of the run in progress, shared by every replay thread
+static struct replay_trace	trace;
+static const struct replay_config*	run_config;
+static struct mem_context	run_context;
+static void**			run_slots;
+static uint32_t			run_started;
+
+
+
+/**
+ * Reads a monotonic clock.
+ *
+ * @return The time, in nanoseconds
+ */
+static uint64_t
+clock_nsec(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER	freq;
+	LARGE_INTEGER	now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+
+	return ((uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000) +
+		((uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart);
+#else
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+
+/**
+ * Yields the processor, while waiting on another thread.
+ */
+static void
+yield(void)
+{
+#if defined(_WIN32)
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+
+
+/**
+ * Obtains the latency bucket a duration falls in.
+ *
+ * @param[in] nsec The duration
+ * @return The bucket index
+ */
+static uint32_t
+latency_bucket(
+	const uint64_t nsec
+)
+{
+	uint32_t	exponent = 63;
+
+	if ( nsec < LATENCY_LINEAR )
+		return (uint32_t)nsec;
+
+	while ( (nsec >> exponent) == 0 )
+		exponent--;
+
+	// 2^6 is LATENCY_LINEAR, and 2^5 LATENCY_SUB_BUCKETS
+	if ( exponent >= 6 + 34 )
+		return LATENCY_BUCKETS - 1;
+
+	return LATENCY_LINEAR + (exponent - 6) * LATENCY_SUB_BUCKETS +
+		(uint32_t)((nsec >> (exponent - 5)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+
+
+/**
+ * Obtains the smallest duration that falls in a latency bucket.
+ *
+ * @param[in] bucket The bucket index
+ * @return The duration, in nanoseconds
+ */
+static uint64_t
+latency_value(
+	const uint32_t bucket
+)
+{
+	uint32_t	exponent;
+
+	if ( bucket < LATENCY_LINEAR )
+		return bucket;
+
+	exponent = 6 + (bucket - LATENCY_LINEAR) / LATENCY_SUB_BUCKETS;
+
+	return ((uint64_t)1 << exponent) +
+		((uint64_t)((bucket - LATENCY_LINEAR) % LATENCY_SUB_BUCKETS) << (exponent - 5));
+}
+
+
+
+/**
+ * Decodes a varint.
+ *
+ * @param[in,out] pos The position to decode from; moved past the varint
+ * @param[in] end The end of the data
+ * @param[out] value The decoded value
+ * @retval true if a complete varint was decoded
+ * @retval false if the data ended first
+ */
+static bool
+decode_varint(
+	const uint8_t** pos,
+	const uint8_t* end,
+	uint64_t* value
+)
+{
+	uint32_t	shift = 0;
+
+	*value = 0;
+
+	while ( *pos < end && shift < 64 )
+	{
+		*value |= (uint64_t)(**pos & 0x7F) << shift;
+		shift += 7;
+
+		if ( (*(*pos)++ & 0x80) == 0 )
+			return true;
+	}
+
+	return false;
+}
+
+
+
+/**
+ * Decodes a zigzag varint, applying it as a difference.
+ *
+ * @param[in,out] pos The position to decode from; moved past the varint
+ * @param[in] end The end of the data
+ * @param[in] from The value the difference is from
+ * @param[out] value The resulting value
+ * @retval true if a complete varint was decoded
+ * @retval false if the data ended first
+ */
+static bool
+decode_zigzag(
+	const uint8_t** pos,
+	const uint8_t* end,
+	const uint64_t from,
+	uint64_t* value
+)
+{
+	uint64_t	encoded;
+
+	if ( !decode_varint(pos, end, &encoded) )
+		return false;
+
+	*value = from + ((encoded >> 1) ^ (0 - (encoded & 1)));
+
+	return true;
+}
+
+
+
+/**
+ * Obtains the thread for a thread id, adding it if not yet seen.
+ *
+ * @param[in] thread_id The shard id from the trace
+ * @return The thread, or NULL if there are too many
+ */
+static struct replay_thread*
+trace_thread(
+	const uint32_t thread_id
+)
+{
+	uint32_t	i;
+
+	for ( i = 0; i < trace.thread_count; i++ )
+	{
+		if ( trace.threads[i].thread_id == thread_id )
+			return &trace.threads[i];
+	}
+
+	if ( trace.thread_count == MAX_THREADS )
+		return NULL;
+
+	trace.threads[trace.thread_count].thread_id = thread_id;
+
+	return &trace.threads[trace.thread_count++];
+}
+
+
+
+/**
+ * Decodes a chunk of events, appending them to the thread they came from.
+ *
+ * @param[in] chunk The chunk header
+ * @param[in] pos The payload
+ * @retval true if the chunk was decoded
+ * @retval false if it was malformed, or memory was exhausted
+ */
+static bool
+decode_events(
+	const struct mem_trace_chunk* chunk,
+	const uint8_t* pos
+)
+{
+	const uint8_t*		end = pos + chunk->length;
+	struct replay_thread*	thread;
+	struct trace_event*	event;
+	struct trace_event*	grown;
+	uint64_t	time = chunk->base_usec;
+	uint64_t	address = 0;
+	uint64_t	value;
+	uint32_t	i;
+
+	if (( thread = trace_thread(chunk->thread_id)) == NULL )
+		return false;
+
+	trace.dropped += chunk->dropped;
+
+	if ( thread->event_count + chunk->count > thread->event_capacity )
+	{
+		thread->event_capacity = thread->event_capacity == 0 ? 4096 : thread->event_capacity;
+		while ( thread->event_count + chunk->count > thread->event_capacity )
+			thread->event_capacity *= 2;
+
+		if (( grown = (struct trace_event*)realloc(thread->events, thread->event_capacity * sizeof(struct trace_event))) == NULL )
+			return false;
+		thread->events = grown;
+	}
+
+	for ( i = 0; i < chunk->count; i++ )
+	{
+		if ( pos == end )
+			return false;
+
+		event = &thread->events[thread->event_count++];
+		memset(event, 0, sizeof(struct trace_event));
+		event->op = *pos++;
+
+		if ( !decode_varint(&pos, end, &value) ||
+		     !decode_zigzag(&pos, end, address, &address) )
+			return false;
+
+		time += value;
+		event->time_usec	= time;
+		event->address		= address;
+
+		if ( event->op != MEM_TRACE_OP_FREE )
+		{
+			if ( !decode_varint(&pos, end, &value) )
+				return false;
+			event->size = value;
+
+			if ( !decode_varint(&pos, end, &value) )
+				return false;
+			event->site_id = (uint32_t)value;
+		}
+		if ( event->op == MEM_TRACE_OP_REALLOC &&
+		     !decode_zigzag(&pos, end, address, &event->old_address) )
+			return false;
+	}
+
+	return (pos == end);
+}
+
+
+
+/**
+ * Decodes the site table, creating a mem_site for each, so tracked replays
+ * register and account sites as the program did.
+ *
+ * @param[in] chunk The chunk header
+ * @param[in] pos The payload
+ * @retval true if the chunk was decoded
+ * @retval false if it was malformed, or memory was exhausted
+ */
+static bool
+decode_sites(
+	const struct mem_trace_chunk* chunk,
+	const uint8_t* pos
+)
+{
+	const uint8_t*	end = pos + chunk->length;
+	const uint8_t*	start = pos;
+	struct mem_site*	site;
+	uint64_t	id;
+	uint64_t	line;
+	uint64_t	length;
+	char*		text;
+	uint32_t	i;
+	uint32_t	s;
+
+	// first pass for the highest id, so the table can be indexed by it
+	for ( i = 0; i < chunk->count; i++ )
+	{
+		if ( !decode_varint(&pos, end, &id) || !decode_varint(&pos, end, &line) ||
+		     !decode_varint(&pos, end, &length) || (uint64_t)(end - pos) < length )
+			return false;
+		pos += length;
+		if ( !decode_varint(&pos, end, &length) || (uint64_t)(end - pos) < length )
+			return false;
+		pos += length;
+
+		if ( id >= trace.site_count )
+			trace.site_count = (uint32_t)id + 1;
+	}
+
+	if (( trace.sites = (struct mem_site*)calloc(trace.site_count + 1, sizeof(struct mem_site))) == NULL )
+		return false;
+
+	for ( pos = start, i = 0; i < chunk->count; i++ )
+	{
+		decode_varint(&pos, end, &id);
+		decode_varint(&pos, end, &line);
+
+		site = &trace.sites[id];
+		site->line = (uint32_t)line;
+
+		// function, then file
+		for ( s = 0; s < 2; s++ )
+		{
+			decode_varint(&pos, end, &length);
+			if (( text = (char*)malloc((size_t)length + 1)) == NULL )
+				return false;
+			memcpy(text, pos, (size_t)length);
+			text[length] = '\0';
+			pos += length;
+
+			if ( s == 0 )
+				site->function = text;
+			else
+				site->file = text;
+		}
+	}
+
+	return true;
+}
+
+
+
+/**
+ * Open-addressed map of live address to slot, used while resolving.
+ *
+ * @struct address_map
+ */
+struct address_map
+{
+	uint64_t*	addresses;	/**< 0 for an empty entry */
+	uint32_t*	slots;
+	size_t		capacity;	/**< Always a power of 2 */
+	size_t		count;
+};
+
+
+
+/**
+ * Finds the entry for an address, or where it would go.
+ *
+ * @param[in] map The map to search
+ * @param[in] address The address to find
+ * @return The index of the entry
+ */
+static size_t
+map_find(
+	const struct address_map* map,
+	const uint64_t address
+)
+{
+	size_t	i = (size_t)((address >> 4) * 0x9E3779B97F4A7C15ull) & (map->capacity - 1);
+
+	while ( map->addresses[i] != 0 && map->addresses[i] != address )
+		i = (i + 1) & (map->capacity - 1);
+
+	return i;
+}
+
+
+
+/**
+ * Adds or replaces the slot of an address, growing the map as needed.
+ *
+ * @param[in] map The map to add to
+ * @param[in] address The address
+ * @param[in] slot The slot now at the address
+ * @return The slot previously at the address, or SLOT_NONE
+ */
+static uint32_t
+map_insert(
+	struct address_map* map,
+	const uint64_t address,
+	const uint32_t slot
+)
+{
+	struct address_map	grown;
+	uint32_t	previous;
+	size_t		i;
+	size_t		j;
+
+	if ( (map->count + 1) * 2 > map->capacity )
+	{
+		grown.capacity	= map->capacity == 0 ? 4096 : map->capacity * 2;
+		grown.count	= map->count;
+		grown.addresses	= (uint64_t*)calloc(grown.capacity, sizeof(uint64_t));
+		grown.slots	= (uint32_t*)malloc(grown.capacity * sizeof(uint32_t));
+
+		if ( grown.addresses == NULL || grown.slots == NULL )
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for ( i = 0; i < map->capacity; i++ )
+		{
+			if ( map->addresses[i] == 0 )
+				continue;
+
+			j = map_find(&grown, map->addresses[i]);
+			grown.addresses[j]	= map->addresses[i];
+			grown.slots[j]		= map->slots[i];
+		}
+
+		free(map->addresses);
+		free(map->slots);
+		*map = grown;
+	}
+
+	i = map_find(map, address);
+
+	if ( map->addresses[i] == 0 )
+	{
+		map->addresses[i] = address;
+		map->count++;
+		previous = SLOT_NONE;
+	}
+	else
+	{
+		previous = map->slots[i];
+	}
+
+	map->slots[i] = slot;
+
+	return previous;
+}
+
+
+
+/**
+ * Removes an address, shifting back any entries its removal would strand.
+ *
+ * @param[in] map The map to remove from
+ * @param[in] address The address
+ * @return The slot that was at the address, or SLOT_NONE if not present
+ */
+static uint32_t
+map_remove(
+	struct address_map* map,
+	const uint64_t address
+)
+{
+	uint32_t	slot;
+	size_t		i;
+	size_t		j;
+	size_t		home;
+
+	if ( map->capacity == 0 )
+		return SLOT_NONE;
+
+	i = map_find(map, address);
+
+	if ( map->addresses[i] == 0 )
+		return SLOT_NONE;
+
+	slot = map->slots[i];
+	map->addresses[i] = 0;
+	map->count--;
+
+	for ( j = (i + 1) & (map->capacity - 1); map->addresses[j] != 0; j = (j + 1) & (map->capacity - 1) )
+	{
+		home = (size_t)((map->addresses[j] >> 4) * 0x9E3779B97F4A7C15ull) & (map->capacity - 1);
+
+		// leave it if its home lies cyclically in (i, j]
+		if ( (i < j) ? (home > i && home <= j) : (home > i || home <= j) )
+			continue;
+
+		map->addresses[i]	= map->addresses[j];
+		map->slots[i]		= map->slots[j];
+		map->addresses[j]	= 0;
+		i = j;
+	}
+
+	return slot;
+}
+
+
+
+/**
+ * Turns every threads events into ops, resolving addresses to slots. The
+ * events of all threads are merged by time, so an address freed on one thread
+ * and reused on another resolves to the right allocation; where two threads
+ * have events in the same microsecond, frees go first.
+ *
+ * @retval true if the ops are ready
+ * @retval false if memory was exhausted
+ */
+static bool
+resolve_trace(void)
+{
+	struct address_map	map;
+	struct replay_thread*	thread;
+	struct trace_event*	event;
+	struct replay_op*	op;
+	size_t		next[MAX_THREADS];
+	uint32_t	best;
+	uint32_t	i;
+
+	memset(&map, 0, sizeof(map));
+	memset(next, 0, sizeof(next));
+
+	for ( i = 0; i < trace.thread_count; i++ )
+	{
+		thread = &trace.threads[i];
+		if (( thread->ops = (struct replay_op*)malloc((thread->event_count + 1) * sizeof(struct replay_op))) == NULL )
+			return false;
+	}
+
+	for ( ;; )
+	{
+		best = MAX_THREADS;
+
+		for ( i = 0; i < trace.thread_count; i++ )
+		{
+			if ( next[i] == trace.threads[i].event_count )
+				continue;
+
+			event = &trace.threads[i].events[next[i]];
+
+			if ( best == MAX_THREADS ||
+			     event->time_usec < trace.threads[best].events[next[best]].time_usec ||
+			     (event->time_usec == trace.threads[best].events[next[best]].time_usec &&
+			      event->op != MEM_TRACE_OP_ALLOC && trace.threads[best].events[next[best]].op == MEM_TRACE_OP_ALLOC) )
+				best = i;
+		}
+
+		if ( best == MAX_THREADS )
+			break;
+
+		thread = &trace.threads[best];
+		event = &thread->events[next[best]++];
+		op = &thread->ops[thread->op_count];
+
+		op->op		= event->op;
+		op->size	= event->size == 0 ? 1 : event->size;
+		op->site_id	= event->site_id < trace.site_count ? event->site_id : 0;
+		op->slot	= SLOT_NONE;
+		op->old_slot	= SLOT_NONE;
+
+		if ( event->op == MEM_TRACE_OP_FREE || event->op == MEM_TRACE_OP_REALLOC )
+		{
+			op->old_slot = map_remove(&map, event->op == MEM_TRACE_OP_FREE ? event->address : event->old_address);
+
+			if ( op->old_slot == SLOT_NONE )
+			{
+				// allocated before the trace began; a realloc becomes an alloc
+				trace.unmatched++;
+				if ( event->op == MEM_TRACE_OP_FREE )
+					continue;
+				op->op = MEM_TRACE_OP_ALLOC;
+			}
+		}
+
+		if ( op->op == MEM_TRACE_OP_FREE )
+			trace.frees++;
+		else
+		{
+			op->slot = trace.slot_count++;
+			if ( map_insert(&map, event->address, op->slot) != SLOT_NONE )
+				trace.conflicts++;
+
+			if ( op->op == MEM_TRACE_OP_ALLOC )
+				trace.allocs++;
+			else
+				trace.reallocs++;
+		}
+
+		thread->op_count++;
+	}
+
+	for ( i = 0; i < trace.thread_count; i++ )
+	{
+		free(trace.threads[i].events);
+		trace.threads[i].events = NULL;
+	}
+
+	free(map.addresses);
+	free(map.slots);
+
+	return true;
+}
+
+
+
+/**
+ * Loads a trace, ready to replay.
+ *
+ * @param[in] path The trace file
+ * @retval true if the trace was loaded
+ * @retval false if it could not be read, or is not a valid trace
+ */
+static bool
+load_trace(
+	const char* path
+)
+{
+	struct mem_trace_header	header;
+	struct mem_trace_chunk	chunk;
+	uint8_t*	payload = NULL;
+	size_t		capacity = 0;
+	FILE*		file;
+	bool		ret = false;
+
+#if defined(_WIN32)
+	if ( fopen_s(&file, path, "rb") != 0 )
+		file = NULL;
+#else
+	file = fopen(path, "rb");
+#endif
+	if ( file == NULL )
+	{
+		fprintf(stderr, "Unable to open '%s'\n", path);
+		return false;
+	}
+
+	if ( fread(&header, sizeof(header), 1, file) != 1 ||
+	     memcmp(header.magic, MEM_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+	     header.version != MEM_TRACE_VERSION ||
+	     header.header_size < sizeof(header) || header.chunk_size < sizeof(chunk) )
+	{
+		fprintf(stderr, "'%s' is not a trace this tool can read\n", path);
+		goto cleanup;
+	}
+
+	if ( fseek(file, header.header_size, SEEK_SET) != 0 )
+		goto cleanup;
+
+	while ( fread(&chunk, sizeof(chunk), 1, file) == 1 )
+	{
+		if ( header.chunk_size > sizeof(chunk) && fseek(file, header.chunk_size - sizeof(chunk), SEEK_CUR) != 0 )
+			goto truncated;
+
+		if ( chunk.length > capacity )
+		{
+			free(payload);
+			capacity = chunk.length;
+			if (( payload = (uint8_t*)malloc(capacity)) == NULL )
+				goto truncated;
+		}
+
+		if ( chunk.length != 0 && fread(payload, chunk.length, 1, file) != 1 )
+			goto truncated;
+
+		if ( chunk.type == MEM_TRACE_CHUNK_EVENTS && !decode_events(&chunk, payload) )
+			goto truncated;
+		if ( chunk.type == MEM_TRACE_CHUNK_SITES && trace.sites == NULL && !decode_sites(&chunk, payload) )
+			goto truncated;
+	}
+
+	if ( trace.sites == NULL )
+		fprintf(stderr, "'%s' has no site table; was the trace stopped?\n", path);
+
+	ret = resolve_trace();
+	goto cleanup;
+
+truncated:
+	fprintf(stderr, "'%s' is corrupt or truncated\n", path);
+cleanup:
+	free(payload);
+	fclose(file);
+
+	return ret;
+}
+
+
+
+/**
+ * Waits for a slot to be allocated, by whichever thread replays that.
+ *
+ * @param[in] slot The slot to wait for
+ * @return The block in the slot
+ */
+static void*
+wait_slot(
+	const uint32_t slot
+)
+{
+	void*	memory;
+
+	while (( memory = mem_atomic_load_ptr(&run_slots[slot])) == NULL )
+		yield();
+
+	return memory;
+}
+
+
+
+/**
+ * Replays the ops of one thread.
+ *
+ * @param[in] param The replay_thread to run
+ */
+#if defined(_WIN32)
+static DWORD WINAPI
+#else
+static void*
+#endif
+replay_thread_run(
+	void* param
+)
+{
+	struct replay_thread*	thread = (struct replay_thread*)param;
+	struct replay_op*	op;
+	struct mem_site*	site;
+	void*		memory;
+	void*		old;
+	uint64_t	start = 0;
+	size_t		i;
+	bool		timed;
+
+	memset(thread->latency, 0, sizeof(thread->latency));
+
+	while ( !mem_atomic_load32(&run_started) )
+		yield();
+
+	for ( i = 0; i < thread->op_count; i++ )
+	{
+		op = &thread->ops[i];
+		site = trace.sites == NULL ? NULL : &trace.sites[op->site_id];
+		old = op->old_slot == SLOT_NONE ? NULL : wait_slot(op->old_slot);
+		memory = NULL;
+
+		if (( timed = (i % LATENCY_INTERVAL) == 0 ))
+			start = clock_nsec();
+
+		if ( !run_config->tracked )
+		{
+			if ( op->op == MEM_TRACE_OP_ALLOC )
+				memory = malloc((size_t)op->size);
+			else if ( op->op == MEM_TRACE_OP_REALLOC )
+				memory = realloc(old, (size_t)op->size);
+			else
+				free(old);
+		}
+		else
+		{
+			if ( op->op == MEM_TRACE_OP_ALLOC )
+				memory = tracked_alloc(&run_context, (size_t)op->size, site);
+			else if ( op->op == MEM_TRACE_OP_REALLOC )
+				memory = tracked_realloc(&run_context, old, (size_t)op->size, site);
+			else
+				tracked_free(&run_context, old);
+		}
+
+		if ( timed )
+			thread->latency[latency_bucket(clock_nsec() - start)]++;
+
+		if ( op->old_slot != SLOT_NONE )
+			run_slots[op->old_slot] = NULL;
+
+		if ( op->slot != SLOT_NONE )
+		{
+			if ( memory == NULL )
+			{
+				fprintf(stderr, "Allocation of %" PRIu64 " bytes failed\n", op->size);
+				exit(EXIT_FAILURE);
+			}
+			mem_atomic_store_ptr(&run_slots[op->slot], memory);
+		}
+	}
+
+#if defined(_WIN32)
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+
+
+/**
+ * Obtains the peak resident set size of this process so far.
+ *
+ * @return The peak, in KiB
+ */
+static uint64_t
+peak_rss_kib(void)
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS	counters;
+
+	if ( !GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) )
+		return 0;
+
+	return counters.PeakWorkingSetSize / 1024;
+#else
+	struct rusage	usage;
+
+	if ( getrusage(RUSAGE_SELF, &usage) != 0 )
+		return 0;
+
+	// kilobytes on Linux and the BSDs; bytes on macOS
+#	if defined(__APPLE__)
+	return (uint64_t)usage.ru_maxrss / 1024;
+#	else
+	return (uint64_t)usage.ru_maxrss;
+#	endif
+#endif
+}
+
+
+
+/**
+ * Replays the whole trace once with a configuration.
+ *
+ * @param[in] config The configuration to replay with
+ * @param[out] result The measurements
+ */
+static void
+replay_run(
+	const struct replay_config* config,
+	struct replay_result* result
+)
+{
+	uint64_t	buckets[LATENCY_BUCKETS];
+	uint64_t	baseline = peak_rss_kib();
+	uint64_t	total = 0;
+	uint64_t	seen;
+	uint64_t	start;
+	uint32_t	bucket;
+	uint32_t	slot;
+	uint32_t	i;
+	uint32_t	p;
+
+	memset(result, 0, sizeof(struct replay_result));
+	memset(buckets, 0, sizeof(buckets));
+
+	run_config = config;
+	run_started = 0;
+
+	if (( run_slots = (void**)calloc(trace.slot_count + 1, sizeof(void*))) == NULL )
+		return;
+
+	if ( config->tracked )
+	{
+		mem_context_init(&run_context);
+		run_context.options.use_slab		= config->use_slab;
+		run_context.options.use_registry	= config->use_registry;
+		run_context.options.sample_rate		= config->sample_rate;
+		run_context.options.stack_depth		= config->stack_depth;
+		run_context.options.report_path		= REPORT_PATH;
+	}
+
+	for ( i = 0; i < trace.thread_count; i++ )
+	{
+#if defined(_WIN32)
+		trace.threads[i].handle = CreateThread(NULL, 0, replay_thread_run, &trace.threads[i], 0, NULL);
+#else
+		pthread_create(&trace.threads[i].handle, NULL, replay_thread_run, &trace.threads[i]);
+#endif
+	}
+
+	start = clock_nsec();
+	mem_atomic_store32(&run_started, 1);
+
+	for ( i = 0; i < trace.thread_count; i++ )
+	{
+#if defined(_WIN32)
+		WaitForSingleObject(trace.threads[i].handle, INFINITE);
+		CloseHandle(trace.threads[i].handle);
+#else
+		pthread_join(trace.threads[i].handle, NULL);
+#endif
+	}
+
+	result->elapsed_nsec = clock_nsec() - start;
+	result->rss_kib = peak_rss_kib() - baseline;
+
+	for ( i = 0; i < trace.thread_count; i++ )
+	{
+		for ( bucket = 0; bucket < LATENCY_BUCKETS; bucket++ )
+		{
+			buckets[bucket] += trace.threads[i].latency[bucket];
+			total += trace.threads[i].latency[bucket];
+		}
+	}
+
+	for ( p = 0; p < 5; p++ )
+	{
+		seen = 0;
+		for ( bucket = 0; bucket < LATENCY_BUCKETS; bucket++ )
+		{
+			seen += buckets[bucket];
+			if ( seen != 0 && seen >= (uint64_t)(total * percentiles[p] / 100.0) )
+				break;
+		}
+		result->percentiles[p] = latency_value(bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1);
+	}
+
+	// whatever the program never freed, in the trace; not timed
+	for ( slot = 0; slot < trace.slot_count; slot++ )
+	{
+		if ( run_slots[slot] == NULL )
+			continue;
+
+		if ( config->tracked )
+			tracked_free(&run_context, run_slots[slot]);
+		else
+			free(run_slots[slot]);
+	}
+
+	if ( config->tracked )
+		mem_context_destroy(&run_context);
+
+	free(run_slots);
+	result->ok = true;
+}
+
+
+
+/**
+ * Replays the trace with a configuration, in a child process where possible,
+ * keeping the fastest of the repeats.
+ *
+ * @param[in] config The configuration to replay with
+ * @param[in] repeats The number of times to replay
+ * @param[out] result The measurements of the fastest replay
+ */
+static void
+replay_config(
+	const struct replay_config* config,
+	const uint32_t repeats,
+	struct replay_result* result
+)
+{
+	struct replay_result	run;
+	uint32_t	i;
+
+	memset(result, 0, sizeof(struct replay_result));
+
+	for ( i = 0; i < repeats; i++ )
+	{
+#if defined(_WIN32)
+		replay_run(config, &run);
+#else
+		int	fds[2];
+		pid_t	pid;
+
+		memset(&run, 0, sizeof(run));
+
+		if ( pipe(fds) != 0 )
+			return;
+
+		fflush(stdout);
+
+		if (( pid = fork()) == 0 )
+		{
+			close(fds[0]);
+			replay_run(config, &run);
+			if ( write(fds[1], &run, sizeof(run)) != sizeof(run) )
+				_exit(EXIT_FAILURE);
+			_exit(EXIT_SUCCESS);
+		}
+
+		close(fds[1]);
+		if ( pid < 0 || read(fds[0], &run, sizeof(run)) != sizeof(run) )
+			run.ok = false;
+		close(fds[0]);
+		if ( pid > 0 )
+			waitpid(pid, NULL, 0);
+#endif
+
+		if ( run.ok && (!result->ok || run.elapsed_nsec < result->elapsed_nsec) )
+			*result = run;
+	}
+}
+
+
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	struct replay_result	result;
+	const char*	path = NULL;
+	uint64_t	ops;
+	uint32_t	repeats = 1;
+	uint32_t	selected = 0;
+	uint32_t	config_count = sizeof(configs) / sizeof(configs[0]);
+	bool		wanted[sizeof(configs) / sizeof(configs[0])];
+	uint32_t	i;
+	int		arg;
+
+	memset(wanted, 0, sizeof(wanted));
+
+	for ( arg = 1; arg < argc; arg++ )
+	{
+		if ( strcmp(argv[arg], "-r") == 0 && arg + 1 < argc )
+		{
+			repeats = (uint32_t)strtoul(argv[++arg], NULL, 10);
+			continue;
+		}
+
+		if ( path == NULL )
+		{
+			path = argv[arg];
+			continue;
+		}
+
+		for ( i = 0; i < config_count; i++ )
+		{
+			if ( strcmp(argv[arg], configs[i].name) == 0 )
+				break;
+		}
+
+		if ( i == config_count )
+		{
+			fprintf(stderr, "Unknown configuration '%s'\n", argv[arg]);
+			return EXIT_FAILURE;
+		}
+
+		wanted[i] = true;
+		selected++;
+	}
+
+	if ( path == NULL || repeats == 0 )
+	{
+		fprintf(stderr, "Usage: %s <trace> [-r repeats] [config ...]\n"
+				"Configurations:", argv[0]);
+		for ( i = 0; i < config_count; i++ )
+			fprintf(stderr, " %s", configs[i].name);
+		fprintf(stderr, "\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( !load_trace(path) )
+		return EXIT_FAILURE;
+
+	ops = trace.allocs + trace.frees + trace.reallocs;
+
+	printf("# %s\n"
+		"%u threads, %" PRIu64 " ops (%" PRIu64 " allocs, %" PRIu64 " frees, %" PRIu64 " reallocs)\n",
+		path, trace.thread_count, ops, trace.allocs, trace.frees, trace.reallocs);
+	if ( trace.dropped != 0 || trace.unmatched != 0 || trace.conflicts != 0 )
+	{
+		printf("%" PRIu64 " events dropped while tracing, %" PRIu64 " frees of earlier blocks skipped, "
+			"%" PRIu64 " reused addresses\n", trace.dropped, trace.unmatched, trace.conflicts);
+	}
+	printf("\n"
+		"Config            Ops/sec     Time (ms)    p50 ns    p90 ns    p99 ns  p99.9 ns    max ns  Peak RSS KiB\n");
+
+	for ( i = 0; i < config_count; i++ )
+	{
+		if ( selected != 0 && !wanted[i] )
+			continue;
+
+		replay_config(&configs[i], repeats, &result);
+
+		if ( !result.ok )
+		{
+			printf("%-12s  failed\n", configs[i].name);
+			continue;
+		}
+
+		printf("%-12s %12.0f %13.2f %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %13" PRIu64 "\n",
+			configs[i].name,
+			result.elapsed_nsec == 0 ? 0.0 : ops * 1e9 / (double)result.elapsed_nsec,
+			result.elapsed_nsec / 1e6,
+			result.percentiles[0], result.percentiles[1], result.percentiles[2],
+			result.percentiles[3], result.percentiles[4], result.rss_kib);
+	}
+
+	return EXIT_SUCCESS;
+}
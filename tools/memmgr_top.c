@@ -0,0 +1,787 @@
+/**
+ * @file	memmgr_top.c
+ * @author	James Warren
+ * @copyright	James Warren, 2013-2014
+ * @license	Zlib (see license.txt or http://opensource.org/licenses/Zlib)
+ * @brief	Live view of every published stats page on the host
+ *
+ * Finds the pages written by mem_publish_start() in MEM_SHM_DIR, and shows,
+ * refreshed every interval, a table of the processes (and contexts) behind
+ * them, then one of their top sites, merged across every process. Both are
+ * sorted on the same key; live bytes, peak bytes, allocations per second,
+ * total bytes allocated, or live blocks. Rates are worked out between the
+ * times the page was last published.
+ *
+ * Live and total bytes are those requested, in both tables; HEAP is what the
+ * context holds for its blocks, headers, redzones and padding included, and
+ * the peak of a context is of that. The peak of a site is of requested bytes.
+ *
+ * On a terminal, the sort can be changed while running with the first letter
+ * of the key (l, p, r, t, b), and q quits; with -b, or when not on a terminal,
+ * each refresh is just printed after the last.
+ *
+ * Pages whose process no longer exists are skipped, unless -a is given; -r
+ * removes them.
+ *
+ * Usage: memmgr-top [-d msec] [-n count] [-s live|peak|rate|total|blocks]
+ *                   [-p pid] [-l lines] [-a] [-b] [-r]
+ */
+
+
+#if !defined(__linux__)
+#	error "pages are only published on Linux"
+#endif
+
+#include "mem_atomic.h"			// page sequence count
+#include "mem_shm.h"			// page layout
+
+#define __STDC_FORMAT_MACROS
+#include <dirent.h>			// opendir, readdir
+#include <errno.h>			// EINTR, EPERM
+#include <fcntl.h>			// open
+#include <inttypes.h>			// PRIu64
+#include <sched.h>			// sched_yield
+#include <signal.h>			// kill, sigaction
+#include <stdbool.h>			// C99 supplies bool
+#include <stdio.h>			// printf
+#include <stdlib.h>			// calloc, qsort, strtoul
+#include <string.h>			// memcmp, memcpy, strcmp
+#include <sys/mman.h>			// mmap
+#include <sys/select.h>			// select
+#include <sys/stat.h>			// fstat
+#include <termios.h>			// tcgetattr, tcsetattr
+#include <time.h>			// clock_gettime
+#include <unistd.h>			// close, isatty, unlink
+
+
+// pages watched at most; any more are ignored
+#define MAX_PAGES		1024
+// site rows shown by default
+#define DEFAULT_SITE_LINES	20
+// times a page is copied before giving up on a consistent copy
+#define READ_ATTEMPTS		100
+
+
+/**
+ * What both tables are sorted on.
+ *
+ * @enum E_SORT_KEY
+ */
+enum E_SORT_KEY
+{
+	SK_Live = 0,
+	SK_Peak,
+	SK_Rate,
+	SK_Total,
+	SK_Blocks
+};
+
+
+/**
+ * A page being watched, and what's needed to work out its rates.
+ *
+ * @struct top_page
+ */
+struct top_page
+{
+	/** The file name, within MEM_SHM_DIR */
+	char			name[256];
+	/** The last consistent copy of the page */
+	struct mem_shm_page	page;
+	/** The last copy that was published before that one, for the rates;
+	 * valid if has_previous */
+	struct mem_shm_page	previous;
+	bool			has_previous;
+	/** Set if the publishing process still exists */
+	bool			alive;
+	/** Set if the file was found this refresh */
+	bool			found;
+
+	/** Allocations and frees per second, since the previous copy */
+	double			alloc_rate;
+	double			free_rate;
+	/** Allocations per second of each site, in the same order */
+	double			site_rates[MEM_SHM_SITES];
+};
+
+
+/**
+ * A site, and the page it was published in; a row of the site table.
+ *
+ * @struct top_site
+ */
+struct top_site
+{
+	const struct top_page*		owner;
+	const struct mem_shm_site*	site;
+	double				rate;
+};
+
+
+// names of each E_SORT_KEY, in order of value
+static const char*	sort_names[] = { "live", "peak", "rate", "total", "blocks" };
+#define SORT_KEYS	(sizeof(sort_names) / sizeof(sort_names[0]))
+
+static enum E_SORT_KEY	sort_key = SK_Live;
+static struct top_page*	pages[MAX_PAGES];
+static uint32_t		page_count;
+
+// the terminal as it was, restored on the way out
+static struct termios	saved_terminal;
+static bool		terminal_changed;
+// set by SIGINT and SIGTERM
+static volatile sig_atomic_t	interrupted;
+
+
+
+/**
+ * Obtains a monotonic time.
+ *
+ * @return The time, in seconds, from an arbitrary point
+ */
+static double
+now_seconds(void)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+
+
+/**
+ * Formats a number of bytes to at most 6 characters, with a binary unit.
+ *
+ * @param[out] buffer At least 16 characters
+ * @param[in] bytes The number to format
+ * @return The buffer
+ */
+static const char*
+format_bytes(
+	char* buffer,
+	const uint64_t bytes
+)
+{
+	static const char	units[] = "KMGTPE";
+	double			value = (double)bytes;
+	uint32_t		unit = 0;
+
+	if ( bytes < 1024 )
+	{
+		snprintf(buffer, 16, "%" PRIu64, bytes);
+		return buffer;
+	}
+
+	for ( value /= 1024; value >= 1024 && unit < sizeof(units) - 2; value /= 1024 )
+		unit++;
+
+	snprintf(buffer, 16, value < 10 ? "%.1f%c" : "%.0f%c", value, units[unit]);
+
+	return buffer;
+}
+
+
+
+/**
+ * Takes a consistent copy of a page; see mem_shm.h.
+ *
+ * @param[in] path The file the page is in
+ * @param[out] copy The copy
+ * @retval true if the copy was taken
+ * @retval false if the file is not a page, of this version, or it was being
+ * rewritten every time it was copied
+ */
+static bool
+page_read(
+	const char* path,
+	struct mem_shm_page* copy
+)
+{
+	const struct mem_shm_page*	mapped;
+	struct stat	st;
+	uint64_t	seq;
+	uint32_t	attempt;
+	bool		ret = false;
+	int		fd;
+
+	if (( fd = open(path, O_RDONLY)) == -1 )
+		return false;
+
+	if ( fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(struct mem_shm_page) ||
+	     (mapped = (const struct mem_shm_page*)mmap(NULL, sizeof(struct mem_shm_page), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED )
+	{
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	for ( attempt = 0; attempt < READ_ATTEMPTS && !ret; attempt++ )
+	{
+		seq = mem_atomic_load64(&mapped->seq);
+		mem_atomic_fence_acquire();
+
+		// part way through a rewrite; the publisher won't be long
+		if ( (seq & 1) != 0 )
+		{
+			sched_yield();
+			continue;
+		}
+
+		memcpy(copy, (const void*)mapped, sizeof(struct mem_shm_page));
+
+		mem_atomic_fence_acquire();
+		ret = (mem_atomic_load64(&mapped->seq) == seq);
+	}
+
+	munmap((void*)mapped, sizeof(struct mem_shm_page));
+
+	return ret &&
+	       memcmp(copy->magic, MEM_SHM_MAGIC, sizeof(MEM_SHM_MAGIC)) == 0 &&
+	       copy->version == MEM_SHM_VERSION &&
+	       copy->page_size == sizeof(struct mem_shm_page);
+}
+
+
+
+/**
+ * Works out the rates of a page, between the times its last two copies were
+ * published; the publisher and this needn't look at the same interval.
+ *
+ * @param[in] page The page to work out the rates of
+ * @param[in] republished Set if the page was rewritten since the last copy
+ */
+static void
+page_rates(
+	struct top_page* page,
+	const bool republished
+)
+{
+	double		elapsed;
+	uint32_t	i;
+	uint32_t	j;
+
+	// not yet rewritten; it keeps its rates until the publisher has looked
+	if ( !republished && page->has_previous && page->page.heartbeat_usec <= page->page.publish_usec )
+		return;
+
+	page->alloc_rate	= 0;
+	page->free_rate		= 0;
+	memset(page->site_rates, 0, sizeof(page->site_rates));
+
+	// looked at, and nothing had changed
+	if ( !republished || !page->has_previous )
+		return;
+
+	if (( elapsed = (double)(page->page.publish_usec - page->previous.publish_usec) / 1000000) <= 0 )
+		return;
+
+	page->alloc_rate	= (double)(page->page.allocs - page->previous.allocs) / elapsed;
+	page->free_rate		= (double)(page->page.frees - page->previous.frees) / elapsed;
+
+	// sites move between slots as they're reordered; match them by id
+	for ( i = 0; i < page->page.site_count && i < MEM_SHM_SITES; i++ )
+	{
+		for ( j = 0; j < page->previous.site_count && j < MEM_SHM_SITES; j++ )
+		{
+			if ( page->previous.sites[j].id == page->page.sites[i].id )
+			{
+				page->site_rates[i] = (double)(page->page.sites[i].allocs -
+							       page->previous.sites[j].allocs) / elapsed;
+				break;
+			}
+		}
+	}
+}
+
+
+
+/**
+ * Finds every page in MEM_SHM_DIR and takes a copy of each; pages that have
+ * gone since the last refresh are forgotten.
+ *
+ * @param[in] only_pid If non-zero, only pages published by this process
+ * @param[in] remove_stale Set to remove pages whose process no longer exists
+ */
+static void
+pages_refresh(
+	const uint32_t only_pid,
+	const bool remove_stale
+)
+{
+	struct top_page*	page;
+	struct dirent*		entry;
+	struct mem_shm_page	copy;
+	DIR*		dir;
+	char		path[512];
+	uint32_t	i;
+	bool		republished;
+
+	for ( i = 0; i < page_count; i++ )
+		pages[i]->found = false;
+
+	if (( dir = opendir(MEM_SHM_DIR)) == NULL )
+		return;
+
+	while (( entry = readdir(dir)) != NULL )
+	{
+		if ( strncmp(entry->d_name, MEM_SHM_PREFIX, sizeof(MEM_SHM_PREFIX) - 1) != 0 ||
+		     strlen(entry->d_name) >= sizeof(page->name) )
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", MEM_SHM_DIR, entry->d_name);
+		if ( !page_read(path, &copy) || (only_pid != 0 && copy.pid != only_pid) )
+			continue;
+
+		for ( i = 0; i < page_count; i++ )
+		{
+			if ( strcmp(pages[i]->name, entry->d_name) == 0 )
+				break;
+		}
+
+		republished = false;
+		if ( i == page_count )
+		{
+			if ( page_count == MAX_PAGES || (page = (struct top_page*)calloc(1, sizeof(struct top_page))) == NULL )
+				continue;
+			strcpy(page->name, entry->d_name);
+			pages[page_count++] = page;
+		}
+		else if ( copy.start_time != pages[i]->page.start_time )
+		{
+			// a new process with the pid of an old one starts afresh
+			page = pages[i];
+			page->has_previous = false;
+		}
+		else
+		{
+			page = pages[i];
+			if (( republished = (copy.publish_usec != page->page.publish_usec)) )
+			{
+				page->previous		= page->page;
+				page->has_previous	= true;
+			}
+		}
+
+		page->page	= copy;
+		page->found	= true;
+		page->alive	= (kill((pid_t)copy.pid, 0) == 0 || errno == EPERM);
+
+		if ( !page->alive && remove_stale )
+		{
+			unlink(path);
+			page->found = false;
+		}
+
+		page_rates(page, republished);
+	}
+
+	closedir(dir);
+
+	for ( i = 0; i < page_count; )
+	{
+		if ( pages[i]->found )
+		{
+			i++;
+			continue;
+		}
+
+		free(pages[i]);
+		pages[i] = pages[--page_count];
+	}
+}
+
+
+
+/**
+ * Compares two values for a descending sort.
+ *
+ * @param[in] a The first value
+ * @param[in] b The second value
+ * @return Less than 0 if a should be first, greater than 0 if b should be
+ */
+static int
+compare_descending(
+	const double a,
+	const double b
+)
+{
+	return a > b ? -1 : a < b ? 1 : 0;
+}
+
+
+
+/**
+ * qsort comparison of pages, by sort_key.
+ */
+static int
+page_compare(
+	const void* a,
+	const void* b
+)
+{
+	const struct top_page*	page_a = *(const struct top_page* const*)a;
+	const struct top_page*	page_b = *(const struct top_page* const*)b;
+
+	switch ( sort_key )
+	{
+	case SK_Peak:
+		return compare_descending((double)page_a->page.peak_allocated, (double)page_b->page.peak_allocated);
+	case SK_Rate:
+		return compare_descending(page_a->alloc_rate, page_b->alloc_rate);
+	case SK_Total:
+		return compare_descending((double)page_a->page.total_requested, (double)page_b->page.total_requested);
+	case SK_Blocks:
+		return compare_descending((double)(page_a->page.allocs - page_a->page.frees),
+					  (double)(page_b->page.allocs - page_b->page.frees));
+	default:
+		return compare_descending((double)page_a->page.current_requested, (double)page_b->page.current_requested);
+	}
+}
+
+
+
+/**
+ * qsort comparison of sites, by sort_key.
+ */
+static int
+site_compare(
+	const void* a,
+	const void* b
+)
+{
+	const struct top_site*	site_a = (const struct top_site*)a;
+	const struct top_site*	site_b = (const struct top_site*)b;
+
+	switch ( sort_key )
+	{
+	case SK_Peak:
+		return compare_descending((double)site_a->site->peak_bytes, (double)site_b->site->peak_bytes);
+	case SK_Rate:
+		return compare_descending(site_a->rate, site_b->rate);
+	case SK_Total:
+		return compare_descending((double)site_a->site->alloc_bytes, (double)site_b->site->alloc_bytes);
+	case SK_Blocks:
+		return compare_descending((double)site_a->site->live_blocks, (double)site_b->site->live_blocks);
+	default:
+		return compare_descending((double)site_a->site->live_bytes, (double)site_b->site->live_bytes);
+	}
+}
+
+
+
+/**
+ * Writes both tables.
+ *
+ * @param[in] site_lines The most site rows to write
+ * @param[in] show_stale Set to include pages whose process no longer exists
+ * @param[in] interactive Set if the keys are being read
+ */
+static void
+display(
+	const uint32_t site_lines,
+	const bool show_stale,
+	const bool interactive
+)
+{
+	static const char*	mode_names[] = { "full", "off", "counters" };
+	static struct top_site	sites[MAX_PAGES * MEM_SHM_SITES];
+	const struct top_page*	page;
+	char		live[16];
+	char		heap[16];
+	char		peak[16];
+	char		total[16];
+	char		mode[24];
+	uint64_t	live_sum = 0;
+	uint64_t	heap_sum = 0;
+	uint64_t	peak_sum = 0;
+	double		rate_sum = 0;
+	uint32_t	site_count = 0;
+	uint32_t	shown = 0;
+	uint32_t	i;
+	uint32_t	j;
+
+	qsort(pages, page_count, sizeof(struct top_page*), page_compare);
+
+	for ( i = 0; i < page_count; i++ )
+	{
+		page = pages[i];
+		if ( !page->alive && !show_stale )
+			continue;
+
+		shown++;
+		live_sum	+= page->page.current_requested;
+		heap_sum	+= page->page.current_allocated;
+		peak_sum	+= page->page.peak_allocated;
+		rate_sum	+= page->alloc_rate;
+
+		for ( j = 0; j < page->page.site_count && j < MEM_SHM_SITES; j++ )
+		{
+			sites[site_count].owner	= page;
+			sites[site_count].site	= &page->page.sites[j];
+			sites[site_count].rate	= page->site_rates[j];
+			site_count++;
+		}
+	}
+
+	qsort(sites, site_count, sizeof(struct top_site), site_compare);
+
+	if ( interactive )
+		printf("\033[H\033[2J");
+
+	printf("memmgr-top: %u contexts, %s live, %s heap, %s peak heap, %.0f allocs/s; sorted by %s%s\n\n",
+	       shown, format_bytes(live, live_sum), format_bytes(heap, heap_sum), format_bytes(peak, peak_sum), rate_sum,
+	       sort_names[sort_key], interactive ? " (l p r t b to sort, q to quit)" : "");
+
+	printf("    PID CTX PROCESS          MODE           LIVE   HEAP   PEAK    BLOCKS  ALLOCS/S   FREES/S  TOTAL  INVALID\n");
+	for ( i = 0; i < page_count; i++ )
+	{
+		page = pages[i];
+		if ( !page->alive && !show_stale )
+			continue;
+
+		if ( !page->alive )
+			snprintf(mode, sizeof(mode), "gone");
+		else
+			snprintf(mode, sizeof(mode), "%s%s",
+				 page->page.mode < 3 ? mode_names[page->page.mode] : "?",
+				 page->page.sample_rate != 0 ? "/sampled" : "");
+
+		printf("%7u %3u %-16.16s %-12s %6s %6s %6s %9" PRIu64 " %9.0f %9.0f %6s %8" PRIu64 "\n",
+		       page->page.pid, page->page.context_index, page->page.process, mode,
+		       format_bytes(live, page->page.current_requested),
+		       format_bytes(heap, page->page.current_allocated),
+		       format_bytes(peak, page->page.peak_allocated),
+		       page->page.allocs - page->page.frees,
+		       page->alloc_rate, page->free_rate,
+		       format_bytes(total, page->page.total_requested),
+		       page->page.invalid_frees);
+	}
+
+	if ( site_count == 0 )
+		return;
+
+	printf("\n    PID   LIVE   PEAK    BLOCKS  ALLOCS/S  TOTAL  SITE\n");
+	for ( i = 0; i < site_count && i < site_lines; i++ )
+	{
+		printf("%7u %6s %6s %9" PRIu64 " %9.0f %6s  %s (%s:%u)\n",
+		       sites[i].owner->page.pid,
+		       format_bytes(live, sites[i].site->live_bytes),
+		       format_bytes(peak, sites[i].site->peak_bytes),
+		       sites[i].site->live_blocks, sites[i].rate,
+		       format_bytes(total, sites[i].site->alloc_bytes),
+		       sites[i].site->function, sites[i].site->file_name, sites[i].site->line);
+	}
+}
+
+
+
+/**
+ * Restores the terminal, if it was changed.
+ */
+static void
+terminal_restore(void)
+{
+	if ( terminal_changed )
+		tcsetattr(STDIN_FILENO, TCSANOW, &saved_terminal);
+	terminal_changed = false;
+}
+
+
+
+/**
+ * Has the terminal hand over each key as it's pressed, without echoing it.
+ *
+ * @retval true if the terminal was changed
+ * @retval false if it could not be
+ */
+static bool
+terminal_raw(void)
+{
+	struct termios	raw;
+
+	if ( tcgetattr(STDIN_FILENO, &saved_terminal) != 0 )
+		return false;
+
+	raw = saved_terminal;
+	raw.c_lflag &= ~(ICANON | ECHO);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+
+	if ( tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0 )
+		return false;
+
+	terminal_changed = true;
+	atexit(terminal_restore);
+
+	return true;
+}
+
+
+
+/**
+ * Handles SIGINT and SIGTERM, ending the main loop.
+ *
+ * @param[in] signal_number Unused
+ */
+static void
+on_interrupt(
+	int signal_number
+)
+{
+	(void)signal_number;
+	interrupted = 1;
+}
+
+
+
+/**
+ * Waits for the next refresh, acting on any keys pressed meanwhile.
+ *
+ * @param[in] msec The time to wait
+ * @param[in] interactive Set if the keys are being read
+ * @retval true to carry on
+ * @retval false if q was pressed, or the wait was interrupted
+ */
+static bool
+wait_keys(
+	const uint32_t msec,
+	const bool interactive
+)
+{
+	struct timeval	timeout;
+	fd_set		read_set;
+	double		until = now_seconds() + msec / 1000.0;
+	double		left;
+	uint32_t	i;
+	char		key;
+
+	if ( !interactive )
+	{
+		timeout.tv_sec	= msec / 1000;
+		timeout.tv_usec	= (msec % 1000) * 1000;
+		select(0, NULL, NULL, NULL, &timeout);
+		return !interrupted;
+	}
+
+	while ( !interrupted && (left = until - now_seconds()) > 0 )
+	{
+		timeout.tv_sec	= (time_t)left;
+		timeout.tv_usec	= (suseconds_t)((left - (double)timeout.tv_sec) * 1e6);
+
+		FD_ZERO(&read_set);
+		FD_SET(STDIN_FILENO, &read_set);
+		if ( select(STDIN_FILENO + 1, &read_set, NULL, NULL, &timeout) <= 0 )
+			continue;
+		if ( read(STDIN_FILENO, &key, 1) != 1 )
+			return false;
+
+		if ( key == 'q' )
+			return false;
+
+		// a new sort is shown straight away
+		for ( i = 0; i < SORT_KEYS; i++ )
+		{
+			if ( key == sort_names[i][0] )
+			{
+				sort_key = (enum E_SORT_KEY)i;
+				return true;
+			}
+		}
+	}
+
+	return !interrupted;
+}
+
+
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	struct sigaction	action;
+	uint32_t	interval_msec = 1000;
+	uint32_t	count = 0;
+	uint32_t	only_pid = 0;
+	uint32_t	site_lines = DEFAULT_SITE_LINES;
+	uint32_t	refreshes;
+	uint32_t	i;
+	bool		show_stale = false;
+	bool		batch = false;
+	bool		remove_stale = false;
+	bool		interactive;
+	int		arg;
+
+	for ( arg = 1; arg < argc; arg++ )
+	{
+		if ( strcmp(argv[arg], "-d") == 0 && arg + 1 < argc )
+			interval_msec = (uint32_t)strtoul(argv[++arg], NULL, 10);
+		else if ( strcmp(argv[arg], "-n") == 0 && arg + 1 < argc )
+			count = (uint32_t)strtoul(argv[++arg], NULL, 10);
+		else if ( strcmp(argv[arg], "-p") == 0 && arg + 1 < argc )
+			only_pid = (uint32_t)strtoul(argv[++arg], NULL, 10);
+		else if ( strcmp(argv[arg], "-l") == 0 && arg + 1 < argc )
+			site_lines = (uint32_t)strtoul(argv[++arg], NULL, 10);
+		else if ( strcmp(argv[arg], "-s") == 0 && arg + 1 < argc )
+		{
+			arg++;
+			for ( i = 0; i < SORT_KEYS; i++ )
+			{
+				if ( strcmp(argv[arg], sort_names[i]) == 0 )
+					break;
+			}
+			if ( i == SORT_KEYS )
+				goto usage;
+			sort_key = (enum E_SORT_KEY)i;
+		}
+		else if ( strcmp(argv[arg], "-a") == 0 )
+			show_stale = true;
+		else if ( strcmp(argv[arg], "-b") == 0 )
+			batch = true;
+		else if ( strcmp(argv[arg], "-r") == 0 )
+			remove_stale = true;
+		else
+			goto usage;
+	}
+
+	if ( interval_msec == 0 )
+		interval_msec = 1000;
+
+	interactive = !batch && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && terminal_raw();
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_interrupt;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	for ( refreshes = 0; count == 0 || refreshes < count; refreshes++ )
+	{
+		pages_refresh(only_pid, remove_stale);
+		display(site_lines, show_stale, interactive);
+		fflush(stdout);
+
+		if ( count != 0 && refreshes + 1 == count )
+			break;
+		if ( !wait_keys(interval_msec, interactive) )
+			break;
+		if ( !interactive )
+			printf("\n");
+	}
+
+	terminal_restore();
+
+	for ( i = 0; i < page_count; i++ )
+		free(pages[i]);
+
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-d msec] [-n count] [-s live|peak|rate|total|blocks]\n"
+			"       %*s [-p pid] [-l lines] [-a] [-b] [-r]\n",
+		argv[0], (int)strlen(argv[0]), "");
+
+	return EXIT_FAILURE;
+}